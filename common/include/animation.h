@@ -22,6 +22,7 @@ struct AssimpNodeData {
 
 class Animation {
 private:
+    std::string m_Name;
     float m_Duration;
     int m_TicksPerSecond;
     std::vector<Bone> m_Bones;
@@ -31,22 +32,37 @@ private:
 public:
     Animation() = default;
 
-    Animation(const std::string& animationPath, Model* model) {
+    // imports only the animation data of a file, mesh data is stripped before any post processing runs.
+    // prefer Animation::ReadAll on the scene the Model was loaded from when both come from the same file.
+    Animation(const std::string& animationPath, Model* model, unsigned int animationIndex = 0) {
         Assimp::Importer importer;
-        const auto* scene = importer.ReadFile(animationPath, aiProcess_Triangulate);
+        importer.SetPropertyInteger(AI_CONFIG_PP_RVC_FLAGS, aiComponent_MESHES | aiComponent_MATERIALS | aiComponent_TEXTURES);
+        const auto* scene = importer.ReadFile(animationPath, aiProcess_RemoveComponent);
         assert(scene && scene->mRootNode);
+        assert(animationIndex < scene->mNumAnimations);
 
-        auto* animation = scene->mAnimations[0];
-        m_Duration = animation->mDuration;
-        m_TicksPerSecond = animation->mTicksPerSecond;
+        ReadAnimation(scene, scene->mAnimations[animationIndex], model);
+    }
 
-        ReadHeirarchyData(m_RootNode, scene->mRootNode);
+    // builds an animation from a scene that has already been imported (e.g. by Model)
+    Animation(const aiScene* scene, const aiAnimation* animation, Model* model) {
+        assert(scene && scene->mRootNode && animation);
 
-        ReadMissingBones(animation, model);
+        ReadAnimation(scene, animation, model);
     }
 
     ~Animation() = default;
 
+    // reads every entry of scene->mAnimations, not only the first one
+    static std::vector<Animation> ReadAll(const aiScene* scene, Model* model) {
+        std::vector<Animation> animations;
+        animations.reserve(scene->mNumAnimations);
+        for (unsigned int i = 0; i < scene->mNumAnimations; i++) {
+            animations.emplace_back(scene, scene->mAnimations[i], model);
+        }
+        return animations;
+    }
+
     Bone* FindBone(const std::string& name) {
         auto iter = std::find_if(m_Bones.begin(), m_Bones.end(), [&](const Bone& bone) {
            return bone.GetBoneName() == name;
@@ -56,6 +72,8 @@ public:
         else return &(*iter);
     }
 
+    inline const std::string& GetName() { return m_Name; }
+
     inline float GetTicksPerSecond() { return m_TicksPerSecond; }
 
     inline float GetDuration() { return m_Duration;}
@@ -68,6 +86,16 @@ public:
     }
 
 private:
+    void ReadAnimation(const aiScene* scene, const aiAnimation* animation, Model* model) {
+        m_Name = animation->mName.C_Str();
+        m_Duration = animation->mDuration;
+        m_TicksPerSecond = animation->mTicksPerSecond;
+
+        ReadHeirarchyData(m_RootNode, scene->mRootNode);
+
+        ReadMissingBones(animation, model);
+    }
+
     void ReadMissingBones(const aiAnimation* animation, Model* model) {
         // a animation node can refer to multiple bones
         auto channelNum = animation->mNumChannels;
@@ -0,0 +1,378 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "frustum.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// a mesh placed in the world, the unit the scene BVH is built over
+struct MeshInstance {
+    Mesh* mesh;
+    glm::mat4 model;
+
+    AABB GetWorldBounds() const { return mesh->Bounds.Transform(model); }
+};
+
+struct BVHNode {
+    AABB Bounds;
+    // inner node: index of the left child, the right child is stored right after it.
+    // leaf: index of the first entry in BVH::Items
+    uint32_t LeftFirst;
+    // number of items of a leaf, 0 for inner nodes
+    uint32_t Count;
+
+    bool IsLeaf() const { return Count > 0; }
+};
+
+// bounding volume hierarchy over a list of boxes (one per object), built with the binned surface area heuristic.
+// nodes live in one flat array, children are always stored after their parent so a refit is a single reverse sweep.
+class BVH {
+public:
+    std::vector<BVHNode> Nodes;
+    // object indices, leaves reference a contiguous range of this list
+    std::vector<uint32_t> Items;
+
+    void Build(const std::vector<AABB>& bounds, uint32_t maxLeafSize = 4)
+    {
+        Nodes.clear();
+        Items.resize(bounds.size());
+        for (uint32_t i = 0; i < Items.size(); i++)
+            Items[i] = i;
+        if (bounds.empty())
+            return;
+
+        itemBounds = bounds;
+        centroids.resize(bounds.size());
+        for (size_t i = 0; i < bounds.size(); i++)
+            centroids[i] = bounds[i].Center();
+
+        // a binary tree over n leaves never needs more than 2n - 1 nodes
+        Nodes.reserve(bounds.size() * 2);
+        BVHNode root;
+        root.LeftFirst = 0;
+        root.Count = (uint32_t)bounds.size();
+        Nodes.push_back(root);
+
+        // (node index, depth) pairs. depth is capped so the fixed size traversal stacks below can never overflow
+        std::vector<std::pair<uint32_t, int>> stack;
+        stack.push_back(std::make_pair(0u, 0));
+        while (!stack.empty())
+        {
+            uint32_t nodeIndex = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+
+            updateNodeBounds(Nodes[nodeIndex]);
+            if (Nodes[nodeIndex].Count <= maxLeafSize || depth >= MAX_DEPTH)
+                continue;
+
+            int axis;
+            float splitPosition;
+            float splitCost = findBestSplit(Nodes[nodeIndex], axis, splitPosition);
+            float leafCost = (float)Nodes[nodeIndex].Count * surfaceArea(Nodes[nodeIndex].Bounds);
+            if (splitCost >= leafCost)
+                continue;
+
+            // partition the item range in place
+            uint32_t first = Nodes[nodeIndex].LeftFirst;
+            uint32_t count = Nodes[nodeIndex].Count;
+            uint32_t* begin = Items.data() + first;
+            uint32_t* middle = std::partition(begin, begin + count, [&](uint32_t item) {
+                return centroids[item][axis] < splitPosition;
+            });
+            uint32_t leftCount = (uint32_t)(middle - begin);
+            if (leftCount == 0 || leftCount == count)
+                continue;
+
+            BVHNode left, right;
+            left.LeftFirst = first;
+            left.Count = leftCount;
+            right.LeftFirst = first + leftCount;
+            right.Count = count - leftCount;
+
+            uint32_t leftIndex = (uint32_t)Nodes.size();
+            Nodes.push_back(left);
+            Nodes.push_back(right);
+            Nodes[nodeIndex].LeftFirst = leftIndex;
+            Nodes[nodeIndex].Count = 0;
+
+            stack.push_back(std::make_pair(leftIndex, depth + 1));
+            stack.push_back(std::make_pair(leftIndex + 1, depth + 1));
+        }
+    }
+
+    // recomputes node bounds after objects moved, keeping the topology. much cheaper than a rebuild,
+    // the tree quality degrades when objects move far from where they were at build time.
+    void Refit(const std::vector<AABB>& bounds)
+    {
+        itemBounds = bounds;
+        for (size_t i = Nodes.size(); i-- > 0; )
+        {
+            BVHNode& node = Nodes[i];
+            if (node.IsLeaf())
+            {
+                updateNodeBounds(node);
+            }
+            else
+            {
+                node.Bounds = Nodes[node.LeftFirst].Bounds;
+                node.Bounds.Expand(Nodes[node.LeftFirst + 1].Bounds);
+            }
+        }
+    }
+
+    // appends the index of every object whose box may intersect the frustum (view or light frustum)
+    void QueryFrustum(const Frustum& frustum, std::vector<uint32_t>& result) const
+    {
+        if (Nodes.empty())
+            return;
+        uint32_t stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = Nodes[stack[--stackSize]];
+            Frustum::Containment containment = frustum.Classify(node.Bounds);
+            if (containment == Frustum::OUTSIDE)
+                continue;
+            if (containment == Frustum::INSIDE)
+            {
+                appendSubtree(node, result);
+                continue;
+            }
+            if (node.IsLeaf())
+            {
+                for (uint32_t i = 0; i < node.Count; i++)
+                {
+                    uint32_t item = Items[node.LeftFirst + i];
+                    if (frustum.IsBoxVisible(itemBounds[item]))
+                        result.push_back(item);
+                }
+                continue;
+            }
+            stack[stackSize++] = node.LeftFirst;
+            stack[stackSize++] = node.LeftFirst + 1;
+        }
+    }
+
+    // appends the index of every object whose box overlaps the given box
+    void QueryAABB(const AABB& box, std::vector<uint32_t>& result) const
+    {
+        if (Nodes.empty())
+            return;
+        uint32_t stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = Nodes[stack[--stackSize]];
+            if (!overlaps(node.Bounds, box))
+                continue;
+            if (node.IsLeaf())
+            {
+                for (uint32_t i = 0; i < node.Count; i++)
+                {
+                    uint32_t item = Items[node.LeftFirst + i];
+                    if (overlaps(itemBounds[item], box))
+                        result.push_back(item);
+                }
+                continue;
+            }
+            stack[stackSize++] = node.LeftFirst;
+            stack[stackSize++] = node.LeftFirst + 1;
+        }
+    }
+
+    // finds the closest object hit by the ray. intersect(item, ray, tMax) returns the hit distance of an object or
+    // a negative value on a miss, so callers can refine the box test with the actual geometry.
+    template <typename IntersectFunction>
+    bool Raycast(const Ray& ray, IntersectFunction intersect, uint32_t& hitItem, float& hitDistance, float tMax = FLT_MAX) const
+    {
+        if (Nodes.empty())
+            return false;
+        glm::vec3 invDirection = 1.0f / ray.Direction;
+        bool hit = false;
+        hitDistance = tMax;
+
+        uint32_t stack[64];
+        int stackSize = 0;
+        stack[stackSize++] = 0;
+        while (stackSize > 0)
+        {
+            const BVHNode& node = Nodes[stack[--stackSize]];
+            float tNear;
+            if (!IntersectRayAABB(ray, invDirection, node.Bounds, hitDistance, tNear))
+                continue;
+            if (node.IsLeaf())
+            {
+                for (uint32_t i = 0; i < node.Count; i++)
+                {
+                    uint32_t item = Items[node.LeftFirst + i];
+                    float t = intersect(item, ray, hitDistance);
+                    if (t >= 0.0f && t < hitDistance)
+                    {
+                        hitDistance = t;
+                        hitItem = item;
+                        hit = true;
+                    }
+                }
+                continue;
+            }
+            // visit the nearer child first so the far one is more likely to be rejected by the shrinking hitDistance
+            const BVHNode& left = Nodes[node.LeftFirst];
+            const BVHNode& right = Nodes[node.LeftFirst + 1];
+            float tLeft, tRight;
+            bool hitLeft = IntersectRayAABB(ray, invDirection, left.Bounds, hitDistance, tLeft);
+            bool hitRight = IntersectRayAABB(ray, invDirection, right.Bounds, hitDistance, tRight);
+            if (hitLeft && hitRight)
+            {
+                if (tLeft < tRight)
+                {
+                    stack[stackSize++] = node.LeftFirst + 1;
+                    stack[stackSize++] = node.LeftFirst;
+                }
+                else
+                {
+                    stack[stackSize++] = node.LeftFirst;
+                    stack[stackSize++] = node.LeftFirst + 1;
+                }
+            }
+            else if (hitLeft)
+                stack[stackSize++] = node.LeftFirst;
+            else if (hitRight)
+                stack[stackSize++] = node.LeftFirst + 1;
+        }
+        return hit;
+    }
+
+    // closest object whose box is hit by the ray
+    bool Raycast(const Ray& ray, uint32_t& hitItem, float& hitDistance, float tMax = FLT_MAX) const
+    {
+        glm::vec3 invDirection = 1.0f / ray.Direction;
+        return Raycast(ray, [&](uint32_t item, const Ray& r, float maxDistance) {
+            float t;
+            return IntersectRayAABB(r, invDirection, itemBounds[item], maxDistance, t) ? t : -1.0f;
+        }, hitItem, hitDistance, tMax);
+    }
+
+private:
+    static const int BIN_COUNT = 16;
+    // deep enough for any sensible tree, and small enough for the traversal stacks (2 entries per level)
+    static const int MAX_DEPTH = 30;
+
+    // copy of the object boxes (by object index), so queries don't need the caller's list
+    std::vector<AABB> itemBounds;
+    std::vector<glm::vec3> centroids;
+
+    static float surfaceArea(const AABB& box)
+    {
+        if (!box.IsValid())
+            return 0.0f;
+        glm::vec3 size = box.max - box.min;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+
+    static bool overlaps(const AABB& a, const AABB& b)
+    {
+        return a.min.x <= b.max.x && a.max.x >= b.min.x &&
+               a.min.y <= b.max.y && a.max.y >= b.min.y &&
+               a.min.z <= b.max.z && a.max.z >= b.min.z;
+    }
+
+    void updateNodeBounds(BVHNode& node)
+    {
+        node.Bounds = AABB();
+        for (uint32_t i = 0; i < node.Count; i++)
+            node.Bounds.Expand(itemBounds[Items[node.LeftFirst + i]]);
+    }
+
+    void appendSubtree(const BVHNode& root, std::vector<uint32_t>& result) const
+    {
+        uint32_t stack[64];
+        int stackSize = 0;
+        const BVHNode* node = &root;
+        while (true)
+        {
+            if (node->IsLeaf())
+            {
+                result.insert(result.end(), Items.begin() + node->LeftFirst, Items.begin() + node->LeftFirst + node->Count);
+            }
+            else
+            {
+                stack[stackSize++] = node->LeftFirst + 1;
+                stack[stackSize++] = node->LeftFirst;
+            }
+            if (stackSize == 0)
+                break;
+            node = &Nodes[stack[--stackSize]];
+        }
+    }
+
+    // binned SAH: returns the cost of the best split found (FLT_MAX if the centroids can't be separated)
+    float findBestSplit(const BVHNode& node, int& bestAxis, float& bestPosition) const
+    {
+        AABB centroidBounds;
+        for (uint32_t i = 0; i < node.Count; i++)
+            centroidBounds.Expand(centroids[Items[node.LeftFirst + i]]);
+
+        float bestCost = FLT_MAX;
+        bestAxis = 0;
+        bestPosition = 0.0f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float boundsMin = centroidBounds.min[axis];
+            float boundsMax = centroidBounds.max[axis];
+            if (boundsMax <= boundsMin)
+                continue;
+
+            AABB binBounds[BIN_COUNT];
+            uint32_t binCount[BIN_COUNT] = {};
+            float scale = BIN_COUNT / (boundsMax - boundsMin);
+            for (uint32_t i = 0; i < node.Count; i++)
+            {
+                uint32_t item = Items[node.LeftFirst + i];
+                int bin = std::min(BIN_COUNT - 1, (int)((centroids[item][axis] - boundsMin) * scale));
+                binCount[bin]++;
+                binBounds[bin].Expand(itemBounds[item]);
+            }
+
+            // sweep from both sides to get the area and count left/right of every plane between bins
+            float leftArea[BIN_COUNT - 1], rightArea[BIN_COUNT - 1];
+            uint32_t leftCount[BIN_COUNT - 1], rightCount[BIN_COUNT - 1];
+            AABB leftBox, rightBox;
+            uint32_t leftSum = 0, rightSum = 0;
+            for (int i = 0; i < BIN_COUNT - 1; i++)
+            {
+                leftSum += binCount[i];
+                leftCount[i] = leftSum;
+                leftBox.Expand(binBounds[i]);
+                leftArea[i] = surfaceArea(leftBox);
+
+                rightSum += binCount[BIN_COUNT - 1 - i];
+                rightCount[BIN_COUNT - 2 - i] = rightSum;
+                rightBox.Expand(binBounds[BIN_COUNT - 1 - i]);
+                rightArea[BIN_COUNT - 2 - i] = surfaceArea(rightBox);
+            }
+
+            float binWidth = (boundsMax - boundsMin) / BIN_COUNT;
+            for (int i = 0; i < BIN_COUNT - 1; i++)
+            {
+                if (leftCount[i] == 0 || rightCount[i] == 0)
+                    continue;
+                float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestPosition = boundsMin + binWidth * (i + 1);
+                }
+            }
+        }
+        return bestCost;
+    }
+};
@@ -4,6 +4,7 @@
 #include <glad/glad.h>
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
+#include "frustum.h"
 
 #include <vector>
 
@@ -63,6 +64,27 @@ public:
         return glm::lookAt(Position, Position + Front, Up);
     }
 
+    //returns the perspective projection matrix for the current zoom
+    glm::mat4 GetProjectionMatrix(float aspect, float nearPlane, float farPlane){
+        return glm::perspective(glm::radians(Zoom), aspect, nearPlane, farPlane);
+    }
+
+    //returns the view frustum (in world space) for the current position, orientation and zoom
+    Frustum GetFrustum(float aspect, float nearPlane, float farPlane){
+        return Frustum(GetProjectionMatrix(aspect, nearPlane, farPlane) * GetViewMatrix());
+    }
+
+    //returns the world space ray through a point on screen (in pixels, origin at the top left corner), e.g. for picking
+    Ray GetPickingRay(float screenX, float screenY, float screenWidth, float screenHeight, float nearPlane, float farPlane){
+        glm::mat4 inverseViewProjection = glm::inverse(GetProjectionMatrix(screenWidth / screenHeight, nearPlane, farPlane) * GetViewMatrix());
+        float ndcX = 2.0f * screenX / screenWidth - 1.0f;
+        float ndcY = 1.0f - 2.0f * screenY / screenHeight;
+        glm::vec4 nearPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+        glm::vec4 farPoint = inverseViewProjection * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+        glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+        return Ray(origin, glm::normalize(glm::vec3(farPoint) / farPoint.w - origin));
+    }
+
     void ProcessKeyboard(Camera_Movement direction, float deltaTime){
         float velocity = MovementSpeed * deltaTime;
         if(direction == FORWARD)
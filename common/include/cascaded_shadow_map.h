@@ -0,0 +1,342 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "frustum.h"
+#include "shader_s.h"
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <string>
+
+// cascaded shadow maps for a directional light: the view frustum is cut into depth slices, every slice gets its
+// own orthographic shadow map sized to it, so near slices get many texels per world unit and far ones few.
+// all cascades are layers of one depth GL_TEXTURE_2D_ARRAY, rendered in a single pass by a geometry shader that
+// sends every triangle to each layer (csm_depth.gs).
+//
+// each cascade is fitted to the bounding sphere of its slice. the sphere doesn't change size when the camera turns
+// and its center is snapped to whole shadow texels in light space, so shadow edges don't shimmer when the camera moves.
+//
+// static casters are rendered into a cache of their own. a cascade of the cache is only redrawn when its light
+// matrix changes (the light moved, or the camera moved by a texel or more) or InvalidateStatic() is called, so a
+// still camera costs no static draws at all. dynamic casters are drawn every frame on top of a copy of the cache.
+// per draw, the caster's layerMask uniform (see CasterMask) skips the cascades it can't shadow. a frame goes:
+//
+//   Update(...)
+//   if (BeginStaticPass(depthShader)) { draw static casters; }
+//   if (BeginDynamicPass(depthShader, hasDynamicCasters)) { draw dynamic casters; }
+//   EndDepthPass();
+class CascadedShadowMap {
+public:
+    // keep in sync with the array sizes in csm_depth.gs and shadow_mapping.fs
+    static const int MAX_CASCADES = 8;
+
+    enum SplitScheme { SPLIT_UNIFORM = 0, SPLIT_LOGARITHMIC, SPLIT_PRACTICAL };
+
+    int CascadeCount;
+    int Resolution;
+    SplitScheme Scheme;
+    // blend of the practical scheme, 0 = uniform, 1 = logarithmic
+    float SplitLambda;
+    // shadows end at this view distance (or the far plane, if closer)
+    float ShadowDistance;
+
+    struct Stats {
+        // cascades of the static cache redrawn this frame
+        unsigned int StaticLayersDrawn = 0;
+        bool DynamicPass = false;
+    };
+
+    // the default keeps an array at the memory of a single 1024x1024 map: 4 cascades of 512x512
+    CascadedShadowMap(int cascadeCount = 4, int resolution = 512, SplitScheme scheme = SPLIT_PRACTICAL,
+                      float splitLambda = 0.75f, float shadowDistance = 50.0f)
+        : CascadeCount(std::min(std::max(cascadeCount, 1), (int)MAX_CASCADES)), Resolution(resolution), Scheme(scheme),
+          SplitLambda(splitLambda), ShadowDistance(shadowDistance)
+    {
+        // the static cache and the array the lighting reads (cache + dynamic casters)
+        staticArray = createDepthArray();
+        depthArray = createDepthArray();
+        staticFBO = createLayeredFramebuffer(staticArray);
+        fbo = createLayeredFramebuffer(depthArray);
+        // single layer attachments for clearing and copying one cascade at a time
+        glGenFramebuffers(1, &layerReadFBO);
+        glGenFramebuffers(1, &layerDrawFBO);
+        for (unsigned int framebuffer : {layerReadFBO, layerDrawFBO})
+        {
+            GLState::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // the lighting reads the depth twice: with hardware comparison (bilinear filtered, 2x2 PCF in one tap)
+        // and raw, for the blocker search of PCSS
+        glGenSamplers(1, &compareSampler);
+        glSamplerParameteri(compareSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glSamplerParameteri(compareSampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glSamplerParameteri(compareSampler, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glSamplerParameteri(compareSampler, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glGenSamplers(1, &depthSampler);
+        glSamplerParameteri(depthSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glSamplerParameteri(depthSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        const float border[] = {1.0f, 1.0f, 1.0f, 1.0f};
+        for (unsigned int sampler : {compareSampler, depthSampler})
+        {
+            glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+            glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+            glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR, border);
+        }
+
+        for (int i = 0; i < MAX_CASCADES; i++)
+            cachedValid[i] = false;
+    }
+
+    ~CascadedShadowMap()
+    {
+        GLState::DeleteFramebuffers(1, &fbo);
+        GLState::DeleteFramebuffers(1, &staticFBO);
+        GLState::DeleteFramebuffers(1, &layerReadFBO);
+        GLState::DeleteFramebuffers(1, &layerDrawFBO);
+        GLState::DeleteTextures(1, &depthArray);
+        GLState::DeleteTextures(1, &staticArray);
+        glDeleteSamplers(1, &compareSampler);
+        glDeleteSamplers(1, &depthSampler);
+    }
+
+    CascadedShadowMap(const CascadedShadowMap&) = delete;
+    CascadedShadowMap& operator=(const CascadedShadowMap&) = delete;
+
+    // fits the cascades to the camera. lightDirection points from the scene towards the light,
+    // every caster of sceneBounds is kept in the depth range of every cascade
+    void Update(const glm::mat4 &view, float fovY, float aspect, float nearPlane, float farPlane,
+                const glm::vec3 &lightDirection, const AABB &sceneBounds)
+    {
+        const float shadowFar = std::min(farPlane, ShadowDistance);
+        splits[0] = nearPlane;
+        for (int i = 1; i <= CascadeCount; i++)
+        {
+            float fraction = (float)i / CascadeCount;
+            float uniform = nearPlane + (shadowFar - nearPlane) * fraction;
+            float logarithmic = nearPlane * std::pow(shadowFar / nearPlane, fraction);
+            switch (Scheme)
+            {
+                case SPLIT_UNIFORM: splits[i] = uniform; break;
+                case SPLIT_LOGARITHMIC: splits[i] = logarithmic; break;
+                default: splits[i] = SplitLambda * logarithmic + (1.0f - SplitLambda) * uniform; break;
+            }
+        }
+
+        // light space without translation from the camera, so snapping to texels is stable
+        glm::vec3 toLight = glm::normalize(lightDirection);
+        glm::vec3 up = std::abs(toLight.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::mat4 lightView = glm::lookAt(toLight, glm::vec3(0.0f), up);
+
+        // depth range of the casters in light space (view space z is negative in front)
+        AABB sceneLight = sceneBounds.Transform(lightView);
+
+        for (int i = 0; i < CascadeCount; i++)
+        {
+            // corners of the slice in world space
+            glm::mat4 inverseSlice = glm::inverse(glm::perspective(fovY, aspect, splits[i], splits[i + 1]) * view);
+            glm::vec3 corners[8];
+            glm::vec3 center(0.0f);
+            for (int c = 0; c < 8; c++)
+            {
+                glm::vec4 corner = inverseSlice * glm::vec4((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : -1.0f, 1.0f);
+                corners[c] = glm::vec3(corner) / corner.w;
+                center += corners[c];
+            }
+            center /= 8.0f;
+            float radius = 0.0f;
+            for (const glm::vec3 &corner : corners)
+                radius = std::max(radius, glm::length(corner - center));
+            // rounded up so float noise doesn't change the texel size from frame to frame
+            radius = std::ceil(radius * 16.0f) / 16.0f;
+
+            glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+            float texel = 2.0f * radius / Resolution;
+            lightCenter.x = std::floor(lightCenter.x / texel) * texel;
+            lightCenter.y = std::floor(lightCenter.y / texel) * texel;
+            // the depth range too, so a matrix only changes on whole texel steps and the static cache stays valid
+            lightCenter.z = std::floor(lightCenter.z / texel) * texel;
+
+            float zNear = std::min(-lightCenter.z - radius, -sceneLight.max.z);
+            float zFar = -lightCenter.z + radius;
+            glm::mat4 lightProjection = glm::ortho(lightCenter.x - radius, lightCenter.x + radius,
+                                                   lightCenter.y - radius, lightCenter.y + radius, zNear, zFar);
+            lightSpaceMatrices[i] = lightProjection * lightView;
+            cascadeFrustums[i] = Frustum(lightSpaceMatrices[i]);
+            texelSizes[i] = texel;
+            depthRanges[i] = zFar - zNear;
+        }
+    }
+
+    // the static casters have changed, every cascade of the cache gets redrawn
+    void InvalidateStatic()
+    {
+        for (int i = 0; i < MAX_CASCADES; i++)
+            cachedValid[i] = false;
+    }
+
+    // the cascades whose light frustum a caster with these world bounds intersects
+    unsigned int CasterMask(const AABB &worldBounds) const
+    {
+        unsigned int mask = 0;
+        for (int i = 0; i < CascadeCount; i++)
+            if (cascadeFrustums[i].IsBoxVisible(worldBounds))
+                mask |= 1u << i;
+        return mask;
+    }
+
+    // starts redrawing the outdated cascades of the static cache. returns the mask of those cascades,
+    // 0 when the cache is up to date and no static caster has to be drawn. the depth shader stays in use
+    unsigned int BeginStaticPass(Shader &depthShader)
+    {
+        stats = Stats();
+        staticDirty = 0;
+        for (int i = 0; i < CascadeCount; i++)
+        {
+            if (cachedValid[i] && cachedMatrices[i] == lightSpaceMatrices[i])
+                continue;
+            staticDirty |= 1u << i;
+            cachedMatrices[i] = lightSpaceMatrices[i];
+            cachedValid[i] = true;
+            stats.StaticLayersDrawn++;
+        }
+        if (staticDirty == 0)
+            return 0;
+
+        GLState::Viewport(0, 0, Resolution, Resolution);
+        // a layered framebuffer clears all of its layers, so clear the outdated ones one by one
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, layerDrawFBO);
+        for (int i = 0; i < CascadeCount; i++)
+        {
+            if (!(staticDirty & (1u << i)))
+                continue;
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticArray, 0, i);
+            glClear(GL_DEPTH_BUFFER_BIT);
+        }
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+        depthShader.use();
+        setMatrices(depthShader);
+        return staticDirty;
+    }
+
+    // when there are dynamic casters, copies the static cache into the lighting array and binds it for them.
+    // returns false when there is nothing dynamic to draw, the lighting then reads the cache directly
+    bool BeginDynamicPass(Shader &depthShader, bool hasDynamicCasters)
+    {
+        stats.DynamicPass = hasDynamicCasters;
+        if (!hasDynamicCasters)
+            return false;
+
+        GLState::BindFramebuffer(GL_READ_FRAMEBUFFER, layerReadFBO);
+        GLState::BindFramebuffer(GL_DRAW_FRAMEBUFFER, layerDrawFBO);
+        for (int i = 0; i < CascadeCount; i++)
+        {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticArray, 0, i);
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthArray, 0, i);
+            glBlitFramebuffer(0, 0, Resolution, Resolution, 0, 0, Resolution, Resolution, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        }
+
+        GLState::Viewport(0, 0, Resolution, Resolution);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, fbo);
+        depthShader.use();
+        setMatrices(depthShader);
+        return true;
+    }
+
+    void EndDepthPass()
+    {
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    // binds the depth array and sets the uniforms the lighting shader needs to pick and sample a cascade.
+    // uses two texture units: unit with a comparison sampler (shadowMap, a sampler2DArrayShadow) and unit + 1
+    // with a plain one (shadowDepth, a sampler2DArray)
+    void Bind(const Shader &shader, int unit)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            GLState::ActiveTexture(GL_TEXTURE0 + unit + i);
+            GLState::BindTexture(GL_TEXTURE_2D_ARRAY, GetDepthArray());
+            glBindSampler(unit + i, i == 0 ? compareSampler : depthSampler);
+        }
+        GLState::ActiveTexture(GL_TEXTURE0);
+        shader.setInt("shadowMap", unit);
+        shader.setInt("shadowDepth", unit + 1);
+        setMatrices(shader);
+        for (int i = 0; i < CascadeCount; i++)
+        {
+            shader.setFloat("cascadeFarDistances[" + std::to_string(i) + "]", splits[i + 1]);
+            shader.setFloat("cascadeTexelSizes[" + std::to_string(i) + "]", texelSizes[i]);
+            shader.setFloat("cascadeDepthRanges[" + std::to_string(i) + "]", depthRanges[i]);
+        }
+    }
+
+    const glm::mat4 &GetLightSpaceMatrix(int cascade) const { return lightSpaceMatrices[cascade]; }
+    // view distances covered by a cascade
+    float GetSplitNear(int cascade) const { return splits[cascade]; }
+    float GetSplitFar(int cascade) const { return splits[cascade + 1]; }
+    // the array holding every caster of this frame
+    unsigned int GetDepthArray() const { return stats.DynamicPass ? depthArray : staticArray; }
+    const Stats &GetStats() const { return stats; }
+
+private:
+    unsigned int fbo, depthArray;
+    unsigned int staticFBO, staticArray;
+    unsigned int layerReadFBO, layerDrawFBO;
+    Frustum cascadeFrustums[MAX_CASCADES];
+    // light matrices the static cache was drawn with
+    glm::mat4 cachedMatrices[MAX_CASCADES];
+    bool cachedValid[MAX_CASCADES];
+    unsigned int staticDirty = 0;
+    Stats stats;
+    float splits[MAX_CASCADES + 1];
+    float texelSizes[MAX_CASCADES];
+    // world distance between depth 0 and 1 of each cascade
+    float depthRanges[MAX_CASCADES];
+    unsigned int compareSampler, depthSampler;
+    glm::mat4 lightSpaceMatrices[MAX_CASCADES];
+
+    unsigned int createDepthArray() const
+    {
+        unsigned int texture;
+        glGenTextures(1, &texture);
+        GLState::BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, Resolution, Resolution, CascadeCount, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        // everything outside of a cascade is lit
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        const float border[] = {1.0f, 1.0f, 1.0f, 1.0f};
+        glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+        return texture;
+    }
+
+    // a layered attachment, gl_Layer picks the cascade
+    unsigned int createLayeredFramebuffer(unsigned int texture) const
+    {
+        unsigned int framebuffer;
+        glGenFramebuffers(1, &framebuffer);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::CASCADED_SHADOW_MAP::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+        return framebuffer;
+    }
+
+    void setMatrices(const Shader &shader) const
+    {
+        shader.setInt("cascadeCount", CascadeCount);
+        for (int i = 0; i < CascadeCount; i++)
+            shader.setMat4("lightSpaceMatrices[" + std::to_string(i) + "]", lightSpaceMatrices[i]);
+    }
+};
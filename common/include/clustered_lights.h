@@ -0,0 +1,393 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "shader_s.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CLUSTERED_LIGHTS_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CLUSTERED_LIGHTS_USE_NEON 1
+#endif
+
+// a point light whose light ends at Radius: attenuation 1 / (1 + Quadratic * d^2), faded out to reach 0 at Radius
+struct ClusteredPointLight {
+    glm::vec3 Position;
+    float Radius;
+    glm::vec3 Color;
+    float Quadratic;
+};
+
+// distance where a light of the given (brightest channel) intensity falls below threshold
+inline float PointLightRadius(float intensity, float quadratic, float threshold = 5.0f / 256.0f)
+{
+    return std::sqrt(std::max(intensity / threshold - 1.0f, 0.0f) / quadratic);
+}
+
+// clustered light culling: the view frustum is cut into CLUSTERS_X x CLUSTERS_Y screen tiles and CLUSTERS_Z
+// exponential depth slices, and each frame every light is listed in the clusters its sphere touches. a fragment
+// then only evaluates the lights of its own cluster, so the cost per fragment follows the lights near it rather
+// than the total count.
+//
+// the assignment runs on the CPU: the depth slices are split between threads that live as long as the object, and
+// within a slice the sphere is tested against four cluster boxes of a row at a time. the results go to the GPU as three texture buffers
+// (GL 3.3 has no storage buffers): lights (two RGBA32F texels per light), lightGrid (RG32UI offset and count per
+// cluster) and lightIndices (R32UI, the lights of all clusters one after the other). a texture buffer holds
+// GL_MAX_TEXTURE_BUFFER_SIZE texels (65536 at least), lights past what fits are ignored and clusters past it are
+// cut short, both counted in the stats.
+class ClusteredLights {
+public:
+    // keep in sync with obj.fs
+    static const int CLUSTERS_X = 16;
+    static const int CLUSTERS_Y = 9;
+    static const int CLUSTERS_Z = 24;
+    static const int CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+    // light indices are 16 bits while sorting, lights past this are ignored
+    static const size_t MAX_LIGHTS = 65536;
+
+    struct Stats {
+        unsigned int Lights = 0;
+        // lights inside the depth range of the clusters
+        unsigned int VisibleLights = 0;
+        // entries of lightIndices, and the most lights a single cluster holds
+        unsigned int References = 0;
+        unsigned int MaxPerCluster = 0;
+        // CPU time of Update
+        float AssignMilliseconds = 0.0f;
+        // left out because they didn't fit the texture buffers
+        unsigned int DroppedLights = 0;
+        unsigned int DroppedReferences = 0;
+    };
+
+    // threadCount = 0 uses every hardware thread
+    explicit ClusteredLights(unsigned int threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        workers.resize(std::min(threadCount, (unsigned int)CLUSTERS_Z));
+        slicesPerWorker = (CLUSTERS_Z + (int)workers.size() - 1) / (int)workers.size();
+        // the calling thread takes the first block of slices
+        for (size_t t = 1; t < workers.size(); t++)
+            threads.emplace_back(&ClusteredLights::workerLoop, this, t);
+
+        GLint maxTexels = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        maxBufferTexels = (size_t)std::max(maxTexels, 65536);
+
+        glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+        const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R32UI};
+        for (int i = 0; i < 3; i++)
+        {
+            glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+            GLState::BindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        GLState::BindTexture(GL_TEXTURE_BUFFER, 0);
+        grid.resize(CLUSTER_COUNT * 2);
+    }
+
+    ~ClusteredLights()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &thread : threads)
+            thread.join();
+        GLState::DeleteTextures(3, textures);
+        glDeleteBuffers(3, buffers);
+    }
+
+    ClusteredLights(const ClusteredLights&) = delete;
+    ClusteredLights& operator=(const ClusteredLights&) = delete;
+
+    // assigns the lights to the clusters of this camera and uploads the result
+    void Update(const std::vector<ClusteredPointLight> &lights, const glm::mat4 &view, float fovY, float aspect, float zNear, float zFar)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (fovY != lastFovY || aspect != lastAspect || zNear != lastNear || zFar != lastFar)
+            buildClusters(fovY, aspect, zNear, zFar);
+
+        // the spheres in view space, and the light texels in world space
+        const size_t lightCount = std::min(std::min(lights.size(), MAX_LIGHTS), maxBufferTexels / 2);
+        viewLights.resize(lightCount);
+        lightTexels.resize(lightCount * 2);
+        for (size_t i = 0; i < lightCount; i++)
+        {
+            viewLights[i] = glm::vec4(glm::vec3(view * glm::vec4(lights[i].Position, 1.0f)), lights[i].Radius);
+            lightTexels[i * 2] = glm::vec4(lights[i].Position, lights[i].Radius);
+            lightTexels[i * 2 + 1] = glm::vec4(lights[i].Color, lights[i].Quadratic);
+        }
+
+        // each worker owns a contiguous block of slices, and so a contiguous block of clusters
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            generation++;
+            busyThreads = (unsigned int)threads.size();
+        }
+        wake.notify_all();
+        assignSlices(workers[0], 0, std::min(slicesPerWorker, CLUSTERS_Z));
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this]() { return busyThreads == 0; });
+        }
+
+        // the workers' lists one after the other, cut short where the index buffer is full
+        stats = Stats();
+        stats.Lights = (unsigned int)lightCount;
+        stats.DroppedLights = (unsigned int)(std::min(lights.size(), MAX_LIGHTS) - lightCount);
+        indices.clear();
+        for (size_t t = 0; t < workers.size(); t++)
+        {
+            Worker &worker = workers[t];
+            int first = (int)t * slicesPerWorker * CLUSTERS_X * CLUSTERS_Y;
+            int last = std::min((int)(t + 1) * slicesPerWorker, CLUSTERS_Z) * CLUSTERS_X * CLUSTERS_Y;
+            for (int cluster = first; cluster < last; cluster++)
+            {
+                uint32_t count = worker.Counts[cluster - first];
+                uint32_t kept = (uint32_t)std::min((size_t)count, maxBufferTexels - indices.size());
+                const uint32_t *clusterIndices = worker.Indices.data() + worker.Offsets[cluster - first];
+                grid[cluster * 2] = (uint32_t)indices.size();
+                grid[cluster * 2 + 1] = kept;
+                indices.insert(indices.end(), clusterIndices, clusterIndices + kept);
+                stats.MaxPerCluster = std::max(stats.MaxPerCluster, kept);
+                stats.DroppedReferences += count - kept;
+            }
+        }
+        for (const glm::vec4 &light : viewLights)
+            stats.VisibleLights += (-light.z + light.w >= lastNear && -light.z - light.w <= lastFar) ? 1 : 0;
+        stats.References = (unsigned int)indices.size();
+
+        upload(0, lightTexels.data(), lightTexels.size() * sizeof(glm::vec4));
+        upload(1, grid.data(), grid.size() * sizeof(uint32_t));
+        upload(2, indices.data(), indices.size() * sizeof(uint32_t));
+        stats.AssignMilliseconds = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // binds the three texture buffers to units unit .. unit + 2 and sets the uniforms that find a fragment's cluster
+    void Bind(const Shader &shader, int unit, const glm::vec2 &viewportSize) const
+    {
+        const char *names[3] = {"lights", "lightGrid", "lightIndices"};
+        for (int i = 0; i < 3; i++)
+        {
+            GLState::ActiveTexture(GL_TEXTURE0 + unit + i);
+            GLState::BindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            shader.setInt(names[i], unit + i);
+        }
+        GLState::ActiveTexture(GL_TEXTURE0);
+        shader.setVec2("viewportSize", viewportSize);
+        shader.setFloat("clusterNear", lastNear);
+        // slice = log(depth / near) * clusterSliceScale
+        shader.setFloat("clusterSliceScale", CLUSTERS_Z / std::log(lastFar / lastNear));
+    }
+
+    // the light texels, for drawing the lights themselves
+    unsigned int GetLightBuffer() const { return textures[0]; }
+
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Worker {
+        // (cluster, light) pairs as they are found, then sorted into Indices by cluster
+        std::vector<uint32_t> Pairs;
+        std::vector<uint32_t> Indices;
+        std::vector<uint32_t> Counts, Offsets;
+    };
+
+    unsigned int buffers[3], textures[3];
+    std::vector<Worker> workers;
+    int slicesPerWorker;
+    size_t maxBufferTexels;
+
+    // shared with the threads of workers 1 and up, they run a block of slices for every new generation
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    unsigned int generation = 0;
+    unsigned int busyThreads = 0;
+    bool stopping = false;
+    float lastFovY = 0.0f, lastAspect = 0.0f, lastNear = 0.0f, lastFar = 0.0f;
+    // view space bounds of the clusters. x only depends on the column and the slice, y on the row and the slice
+    float sliceNear[CLUSTERS_Z], sliceFar[CLUSTERS_Z];
+    alignas(16) float columnMin[CLUSTERS_Z][CLUSTERS_X], columnMax[CLUSTERS_Z][CLUSTERS_X];
+    float rowMin[CLUSTERS_Z][CLUSTERS_Y], rowMax[CLUSTERS_Z][CLUSTERS_Y];
+    std::vector<glm::vec4> viewLights, lightTexels;
+    std::vector<uint32_t> grid, indices;
+    Stats stats;
+
+    void buildClusters(float fovY, float aspect, float zNear, float zFar)
+    {
+        lastFovY = fovY;
+        lastAspect = aspect;
+        lastNear = zNear;
+        lastFar = zFar;
+        float tanY = std::tan(fovY * 0.5f), tanX = tanY * aspect;
+        for (int z = 0; z < CLUSTERS_Z; z++)
+        {
+            sliceNear[z] = zNear * std::pow(zFar / zNear, (float)z / CLUSTERS_Z);
+            sliceFar[z] = zNear * std::pow(zFar / zNear, (float)(z + 1) / CLUSTERS_Z);
+            // a tile's side is linear in depth, so its extremes are at the near or the far end of the slice
+            for (int x = 0; x < CLUSTERS_X; x++)
+            {
+                float ndc0 = -1.0f + 2.0f * x / CLUSTERS_X, ndc1 = -1.0f + 2.0f * (x + 1) / CLUSTERS_X;
+                columnMin[z][x] = std::min(ndc0 * sliceNear[z], ndc0 * sliceFar[z]) * tanX;
+                columnMax[z][x] = std::max(ndc1 * sliceNear[z], ndc1 * sliceFar[z]) * tanX;
+            }
+            for (int y = 0; y < CLUSTERS_Y; y++)
+            {
+                float ndc0 = -1.0f + 2.0f * y / CLUSTERS_Y, ndc1 = -1.0f + 2.0f * (y + 1) / CLUSTERS_Y;
+                rowMin[z][y] = std::min(ndc0 * sliceNear[z], ndc0 * sliceFar[z]) * tanY;
+                rowMax[z][y] = std::max(ndc1 * sliceNear[z], ndc1 * sliceFar[z]) * tanY;
+            }
+        }
+    }
+
+    void workerLoop(size_t t)
+    {
+        unsigned int seen = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this, seen]() { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            int first = (int)t * slicesPerWorker, last = std::min(first + slicesPerWorker, CLUSTERS_Z);
+            if (first < last)
+                assignSlices(workers[t], first, last);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busyThreads == 0)
+                finished.notify_one();
+        }
+    }
+
+    int sliceOf(float depth) const
+    {
+        int slice = (int)std::floor(std::log(depth / lastNear) * CLUSTERS_Z / std::log(lastFar / lastNear));
+        return std::min(std::max(slice, 0), CLUSTERS_Z - 1);
+    }
+
+    // lists every light in the clusters of slices [firstSlice, lastSlice) it touches
+    void assignSlices(Worker &worker, int firstSlice, int lastSlice)
+    {
+        const int firstCluster = firstSlice * CLUSTERS_X * CLUSTERS_Y;
+        const int clusterCount = (lastSlice - firstSlice) * CLUSTERS_X * CLUSTERS_Y;
+        worker.Pairs.clear();
+        for (uint32_t light = 0; light < (uint32_t)viewLights.size(); light++)
+        {
+            const glm::vec4 &sphere = viewLights[light];
+            float depth = -sphere.z, radius = sphere.w, radius2 = radius * radius;
+            if (depth + radius < sliceNear[firstSlice] || depth - radius > sliceFar[lastSlice - 1])
+                continue;
+            int first = std::max(sliceOf(std::max(depth - radius, lastNear)), firstSlice);
+            int last = std::min(sliceOf(std::max(depth + radius, lastNear)), lastSlice - 1);
+            for (int z = first; z <= last; z++)
+            {
+                float dz = std::max(std::max(sliceNear[z] - depth, depth - sliceFar[z]), 0.0f);
+                for (int y = 0; y < CLUSTERS_Y; y++)
+                {
+                    float dy = std::max(std::max(rowMin[z][y] - sphere.y, sphere.y - rowMax[z][y]), 0.0f);
+                    float rest = radius2 - dy * dy - dz * dz;
+                    if (rest < 0.0f)
+                        continue;
+                    uint32_t mask = touchedColumns(columnMin[z], columnMax[z], sphere.x, rest);
+                    uint32_t rowCluster = (uint32_t)(((z * CLUSTERS_Y) + y) * CLUSTERS_X - firstCluster);
+                    for (; mask != 0; mask &= mask - 1)
+                    {
+                        int x = lowestBit(mask);
+                        worker.Pairs.push_back((rowCluster + x) << 16 | light);
+                    }
+                }
+            }
+        }
+
+        // counting sort by cluster, the lights of a cluster stay in order
+        worker.Counts.assign(clusterCount, 0);
+        worker.Offsets.resize(clusterCount);
+        for (uint32_t pair : worker.Pairs)
+            worker.Counts[pair >> 16]++;
+        uint32_t offset = 0;
+        for (int i = 0; i < clusterCount; i++)
+        {
+            worker.Offsets[i] = offset;
+            offset += worker.Counts[i];
+        }
+        worker.Indices.resize(worker.Pairs.size());
+        std::vector<uint32_t> cursor(worker.Offsets);
+        for (uint32_t pair : worker.Pairs)
+            worker.Indices[cursor[pair >> 16]++] = pair & 0xFFFF;
+    }
+
+    // bit x set when the x extent [min[x], max[x]] of column x is within sqrt(rest) of center
+    static uint32_t touchedColumns(const float *min, const float *max, float center, float rest)
+    {
+        uint32_t mask = 0;
+        int x = 0;
+#if defined(CLUSTERED_LIGHTS_USE_SSE)
+        const __m128 c = _mm_set1_ps(center), r = _mm_set1_ps(rest), zero = _mm_setzero_ps();
+        for (; x + 4 <= CLUSTERS_X; x += 4)
+        {
+            __m128 below = _mm_sub_ps(_mm_load_ps(min + x), c), above = _mm_sub_ps(c, _mm_load_ps(max + x));
+            __m128 d = _mm_max_ps(_mm_max_ps(below, above), zero);
+            mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(_mm_mul_ps(d, d), r)) << x;
+        }
+#elif defined(CLUSTERED_LIGHTS_USE_NEON)
+        const float32x4_t c = vdupq_n_f32(center), r = vdupq_n_f32(rest), zero = vdupq_n_f32(0.0f);
+        const uint32x4_t bits = {1, 2, 4, 8};
+        for (; x + 4 <= CLUSTERS_X; x += 4)
+        {
+            float32x4_t below = vsubq_f32(vld1q_f32(min + x), c), above = vsubq_f32(c, vld1q_f32(max + x));
+            float32x4_t d = vmaxq_f32(vmaxq_f32(below, above), zero);
+            uint32x4_t inside = vandq_u32(vcleq_f32(vmulq_f32(d, d), r), bits);
+            uint32x2_t sum = vpadd_u32(vget_low_u32(inside), vget_high_u32(inside));
+            mask |= (vget_lane_u32(sum, 0) + vget_lane_u32(sum, 1)) << x;
+        }
+#endif
+        for (; x < CLUSTERS_X; x++)
+        {
+            float d = std::max(std::max(min[x] - center, center - max[x]), 0.0f);
+            if (d * d <= rest)
+                mask |= 1u << x;
+        }
+        return mask;
+    }
+
+    static int lowestBit(uint32_t mask)
+    {
+        int bit = 0;
+        while ((mask & 1u) == 0)
+        {
+            mask >>= 1;
+            bit++;
+        }
+        return bit;
+    }
+
+    void upload(int index, const void *data, size_t size)
+    {
+        // a new store every frame, so the GPU may still read the previous one
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers[index]);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(size, (size_t)16), nullptr, GL_STREAM_DRAW);
+        if (size > 0)
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+};
@@ -0,0 +1,259 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <cfloat>
+#include <cstddef>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FRUSTUM_USE_NEON 1
+#endif
+
+// axis aligned bounding box, an empty box has min > max
+struct AABB {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    AABB() = default;
+    AABB(const glm::vec3& minCorner, const glm::vec3& maxCorner) : min(minCorner), max(maxCorner) {}
+
+    bool IsValid() const { return min.x <= max.x && min.y <= max.y && min.z <= max.z; }
+
+    glm::vec3 Center() const { return (min + max) * 0.5f; }
+    glm::vec3 Extents() const { return (max - min) * 0.5f; }
+
+    void Expand(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void Expand(const AABB& box)
+    {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    // bounds of this box after an affine transformation (Arvo's method, no need to transform the 8 corners)
+    AABB Transform(const glm::mat4& m) const
+    {
+        glm::vec3 center = glm::vec3(m * glm::vec4(Center(), 1.0f));
+        glm::vec3 extents = Extents();
+        glm::vec3 newExtents;
+        for (int i = 0; i < 3; i++)
+            newExtents[i] = glm::abs(m[0][i]) * extents.x + glm::abs(m[1][i]) * extents.y + glm::abs(m[2][i]) * extents.z;
+        return AABB(center - newExtents, center + newExtents);
+    }
+};
+
+struct Ray {
+    glm::vec3 Origin;
+    glm::vec3 Direction;
+
+    Ray() = default;
+    Ray(const glm::vec3& origin, const glm::vec3& direction) : Origin(origin), Direction(direction) {}
+};
+
+// slab test, invDirection = 1 / ray.Direction. on a hit tNear receives the entry distance (0 if the origin is inside)
+inline bool IntersectRayAABB(const Ray& ray, const glm::vec3& invDirection, const AABB& box, float tMax, float& tNear)
+{
+    glm::vec3 t0 = (box.min - ray.Origin) * invDirection;
+    glm::vec3 t1 = (box.max - ray.Origin) * invDirection;
+    glm::vec3 tSmall = glm::min(t0, t1);
+    glm::vec3 tBig = glm::max(t0, t1);
+    float tEnter = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, 0.0f));
+    float tExit = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, tMax));
+    tNear = tEnter;
+    return tEnter <= tExit;
+}
+
+// boxes in structure-of-arrays layout, so the batch culling routine can test several boxes per instruction
+struct AABBBatch {
+    std::vector<float> MinX, MinY, MinZ;
+    std::vector<float> MaxX, MaxY, MaxZ;
+
+    size_t Size() const { return MinX.size(); }
+
+    void Clear()
+    {
+        MinX.clear(); MinY.clear(); MinZ.clear();
+        MaxX.clear(); MaxY.clear(); MaxZ.clear();
+    }
+
+    void Reserve(size_t count)
+    {
+        MinX.reserve(count); MinY.reserve(count); MinZ.reserve(count);
+        MaxX.reserve(count); MaxY.reserve(count); MaxZ.reserve(count);
+    }
+
+    void Add(const AABB& box)
+    {
+        MinX.push_back(box.min.x); MinY.push_back(box.min.y); MinZ.push_back(box.min.z);
+        MaxX.push_back(box.max.x); MaxY.push_back(box.max.y); MaxZ.push_back(box.max.z);
+    }
+};
+
+class Frustum {
+public:
+    enum Plane { PLANE_LEFT = 0, PLANE_RIGHT, PLANE_BOTTOM, PLANE_TOP, PLANE_NEAR, PLANE_FAR, PLANE_COUNT };
+
+    // plane equations (xyz = normal pointing inside the frustum, w = distance), a point p is inside when dot(n, p) + w >= 0
+    glm::vec4 Planes[PLANE_COUNT];
+
+    Frustum() = default;
+
+    // extracts the planes from a (projection * view) matrix, the resulting planes live in world space.
+    // pass (projection * view * model) instead to get them in the model's local space.
+    explicit Frustum(const glm::mat4& viewProjection)
+    {
+        // glm matrices are column major, m[c][r]
+        glm::vec4 row0(viewProjection[0][0], viewProjection[1][0], viewProjection[2][0], viewProjection[3][0]);
+        glm::vec4 row1(viewProjection[0][1], viewProjection[1][1], viewProjection[2][1], viewProjection[3][1]);
+        glm::vec4 row2(viewProjection[0][2], viewProjection[1][2], viewProjection[2][2], viewProjection[3][2]);
+        glm::vec4 row3(viewProjection[0][3], viewProjection[1][3], viewProjection[2][3], viewProjection[3][3]);
+
+        Planes[PLANE_LEFT]   = row3 + row0;
+        Planes[PLANE_RIGHT]  = row3 - row0;
+        Planes[PLANE_BOTTOM] = row3 + row1;
+        Planes[PLANE_TOP]    = row3 - row1;
+        Planes[PLANE_NEAR]   = row3 + row2;
+        Planes[PLANE_FAR]    = row3 - row2;
+
+        for (int i = 0; i < PLANE_COUNT; i++)
+            Planes[i] /= glm::length(glm::vec3(Planes[i]));
+    }
+
+    // conservative test: may report boxes close to a frustum corner as visible, never hides a visible box
+    bool IsBoxVisible(const AABB& box) const
+    {
+        for (int i = 0; i < PLANE_COUNT; i++)
+        {
+            // the corner furthest along the plane normal
+            glm::vec3 positive(Planes[i].x >= 0.0f ? box.max.x : box.min.x,
+                               Planes[i].y >= 0.0f ? box.max.y : box.min.y,
+                               Planes[i].z >= 0.0f ? box.max.z : box.min.z);
+            if (glm::dot(glm::vec3(Planes[i]), positive) + Planes[i].w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    enum Containment { OUTSIDE = 0, INTERSECTING, INSIDE };
+
+    // like IsBoxVisible, but also tells whether the box is completely inside (so its children need no more tests)
+    Containment Classify(const AABB& box) const
+    {
+        Containment result = INSIDE;
+        for (int i = 0; i < PLANE_COUNT; i++)
+        {
+            glm::vec3 normal(Planes[i]);
+            glm::vec3 positive(normal.x >= 0.0f ? box.max.x : box.min.x,
+                               normal.y >= 0.0f ? box.max.y : box.min.y,
+                               normal.z >= 0.0f ? box.max.z : box.min.z);
+            if (glm::dot(normal, positive) + Planes[i].w < 0.0f)
+                return OUTSIDE;
+            glm::vec3 negative(normal.x >= 0.0f ? box.min.x : box.max.x,
+                               normal.y >= 0.0f ? box.min.y : box.max.y,
+                               normal.z >= 0.0f ? box.min.z : box.max.z);
+            if (glm::dot(normal, negative) + Planes[i].w < 0.0f)
+                result = INTERSECTING;
+        }
+        return result;
+    }
+
+    bool IsSphereVisible(const glm::vec3& center, float radius) const
+    {
+        for (int i = 0; i < PLANE_COUNT; i++)
+        {
+            if (glm::dot(glm::vec3(Planes[i]), center) + Planes[i].w < -radius)
+                return false;
+        }
+        return true;
+    }
+};
+
+// tests every box of the batch against the frustum, visible[i] is set to 1 for boxes that may be visible and 0 otherwise.
+// visible must hold batch.Size() entries. returns the number of visible boxes.
+inline size_t CullAABBs(const Frustum& frustum, const AABBBatch& batch, unsigned char* visible)
+{
+    const size_t count = batch.Size();
+    size_t first = 0;
+    size_t visibleCount = 0;
+
+    // per plane, pick the arrays holding the positive vertex once instead of per box
+    const float* px[Frustum::PLANE_COUNT];
+    const float* py[Frustum::PLANE_COUNT];
+    const float* pz[Frustum::PLANE_COUNT];
+    for (int p = 0; p < Frustum::PLANE_COUNT; p++)
+    {
+        px[p] = frustum.Planes[p].x >= 0.0f ? batch.MaxX.data() : batch.MinX.data();
+        py[p] = frustum.Planes[p].y >= 0.0f ? batch.MaxY.data() : batch.MinY.data();
+        pz[p] = frustum.Planes[p].z >= 0.0f ? batch.MaxZ.data() : batch.MinZ.data();
+    }
+
+#if defined(FRUSTUM_USE_SSE)
+    const __m128 zero = _mm_setzero_ps();
+    for (; first + 4 <= count; first += 4)
+    {
+        __m128 inside = _mm_cmpeq_ps(zero, zero); // all bits set
+        for (int p = 0; p < Frustum::PLANE_COUNT; p++)
+        {
+            const glm::vec4& plane = frustum.Planes[p];
+            __m128 d = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(px[p] + first), _mm_set1_ps(plane.x)),
+                                  _mm_mul_ps(_mm_loadu_ps(py[p] + first), _mm_set1_ps(plane.y)));
+            d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(pz[p] + first), _mm_set1_ps(plane.z)));
+            d = _mm_add_ps(d, _mm_set1_ps(plane.w));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, zero));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            visible[first + lane] = (unsigned char)((mask >> lane) & 1);
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#elif defined(FRUSTUM_USE_NEON)
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    for (; first + 4 <= count; first += 4)
+    {
+        uint32x4_t inside = vdupq_n_u32(0xFFFFFFFFu);
+        for (int p = 0; p < Frustum::PLANE_COUNT; p++)
+        {
+            const glm::vec4& plane = frustum.Planes[p];
+            float32x4_t d = vmlaq_n_f32(vdupq_n_f32(plane.w), vld1q_f32(px[p] + first), plane.x);
+            d = vmlaq_n_f32(d, vld1q_f32(py[p] + first), plane.y);
+            d = vmlaq_n_f32(d, vld1q_f32(pz[p] + first), plane.z);
+            inside = vandq_u32(inside, vcgeq_f32(d, zero));
+        }
+        unsigned char lanes[4] = {
+            (unsigned char)(vgetq_lane_u32(inside, 0) & 1), (unsigned char)(vgetq_lane_u32(inside, 1) & 1),
+            (unsigned char)(vgetq_lane_u32(inside, 2) & 1), (unsigned char)(vgetq_lane_u32(inside, 3) & 1)
+        };
+        for (int lane = 0; lane < 4; lane++)
+        {
+            visible[first + lane] = lanes[lane];
+            visibleCount += lanes[lane];
+        }
+    }
+#endif
+
+    // scalar tail (or the whole batch when no SIMD path is available)
+    for (size_t i = first; i < count; i++)
+    {
+        unsigned char isInside = 1;
+        for (int p = 0; p < Frustum::PLANE_COUNT && isInside; p++)
+        {
+            const glm::vec4& plane = frustum.Planes[p];
+            if (px[p][i] * plane.x + py[p][i] * plane.y + pz[p][i] * plane.z + plane.w < 0.0f)
+                isInside = 0;
+        }
+        visible[i] = isInside;
+        visibleCount += isInside;
+    }
+    return visibleCount;
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "shader_s.h"
+
+#include <iostream>
+
+// the render targets of deferred shading. the geometry pass writes 8 bytes per pixel plus depth:
+//
+//   gAlbedoSpec  GL_RGBA8  albedo, specular intensity in alpha
+//   gNormal      GL_RG16   view space normal, octahedral encoded into [0, 1]
+//   gDepth       GL_DEPTH_COMPONENT24, the view space position is reconstructed from it and the inverse projection
+//
+// the lighting passes add up into a light target of their own, which has a copy of the geometry depth so light
+// volumes can be depth tested while gDepth is read as a texture. Present() copies the result to the screen:
+//
+//   BeginGeometryPass(); draw the scene with gbuffer.fs;
+//   BeginLightingPass(); fullscreen and light volume passes reading BindTextures(...);
+//   Present();
+class GBuffer {
+public:
+    int Width = 0, Height = 0;
+
+    GBuffer(int width, int height)
+    {
+        glGenFramebuffers(1, &geometryFBO);
+        glGenFramebuffers(1, &lightFBO);
+        glGenTextures(1, &albedoSpec);
+        glGenTextures(1, &normal);
+        glGenTextures(1, &depth);
+        glGenTextures(1, &lightColor);
+        glGenRenderbuffers(1, &lightDepth);
+        Resize(width, height);
+    }
+
+    ~GBuffer()
+    {
+        GLState::DeleteFramebuffers(1, &geometryFBO);
+        GLState::DeleteFramebuffers(1, &lightFBO);
+        GLState::DeleteTextures(1, &albedoSpec);
+        GLState::DeleteTextures(1, &normal);
+        GLState::DeleteTextures(1, &depth);
+        GLState::DeleteTextures(1, &lightColor);
+        glDeleteRenderbuffers(1, &lightDepth);
+    }
+
+    GBuffer(const GBuffer&) = delete;
+    GBuffer& operator=(const GBuffer&) = delete;
+
+    // reallocates the targets when the framebuffer size changed
+    void Resize(int width, int height)
+    {
+        if (width == Width && height == Height)
+            return;
+        Width = width;
+        Height = height;
+
+        allocate(albedoSpec, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        allocate(normal, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+        allocate(depth, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, geometryFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedoSpec, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+        const GLenum attachments[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+        glDrawBuffers(2, attachments);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::GBUFFER::GEOMETRY_FRAMEBUFFER_INCOMPLETE" << std::endl;
+
+        // same depth format as gDepth, so it can be blitted
+        allocate(lightColor, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        glBindRenderbuffer(GL_RENDERBUFFER, lightDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, lightFBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, lightColor, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, lightDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::GBUFFER::LIGHT_FRAMEBUFFER_INCOMPLETE" << std::endl;
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void BeginGeometryPass()
+    {
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, geometryFBO);
+        GLState::Viewport(0, 0, Width, Height);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // copies the geometry depth to the light target and clears its color to clearColor
+    void BeginLightingPass(const glm::vec3 &clearColor)
+    {
+        GLState::BindFramebuffer(GL_READ_FRAMEBUFFER, geometryFBO);
+        GLState::BindFramebuffer(GL_DRAW_FRAMEBUFFER, lightFBO);
+        glBlitFramebuffer(0, 0, Width, Height, 0, 0, Width, Height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, lightFBO);
+        glClearColor(clearColor.r, clearColor.g, clearColor.b, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
+
+    // binds gAlbedoSpec, gNormal and gDepth to units unit .. unit + 2
+    void BindTextures(const Shader &shader, int unit) const
+    {
+        const unsigned int textures[3] = {albedoSpec, normal, depth};
+        const char *names[3] = {"gAlbedoSpec", "gNormal", "gDepth"};
+        for (int i = 0; i < 3; i++)
+        {
+            GLState::ActiveTexture(GL_TEXTURE0 + unit + i);
+            GLState::BindTexture(GL_TEXTURE_2D, textures[i]);
+            shader.setInt(names[i], unit + i);
+        }
+        GLState::ActiveTexture(GL_TEXTURE0);
+        shader.setVec2("viewportSize", glm::vec2(Width, Height));
+    }
+
+    // copies the lit image to the default framebuffer
+    void Present()
+    {
+        GLState::BindFramebuffer(GL_READ_FRAMEBUFFER, lightFBO);
+        GLState::BindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, Width, Height, 0, 0, Width, Height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+private:
+    unsigned int geometryFBO, lightFBO;
+    unsigned int albedoSpec, normal, depth, lightColor, lightDepth;
+
+    void allocate(unsigned int texture, GLint internalFormat, GLenum format, GLenum type)
+    {
+        GLState::BindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, Width, Height, 0, format, type, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        GLState::BindTexture(GL_TEXTURE_2D, 0);
+    }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <glad/glad.h>
+
+// a shadow copy of the GL state that is changed most often: program, vertex array, active texture unit and the
+// textures bound to each unit, framebuffers, viewport and the depth/cull/blend/color mask state. the functions
+// take the arguments of the GL call they replace and only issue it when the value actually changes.
+//
+// the copy is only right as long as every change goes through here, so common/include and the courses use these
+// instead of the raw calls, including while creating objects. Invalidate() forgets everything after GL was
+// changed behind its back. deleting an object also unbinds it, use the Delete* functions so the copy follows.
+//
+// counters of issued and skipped calls add up until EndFrame(), which keeps them as the last frame's numbers.
+class GLState {
+public:
+    static const int MAX_TEXTURE_UNITS = 32;
+
+    struct Counters {
+        unsigned int Issued = 0;
+        unsigned int Skipped = 0;
+    };
+
+    static void UseProgram(GLuint program)
+    {
+        State &s = state();
+        if (s.Program == program)
+            return skip();
+        s.Program = program;
+        issue();
+        glUseProgram(program);
+    }
+
+    static void BindVertexArray(GLuint vertexArray)
+    {
+        State &s = state();
+        if (s.VertexArray == vertexArray)
+            return skip();
+        s.VertexArray = vertexArray;
+        issue();
+        glBindVertexArray(vertexArray);
+    }
+
+    // texture is GL_TEXTURE0 + unit, as for glActiveTexture
+    static void ActiveTexture(GLenum texture)
+    {
+        State &s = state();
+        if (s.ActiveUnit == texture - GL_TEXTURE0)
+            return skip();
+        s.ActiveUnit = texture - GL_TEXTURE0;
+        issue();
+        glActiveTexture(texture);
+    }
+
+    // binds to the active unit like glBindTexture, every target of a unit is tracked on its own
+    static void BindTexture(GLenum target, GLuint texture)
+    {
+        State &s = state();
+        int slot = targetSlot(target);
+        if (slot < 0 || s.ActiveUnit >= (GLuint)MAX_TEXTURE_UNITS)
+        {
+            issue();
+            glBindTexture(target, texture);
+            return;
+        }
+        GLuint &bound = s.Textures[s.ActiveUnit][slot];
+        if (bound == texture)
+            return skip();
+        bound = texture;
+        issue();
+        glBindTexture(target, texture);
+    }
+
+    // GL_FRAMEBUFFER sets both the read and the draw binding
+    static void BindFramebuffer(GLenum target, GLuint framebuffer)
+    {
+        State &s = state();
+        bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+        bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+        if ((!read || s.ReadFramebuffer == framebuffer) && (!draw || s.DrawFramebuffer == framebuffer))
+            return skip();
+        if (read)
+            s.ReadFramebuffer = framebuffer;
+        if (draw)
+            s.DrawFramebuffer = framebuffer;
+        issue();
+        glBindFramebuffer(target, framebuffer);
+    }
+
+    static void Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        State &s = state();
+        if (s.Viewport[0] == x && s.Viewport[1] == y && s.Viewport[2] == width && s.Viewport[3] == height)
+            return skip();
+        s.Viewport[0] = x;
+        s.Viewport[1] = y;
+        s.Viewport[2] = width;
+        s.Viewport[3] = height;
+        issue();
+        glViewport(x, y, width, height);
+    }
+
+    // GL_DEPTH_TEST, GL_CULL_FACE, GL_BLEND and GL_STENCIL_TEST are tracked, other capabilities pass through
+    static void Enable(GLenum capability) { setCapability(capability, true); }
+    static void Disable(GLenum capability) { setCapability(capability, false); }
+
+    static void DepthFunc(GLenum func)
+    {
+        State &s = state();
+        if (s.DepthFunc == func)
+            return skip();
+        s.DepthFunc = func;
+        issue();
+        glDepthFunc(func);
+    }
+
+    static void DepthMask(GLboolean flag)
+    {
+        State &s = state();
+        if (s.DepthMask == (int)flag)
+            return skip();
+        s.DepthMask = flag;
+        issue();
+        glDepthMask(flag);
+    }
+
+    static void CullFace(GLenum mode)
+    {
+        State &s = state();
+        if (s.CullFace == mode)
+            return skip();
+        s.CullFace = mode;
+        issue();
+        glCullFace(mode);
+    }
+
+    static void BlendFunc(GLenum source, GLenum destination)
+    {
+        State &s = state();
+        if (s.BlendSource == source && s.BlendDestination == destination)
+            return skip();
+        s.BlendSource = source;
+        s.BlendDestination = destination;
+        issue();
+        glBlendFunc(source, destination);
+    }
+
+    static void ColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha)
+    {
+        State &s = state();
+        int mask = (red ? 1 : 0) | (green ? 2 : 0) | (blue ? 4 : 0) | (alpha ? 8 : 0);
+        if (s.ColorMask == mask)
+            return skip();
+        s.ColorMask = mask;
+        issue();
+        glColorMask(red, green, blue, alpha);
+    }
+
+    // deleting a bound object binds 0 in its place
+    static void DeleteTextures(GLsizei count, const GLuint *textures)
+    {
+        State &s = state();
+        for (GLsizei i = 0; i < count; i++)
+            for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+                for (int slot = 0; slot < TARGET_SLOTS; slot++)
+                    if (s.Textures[unit][slot] == textures[i])
+                        s.Textures[unit][slot] = 0;
+        glDeleteTextures(count, textures);
+    }
+
+    static void DeleteVertexArrays(GLsizei count, const GLuint *vertexArrays)
+    {
+        State &s = state();
+        for (GLsizei i = 0; i < count; i++)
+            if (s.VertexArray == vertexArrays[i])
+                s.VertexArray = 0;
+        glDeleteVertexArrays(count, vertexArrays);
+    }
+
+    static void DeleteFramebuffers(GLsizei count, const GLuint *framebuffers)
+    {
+        State &s = state();
+        for (GLsizei i = 0; i < count; i++)
+        {
+            if (s.ReadFramebuffer == framebuffers[i])
+                s.ReadFramebuffer = 0;
+            if (s.DrawFramebuffer == framebuffers[i])
+                s.DrawFramebuffer = 0;
+        }
+        glDeleteFramebuffers(count, framebuffers);
+    }
+
+    // forgets the whole copy, the next call of each kind is issued
+    static void Invalidate()
+    {
+        Counters counters = state().Current, last = state().LastFrame;
+        state() = State();
+        state().Current = counters;
+        state().LastFrame = last;
+    }
+
+    static void EndFrame()
+    {
+        State &s = state();
+        s.LastFrame = s.Current;
+        s.Current = Counters();
+    }
+
+    // calls issued and skipped during the last frame
+    static const Counters &GetCounters() { return state().LastFrame; }
+
+private:
+    static const GLuint UNKNOWN = 0xFFFFFFFFu;
+    static const int TARGET_SLOTS = 6;
+
+    struct State {
+        GLuint Program = UNKNOWN, VertexArray = UNKNOWN;
+        GLuint ActiveUnit = UNKNOWN;
+        GLuint Textures[MAX_TEXTURE_UNITS][TARGET_SLOTS];
+        GLuint ReadFramebuffer = UNKNOWN, DrawFramebuffer = UNKNOWN;
+        GLint Viewport[4] = {-1, -1, -1, -1};
+        // -1 while unknown
+        int DepthTest = -1, CullFaceEnabled = -1, Blend = -1, StencilTest = -1;
+        GLenum DepthFunc = UNKNOWN, CullFace = UNKNOWN, BlendSource = UNKNOWN, BlendDestination = UNKNOWN;
+        int DepthMask = -1, ColorMask = -1;
+        Counters Current, LastFrame;
+
+        State()
+        {
+            for (int unit = 0; unit < MAX_TEXTURE_UNITS; unit++)
+                for (int slot = 0; slot < TARGET_SLOTS; slot++)
+                    Textures[unit][slot] = UNKNOWN;
+        }
+    };
+
+    static State &state()
+    {
+        static State instance;
+        return instance;
+    }
+
+    static void issue() { state().Current.Issued++; }
+    static void skip() { state().Current.Skipped++; }
+
+    static int targetSlot(GLenum target)
+    {
+        switch (target)
+        {
+            case GL_TEXTURE_2D: return 0;
+            case GL_TEXTURE_2D_ARRAY: return 1;
+            case GL_TEXTURE_CUBE_MAP: return 2;
+            case GL_TEXTURE_BUFFER: return 3;
+            case GL_TEXTURE_3D: return 4;
+            case GL_TEXTURE_2D_MULTISAMPLE: return 5;
+            default: return -1;
+        }
+    }
+
+    static void setCapability(GLenum capability, bool enabled)
+    {
+        State &s = state();
+        int *tracked = nullptr;
+        switch (capability)
+        {
+            case GL_DEPTH_TEST: tracked = &s.DepthTest; break;
+            case GL_CULL_FACE: tracked = &s.CullFaceEnabled; break;
+            case GL_BLEND: tracked = &s.Blend; break;
+            case GL_STENCIL_TEST: tracked = &s.StencilTest; break;
+            default: break;
+        }
+        if (tracked)
+        {
+            if (*tracked == (enabled ? 1 : 0))
+                return skip();
+            *tracked = enabled ? 1 : 0;
+        }
+        issue();
+        if (enabled)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <cstdint>
+
+// a GL query object (GL_PRIMITIVES_GENERATED, GL_TIME_ELAPSED, GL_SAMPLES_PASSED, ...) read back without
+// stalling: every frame begins a query on the next object of a small ring, and the result of an older
+// frame is collected once the GPU has finished it. the value lags a few frames behind.
+class GpuCounter {
+public:
+    static const int RING_SIZE = 4;
+
+    GpuCounter(GLenum target) : target(target)
+    {
+        glGenQueries(RING_SIZE, queries);
+    }
+
+    ~GpuCounter()
+    {
+        glDeleteQueries(RING_SIZE, queries);
+    }
+
+    GpuCounter(const GpuCounter&) = delete;
+    GpuCounter& operator=(const GpuCounter&) = delete;
+
+    // only one query of a target can be active at a time
+    void Begin()
+    {
+        // a query whose result never arrived is dropped rather than waited on
+        if (pending[current])
+            collect(current, false);
+        glBeginQuery(target, queries[current]);
+    }
+
+    void End()
+    {
+        glEndQuery(target);
+        pending[current] = true;
+        current = (current + 1) % RING_SIZE;
+        // oldest first, so the newest available result wins
+        for (int i = 0; i < RING_SIZE; i++)
+            if (pending[(current + i) % RING_SIZE])
+                collect((current + i) % RING_SIZE, true);
+    }
+
+    // the most recent result available (0 until the first one arrives)
+    uint64_t Result() const { return result; }
+
+private:
+    GLenum target;
+    GLuint queries[RING_SIZE];
+    bool pending[RING_SIZE] = {};
+    int current = 0;
+    uint64_t result = 0;
+
+    void collect(int index, bool onlyIfAvailable)
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(queries[index], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available && onlyIfAvailable)
+            return;
+        if (available)
+            glGetQueryObjectui64v(queries[index], GL_QUERY_RESULT, (GLuint64*)&result);
+        pending[index] = false;
+    }
+};
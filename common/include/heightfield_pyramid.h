@@ -0,0 +1,304 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "frustum.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEIGHTFIELD_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HEIGHTFIELD_USE_NEON 1
+#endif
+
+// min/max mip pyramid of a heightmap. level 0 holds the lowest and highest sample of every cell (the square
+// between 4 neighbouring samples), every further level the min/max of 2x2 texels of the level below, up to a
+// single texel for the whole map. it answers conservative bounds of any region in a couple of lookups and
+// lets a ray skip every part of the map it passes above or below.
+//
+// the world mapping is the one of HeightmapMesh and TerrainQuadtree: world x = -height / 2 + row,
+// world z = -width / 2 + column, world y = value * yScale - yShift, and every cell is split into two triangles
+// along the diagonal from (row, column + 1) to (row + 1, column), like the triangle strips.
+class HeightfieldPyramid {
+public:
+    // data is the heightmap as loaded by stb_image, the first channel is the height
+    HeightfieldPyramid(const unsigned char *data, int width, int height, int channels, float yScale, float yShift)
+        : width(width), height(height), yScale(yScale), yShift(yShift)
+    {
+        heights.resize((size_t)width * height);
+        for (size_t i = 0; i < heights.size(); i++)
+            heights[i] = data[i * channels];
+        build();
+    }
+
+    int LevelCount() const { return (int)levels.size(); }
+
+    // conservative world space box of the surface between two samples (inclusive)
+    AABB Bounds(int firstRow, int firstColumn, int lastRow, int lastColumn) const
+    {
+        firstRow = glm::clamp(firstRow, 0, height - 1);
+        lastRow = glm::clamp(lastRow, firstRow, height - 1);
+        firstColumn = glm::clamp(firstColumn, 0, width - 1);
+        lastColumn = glm::clamp(lastColumn, firstColumn, width - 1);
+
+        // cells touching the region, then the first level where they fit in at most 2x2 texels
+        int firstCellY = std::min(firstRow, height - 2), lastCellY = std::max(lastRow - 1, firstCellY);
+        int firstCellX = std::min(firstColumn, width - 2), lastCellX = std::max(lastColumn - 1, firstCellX);
+        int level = 0;
+        while ((lastCellY >> level) - (firstCellY >> level) > 1 || (lastCellX >> level) - (firstCellX >> level) > 1)
+            level++;
+
+        uint8_t low = 255, high = 0;
+        for (int y = firstCellY >> level; y <= lastCellY >> level; y++)
+            for (int x = firstCellX >> level; x <= lastCellX >> level; x++)
+            {
+                low = std::min(low, levels[level].Min[y * levels[level].Width + x]);
+                high = std::max(high, levels[level].Max[y * levels[level].Width + x]);
+            }
+        glm::vec2 first = sampleToWorld((float)firstRow, (float)firstColumn), last = sampleToWorld((float)lastRow, (float)lastColumn);
+        return AABB(glm::vec3(first.x, low * yScale - yShift, first.y), glm::vec3(last.x, high * yScale - yShift, last.y));
+    }
+
+    // height of the triangulated surface below a world position, false outside of the map
+    bool HeightAt(float x, float z, float &y) const
+    {
+        float row = x + height / 2.0f, column = z + width / 2.0f;
+        if (row < 0.0f || column < 0.0f || row > height - 1 || column > width - 1)
+            return false;
+        int cellY = std::min((int)row, height - 2), cellX = std::min((int)column, width - 2);
+        float fy = row - cellY, fx = column - cellX;
+        float a = sample(cellY, cellX), b = sample(cellY, cellX + 1);
+        float e = sample(cellY + 1, cellX), d = sample(cellY + 1, cellX + 1);
+        float value = fx + fy <= 1.0f ? a + (b - a) * fx + (e - a) * fy
+                                      : d + (e - d) * (1.0f - fx) + (b - d) * (1.0f - fy);
+        y = value * yScale - yShift;
+        return true;
+    }
+
+    // first hit of a ray with the surface closer than tMax, descending only into texels whose box the ray enters,
+    // nearest first, so the search stops at the first triangle hit
+    bool Raycast(const Ray &ray, float &hitDistance, float tMax = FLT_MAX) const
+    {
+        struct Entry {
+            int Level, X, Y;
+            float Near;
+        };
+        const glm::vec3 invDirection = 1.0f / ray.Direction;
+        float closest = tMax;
+        bool hit = false;
+
+        Entry stack[4 * 32];
+        int stackSize = 0;
+        float rootNear;
+        const int top = (int)levels.size() - 1;
+        if (IntersectRayAABB(ray, invDirection, texelBounds(top, 0, 0), closest, rootNear))
+            stack[stackSize++] = {top, 0, 0, rootNear};
+
+        while (stackSize > 0)
+        {
+            Entry entry = stack[--stackSize];
+            if (entry.Near > closest)
+                continue;
+
+            if (entry.Level == 0)
+            {
+                float t;
+                if (intersectCell(ray, entry.Y, entry.X, closest, t))
+                {
+                    closest = t;
+                    hit = true;
+                }
+                continue;
+            }
+
+            // children sorted far to near, so the nearest is popped first
+            Entry children[4];
+            int childCount = 0;
+            const Level &below = levels[entry.Level - 1];
+            for (int i = 0; i < 4; i++)
+            {
+                int x = entry.X * 2 + (i & 1), y = entry.Y * 2 + (i >> 1);
+                float t;
+                if (x < below.Width && y < below.Height && IntersectRayAABB(ray, invDirection, texelBounds(entry.Level - 1, x, y), closest, t))
+                    children[childCount++] = {entry.Level - 1, x, y, t};
+            }
+            std::sort(children, children + childCount, [](const Entry &a, const Entry &b) { return a.Near > b.Near; });
+            for (int i = 0; i < childCount; i++)
+                stack[stackSize++] = children[i];
+        }
+
+        if (hit)
+            hitDistance = closest;
+        return hit;
+    }
+
+private:
+    struct Level {
+        int Width, Height;
+        std::vector<uint8_t> Min, Max;
+    };
+
+    int width, height;
+    float yScale, yShift;
+    std::vector<uint8_t> heights;
+    std::vector<Level> levels;
+
+    float sample(int row, int column) const { return heights[(size_t)row * width + column]; }
+
+    glm::vec2 sampleToWorld(float row, float column) const
+    {
+        return glm::vec2(-height / 2.0f + row, -width / 2.0f + column);
+    }
+
+    glm::vec3 vertex(int row, int column) const
+    {
+        glm::vec2 position = sampleToWorld((float)row, (float)column);
+        return glm::vec3(position.x, sample(row, column) * yScale - yShift, position.y);
+    }
+
+    // world box of a texel: the samples of the cells it covers, heights from the pyramid
+    AABB texelBounds(int level, int x, int y) const
+    {
+        const Level &info = levels[level];
+        int firstRow = y << level, lastRow = std::min((y + 1) << level, height - 1);
+        int firstColumn = x << level, lastColumn = std::min((x + 1) << level, width - 1);
+        glm::vec2 first = sampleToWorld((float)firstRow, (float)firstColumn), last = sampleToWorld((float)lastRow, (float)lastColumn);
+        return AABB(glm::vec3(first.x, info.Min[y * info.Width + x] * yScale - yShift, first.y),
+                    glm::vec3(last.x, info.Max[y * info.Width + x] * yScale - yShift, last.y));
+    }
+
+    // ray against the two triangles of a cell (Moller-Trumbore)
+    bool intersectCell(const Ray &ray, int row, int column, float tMax, float &t) const
+    {
+        glm::vec3 a = vertex(row, column), b = vertex(row, column + 1);
+        glm::vec3 e = vertex(row + 1, column), d = vertex(row + 1, column + 1);
+        bool hit = false;
+        t = tMax;
+        const glm::vec3 triangles[2][3] = {{a, e, b}, {e, d, b}};
+        for (const auto &triangle : triangles)
+        {
+            glm::vec3 edge1 = triangle[1] - triangle[0], edge2 = triangle[2] - triangle[0];
+            glm::vec3 p = glm::cross(ray.Direction, edge2);
+            float determinant = glm::dot(edge1, p);
+            if (std::abs(determinant) < 1e-8f)
+                continue;
+            float inverse = 1.0f / determinant;
+            glm::vec3 s = ray.Origin - triangle[0];
+            float u = glm::dot(s, p) * inverse;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+            glm::vec3 q = glm::cross(s, edge1);
+            float v = glm::dot(ray.Direction, q) * inverse;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+            float distance = glm::dot(edge2, q) * inverse;
+            if (distance >= 0.0f && distance < t)
+            {
+                t = distance;
+                hit = true;
+            }
+        }
+        return hit;
+    }
+
+    void build()
+    {
+        Level base;
+        base.Width = width - 1;
+        base.Height = height - 1;
+        base.Min.resize((size_t)base.Width * base.Height);
+        base.Max.resize(base.Min.size());
+        for (int y = 0; y < base.Height; y++)
+            reduceCells(&heights[(size_t)y * width], &heights[(size_t)(y + 1) * width], base.Width,
+                        &base.Min[(size_t)y * base.Width], &base.Max[(size_t)y * base.Width]);
+        levels.push_back(std::move(base));
+
+        while (levels.back().Width > 1 || levels.back().Height > 1)
+        {
+            const Level &below = levels.back();
+            Level level;
+            level.Width = (below.Width + 1) / 2;
+            level.Height = (below.Height + 1) / 2;
+            level.Min.resize((size_t)level.Width * level.Height);
+            level.Max.resize(level.Min.size());
+            for (int y = 0; y < level.Height; y++)
+            {
+                // an odd last row/column is paired with itself
+                int row0 = y * 2, row1 = std::min(y * 2 + 1, below.Height - 1);
+                reduceTexels<true>(&below.Min[(size_t)row0 * below.Width], &below.Min[(size_t)row1 * below.Width], below.Width,
+                                   &level.Min[(size_t)y * level.Width]);
+                reduceTexels<false>(&below.Max[(size_t)row0 * below.Width], &below.Max[(size_t)row1 * below.Width], below.Width,
+                                    &level.Max[(size_t)y * level.Width]);
+            }
+            levels.push_back(std::move(level));
+        }
+    }
+
+    // min and max of the 4 corners of each cell between two sample rows
+    static void reduceCells(const uint8_t *row0, const uint8_t *row1, int cells, uint8_t *low, uint8_t *high)
+    {
+        int x = 0;
+#if defined(HEIGHTFIELD_USE_SSE)
+        for (; x + 16 < cells + 1; x += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0 + x)), b = _mm_loadu_si128((const __m128i*)(row0 + x + 1));
+            __m128i c = _mm_loadu_si128((const __m128i*)(row1 + x)), d = _mm_loadu_si128((const __m128i*)(row1 + x + 1));
+            _mm_storeu_si128((__m128i*)(low + x), _mm_min_epu8(_mm_min_epu8(a, b), _mm_min_epu8(c, d)));
+            _mm_storeu_si128((__m128i*)(high + x), _mm_max_epu8(_mm_max_epu8(a, b), _mm_max_epu8(c, d)));
+        }
+#elif defined(HEIGHTFIELD_USE_NEON)
+        for (; x + 16 < cells + 1; x += 16)
+        {
+            uint8x16_t a = vld1q_u8(row0 + x), b = vld1q_u8(row0 + x + 1);
+            uint8x16_t c = vld1q_u8(row1 + x), d = vld1q_u8(row1 + x + 1);
+            vst1q_u8(low + x, vminq_u8(vminq_u8(a, b), vminq_u8(c, d)));
+            vst1q_u8(high + x, vmaxq_u8(vmaxq_u8(a, b), vmaxq_u8(c, d)));
+        }
+#endif
+        for (; x < cells; x++)
+        {
+            low[x] = std::min(std::min(row0[x], row0[x + 1]), std::min(row1[x], row1[x + 1]));
+            high[x] = std::max(std::max(row0[x], row0[x + 1]), std::max(row1[x], row1[x + 1]));
+        }
+    }
+
+    // min (or max) of 2x2 texels of two rows of the level below, belowWidth texels per row
+    template<bool IsMin>
+    static void reduceTexels(const uint8_t *row0, const uint8_t *row1, int belowWidth, uint8_t *out)
+    {
+        const int outWidth = (belowWidth + 1) / 2;
+        int x = 0;
+#if defined(HEIGHTFIELD_USE_SSE)
+        // 16 texels of each row give 8 results: combine the rows, then the even and odd bytes of every 16-bit lane
+        const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+        for (; (x + 8) * 2 <= belowWidth; x += 8)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0 + x * 2)), b = _mm_loadu_si128((const __m128i*)(row1 + x * 2));
+            __m128i rows = IsMin ? _mm_min_epu8(a, b) : _mm_max_epu8(a, b);
+            __m128i even = _mm_and_si128(rows, lowBytes), odd = _mm_srli_epi16(rows, 8);
+            __m128i pairs = IsMin ? _mm_min_epi16(even, odd) : _mm_max_epi16(even, odd);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packus_epi16(pairs, pairs));
+        }
+#elif defined(HEIGHTFIELD_USE_NEON)
+        // the pairwise instructions reduce neighbouring bytes directly
+        for (; (x + 8) * 2 <= belowWidth; x += 8)
+        {
+            uint8x16_t a = vld1q_u8(row0 + x * 2), b = vld1q_u8(row1 + x * 2);
+            uint8x16_t rows = IsMin ? vminq_u8(a, b) : vmaxq_u8(a, b);
+            uint8x8_t pairs = IsMin ? vpmin_u8(vget_low_u8(rows), vget_high_u8(rows)) : vpmax_u8(vget_low_u8(rows), vget_high_u8(rows));
+            vst1_u8(out + x, pairs);
+        }
+#endif
+        for (; x < outWidth; x++)
+        {
+            int x0 = x * 2, x1 = std::min(x * 2 + 1, belowWidth - 1);
+            out[x] = IsMin ? std::min(std::min(row0[x0], row0[x1]), std::min(row1[x0], row1[x1]))
+                           : std::max(std::max(row0[x0], row0[x1]), std::max(row1[x0], row1[x1]));
+        }
+    }
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// builds the full resolution heightmap lattice: one vertex per pixel with position and normal, and one
+// triangle strip per row separated by a restart index. the output sizes are known up front, so the
+// caller allocates once (or maps a GL buffer) and the rows are filled in parallel without any reallocation.
+class HeightmapMesh {
+public:
+    // position (x, y, z) followed by normal (x, y, z)
+    static const int FLOATS_PER_VERTEX = 6;
+
+    HeightmapMesh(const unsigned char *data, int width, int height, int channels, float yScale, float yShift)
+        : data(data), width(width), height(height), channels(channels), yScale(yScale), yShift(yShift) {}
+
+    size_t VertexCount() const { return (size_t)width * height; }
+    size_t VertexFloatCount() const { return VertexCount() * FLOATS_PER_VERTEX; }
+
+    int StripCount() const { return height - 1; }
+    // indices of one strip, without its restart index
+    int IndicesPerStrip() const { return width * 2; }
+    size_t IndexCount() const { return (size_t)StripCount() * (IndicesPerStrip() + 1); }
+
+    // fills VertexFloatCount() floats, threadCount = 0 uses every hardware thread
+    void GenerateVertices(float *vertices, unsigned int threadCount = 0) const
+    {
+        forEachRow(height, threadCount, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+            {
+                float *out = vertices + (size_t)i * width * FLOATS_PER_VERTEX;
+                for (int j = 0; j < width; j++)
+                {
+                    // central differences, one sided on the borders
+                    int up = std::max(i - 1, 0), down = std::min(i + 1, height - 1);
+                    int left = std::max(j - 1, 0), right = std::min(j + 1, width - 1);
+                    float dx = (heightAt(down, j) - heightAt(up, j)) / (float)(down - up);
+                    float dz = (heightAt(i, right) - heightAt(i, left)) / (float)(right - left);
+                    glm::vec3 normal = glm::normalize(glm::vec3(-dx, 1.0f, -dz));
+
+                    *out++ = -height / 2.0f + i;
+                    *out++ = heightAt(i, j);
+                    *out++ = -width / 2.0f + j;
+                    *out++ = normal.x;
+                    *out++ = normal.y;
+                    *out++ = normal.z;
+                }
+            }
+        });
+    }
+
+    // fills IndexCount() indices: every row strip is followed by restartIndex
+    void GenerateIndices(unsigned int *indices, unsigned int restartIndex, unsigned int threadCount = 0) const
+    {
+        forEachRow(StripCount(), threadCount, [&](int first, int last) {
+            for (int i = first; i < last; i++)
+            {
+                unsigned int *out = indices + (size_t)i * (IndicesPerStrip() + 1);
+                for (int j = 0; j < width; j++)
+                {
+                    *out++ = (unsigned int)(j + width * i);
+                    *out++ = (unsigned int)(j + width * (i + 1));
+                }
+                *out = restartIndex;
+            }
+        });
+    }
+
+private:
+    const unsigned char *data;
+    int width, height, channels;
+    float yScale, yShift;
+
+    float heightAt(int row, int column) const
+    {
+        return (int)data[((size_t)row * width + column) * channels] * yScale - yShift;
+    }
+
+    // splits [0, rows) into contiguous blocks, one per thread, the calling thread takes the first block
+    template<typename Function>
+    static void forEachRow(int rows, unsigned int threadCount, const Function &function)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        threadCount = std::min(threadCount, (unsigned int)std::max(rows, 1));
+        int rowsPerThread = (rows + threadCount - 1) / threadCount;
+
+        std::vector<std::thread> workers;
+        for (unsigned int t = 1; t < threadCount; t++)
+        {
+            int first = t * rowsPerThread, last = std::min(first + rowsPerThread, rows);
+            if (first < last)
+                workers.emplace_back([&function, first, last]() { function(first, last); });
+        }
+        function(0, std::min(rowsPerThread, rows));
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+};
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "mesh.h"
+#include "shader_s.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// all materials of a scene in one place, so drawing a mesh takes no texture binds: a material is a diffuse and a
+// specular texture (gbuffer.fs and forward_lighting.fs only read the diffuse one), the shader finds them through
+// the index of the material (the "materialIndex" uniform) in a uniform block. the textures are either
+//
+//   copied into GL_TEXTURE_2D_ARRAYs, one per texture size (up to MAX_ARRAYS, textures of other sizes are scaled
+//   into the array of the closest size), a material holds array and layer of each texture. block compressed
+//   textures (texture_cooker.h) keep their format, they get arrays per size and format and are never scaled
+//   or, with ARB_bindless_texture, left where they are and referenced by their resident handles
+//
+// the shader side is the MATERIAL_SYSTEM permutation of gbuffer.fs and forward_lighting.fs, compiled with
+// ShaderDefines(). the layout of the block is kept in sync with them:
+//
+//   struct Material { ivec4 Slots; uvec4 Handles; };   Slots: diffuse array, layer, specular array, layer (-1: none)
+//   layout (std140) uniform Materials { Material materials[MAX_MATERIALS]; };
+class MaterialSystem {
+public:
+    static const int MAX_MATERIALS = 256;
+    static const int MAX_ARRAYS = 4;
+
+    struct Stats {
+        unsigned int Materials = 0;
+        unsigned int Textures = 0;
+        unsigned int Arrays = 0;
+        // textures that had to be scaled to the size of their array
+        unsigned int Resized = 0;
+        size_t Bytes = 0;
+        bool Bindless = false;
+    };
+
+    // bindless handles are used when allowed and the driver has ARB_bindless_texture
+    explicit MaterialSystem(bool allowBindless = true)
+        : bindless(allowBindless && GLAD_GL_ARB_bindless_texture)
+    {
+        for (int i = 0; i < MAX_ARRAYS; i++)
+            arrays[i] = 0;
+    }
+
+    ~MaterialSystem()
+    {
+        for (const std::pair<const unsigned int, uint64_t> &handle : handles)
+            glMakeTextureHandleNonResidentARB(handle.second);
+        for (int i = 0; i < MAX_ARRAYS; i++)
+            if (arrays[i] != 0)
+                GLState::DeleteTextures(1, &arrays[i]);
+        if (materialBuffer != 0)
+            glDeleteBuffers(1, &materialBuffer);
+    }
+
+    MaterialSystem(const MaterialSystem&) = delete;
+    MaterialSystem& operator=(const MaterialSystem&) = delete;
+
+    // registers the material of a mesh's textures (the first diffuse and specular one), meshes with the same
+    // textures share it. returns its index, or -1 when there are MAX_MATERIALS already
+    int AddMaterial(const vector<Texture> &textures)
+    {
+        unsigned int diffuse = 0, specular = 0;
+        for (const Texture &texture : textures)
+        {
+            if (texture.type == "texture_diffuse" && diffuse == 0)
+                diffuse = texture.id;
+            else if (texture.type == "texture_specular" && specular == 0)
+                specular = texture.id;
+        }
+        std::pair<unsigned int, unsigned int> key(diffuse, specular);
+        auto found = materialIndices.find(key);
+        if (found != materialIndices.end())
+            return found->second;
+        if ((int)materials.size() >= MAX_MATERIALS)
+        {
+            std::cout << "ERROR::MATERIAL_SYSTEM::TOO_MANY_MATERIALS" << std::endl;
+            return -1;
+        }
+        materials.push_back(key);
+        materialIndices[key] = (int)materials.size() - 1;
+        return (int)materials.size() - 1;
+    }
+
+    // sets the material of every mesh of the model
+    template <typename ModelType>
+    void AddModel(ModelType &model)
+    {
+        for (Mesh &mesh : model.meshes)
+            mesh.MaterialIndex = AddMaterial(mesh.textures);
+    }
+
+    // packs the textures of all materials (or makes their handles resident) and uploads the material block,
+    // called once after the last AddMaterial
+    void Build()
+    {
+        std::vector<unsigned int> textures;
+        for (const std::pair<unsigned int, unsigned int> &material : materials)
+            for (unsigned int texture : {material.first, material.second})
+                if (texture != 0 && std::find(textures.begin(), textures.end(), texture) == textures.end())
+                    textures.push_back(texture);
+        stats.Materials = (unsigned int)materials.size();
+        stats.Textures = (unsigned int)textures.size();
+        stats.Bindless = bindless;
+
+        if (bindless)
+            makeResident(textures);
+        else
+            packArrays(textures);
+
+        // std140: two 16 byte vectors per material
+        std::vector<int32_t> block(MAX_MATERIALS * 8, 0);
+        for (size_t i = 0; i < materials.size(); i++)
+        {
+            int32_t *entry = &block[i * 8];
+            writeSlot(materials[i].first, entry);
+            writeSlot(materials[i].second, entry + 2);
+            if (bindless)
+            {
+                uint64_t diffuseHandle = materials[i].first ? handles[materials[i].first] : 0;
+                uint64_t specularHandle = materials[i].second ? handles[materials[i].second] : 0;
+                uint32_t words[4] = {(uint32_t)diffuseHandle, (uint32_t)(diffuseHandle >> 32),
+                                     (uint32_t)specularHandle, (uint32_t)(specularHandle >> 32)};
+                std::copy(words, words + 4, reinterpret_cast<uint32_t *>(entry + 4));
+            }
+        }
+        if (materialBuffer == 0)
+            glGenBuffers(1, &materialBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, materialBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, block.size() * sizeof(int32_t), block.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    // the defines of the shader permutation that reads materials from here
+    std::string ShaderDefines() const
+    {
+        std::string defines = "#define MATERIAL_SYSTEM\n#define MAX_MATERIALS " + std::to_string(MAX_MATERIALS) +
+                              "\n#define MATERIAL_ARRAYS " + std::to_string(MAX_ARRAYS) + "\n";
+        if (bindless)
+            defines += "#define MATERIAL_BINDLESS\n";
+        return defines;
+    }
+
+    // binds the material block to uniform buffer binding point binding and, without bindless handles, the arrays to
+    // units unit .. unit + MAX_ARRAYS - 1. the shader has to be in use
+    void Bind(const Shader &shader, int unit, unsigned int binding) const
+    {
+        unsigned int blockIndex = glGetUniformBlockIndex(shader.ID, "Materials");
+        if (blockIndex != GL_INVALID_INDEX)
+            glUniformBlockBinding(shader.ID, blockIndex, binding);
+        glBindBufferBase(GL_UNIFORM_BUFFER, binding, materialBuffer);
+        if (bindless)
+            return;
+        // every sampler of the array has to point at a unit of its own type, unused ones get an empty array
+        for (int i = 0; i < MAX_ARRAYS; i++)
+        {
+            GLState::ActiveTexture(GL_TEXTURE0 + unit + i);
+            GLState::BindTexture(GL_TEXTURE_2D_ARRAY, arrays[i]);
+            shader.setInt("materialArrays[" + std::to_string(i) + "]", unit + i);
+        }
+        GLState::ActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    bool IsBindless() const { return bindless; }
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Slot {
+        int Array;
+        int Layer;
+    };
+
+    // what a texture needs of an array: its size and, as block compressed textures are copied as they are, its
+    // format. uncompressed textures of any format share RGBA8 arrays
+    struct ArrayClass {
+        glm::ivec2 Size = glm::ivec2(0);
+        GLenum Format = GL_RGBA8;
+        bool Compressed = false;
+
+        bool operator==(const ArrayClass &other) const { return Size == other.Size && Format == other.Format; }
+        bool operator<(const ArrayClass &other) const
+        {
+            return std::tie(Size.x, Size.y, Format) < std::tie(other.Size.x, other.Size.y, other.Format);
+        }
+    };
+
+    bool bindless;
+    // the (diffuse, specular) textures of each material
+    std::vector<std::pair<unsigned int, unsigned int>> materials;
+    std::map<std::pair<unsigned int, unsigned int>, int> materialIndices;
+    std::map<unsigned int, Slot> slots;
+    std::map<unsigned int, uint64_t> handles;
+    unsigned int arrays[MAX_ARRAYS];
+    unsigned int materialBuffer = 0;
+    Stats stats;
+
+    void writeSlot(unsigned int texture, int32_t *slot) const
+    {
+        auto found = slots.find(texture);
+        slot[0] = found != slots.end() ? found->second.Array : -1;
+        slot[1] = found != slots.end() ? found->second.Layer : -1;
+    }
+
+    // the formats of texture_cooker.h, 8 bytes per 4x4 block for one channel and opaque color, 16 otherwise
+    static size_t compressedLevelBytes(GLenum format, const glm::ivec2 &size)
+    {
+        size_t blockBytes = format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ||
+                            format == GL_COMPRESSED_RED_RGTC1 || format == GL_COMPRESSED_SIGNED_RED_RGTC1 ? 8 : 16;
+        return (size_t)((size.x + 3) / 4) * ((size.y + 3) / 4) * blockBytes;
+    }
+
+    static double texelDifference(const glm::ivec2 &a, const glm::ivec2 &b)
+    {
+        return std::abs((double)a.x * a.y - (double)b.x * b.y);
+    }
+
+    void makeResident(const std::vector<unsigned int> &textures)
+    {
+        for (unsigned int texture : textures)
+        {
+            uint64_t handle = glGetTextureHandleARB(texture);
+            glMakeTextureHandleResidentARB(handle);
+            handles[texture] = handle;
+            // the shader tells a missing texture by its array, the handle is all it needs otherwise
+            slots[texture] = {0, 0};
+        }
+    }
+
+    void packArrays(const std::vector<unsigned int> &textures)
+    {
+        // the classes of the textures, most common first, each of the first MAX_ARRAYS gets an array
+        std::vector<ArrayClass> classes(textures.size());
+        std::map<ArrayClass, unsigned int> classCounts;
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            GLint compressed = 0, format = 0;
+            GLState::BindTexture(GL_TEXTURE_2D, textures[i]);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &classes[i].Size.x);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &classes[i].Size.y);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &compressed);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+            classes[i].Format = compressed ? (GLenum)format : GL_RGBA8;
+            classes[i].Compressed = compressed != 0;
+            classCounts[classes[i]]++;
+        }
+        std::vector<std::pair<unsigned int, ArrayClass>> byCount;
+        for (const auto &entry : classCounts)
+            byCount.push_back(std::make_pair(entry.second, entry.first));
+        std::stable_sort(byCount.begin(), byCount.end(), [](const std::pair<unsigned int, ArrayClass> &a,
+                                                     const std::pair<unsigned int, ArrayClass> &b) { return a.first > b.first; });
+        int arrayCount = std::min((int)byCount.size(), MAX_ARRAYS);
+        std::vector<ArrayClass> arrayClasses(arrayCount);
+        for (int i = 0; i < arrayCount; i++)
+            arrayClasses[i] = byCount[i].second;
+
+        // every texture goes to the array of its class or, past MAX_ARRAYS classes, an uncompressed one to the
+        // uncompressed array of the closest texel count. block compressed textures can't be scaled (or blitted at
+        // all), without an array of their own format and size they are left out
+        std::vector<int> layerCounts(arrayCount, 0);
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            int best = -1;
+            for (int a = 0; a < arrayCount; a++)
+            {
+                if (classes[i] == arrayClasses[a])
+                {
+                    best = a;
+                    break;
+                }
+                if (!classes[i].Compressed && !arrayClasses[a].Compressed &&
+                    (best < 0 || texelDifference(classes[i].Size, arrayClasses[a].Size) < texelDifference(classes[i].Size, arrayClasses[best].Size)))
+                    best = a;
+            }
+            if (best < 0)
+            {
+                std::cout << "ERROR::MATERIAL_SYSTEM::NO_ARRAY_FOR_TEXTURE " << textures[i] << std::endl;
+                continue;
+            }
+            slots[textures[i]] = {best, layerCounts[best]++};
+            if (classes[i].Size != arrayClasses[best].Size)
+                stats.Resized++;
+        }
+
+        // compressed arrays get the levels all of their textures have, the others generate theirs
+        std::vector<int> levelCounts(arrayCount);
+        for (int a = 0; a < arrayCount; a++)
+        {
+            const glm::ivec2 &size = arrayClasses[a].Size;
+            levelCounts[a] = 1 + (int)std::floor(std::log2((double)std::max(size.x, size.y)));
+        }
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            auto found = slots.find(textures[i]);
+            if (found == slots.end() || !classes[i].Compressed)
+                continue;
+            GLint maxLevel = 0;
+            GLState::BindTexture(GL_TEXTURE_2D, textures[i]);
+            glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+            levelCounts[found->second.Array] = std::min(levelCounts[found->second.Array], maxLevel + 1);
+        }
+
+        GLint maxLayers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+        for (int a = 0; a < arrayCount; a++)
+        {
+            const ArrayClass &arrayClass = arrayClasses[a];
+            if (layerCounts[a] > maxLayers)
+                std::cout << "ERROR::MATERIAL_SYSTEM::TOO_MANY_LAYERS " << layerCounts[a] << std::endl;
+            glGenTextures(1, &arrays[a]);
+            GLState::BindTexture(GL_TEXTURE_2D_ARRAY, arrays[a]);
+            if (arrayClass.Compressed)
+            {
+                glm::ivec2 size = arrayClass.Size;
+                for (int level = 0; level < levelCounts[a]; level++)
+                {
+                    GLsizei bytes = (GLsizei)(compressedLevelBytes(arrayClass.Format, size) * layerCounts[a]);
+                    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, arrayClass.Format, size.x, size.y, layerCounts[a], 0,
+                                           bytes, nullptr);
+                    stats.Bytes += bytes;
+                    size = glm::max(size / 2, glm::ivec2(1));
+                }
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levelCounts[a] - 1);
+            }
+            else
+            {
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, arrayClass.Size.x, arrayClass.Size.y, layerCounts[a], 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+                // with the mip chain a third more
+                stats.Bytes += (size_t)arrayClass.Size.x * arrayClass.Size.y * layerCounts[a] * 4 * 4 / 3;
+            }
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        }
+        stats.Arrays = (unsigned int)arrayCount;
+
+        // compressed textures are copied block for block, level by level, through the CPU (copying between
+        // textures is 4.3). the layers keep the blocks the texture cooker made
+        std::vector<uint8_t> blocks;
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            auto found = slots.find(textures[i]);
+            if (found == slots.end() || !classes[i].Compressed)
+                continue;
+            const Slot &slot = found->second;
+            glm::ivec2 size = classes[i].Size;
+            for (int level = 0; level < levelCounts[slot.Array]; level++)
+            {
+                GLint bytes = 0;
+                GLState::BindTexture(GL_TEXTURE_2D, textures[i]);
+                glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &bytes);
+                blocks.resize(bytes);
+                glGetCompressedTexImage(GL_TEXTURE_2D, level, blocks.data());
+                GLState::BindTexture(GL_TEXTURE_2D_ARRAY, arrays[slot.Array]);
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, slot.Layer, size.x, size.y, 1,
+                                          classes[i].Format, bytes, blocks.data());
+                size = glm::max(size / 2, glm::ivec2(1));
+            }
+        }
+
+        // the other copies stay on the GPU: each texture is blitted into its layer, scaled when the sizes differ.
+        // one, three and four channel textures all end up as RGBA8
+        unsigned int framebuffers[2];
+        glGenFramebuffers(2, framebuffers);
+        GLState::BindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[0]);
+        GLState::BindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1]);
+        for (size_t i = 0; i < textures.size(); i++)
+        {
+            auto found = slots.find(textures[i]);
+            if (found == slots.end() || classes[i].Compressed)
+                continue;
+            const Slot &slot = found->second;
+            const glm::ivec2 &arraySize = arrayClasses[slot.Array].Size;
+            const glm::ivec2 &size = classes[i].Size;
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[i], 0);
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, arrays[slot.Array], 0, slot.Layer);
+            glBlitFramebuffer(0, 0, size.x, size.y, 0, 0, arraySize.x, arraySize.y, GL_COLOR_BUFFER_BIT,
+                              size == arraySize ? GL_NEAREST : GL_LINEAR);
+        }
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+        GLState::DeleteFramebuffers(2, framebuffers);
+
+        for (int a = 0; a < arrayCount; a++)
+        {
+            if (arrayClasses[a].Compressed)
+                continue;
+            GLState::BindTexture(GL_TEXTURE_2D_ARRAY, arrays[a]);
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        }
+    }
+};
@@ -5,6 +5,8 @@
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 #include "shader_s.h"
+#include "frustum.h"
+#include <algorithm>
 #include <string>
 #include <vector>
 using namespace std;
@@ -34,6 +36,26 @@ struct Texture {
     string path;
 };
 
+// a level of detail is a range of the mesh's element buffer, all levels share the same vertices
+struct MeshLod {
+    unsigned int IndexOffset;
+    unsigned int IndexCount;
+    // how far (in model units) the simplified surface may be from the full resolution one
+    float Error;
+};
+
+// what's needed to turn a geometric error into pixels on screen
+struct LodSelector {
+    glm::vec3 ViewPosition;
+    // screen height / (2 * tan(fovY / 2)): pixels covered by one unit at distance one
+    float PixelsPerUnit;
+    // the coarsest level whose projected error stays below this is chosen
+    float MaxPixelError;
+
+    LodSelector(const glm::vec3 &viewPosition, float fovY, float screenHeight, float maxPixelError = 1.0f)
+        : ViewPosition(viewPosition), PixelsPerUnit(screenHeight / (2.0f * tan(fovY * 0.5f))), MaxPixelError(maxPixelError) {}
+};
+
 class Mesh {
 public:
     // mesh Data
@@ -41,20 +63,41 @@ public:
     vector<unsigned int> indices;
     vector<Texture>      textures;
     unsigned int VAO;
+    // positions only, for depth-only passes: a third of the bytes per vertex of VAO's interleaved stream
+    unsigned int DepthVAO;
+    // bounds of the vertex positions in model space, used for culling
+    AABB Bounds;
+    // level 0 is the full resolution index list above, coarser levels follow it in the element buffer
+    vector<MeshLod> Lods;
+    // index of the mesh's textures in a MaterialSystem, -1 until one is assigned
+    int MaterialIndex = -1;
+    // index of the mesh's diffuse texture in a VirtualTexture, -1 when it has none there
+    int VirtualTextureIndex = -1;
 
-    // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+    // constructor, lodIndices/lodErrors optionally hold simplified index lists ordered from fine to coarse
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures,
+         const vector<vector<unsigned int>> &lodIndices = vector<vector<unsigned int>>(), const vector<float> &lodErrors = vector<float>())
     {
         this->vertices = vertices;
         this->indices = indices;
         this->textures = textures;
 
+        Lods.push_back({0, (unsigned int)this->indices.size(), 0.0f});
+        for (size_t i = 0; i < lodIndices.size(); i++)
+        {
+            const MeshLod &previous = Lods.back();
+            Lods.push_back({previous.IndexOffset + previous.IndexCount, (unsigned int)lodIndices[i].size(), lodErrors[i]});
+        }
+
+        for (const Vertex& vertex : this->vertices)
+            Bounds.Expand(vertex.Position);
+
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
-        setupMesh();
+        setupMesh(lodIndices);
     }
 
     // render the mesh
-    void Draw(Shader &shader)
+    void Draw(Shader &shader, unsigned int lod = 0)
     {
         // bind appropriate textures
         unsigned int diffuseNr  = 1;
@@ -63,7 +106,7 @@ public:
         unsigned int heightNr   = 1;
         for(unsigned int i = 0; i < textures.size(); i++)
         {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
+            GLState::ActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
             // retrieve texture number (the N in diffuse_textureN)
             string number;
             string name = textures[i].type;
@@ -79,31 +122,62 @@ public:
             // now set the sampler to the correct texture unit
             glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
             // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
+            GLState::BindTexture(GL_TEXTURE_2D, textures[i].id);
         }
 
         // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
+        DrawGeometry(lod);
+        // the VAO and texture units stay bound, GLState skips rebinding them for the next draw of this mesh
+    }
+
+    // draws with all vertex attributes but binds no textures, for shaders that find them through MaterialIndex
+    void DrawGeometry(unsigned int lod = 0) const
+    {
+        GLState::BindVertexArray(VAO);
+        const MeshLod &level = Lods[std::min<size_t>(lod, Lods.size() - 1)];
+        glDrawElements(GL_TRIANGLES, level.IndexCount, GL_UNSIGNED_INT, (void*)(level.IndexOffset * sizeof(unsigned int)));
+    }
+
+    // draws positions only, for a depth prepass or shadow pass; the shader needs no textures
+    void DrawDepth(unsigned int lod = 0) const
+    {
+        GLState::BindVertexArray(DepthVAO);
+        const MeshLod &level = Lods[std::min<size_t>(lod, Lods.size() - 1)];
+        glDrawElements(GL_TRIANGLES, level.IndexCount, GL_UNSIGNED_INT, (void*)(level.IndexOffset * sizeof(unsigned int)));
+    }
+
+    // picks the coarsest level whose error, projected at the distance of the (transformed) bounds, is below the threshold
+    unsigned int SelectLod(const glm::mat4 &model, const LodSelector &selector) const
+    {
+        // the largest axis scale, so the error is never underestimated
+        float scale = std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))), glm::length(glm::vec3(model[2])));
+        glm::vec3 center = glm::vec3(model * glm::vec4(Bounds.Center(), 1.0f));
+        float radius = glm::length(Bounds.Extents()) * scale;
+        float distance = std::max(glm::length(center - selector.ViewPosition) - radius, 1e-3f);
 
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
+        unsigned int lod = 0;
+        for (unsigned int i = 1; i < Lods.size(); i++)
+        {
+            if (Lods[i].Error * scale / distance * selector.PixelsPerUnit > selector.MaxPixelError)
+                break;
+            lod = i;
+        }
+        return lod;
     }
 
 private:
     // render data
-    unsigned int VBO, EBO;
+    unsigned int VBO, EBO, positionVBO;
 
     // initializes all the buffer objects/arrays
-    void setupMesh()
+    void setupMesh(const vector<vector<unsigned int>> &lodIndices)
     {
         // create buffers/arrays
         glGenVertexArrays(1, &VAO);
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        GLState::BindVertexArray(VAO);
         // load data into vertex buffers
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         // A great thing about structs is that their memory layout is sequential for all its items.
@@ -111,8 +185,13 @@ private:
         // again translates to 3/2 floats which translates to a byte array.
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
 
+        // every level of detail lives in the same element buffer, one after the other
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        const MeshLod &last = Lods.back();
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, (last.IndexOffset + last.IndexCount) * sizeof(unsigned int), nullptr, GL_STATIC_DRAW);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indices.size() * sizeof(unsigned int), &indices[0]);
+        for (size_t i = 0; i < lodIndices.size(); i++)
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, Lods[i + 1].IndexOffset * sizeof(unsigned int), lodIndices[i].size() * sizeof(unsigned int), lodIndices[i].data());
 
         // set the vertex attribute pointers
         // vertex Positions
@@ -137,7 +216,47 @@ private:
         // weights
         glEnableVertexAttribArray(6);
         glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_Weights));
-        glBindVertexArray(0);
+        GLState::BindVertexArray(0);
+
+        // the depth-only stream: tightly packed positions, same element buffer
+        vector<glm::vec3> positions(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            positions[i] = vertices[i].Position;
+        glGenVertexArrays(1, &DepthVAO);
+        glGenBuffers(1, &positionVBO);
+        GLState::BindVertexArray(DepthVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        GLState::BindVertexArray(0);
     }
 };
+
+// one mesh of a frame with its transform and level of detail. collecting a frame's draws first lets them be
+// sorted and submitted more than once, e.g. to a depth prepass and then to the shading pass
+struct MeshDraw {
+    Mesh *mesh;
+    glm::mat4 model;
+    unsigned int lod;
+};
+
+// nearest bounds center first, so a depth pass fills the closest surfaces early and hidden fragments fail the depth test
+inline void SortFrontToBack(vector<MeshDraw> &draws, const glm::vec3 &viewPosition)
+{
+    vector<std::pair<float, size_t>> keys(draws.size());
+    for (size_t i = 0; i < draws.size(); i++)
+    {
+        glm::vec3 center = glm::vec3(draws[i].model * glm::vec4(draws[i].mesh->Bounds.Center(), 1.0f));
+        glm::vec3 offset = center - viewPosition;
+        keys[i] = std::make_pair(glm::dot(offset, offset), i);
+    }
+    std::sort(keys.begin(), keys.end());
+    vector<MeshDraw> sorted;
+    sorted.reserve(draws.size());
+    for (const std::pair<float, size_t> &key : keys)
+        sorted.push_back(draws[key.second]);
+    draws.swap(sorted);
+}
 #endif //MODEL_LOADING_MESH_H
@@ -0,0 +1,311 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// quadric error metric simplification (Garland & Heckbert) working on index buffers only:
+// every edge collapse moves a vertex onto one of its existing neighbours, so all levels of detail
+// can share the original vertex buffer and only need their own range of indices.
+class MeshSimplifier {
+public:
+    // simplifies the triangle list until it has at most targetIndexCount indices (or nothing more can be collapsed).
+    // error, if given, receives the largest distance (in model units) the surface moved.
+    static std::vector<unsigned int> Simplify(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+                                              size_t targetIndexCount, float *error = nullptr)
+    {
+        const size_t vertexCount = vertices.size();
+        std::vector<unsigned int> result(indices);
+        float maxError = 0.0f;
+
+        // vertices sharing a position (uv or normal seams) are welded for the error metric, the seam itself
+        // is locked because collapsing one side of it would tear the other side open
+        std::vector<unsigned int> position(vertexCount);
+        std::vector<bool> locked(vertexCount, false);
+        weldPositions(vertices, position, locked);
+
+        std::vector<Quadric> quadrics(vertexCount);
+        computeQuadrics(vertices, result, position, quadrics);
+
+        std::vector<unsigned int> remap(vertexCount);
+        std::vector<bool> touched(vertexCount);
+        std::vector<Collapse> collapses;
+        std::vector<unsigned int> triangleOffsets, triangles;
+
+        // collapsing in passes of independent edges keeps the cost evaluation and flip checks valid without a priority queue
+        while (result.size() > targetIndexCount)
+        {
+            collectCollapses(vertices, result, position, locked, quadrics, collapses);
+            if (collapses.empty())
+                break;
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse &a, const Collapse &b) { return a.Cost < b.Cost; });
+
+            buildAdjacency(vertexCount, result, triangleOffsets, triangles);
+            for (unsigned int i = 0; i < vertexCount; i++)
+                remap[i] = i;
+            std::fill(touched.begin(), touched.end(), false);
+
+            // every collapse removes about two triangles
+            size_t trianglesToRemove = (result.size() - targetIndexCount) / 3;
+            size_t removed = 0;
+            size_t collapsed = 0;
+            for (const Collapse &collapse : collapses)
+            {
+                if (removed >= trianglesToRemove)
+                    break;
+                if (touched[collapse.From] || touched[collapse.To])
+                    continue;
+                if (flipsTriangle(vertices, result, position, triangleOffsets, triangles, collapse))
+                    continue;
+
+                remap[collapse.From] = collapse.To;
+                quadrics[position[collapse.To]].Add(quadrics[position[collapse.From]]);
+                maxError = std::max(maxError, collapse.Cost);
+
+                // the neighbourhood of the collapsed vertex changed, its costs are stale until the next pass
+                for (unsigned int t = triangleOffsets[collapse.From]; t < triangleOffsets[collapse.From + 1]; t++)
+                    for (int k = 0; k < 3; k++)
+                        touched[result[triangles[t] * 3 + k]] = true;
+                touched[collapse.To] = true;
+
+                removed += 2;
+                collapsed++;
+            }
+            if (collapsed == 0)
+                break;
+
+            // rewrite the index buffer and drop the triangles that became degenerate
+            size_t write = 0;
+            for (size_t i = 0; i < result.size(); i += 3)
+            {
+                unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+                if (position[a] == position[b] || position[b] == position[c] || position[a] == position[c])
+                    continue;
+                result[write++] = a;
+                result[write++] = b;
+                result[write++] = c;
+            }
+            result.resize(write);
+        }
+
+        if (error)
+            *error = maxError;
+        return result;
+    }
+
+private:
+    // symmetric 4x4 matrix of the summed squared plane distances, w is the summed area used for normalization
+    struct Quadric {
+        double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+        double a11 = 0, a12 = 0, a13 = 0;
+        double a22 = 0, a23 = 0;
+        double a33 = 0;
+        double w = 0;
+
+        void AddPlane(const glm::dvec3 &normal, double distance, double weight)
+        {
+            a00 += weight * normal.x * normal.x; a01 += weight * normal.x * normal.y; a02 += weight * normal.x * normal.z; a03 += weight * normal.x * distance;
+            a11 += weight * normal.y * normal.y; a12 += weight * normal.y * normal.z; a13 += weight * normal.y * distance;
+            a22 += weight * normal.z * normal.z; a23 += weight * normal.z * distance;
+            a33 += weight * distance * distance;
+            w += weight;
+        }
+
+        void Add(const Quadric &q)
+        {
+            a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+            a11 += q.a11; a12 += q.a12; a13 += q.a13;
+            a22 += q.a22; a23 += q.a23;
+            a33 += q.a33;
+            w += q.w;
+        }
+
+        // squared distance to the accumulated planes
+        double Evaluate(const glm::vec3 &p) const
+        {
+            double x = p.x, y = p.y, z = p.z;
+            double result = a00 * x * x + 2 * a01 * x * y + 2 * a02 * x * z + 2 * a03 * x
+                          + a11 * y * y + 2 * a12 * y * z + 2 * a13 * y
+                          + a22 * z * z + 2 * a23 * z
+                          + a33;
+            return result > 0.0 ? result : 0.0;
+        }
+    };
+
+    struct Collapse {
+        unsigned int From;
+        unsigned int To;
+        float Cost;
+    };
+
+    // boundary edges are kept in place with a plane perpendicular to the face, weighted well above regular faces
+    static constexpr double BOUNDARY_WEIGHT = 10.0;
+    // reject collapses that turn a face by more than about 75 degrees
+    static constexpr float MIN_NORMAL_DOT = 0.25f;
+
+    struct PositionKey {
+        float x, y, z;
+        bool operator<(const PositionKey &other) const
+        {
+            if (x != other.x) return x < other.x;
+            if (y != other.y) return y < other.y;
+            return z < other.z;
+        }
+    };
+
+    static void weldPositions(const std::vector<Vertex> &vertices, std::vector<unsigned int> &position, std::vector<bool> &locked)
+    {
+        std::map<PositionKey, unsigned int> firstVertex;
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            PositionKey key = {vertices[i].Position.x, vertices[i].Position.y, vertices[i].Position.z};
+            auto inserted = firstVertex.insert(std::make_pair(key, i));
+            position[i] = inserted.first->second;
+            if (!inserted.second)
+            {
+                locked[i] = true;
+                locked[inserted.first->second] = true;
+            }
+        }
+    }
+
+    static void computeQuadrics(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+                                const std::vector<unsigned int> &position, std::vector<Quadric> &quadrics)
+    {
+        // edge (by welded position) -> number of faces using it, an edge used once lies on the boundary
+        std::map<std::pair<unsigned int, unsigned int>, int> edgeFaces;
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            unsigned int corner[3] = {position[indices[i]], position[indices[i + 1]], position[indices[i + 2]]};
+            glm::dvec3 p0(vertices[corner[0]].Position), p1(vertices[corner[1]].Position), p2(vertices[corner[2]].Position);
+            glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+            double area = glm::length(normal);
+            if (area <= 0.0)
+                continue;
+            normal /= area;
+            for (int k = 0; k < 3; k++)
+            {
+                quadrics[corner[k]].AddPlane(normal, -glm::dot(normal, p0), area * 0.5);
+                unsigned int a = corner[k], b = corner[(k + 1) % 3];
+                edgeFaces[std::make_pair(std::min(a, b), std::max(a, b))]++;
+            }
+        }
+
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            unsigned int corner[3] = {position[indices[i]], position[indices[i + 1]], position[indices[i + 2]]};
+            glm::dvec3 p0(vertices[corner[0]].Position), p1(vertices[corner[1]].Position), p2(vertices[corner[2]].Position);
+            glm::dvec3 faceNormal = glm::cross(p1 - p0, p2 - p0);
+            if (glm::length(faceNormal) <= 0.0)
+                continue;
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int a = corner[k], b = corner[(k + 1) % 3];
+                if (edgeFaces[std::make_pair(std::min(a, b), std::max(a, b))] != 1)
+                    continue;
+                glm::dvec3 pa(vertices[a].Position), pb(vertices[b].Position);
+                glm::dvec3 edge = pb - pa;
+                glm::dvec3 normal = glm::cross(edge, faceNormal);
+                double length = glm::length(normal);
+                if (length <= 0.0)
+                    continue;
+                normal /= length;
+                double weight = glm::dot(edge, edge) * BOUNDARY_WEIGHT;
+                quadrics[a].AddPlane(normal, -glm::dot(normal, pa), weight);
+                quadrics[b].AddPlane(normal, -glm::dot(normal, pa), weight);
+            }
+        }
+    }
+
+    static float collapseCost(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &position,
+                              const std::vector<Quadric> &quadrics, unsigned int from, unsigned int to)
+    {
+        Quadric q = quadrics[position[from]];
+        q.Add(quadrics[position[to]]);
+        return q.w > 0.0 ? (float)std::sqrt(q.Evaluate(vertices[to].Position) / q.w) : 0.0f;
+    }
+
+    static void collectCollapses(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+                                 const std::vector<unsigned int> &position, const std::vector<bool> &locked,
+                                 const std::vector<Quadric> &quadrics, std::vector<Collapse> &collapses)
+    {
+        std::vector<std::pair<unsigned int, unsigned int>> edges;
+        edges.reserve(indices.size());
+        for (size_t i = 0; i < indices.size(); i += 3)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                unsigned int a = indices[i + k], b = indices[i + (k + 1) % 3];
+                edges.push_back(std::make_pair(std::min(a, b), std::max(a, b)));
+            }
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        collapses.clear();
+        for (const auto &edge : edges)
+        {
+            bool canCollapseFirst = !locked[edge.first], canCollapseSecond = !locked[edge.second];
+            if (!canCollapseFirst && !canCollapseSecond)
+                continue;
+            float firstCost = canCollapseFirst ? collapseCost(vertices, position, quadrics, edge.first, edge.second) : FLT_MAX;
+            float secondCost = canCollapseSecond ? collapseCost(vertices, position, quadrics, edge.second, edge.first) : FLT_MAX;
+            if (firstCost <= secondCost)
+                collapses.push_back({edge.first, edge.second, firstCost});
+            else
+                collapses.push_back({edge.second, edge.first, secondCost});
+        }
+    }
+
+    // triangles around every vertex, triangles[offsets[v] .. offsets[v + 1]) reference vertex v
+    static void buildAdjacency(size_t vertexCount, const std::vector<unsigned int> &indices,
+                               std::vector<unsigned int> &offsets, std::vector<unsigned int> &triangles)
+    {
+        offsets.assign(vertexCount + 1, 0);
+        for (unsigned int index : indices)
+            offsets[index + 1]++;
+        for (size_t i = 0; i < vertexCount; i++)
+            offsets[i + 1] += offsets[i];
+        triangles.resize(indices.size());
+        std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++)
+            triangles[fill[indices[i]]++] = (unsigned int)(i / 3);
+    }
+
+    static bool flipsTriangle(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices,
+                              const std::vector<unsigned int> &position, const std::vector<unsigned int> &offsets,
+                              const std::vector<unsigned int> &triangles, const Collapse &collapse)
+    {
+        const glm::vec3 &target = vertices[collapse.To].Position;
+        for (unsigned int t = offsets[collapse.From]; t < offsets[collapse.From + 1]; t++)
+        {
+            unsigned int corner[3] = {indices[triangles[t] * 3], indices[triangles[t] * 3 + 1], indices[triangles[t] * 3 + 2]};
+            // the triangles sharing the collapsed edge disappear
+            if (position[corner[0]] == position[collapse.To] || position[corner[1]] == position[collapse.To] ||
+                position[corner[2]] == position[collapse.To])
+                continue;
+
+            glm::vec3 before[3], after[3];
+            for (int k = 0; k < 3; k++)
+            {
+                before[k] = vertices[corner[k]].Position;
+                after[k] = corner[k] == collapse.From ? target : before[k];
+            }
+            glm::vec3 oldNormal = glm::cross(before[1] - before[0], before[2] - before[0]);
+            glm::vec3 newNormal = glm::cross(after[1] - after[0], after[2] - after[0]);
+            float oldLength = glm::length(oldNormal), newLength = glm::length(newNormal);
+            if (newLength <= 0.0f)
+                return true;
+            if (oldLength > 0.0f && glm::dot(oldNormal, newNormal) < MIN_NORMAL_DOT * oldLength * newLength)
+                return true;
+        }
+        return false;
+    }
+};
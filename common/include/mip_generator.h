@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MIPGEN_USE_AVX2 1
+#define MIPGEN_USE_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIPGEN_USE_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIPGEN_USE_NEON 1
+#endif
+
+// mip chains made on the CPU at import time, instead of by glGenerateMipmap (whose filter is up to the driver).
+// every level is filtered from the one above it in floating point, separably, with one of
+//
+//   BOX     the average of 2x2 texels
+//   KAISER  6x6 taps of a Kaiser windowed sinc: keeps the detail the box blurs away without its aliasing
+//
+// sRGB color maps are filtered in linear light, otherwise dark texels win: the box of black and white is 188, not
+// 128. normal maps are filtered as vectors and renormalized on every level. texels are 4 floats whatever the image
+// has, so the vertical pass runs over whole rows (8 floats at a time with AVX2, 4 with SSE or NEON) and the
+// horizontal one over whole texels (two at a time with AVX2). the rows of a level are split over the cores.
+// the taps clamp at the edges, odd sizes lose (most of) their last row or column.
+class MipGenerator {
+public:
+    enum Filter { BOX, KAISER };
+
+    struct Options {
+        Filter Kernel = KAISER;
+        // the color channels are sRGB encoded (alpha never is)
+        bool SRGB = false;
+        // rgb is a unit vector stored as v * 0.5 + 0.5
+        bool NormalMap = false;
+        // 0: one per core. callers that are worker threads themselves pass 1, a pool of workers each starting
+        // a thread per core would only oversubscribe the machine
+        unsigned int ThreadCount = 0;
+    };
+
+    // levels of a width x height image, down to 1x1
+    static int LevelCount(int width, int height)
+    {
+        int levels = 1;
+        while (width > 1 || height > 1)
+        {
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+            levels++;
+        }
+        return levels;
+    }
+
+    // the levels below the image (1 to 4 channels, stb_image's layout), each half the size of the one before,
+    // down to 1x1. element i is mip level i + 1, in the layout of the image
+    static std::vector<std::vector<uint8_t>> Generate(const uint8_t *pixels, int width, int height, int channels, const Options &options)
+    {
+        std::vector<std::vector<uint8_t>> levels;
+        const Kernel kernel = makeKernel(options.Kernel);
+        const bool normalMap = options.NormalMap && channels >= 3;
+        const Format format = {channels, options.SRGB && !normalMap ? (channels == 2 ? 1 : std::min(channels, 3)) : 0, normalMap};
+
+        std::vector<float> level((size_t)width * height * 4), next;
+        forEachRow(height, options.ThreadCount, [&](int first, int last) {
+            for (int y = first; y < last; y++)
+                unpack(pixels + (size_t)y * width * channels, width, format, &level[(size_t)y * width * 4]);
+        });
+
+        while (width > 1 || height > 1)
+        {
+            const int nextWidth = std::max(width / 2, 1), nextHeight = std::max(height / 2, 1);
+            next.resize((size_t)nextWidth * nextHeight * 4);
+            levels.emplace_back((size_t)nextWidth * nextHeight * channels);
+            uint8_t *packed = levels.back().data();
+            forEachRow(nextHeight, options.ThreadCount, [&](int first, int last) {
+                std::vector<float> column((size_t)width * 4);
+                const float *rows[MAX_TAPS];
+                for (int y = first; y < last; y++)
+                {
+                    for (int k = 0; k < kernel.Taps; k++)
+                        rows[k] = &level[(size_t)clampIndex(y * 2 + kernel.First + k, height) * width * 4];
+                    filterRows(rows, kernel, width * 4, column.data());
+                    float *row = &next[(size_t)y * nextWidth * 4];
+                    filterTexels(column.data(), width, kernel, nextWidth, row);
+                    if (format.NormalMap)
+                        renormalize(row, nextWidth);
+                    pack(row, nextWidth, format, packed + (size_t)y * nextWidth * channels);
+                }
+            });
+            level.swap(next);
+            width = nextWidth;
+            height = nextHeight;
+        }
+        return levels;
+    }
+
+private:
+    static const int MAX_TAPS = 6;
+    // resolution of the linear to sRGB table, fine enough that the steps stay below half an 8-bit step
+    static const int SRGB_TABLE_SIZE = 8192;
+
+    // output texel x takes the taps at 2x + First .. 2x + First + Taps - 1 of the level above
+    struct Kernel {
+        int First;
+        int Taps;
+        float Weights[MAX_TAPS];
+    };
+
+    struct Format {
+        int Channels;
+        // the first ColorChannels channels are sRGB encoded
+        int ColorChannels;
+        bool NormalMap;
+    };
+
+    struct Tables {
+        float ToLinear[256];
+        uint8_t ToSRGB[SRGB_TABLE_SIZE];
+
+        Tables()
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                float c = i / 255.0f;
+                ToLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+            for (int i = 0; i < SRGB_TABLE_SIZE; i++)
+            {
+                float l = i / (float)(SRGB_TABLE_SIZE - 1);
+                float c = l <= 0.0031308f ? l * 12.92f : 1.055f * std::pow(l, 1.0f / 2.4f) - 0.055f;
+                ToSRGB[i] = (uint8_t)std::min(std::max(c * 255.0f + 0.5f, 0.0f), 255.0f);
+            }
+        }
+    };
+
+    static const Tables &tables()
+    {
+        static const Tables instance;
+        return instance;
+    }
+
+    static int clampIndex(int i, int size) { return std::min(std::max(i, 0), size - 1); }
+
+    static double besselI0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 20; k++)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    static Kernel makeKernel(Filter filter)
+    {
+        Kernel kernel;
+        if (filter == BOX)
+        {
+            kernel.First = 0;
+            kernel.Taps = 2;
+            kernel.Weights[0] = kernel.Weights[1] = 0.5f;
+            return kernel;
+        }
+        // the taps are 0.25, 0.75 and 1.25 output texels from the center, the window reaches to 1.5
+        const double alpha = 4.0, radius = 1.5, pi = 3.14159265358979323846;
+        kernel.First = -2;
+        kernel.Taps = 6;
+        double sum = 0.0, weights[MAX_TAPS];
+        for (int k = 0; k < kernel.Taps; k++)
+        {
+            double t = (k - 2.5) / 2.0, x = t / radius;
+            double sinc = std::sin(pi * t) / (pi * t);
+            weights[k] = sinc * besselI0(alpha * std::sqrt(1.0 - x * x)) / besselI0(alpha);
+            sum += weights[k];
+        }
+        for (int k = 0; k < kernel.Taps; k++)
+            kernel.Weights[k] = (float)(weights[k] / sum);
+        return kernel;
+    }
+
+    static void unpack(const uint8_t *source, int width, const Format &format, float *texels)
+    {
+        const Tables &table = tables();
+        for (int x = 0; x < width; x++)
+        {
+            const uint8_t *texel = source + x * format.Channels;
+            float *out = texels + x * 4;
+            out[0] = out[1] = out[2] = 0.0f;
+            out[3] = 1.0f;
+            for (int c = 0; c < format.Channels; c++)
+                out[c] = c < format.ColorChannels ? table.ToLinear[texel[c]] : texel[c] / 255.0f;
+            if (format.NormalMap)
+                for (int c = 0; c < 3; c++)
+                    out[c] = texel[c] / 127.5f - 1.0f;
+        }
+    }
+
+    static void pack(const float *texels, int width, const Format &format, uint8_t *out)
+    {
+        const Tables &table = tables();
+        for (int x = 0; x < width; x++)
+        {
+            const float *texel = texels + x * 4;
+            uint8_t *packed = out + x * format.Channels;
+            for (int c = 0; c < format.Channels; c++)
+            {
+                // the sinc lobes can overshoot
+                float value = std::min(std::max(format.NormalMap && c < 3 ? texel[c] * 0.5f + 0.5f : texel[c], 0.0f), 1.0f);
+                packed[c] = c < format.ColorChannels ? table.ToSRGB[(int)(value * (SRGB_TABLE_SIZE - 1) + 0.5f)]
+                                                     : (uint8_t)(value * 255.0f + 0.5f);
+            }
+        }
+    }
+
+    static void renormalize(float *texels, int width)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float *n = texels + x * 4;
+            float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length > 1e-6f)
+                for (int c = 0; c < 3; c++)
+                    n[c] /= length;
+        }
+    }
+
+    // the vertical pass: the weighted sum of the kernel's rows, count floats each
+    static void filterRows(const float *const *rows, const Kernel &kernel, int count, float *out)
+    {
+        int i = 0;
+#if defined(MIPGEN_USE_AVX2)
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 sum = _mm256_mul_ps(_mm256_loadu_ps(rows[0] + i), _mm256_set1_ps(kernel.Weights[0]));
+            for (int k = 1; k < kernel.Taps; k++)
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(rows[k] + i), _mm256_set1_ps(kernel.Weights[k])));
+            _mm256_storeu_ps(out + i, sum);
+        }
+#endif
+#if defined(MIPGEN_USE_SSE)
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 sum = _mm_mul_ps(_mm_loadu_ps(rows[0] + i), _mm_set1_ps(kernel.Weights[0]));
+            for (int k = 1; k < kernel.Taps; k++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), _mm_set1_ps(kernel.Weights[k])));
+            _mm_storeu_ps(out + i, sum);
+        }
+#elif defined(MIPGEN_USE_NEON)
+        for (; i + 4 <= count; i += 4)
+        {
+            float32x4_t sum = vmulq_n_f32(vld1q_f32(rows[0] + i), kernel.Weights[0]);
+            for (int k = 1; k < kernel.Taps; k++)
+                sum = vmlaq_n_f32(sum, vld1q_f32(rows[k] + i), kernel.Weights[k]);
+            vst1q_f32(out + i, sum);
+        }
+#endif
+        for (; i < count; i++)
+        {
+            float sum = 0.0f;
+            for (int k = 0; k < kernel.Taps; k++)
+                sum += rows[k][i] * kernel.Weights[k];
+            out[i] = sum;
+        }
+    }
+
+    // the horizontal pass: outWidth texels from a row of width texels
+    static void filterTexels(const float *row, int width, const Kernel &kernel, int outWidth, float *out)
+    {
+        int x = 0;
+#if defined(MIPGEN_USE_AVX2)
+        // two output texels per register, one in each half
+        for (; x + 2 <= outWidth; x += 2)
+        {
+            __m256 sum = _mm256_setzero_ps();
+            for (int k = 0; k < kernel.Taps; k++)
+            {
+                __m128 left = _mm_loadu_ps(row + clampIndex(x * 2 + kernel.First + k, width) * 4);
+                __m128 right = _mm_loadu_ps(row + clampIndex(x * 2 + 2 + kernel.First + k, width) * 4);
+                __m256 texels = _mm256_insertf128_ps(_mm256_castps128_ps256(left), right, 1);
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(texels, _mm256_set1_ps(kernel.Weights[k])));
+            }
+            _mm256_storeu_ps(out + x * 4, sum);
+        }
+#endif
+        for (; x < outWidth; x++)
+        {
+#if defined(MIPGEN_USE_SSE)
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < kernel.Taps; k++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + clampIndex(x * 2 + kernel.First + k, width) * 4),
+                                                 _mm_set1_ps(kernel.Weights[k])));
+            _mm_storeu_ps(out + x * 4, sum);
+#elif defined(MIPGEN_USE_NEON)
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            for (int k = 0; k < kernel.Taps; k++)
+                sum = vmlaq_n_f32(sum, vld1q_f32(row + clampIndex(x * 2 + kernel.First + k, width) * 4), kernel.Weights[k]);
+            vst1q_f32(out + x * 4, sum);
+#else
+            for (int c = 0; c < 4; c++)
+            {
+                float sum = 0.0f;
+                for (int k = 0; k < kernel.Taps; k++)
+                    sum += row[clampIndex(x * 2 + kernel.First + k, width) * 4 + c] * kernel.Weights[k];
+                out[x * 4 + c] = sum;
+            }
+#endif
+        }
+    }
+
+    // rows a thread filters at least
+    static const int MIN_ROWS_PER_THREAD = 64;
+
+    // calls function(first, last) for ranges of rows on up to threadCount threads (0: one per core)
+    template <typename Function>
+    static void forEachRow(int rows, unsigned int threadCount, const Function &function)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        // starting a thread costs more than filtering a few rows, small levels are done on the calling thread
+        threadCount = std::min(threadCount, (unsigned int)std::max(rows / MIN_ROWS_PER_THREAD, 1));
+        int rowsPerThread = (rows + threadCount - 1) / threadCount;
+
+        std::vector<std::thread> workers;
+        for (unsigned int t = 1; t < threadCount; t++)
+        {
+            int first = t * rowsPerThread, last = std::min(first + rowsPerThread, rows);
+            if (first < last)
+                workers.emplace_back([&function, first, last]() { function(first, last); });
+        }
+        function(0, std::min(rowsPerThread, rows));
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+};
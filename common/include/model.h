@@ -11,6 +11,11 @@
 #include "assimp/postprocess.h"
 
 #include "mesh.h"
+#include "texture_cooker.h"
+#include "texture_streamer.h"
+#include "virtual_texture.h"
+#include "occlusion.h"
+#include "mesh_simplifier.h"
 #include "shader_s.h"
 
 #include <string>
@@ -30,7 +35,9 @@ struct TextureData {
 
 TextureData TextureFromFile(const char *path, const string &directory);
 TextureData TextureFromBuffer(unsigned char* buffer, size_t size);
-unsigned int UploadTexture(TextureData texData);
+unsigned int UploadTexture(TextureData texData, TextureCooker::Usage usage = TextureCooker::DATA, bool srgb = false);
+string EmbeddedTextureName(const char *name);
+TextureStreamer::Decode StreamedTextureDecoder(const aiScene *scene, const char *name, const string &file, bool fromEmbedded);
 
 class Model
 {
@@ -39,10 +46,19 @@ public:
     vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
     vector<Mesh>    meshes;
     string directory;
+    // the file the model was loaded from, its embedded textures are cached next to it
+    string sourcePath;
     bool gammaCorrection;
-
-    // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    // number of levels of detail generated per mesh at import time (1 = full resolution only)
+    unsigned int lodCount;
+
+    // constructor, expects a filepath to a 3D model. with a streamer the textures are loaded in the background
+    // and start out as placeholders. with a virtual texture the diffuse textures are registered there instead of
+    // being loaded (see Mesh::VirtualTextureIndex), only their pages that are seen become resident. its shaders
+    // sample nothing else, so the other maps aren't loaded either
+    Model(string const &path, bool gamma = false, unsigned int lodCount = 1, TextureStreamer *streamer = nullptr,
+          VirtualTexture *virtualTexture = nullptr)
+        : gammaCorrection(gamma), lodCount(lodCount), streamer(streamer), virtualTexture(virtualTexture)
     {
         loadModel(path);
     }
@@ -54,13 +70,72 @@ public:
             meshes[i].Draw(shader);
     }
 
+    // draws only the meshes whose bounds (transformed by the model matrix) intersect the frustum and,
+    // when an occlusion buffer is given, are not hidden behind its occluders. with a lod selector each mesh
+    // is drawn at the coarsest level of detail whose error is invisible from the selector's position.
+    // returns the number of meshes that were submitted.
+    unsigned int Draw(Shader &shader, const glm::mat4 &model, const Frustum &frustum, OcclusionBuffer *occlusion = nullptr,
+                      const LodSelector *lodSelector = nullptr)
+    {
+        drawScratch.clear();
+        Collect(model, frustum, drawScratch, occlusion, lodSelector);
+        for(const MeshDraw &draw : drawScratch)
+            draw.mesh->Draw(shader, draw.lod);
+        return (unsigned int)drawScratch.size();
+    }
+
+    // the culling and level of detail selection of Draw, appending the draws instead of submitting them.
+    // returns the number of draws appended.
+    unsigned int Collect(const glm::mat4 &model, const Frustum &frustum, vector<MeshDraw> &draws, OcclusionBuffer *occlusion = nullptr,
+                         const LodSelector *lodSelector = nullptr)
+    {
+        cullBatch.Clear();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            cullBatch.Add(meshes[i].Bounds.Transform(model));
+        cullVisible.resize(meshes.size());
+        CullAABBs(frustum, cullBatch, cullVisible.data());
+
+        unsigned int collected = 0;
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            if(!cullVisible[i])
+                continue;
+            if(occlusion && !occlusion->IsVisible(AABB(glm::vec3(cullBatch.MinX[i], cullBatch.MinY[i], cullBatch.MinZ[i]),
+                                                       glm::vec3(cullBatch.MaxX[i], cullBatch.MaxY[i], cullBatch.MaxZ[i]))))
+                continue;
+            draws.push_back({&meshes[i], model, lodSelector ? meshes[i].SelectLod(model, *lodSelector) : 0});
+            collected++;
+        }
+        return collected;
+    }
+
+    // bounds of all meshes in model space
+    AABB GetBounds() const
+    {
+        AABB bounds;
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            bounds.Expand(meshes[i].Bounds);
+        return bounds;
+    }
+
 private:
+    TextureStreamer *streamer;
+    VirtualTexture *virtualTexture;
+    // scratch storage for culling, kept around so drawing does not allocate every frame
+    AABBBatch cullBatch;
+    vector<unsigned char> cullVisible;
+    vector<MeshDraw> drawScratch;
+
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const &path)
     {
         // read file via ASSIMP
         Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_CalcTangentSpace);
+        // the simplifier needs shared vertices to find edges, some formats (obj) come with one vertex per face corner
+        unsigned int flags = aiProcess_Triangulate | aiProcess_CalcTangentSpace;
+        if (lodCount > 1)
+            flags |= aiProcess_JoinIdenticalVertices;
+        const aiScene* scene = importer.ReadFile(path, flags);
         // check for errors
         if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
         {
@@ -69,6 +144,7 @@ private:
         }
         // retrieve the directory path of the filepath
         directory = path.substr(0, path.find_last_of('/'));
+        sourcePath = path;
 
         // process ASSIMP's root node recursively
         processNode(scene->mRootNode, scene);
@@ -169,20 +245,65 @@ private:
         bool fromEmbedded = scene->mNumTextures != 0;
 
         // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(scene, material, aiTextureType_DIFFUSE, "texture_diffuse", fromEmbedded);
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-        // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(scene, material, aiTextureType_SPECULAR, "texture_specular", fromEmbedded);
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
-        // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(scene, material, aiTextureType_HEIGHT, "texture_normal", fromEmbedded);
-        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
-        // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(scene, material, aiTextureType_AMBIENT, "texture_height", fromEmbedded);
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+        int virtualTextureIndex = -1;
+        if(virtualTexture)
+            virtualTextureIndex = loadVirtualTexture(scene, material, fromEmbedded);
+        else
+        {
+            vector<Texture> diffuseMaps = loadMaterialTextures(scene, material, aiTextureType_DIFFUSE, "texture_diffuse", fromEmbedded);
+            textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
+        }
+        if(!virtualTexture)
+        {
+            // 2. specular maps
+            vector<Texture> specularMaps = loadMaterialTextures(scene, material, aiTextureType_SPECULAR, "texture_specular", fromEmbedded);
+            textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
+            // 3. normal maps
+            std::vector<Texture> normalMaps = loadMaterialTextures(scene, material, aiTextureType_HEIGHT, "texture_normal", fromEmbedded);
+            textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
+            // 4. height maps
+            std::vector<Texture> heightMaps = loadMaterialTextures(scene, material, aiTextureType_AMBIENT, "texture_height", fromEmbedded);
+            textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
+        }
+
+        // generate the levels of detail, each one from the previous level with about half the triangles
+        vector<vector<unsigned int>> lodIndices;
+        vector<float> lodErrors;
+        float error = 0.0f;
+        for(unsigned int level = 1; level < lodCount; level++)
+        {
+            const vector<unsigned int> &source = lodIndices.empty() ? indices : lodIndices.back();
+            float levelError;
+            vector<unsigned int> simplified = MeshSimplifier::Simplify(vertices, source, source.size() / 6 * 3, &levelError);
+            // stop once the simplifier gets stuck (locked seams, tiny meshes), a level that barely differs is useless
+            if(simplified.empty() || simplified.size() > source.size() * 3 / 4)
+                break;
+            // errors of consecutive levels add up in the worst case
+            error += levelError;
+            lodIndices.push_back(simplified);
+            lodErrors.push_back(error);
+        }
 
         // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        Mesh result(vertices, indices, textures, lodIndices, lodErrors);
+        result.VirtualTextureIndex = virtualTextureIndex;
+        return result;
+    }
+
+    // registers the first diffuse texture of the material with the virtual texture, it is only decoded when the
+    // page file is cooked. returns its index there, -1 without one
+    int loadVirtualTexture(const aiScene* scene, aiMaterial *mat, bool fromEmbedded)
+    {
+        if(mat->GetTextureCount(aiTextureType_DIFFUSE) == 0)
+            return -1;
+        aiString str;
+        mat->GetTexture(aiTextureType_DIFFUSE, 0, &str);
+        string source = fromEmbedded ? sourcePath : directory + '/' + str.C_Str();
+        string key = fromEmbedded ? sourcePath + ".embedded" + EmbeddedTextureName(str.C_Str()) : source;
+        int index = virtualTexture->Find(key);
+        if(index >= 0)
+            return index;
+        return virtualTexture->AddTexture(key, source, StreamedTextureDecoder(scene, str.C_Str(), source, fromEmbedded));
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -208,11 +329,46 @@ private:
             if(!skip)
             {   // if texture hasn't been loaded already, load it
                 Texture texture;
-                auto texData = fromEmbedded ?
-                        TextureFromBuffer(reinterpret_cast<unsigned char *>(scene->GetEmbeddedTexture(str.C_Str())->pcData), scene->GetEmbeddedTexture(str.C_Str())->mWidth)
-                        : TextureFromFile(str.C_Str(), this->directory);
-
-                texture.id = UploadTexture(texData);
+                // color maps are filtered (and, with gamma correction, sampled) as sRGB, normal maps as vectors
+                TextureCooker::Usage usage = typeName == "texture_diffuse" ? TextureCooker::COLOR :
+                                             typeName == "texture_normal" ? TextureCooker::NORMAL : TextureCooker::DATA;
+                bool srgb = gammaCorrection && usage == TextureCooker::COLOR;
+                string source = fromEmbedded ? sourcePath : directory + '/' + str.C_Str();
+                string cache = fromEmbedded ? sourcePath + ".embedded" + EmbeddedTextureName(str.C_Str()) + ".dds" : TextureCooker::CachePath(source);
+                if(streamer)
+                {
+                    texture.id = streamer->Request(source, cache, usage, StreamedTextureDecoder(scene, str.C_Str(), source, fromEmbedded), srgb);
+                    texture.type = typeName;
+                    texture.path = str.C_Str();
+                    textures.push_back(texture);
+                    textures_loaded.push_back(texture);
+                    continue;
+                }
+                // block compressed from the cache next to the image (or the model, for embedded ones), the image is
+                // only decoded when the cache has to be cooked or the driver can't sample the compressed format
+                TextureData texData = {nullptr, 0, 0, 0};
+                bool decoded = false;
+                auto decode = [&](int &width, int &height, int &channels) {
+                    texData = fromEmbedded ?
+                            TextureFromBuffer(reinterpret_cast<unsigned char *>(scene->GetEmbeddedTexture(str.C_Str())->pcData), scene->GetEmbeddedTexture(str.C_Str())->mWidth)
+                            : TextureFromFile(str.C_Str(), this->directory);
+                    decoded = true;
+                    width = texData.width;
+                    height = texData.height;
+                    channels = texData.nrComponent;
+                    return texData.data;
+                };
+                texture.id = TextureCooker::LoadTexture(source, cache, usage, decode, srgb);
+                if(texture.id == 0)
+                {
+                    if(!decoded)
+                    {
+                        int width, height, channels;
+                        decode(width, height, channels);
+                    }
+                    texture.id = UploadTexture(texData, usage, srgb);
+                }
+                stbi_image_free(texData.data);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
@@ -253,21 +409,42 @@ TextureData TextureFromFile(const char *path, const string &directory)
     return texData;
 }
 
-unsigned int UploadTexture(TextureData texData) {
+// the image and the mip chain MipGenerator filters for its usage. srgb (color only) stores it as sRGB, sampled
+// decoded to linear
+unsigned int UploadTexture(TextureData texData, TextureCooker::Usage usage, bool srgb) {
     unsigned int textureID;
     glGenTextures(1, &textureID);
 
-    GLenum format;
+    GLenum format = GL_RGBA;
     if (texData.nrComponent == 1)
         format = GL_RED;
+    else if (texData.nrComponent == 2)
+        format = GL_RG;
     else if (texData.nrComponent == 3)
         format = GL_RGB;
-    else if (texData.nrComponent == 4)
-        format = GL_RGBA;
-
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, texData.width, texData.height, 0, format, GL_UNSIGNED_BYTE, texData.data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    GLenum internalFormat = format;
+    if (srgb && texData.nrComponent >= 3)
+        internalFormat = texData.nrComponent == 3 ? GL_SRGB8 : GL_SRGB8_ALPHA8;
+
+    GLState::BindTexture(GL_TEXTURE_2D, textureID);
+    // rows of 1 to 3 channel images aren't 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, texData.width, texData.height, 0, format, GL_UNSIGNED_BYTE, texData.data);
+    int levelCount = 1;
+    if (texData.data)
+    {
+        std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(texData.data, texData.width, texData.height,
+                                                                        texData.nrComponent, TextureCooker::MipOptions(usage));
+        int width = texData.width, height = texData.height;
+        for (const std::vector<uint8_t> &mip : mips)
+        {
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+            glTexImage2D(GL_TEXTURE_2D, levelCount++, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, mip.data());
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -277,4 +454,37 @@ unsigned int UploadTexture(TextureData texData) {
     return textureID;
 }
 
+// the name of an embedded texture ("*0" for the first of a gltf) made safe for a file name
+string EmbeddedTextureName(const char *name)
+{
+    string safe;
+    for(const char *c = name; *c; c++)
+        safe += std::isalnum((unsigned char)*c) ? *c : '_';
+    return safe;
+}
+
+// decodes the texture on a streaming worker, after the importer is gone: embedded images are copied
+TextureStreamer::Decode StreamedTextureDecoder(const aiScene *scene, const char *name, const string &file, bool fromEmbedded)
+{
+    vector<unsigned char> encoded;
+    if(fromEmbedded)
+    {
+        const aiTexture *embedded = scene->GetEmbeddedTexture(name);
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(embedded->pcData);
+        encoded.assign(bytes, bytes + embedded->mWidth);
+    }
+    return [encoded, file, fromEmbedded](vector<unsigned char> &pixels, int &width, int &height, int &channels) {
+        unsigned char *data = fromEmbedded ? stbi_load_from_memory(encoded.data(), (int)encoded.size(), &width, &height, &channels, 0)
+                                           : stbi_load(file.c_str(), &width, &height, &channels, 0);
+        if(!data)
+        {
+            std::cout << "Texture failed to load at path: " << file << std::endl;
+            return false;
+        }
+        pixels.assign(data, data + (size_t)width * height * channels);
+        stbi_image_free(data);
+        return true;
+    };
+}
+
 #endif //MODEL_LOADING_MODEL_H
@@ -14,6 +14,7 @@
 #include "assimp/postprocess.h"
 
 #include "mesh.h"
+#include "texture_cooker.h"
 #include "shader_s.h"
 
 #include <string>
@@ -22,6 +23,7 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <functional>
 using namespace std;
 
 struct BoneInfo {
@@ -40,7 +42,8 @@ struct TextureData {
 
 TextureData TextureFromFile(const char *path, const string &directory);
 TextureData TextureFromBuffer(unsigned char* buffer, size_t size);
-unsigned int UploadTexture(TextureData texData);
+unsigned int UploadTexture(TextureData texData, TextureCooker::Usage usage = TextureCooker::DATA, bool srgb = false);
+string EmbeddedTextureName(const char *name);
 
 class Model
 {
@@ -49,6 +52,8 @@ public:
     vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
     vector<Mesh>    meshes;
     string directory;
+    // the file the model was loaded from, its embedded textures are cached next to it
+    string sourcePath;
     bool gammaCorrection = false;
 
     auto& GetBoneInfoMap() { return m_BoneInfoMap; }
@@ -67,6 +72,13 @@ public:
         loadModel(path);
     }
 
+    // constructor that also hands the imported scene to onSceneLoaded once meshes and bones are processed,
+    // so animations can be read from the same import instead of parsing the file a second time.
+    Model(string const &path, const std::function<void(const aiScene*, Model*)>& onSceneLoaded, bool gamma = false) : gammaCorrection(gamma)
+    {
+        loadModel(path, onSceneLoaded);
+    }
+
     // draws the model, and thus all its meshes
     void Draw(Shader &shader)
     {
@@ -79,7 +91,7 @@ private:
     int m_BoneCounter = 0;
 
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const &path)
+    void loadModel(string const &path, const std::function<void(const aiScene*, Model*)>& onSceneLoaded = nullptr)
     {
         // read file via ASSIMP
         Assimp::Importer importer;
@@ -92,9 +104,14 @@ private:
         }
         // retrieve the directory path of the filepath
         directory = path.substr(0, path.find_last_of('/'));
+        sourcePath = path;
 
         // process ASSIMP's root node recursively
         processNode(scene->mRootNode, scene);
+
+        // the scene is still alive here (it is owned by the importer), let the caller read whatever else it needs
+        if (onSceneLoaded)
+            onSceneLoaded(scene, this);
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
@@ -231,11 +248,37 @@ private:
             if(!skip)
             {   // if texture hasn't been loaded already, load it
                 Texture texture;
-                auto texData = fromEmbedded ?
-                               TextureFromBuffer(reinterpret_cast<unsigned char *>(scene->GetEmbeddedTexture(str.C_Str())->pcData), scene->GetEmbeddedTexture(str.C_Str())->mWidth)
-                                            : TextureFromFile(str.C_Str(), this->directory);
-
-                texture.id = UploadTexture(texData);
+                // block compressed from the cache next to the image (or the model, for embedded ones), the image is
+                // only decoded when the cache has to be cooked or the driver can't sample the compressed format
+                TextureData texData = {nullptr, 0, 0, 0};
+                bool decoded = false;
+                auto decode = [&](int &width, int &height, int &channels) {
+                    texData = fromEmbedded ?
+                            TextureFromBuffer(reinterpret_cast<unsigned char *>(scene->GetEmbeddedTexture(str.C_Str())->pcData), scene->GetEmbeddedTexture(str.C_Str())->mWidth)
+                            : TextureFromFile(str.C_Str(), this->directory);
+                    decoded = true;
+                    width = texData.width;
+                    height = texData.height;
+                    channels = texData.nrComponent;
+                    return texData.data;
+                };
+                // color maps are filtered (and, with gamma correction, sampled) as sRGB, normal maps as vectors
+                TextureCooker::Usage usage = typeName == "texture_diffuse" ? TextureCooker::COLOR :
+                                             typeName == "texture_normal" ? TextureCooker::NORMAL : TextureCooker::DATA;
+                bool srgb = gammaCorrection && usage == TextureCooker::COLOR;
+                string source = fromEmbedded ? sourcePath : directory + '/' + str.C_Str();
+                string cache = fromEmbedded ? sourcePath + ".embedded" + EmbeddedTextureName(str.C_Str()) + ".dds" : TextureCooker::CachePath(source);
+                texture.id = TextureCooker::LoadTexture(source, cache, usage, decode, srgb);
+                if(texture.id == 0)
+                {
+                    if(!decoded)
+                    {
+                        int width, height, channels;
+                        decode(width, height, channels);
+                    }
+                    texture.id = UploadTexture(texData, usage, srgb);
+                }
+                stbi_image_free(texData.data);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
@@ -316,21 +359,42 @@ TextureData TextureFromFile(const char *path, const string &directory)
     return texData;
 }
 
-unsigned int UploadTexture(TextureData texData) {
+// the image and the mip chain MipGenerator filters for its usage. srgb (color only) stores it as sRGB, sampled
+// decoded to linear
+unsigned int UploadTexture(TextureData texData, TextureCooker::Usage usage, bool srgb) {
     unsigned int textureID;
     glGenTextures(1, &textureID);
 
-    GLenum format;
+    GLenum format = GL_RGBA;
     if (texData.nrComponent == 1)
         format = GL_RED;
+    else if (texData.nrComponent == 2)
+        format = GL_RG;
     else if (texData.nrComponent == 3)
         format = GL_RGB;
-    else if (texData.nrComponent == 4)
-        format = GL_RGBA;
-
-    glBindTexture(GL_TEXTURE_2D, textureID);
-    glTexImage2D(GL_TEXTURE_2D, 0, format, texData.width, texData.height, 0, format, GL_UNSIGNED_BYTE, texData.data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    GLenum internalFormat = format;
+    if (srgb && texData.nrComponent >= 3)
+        internalFormat = texData.nrComponent == 3 ? GL_SRGB8 : GL_SRGB8_ALPHA8;
+
+    GLState::BindTexture(GL_TEXTURE_2D, textureID);
+    // rows of 1 to 3 channel images aren't 4 byte aligned
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, texData.width, texData.height, 0, format, GL_UNSIGNED_BYTE, texData.data);
+    int levelCount = 1;
+    if (texData.data)
+    {
+        std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(texData.data, texData.width, texData.height,
+                                                                        texData.nrComponent, TextureCooker::MipOptions(usage));
+        int width = texData.width, height = texData.height;
+        for (const std::vector<uint8_t> &mip : mips)
+        {
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+            glTexImage2D(GL_TEXTURE_2D, levelCount++, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, mip.data());
+        }
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -340,3 +404,11 @@ unsigned int UploadTexture(TextureData texData) {
     return textureID;
 }
 
+// the name of an embedded texture ("*0" for the first of a gltf) made safe for a file name
+string EmbeddedTextureName(const char *name)
+{
+    string safe;
+    for(const char *c = name; *c; c++)
+        safe += std::isalnum((unsigned char)*c) ? *c : '_';
+    return safe;
+}
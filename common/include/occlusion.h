@@ -0,0 +1,210 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "frustum.h"
+#include "mesh.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// software occlusion culling: a few large occluders are rasterized on the CPU into a small depth buffer,
+// a max-depth (hierarchical-z) pyramid is built on top of it and bounding boxes are tested against that
+// pyramid before their meshes are submitted. depth is stored in [0, 1] like the default GL depth range.
+class OcclusionBuffer {
+public:
+    struct Stats {
+        unsigned int Tested = 0;
+        unsigned int Occluded = 0;
+        unsigned int Visible() const { return Tested - Occluded; }
+    };
+
+    // width and height must be powers of two so that every pyramid level halves exactly
+    OcclusionBuffer(int width = 256, int height = 128) : width(width), height(height)
+    {
+        assert((width & (width - 1)) == 0 && (height & (height - 1)) == 0);
+        int levelWidth = width, levelHeight = height;
+        while (true)
+        {
+            levels.push_back(std::vector<float>(levelWidth * levelHeight, 1.0f));
+            levelSizes.push_back(glm::ivec2(levelWidth, levelHeight));
+            if (levelWidth == 1 && levelHeight == 1)
+                break;
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+        }
+    }
+
+    // starts a new frame: clears the depth to the far plane and resets the statistics
+    void Begin(const glm::mat4& viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        std::fill(levels[0].begin(), levels[0].end(), 1.0f);
+        stats = Stats();
+    }
+
+    // rasterizes the triangles of a mesh as an occluder, call BuildHierarchy once all occluders are in
+    void AddOccluder(const Mesh& mesh, const glm::mat4& model)
+    {
+        glm::mat4 mvp = viewProjection * model;
+        projected.resize(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.vertices.size(); i++)
+            projected[i] = mvp * glm::vec4(mesh.vertices[i].Position, 1.0f);
+
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+            rasterizeTriangle(projected[mesh.indices[i]], projected[mesh.indices[i + 1]], projected[mesh.indices[i + 2]]);
+    }
+
+    // builds the coarser levels, each texel keeps the farthest depth of the 2x2 texels below it
+    void BuildHierarchy()
+    {
+        for (size_t level = 1; level < levels.size(); level++)
+        {
+            const std::vector<float>& source = levels[level - 1];
+            std::vector<float>& target = levels[level];
+            glm::ivec2 sourceSize = levelSizes[level - 1];
+            glm::ivec2 size = levelSizes[level];
+            for (int y = 0; y < size.y; y++)
+            {
+                int y0 = std::min(y * 2, sourceSize.y - 1), y1 = std::min(y * 2 + 1, sourceSize.y - 1);
+                for (int x = 0; x < size.x; x++)
+                {
+                    int x0 = std::min(x * 2, sourceSize.x - 1), x1 = std::min(x * 2 + 1, sourceSize.x - 1);
+                    target[y * size.x + x] = std::max(std::max(source[y0 * sourceSize.x + x0], source[y0 * sourceSize.x + x1]),
+                                                      std::max(source[y1 * sourceSize.x + x0], source[y1 * sourceSize.x + x1]));
+                }
+            }
+        }
+    }
+
+    // returns false when the (world space) box is completely hidden behind the occluders
+    bool IsVisible(const AABB& box)
+    {
+        stats.Tested++;
+
+        glm::vec2 screenMin(FLT_MAX), screenMax(-FLT_MAX);
+        float nearestDepth = FLT_MAX;
+        for (int corner = 0; corner < 8; corner++)
+        {
+            glm::vec3 point((corner & 1) ? box.max.x : box.min.x,
+                            (corner & 2) ? box.max.y : box.min.y,
+                            (corner & 4) ? box.max.z : box.min.z);
+            glm::vec4 clip = viewProjection * glm::vec4(point, 1.0f);
+            // the box crosses the camera plane, we can't say anything about it
+            if (clip.w <= 1e-5f)
+                return true;
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            screenMin = glm::min(screenMin, glm::vec2(ndc));
+            screenMax = glm::max(screenMax, glm::vec2(ndc));
+            nearestDepth = std::min(nearestDepth, ndc.z * 0.5f + 0.5f);
+        }
+
+        // to texels of the finest level
+        screenMin = (glm::clamp(screenMin, -1.0f, 1.0f) * 0.5f + 0.5f) * glm::vec2(width, height);
+        screenMax = (glm::clamp(screenMax, -1.0f, 1.0f) * 0.5f + 0.5f) * glm::vec2(width, height);
+
+        // pick the level where the rectangle covers at most 3x3 texels, one level finer than the 2x2 footprint
+        // keeps the test cheap while losing less precision at occluder edges
+        float extent = std::max(screenMax.x - screenMin.x, screenMax.y - screenMin.y);
+        int level = extent > 2.0f ? (int)std::ceil(std::log2(extent * 0.5f)) : 0;
+        level = std::min(level, (int)levels.size() - 1);
+
+        glm::ivec2 size = levelSizes[level];
+        float scale = 1.0f / (float)(1 << level);
+        int x0 = glm::clamp((int)(screenMin.x * scale), 0, size.x - 1);
+        int y0 = glm::clamp((int)(screenMin.y * scale), 0, size.y - 1);
+        int x1 = glm::clamp((int)(screenMax.x * scale), 0, size.x - 1);
+        int y1 = glm::clamp((int)(screenMax.y * scale), 0, size.y - 1);
+
+        const std::vector<float>& depth = levels[level];
+        float farthestOccluder = 0.0f;
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                farthestOccluder = std::max(farthestOccluder, depth[y * size.x + x]);
+
+        if (nearestDepth > farthestOccluder)
+        {
+            stats.Occluded++;
+            return false;
+        }
+        return true;
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+    // full resolution depth, row 0 is the bottom of the screen
+    const std::vector<float>& GetDepth() const { return levels[0]; }
+    int GetWidth() const { return width; }
+    int GetHeight() const { return height; }
+
+private:
+    int width, height;
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    std::vector<std::vector<float>> levels;
+    std::vector<glm::ivec2> levelSizes;
+    std::vector<glm::vec4> projected;
+    Stats stats;
+
+    void rasterizeTriangle(const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2)
+    {
+        // occluders only have to be conservative: triangles touching the near plane are dropped instead of clipped,
+        // which can only make the buffer see less occlusion, never more
+        if (c0.w <= 1e-5f || c1.w <= 1e-5f || c2.w <= 1e-5f)
+            return;
+
+        glm::vec3 v0 = toScreen(c0), v1 = toScreen(c1), v2 = toScreen(c2);
+        float area = edge(v0, v1, v2);
+        // back facing or degenerate
+        if (area <= 0.0f)
+            return;
+
+        int minX = std::max((int)std::floor(std::min(std::min(v0.x, v1.x), v2.x)), 0);
+        int minY = std::max((int)std::floor(std::min(std::min(v0.y, v1.y), v2.y)), 0);
+        int maxX = std::min((int)std::ceil(std::max(std::max(v0.x, v1.x), v2.x)), width - 1);
+        int maxY = std::min((int)std::ceil(std::max(std::max(v0.y, v1.y), v2.y)), height - 1);
+        if (minX > maxX || minY > maxY)
+            return;
+
+        // depth (z / w) is affine in screen space, so it can be interpolated with the barycentric weights directly
+        float invArea = 1.0f / area;
+        // coverage is conservative: a texel is only written when all of it is inside the triangle, so a partly
+        // covered texel on the silhouette keeps what's behind it. an edge function is linear, its smallest value
+        // over the texel is the one at the center less half the sum of its slopes. likewise the depth written is
+        // the farthest one over the texel
+        float margin0 = 0.5f * (std::abs(v2.x - v1.x) + std::abs(v2.y - v1.y));
+        float margin1 = 0.5f * (std::abs(v0.x - v2.x) + std::abs(v0.y - v2.y));
+        float margin2 = 0.5f * (std::abs(v1.x - v0.x) + std::abs(v1.y - v0.y));
+        float depthX = ((v1.y - v2.y) * v0.z + (v2.y - v0.y) * v1.z + (v0.y - v1.y) * v2.z) * invArea;
+        float depthY = ((v2.x - v1.x) * v0.z + (v0.x - v2.x) * v1.z + (v1.x - v0.x) * v2.z) * invArea;
+        float depthMargin = 0.5f * (std::abs(depthX) + std::abs(depthY));
+        std::vector<float>& depth = levels[0];
+        for (int y = minY; y <= maxY; y++)
+        {
+            for (int x = minX; x <= maxX; x++)
+            {
+                glm::vec3 p(x + 0.5f, y + 0.5f, 0.0f);
+                float w0 = edge(v1, v2, p), w1 = edge(v2, v0, p), w2 = edge(v0, v1, p);
+                if (w0 < margin0 || w1 < margin1 || w2 < margin2)
+                    continue;
+                float z = (w0 * v0.z + w1 * v1.z + w2 * v2.z) * invArea + depthMargin;
+                float& stored = depth[y * width + x];
+                if (z < stored)
+                    stored = std::max(z, 0.0f);
+            }
+        }
+    }
+
+    glm::vec3 toScreen(const glm::vec4& clip) const
+    {
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        return glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height, ndc.z * 0.5f + 0.5f);
+    }
+
+    // twice the signed area of (a, b, c), positive for counter-clockwise triangles
+    static float edge(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+    {
+        return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    }
+};
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// draws are submitted as a 64-bit sort key and a small payload (an index into the caller's own draw data), radix
+// sorted once per frame and executed in key order, so draws sharing a program, material and textures follow each
+// other and their state changes happen once per group. the key, from the most significant bit:
+//
+//   front to back   pass:4 | 0 | shader:10 | material:12 | textures:13 | depth:24
+//   back to front   pass:4 | 1 | farness:24 | shader:10 | material:12 | textures:13
+//
+// opaque passes group by state and are front to back inside a group, for early depth rejection. blended passes need
+// strict back to front order (farness is the inverted depth), state is only grouped among draws at the same depth.
+// depth is the view distance quantized over the range given to Begin().
+//
+//   queue.Begin(zNear, zFar);
+//   queue.Submit(queue.MakeKey(pass, false, shader, material, textures, viewDepth), index); ...
+//   queue.Sort();
+//   queue.Execute([&](const RenderQueue::Command &command) { ... draw data[command.Payload] ... });
+class RenderQueue {
+public:
+    static const unsigned int PASS_BITS = 4;
+    static const unsigned int SHADER_BITS = 10;
+    static const unsigned int MATERIAL_BITS = 12;
+    static const unsigned int TEXTURE_BITS = 13;
+    static const unsigned int DEPTH_BITS = 24;
+
+    struct Command {
+        uint64_t Key;
+        uint32_t Payload;
+    };
+
+    // of the last Execute(), a change is counted whenever a field differs from the previous command (and for the first)
+    struct Stats {
+        unsigned int Commands = 0;
+        unsigned int ShaderChanges = 0;
+        unsigned int MaterialChanges = 0;
+        unsigned int TextureChanges = 0;
+        double SortMilliseconds = 0.0;
+    };
+
+    // starts a frame, the view distances of the keys are quantized over [zNear, zFar]
+    void Begin(float zNear, float zFar)
+    {
+        commands.clear();
+        depthNear = zNear;
+        depthScale = zFar > zNear ? 1.0f / (zFar - zNear) : 0.0f;
+    }
+
+    // shader, material and textures are small ids picked by the caller, they are cut to the width of their field
+    uint64_t MakeKey(unsigned int pass, bool backToFront, unsigned int shader, unsigned int material,
+                     unsigned int textures, float viewDepth) const
+    {
+        uint64_t depth = quantizeDepth(viewDepth);
+        uint64_t state = ((uint64_t)(shader & mask(SHADER_BITS)) << (MATERIAL_BITS + TEXTURE_BITS)) |
+                         ((uint64_t)(material & mask(MATERIAL_BITS)) << TEXTURE_BITS) |
+                         (uint64_t)(textures & mask(TEXTURE_BITS));
+        uint64_t key = (uint64_t)(pass & mask(PASS_BITS)) << 60;
+        if (backToFront)
+            return key | (1ull << 59) | ((mask(DEPTH_BITS) - depth) << (59 - DEPTH_BITS)) | state;
+        return key | (state << DEPTH_BITS) | depth;
+    }
+
+    static unsigned int KeyPass(uint64_t key) { return (unsigned int)(key >> 60); }
+    static unsigned int KeyShader(uint64_t key) { return (unsigned int)(stateBits(key) >> (MATERIAL_BITS + TEXTURE_BITS)) & mask(SHADER_BITS); }
+    static unsigned int KeyMaterial(uint64_t key) { return (unsigned int)(stateBits(key) >> TEXTURE_BITS) & mask(MATERIAL_BITS); }
+    static unsigned int KeyTextures(uint64_t key) { return (unsigned int)stateBits(key) & mask(TEXTURE_BITS); }
+
+    void Submit(uint64_t key, uint32_t payload)
+    {
+        commands.push_back({key, payload});
+    }
+
+    // least significant digit radix sort of the keys, 8 bits at a time. it is stable, so draws with equal keys keep
+    // the order they were submitted in. digits that are the same in every key are skipped
+    void Sort()
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        const size_t count = commands.size();
+        if (count > 1)
+        {
+            size_t histograms[8][256] = {};
+            for (const Command &command : commands)
+                for (int digit = 0; digit < 8; digit++)
+                    histograms[digit][(command.Key >> (digit * 8)) & 0xFF]++;
+
+            scratch.resize(count);
+            Command *source = commands.data(), *destination = scratch.data();
+            for (int digit = 0; digit < 8; digit++)
+            {
+                size_t *histogram = histograms[digit];
+                if (histogram[(source[0].Key >> (digit * 8)) & 0xFF] == count)
+                    continue;
+                size_t offset = 0;
+                for (int bucket = 0; bucket < 256; bucket++)
+                {
+                    size_t size = histogram[bucket];
+                    histogram[bucket] = offset;
+                    offset += size;
+                }
+                for (size_t i = 0; i < count; i++)
+                    destination[histogram[(source[i].Key >> (digit * 8)) & 0xFF]++] = source[i];
+                std::swap(source, destination);
+            }
+            if (source != commands.data())
+                commands.swap(scratch);
+        }
+        stats.SortMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    // calls draw(const Command &) for every command in the current order, sorted or not
+    template <typename Function>
+    void Execute(Function draw)
+    {
+        stats.Commands = (unsigned int)commands.size();
+        stats.ShaderChanges = stats.MaterialChanges = stats.TextureChanges = 0;
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            uint64_t key = commands[i].Key;
+            bool first = i == 0;
+            uint64_t previous = first ? 0 : commands[i - 1].Key;
+            if (first || KeyPass(key) != KeyPass(previous) || KeyShader(key) != KeyShader(previous))
+                stats.ShaderChanges++;
+            if (first || KeyMaterial(key) != KeyMaterial(previous))
+                stats.MaterialChanges++;
+            if (first || KeyTextures(key) != KeyTextures(previous))
+                stats.TextureChanges++;
+            draw(commands[i]);
+        }
+    }
+
+    const std::vector<Command> &GetCommands() const { return commands; }
+    const Stats &GetStats() const { return stats; }
+
+private:
+    std::vector<Command> commands, scratch;
+    float depthNear = 0.0f, depthScale = 0.0f;
+    Stats stats;
+
+    static unsigned int mask(unsigned int bits) { return (1u << bits) - 1u; }
+
+    // the shader, material and textures fields moved to the low bits, wherever the order put them
+    static uint64_t stateBits(uint64_t key)
+    {
+        return (key & (1ull << 59)) ? key : key >> DEPTH_BITS;
+    }
+
+    uint64_t quantizeDepth(float viewDepth) const
+    {
+        float t = std::min(std::max((viewDepth - depthNear) * depthScale, 0.0f), 1.0f);
+        return (uint64_t)(t * (float)mask(DEPTH_BITS));
+    }
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "terrain_tiles.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+// culling data of one tessellation patch: the height range of the displaced surface and a cone holding
+// all of its normals. tessellation.tcs drops a patch whose box is outside the frustum, or whose normal cone
+// points away from the camera everywhere (terrain seen from below).
+struct TerrainPatchBounds {
+    float MinHeight = FLT_MAX, MaxHeight = -FLT_MAX;
+    glm::vec3 ConeAxis = glm::vec3(0.0f, 1.0f, 0.0f);
+    // half angle in radians, >= pi/2 when the patch can't be backface culled
+    float ConeAngle = 0.0f;
+};
+
+// bounds of a patchesX x patchesY grid laid over the whole map, in world units: height = sample * heightScale - heightShift
+// with samples in [0, 1] and one world unit between two samples.
+//
+// the streamer may show a coarser level than level 0, whose bilinear filter reaches up to 2^(LevelCount-1) samples
+// past a patch, so every patch also takes in the samples of that margin. the normals of any tessellation of the
+// surface are averages of the cell gradients, so a cone holding all cell gradients holds them too; coneSlack
+// widens it for the rounding of the tessellated positions.
+inline std::vector<TerrainPatchBounds> ComputeTerrainPatchBounds(TerrainTileFile &file, int patchesX, int patchesY,
+                                                                 float heightScale, float heightShift, float coneSlack = 0.05f)
+{
+    const int width = file.Header.Width, height = file.Header.Height;
+    const int tileSize = file.Header.TileSize, cells = tileSize - 1;
+    const int margin = 1 << (file.Levels.size() - 1);
+    const float toWorld = heightScale / 65535.0f;
+
+    // per patch the box of the cell gradients (dh/dx, dh/dz), see the cone below
+    std::vector<TerrainPatchBounds> bounds((size_t)patchesX * patchesY);
+    std::vector<glm::vec4> gradients(bounds.size(), glm::vec4(FLT_MAX, -FLT_MAX, FLT_MAX, -FLT_MAX));
+
+    // first and last patch whose (margin-grown) sample range overlaps [first, last]
+    auto patchRange = [margin](int first, int last, int samples, int patches, int &firstPatch, int &lastPatch) {
+        float perPatch = (float)(samples - 1) / patches;
+        firstPatch = std::max((int)std::floor((first - margin) / perPatch), 0);
+        lastPatch = std::min((int)std::floor((last + margin) / perPatch), patches - 1);
+    };
+
+    const TerrainTileLevel &finest = file.Levels[0];
+    std::vector<uint16_t> samples(file.TileSampleCount());
+    for (uint32_t tileY = 0; tileY < finest.TilesY; tileY++)
+    {
+        for (uint32_t tileX = 0; tileX < finest.TilesX; tileX++)
+        {
+            file.ReadTile(0, tileX, tileY, samples.data());
+            // cells of this tile that lie inside the map, the last tiles of a row/column are partly padding
+            int cellsX = std::min(cells, width - 1 - (int)tileX * cells);
+            int cellsY = std::min(cells, height - 1 - (int)tileY * cells);
+            for (int y = 0; y < cellsY; y++)
+            {
+                int row = tileY * cells + y;
+                int firstPatchY, lastPatchY;
+                patchRange(row, row + 1, height, patchesY, firstPatchY, lastPatchY);
+                for (int x = 0; x < cellsX; x++)
+                {
+                    int column = tileX * cells + x;
+                    float h00 = samples[y * tileSize + x] * toWorld, h10 = samples[y * tileSize + x + 1] * toWorld;
+                    float h01 = samples[(y + 1) * tileSize + x] * toWorld, h11 = samples[(y + 1) * tileSize + x + 1] * toWorld;
+                    float low = std::min(std::min(h00, h10), std::min(h01, h11));
+                    float high = std::max(std::max(h00, h10), std::max(h01, h11));
+                    // the gradients of a bilinear cell lie between those of its opposite edges
+                    float dx0 = h10 - h00, dx1 = h11 - h01, dz0 = h01 - h00, dz1 = h11 - h10;
+
+                    int firstPatchX, lastPatchX;
+                    patchRange(column, column + 1, width, patchesX, firstPatchX, lastPatchX);
+                    for (int py = firstPatchY; py <= lastPatchY; py++)
+                    {
+                        for (int px = firstPatchX; px <= lastPatchX; px++)
+                        {
+                            size_t index = (size_t)py * patchesX + px;
+                            bounds[index].MinHeight = std::min(bounds[index].MinHeight, low);
+                            bounds[index].MaxHeight = std::max(bounds[index].MaxHeight, high);
+                            glm::vec4 &box = gradients[index];
+                            box.x = std::min(box.x, std::min(dx0, dx1));
+                            box.y = std::max(box.y, std::max(dx0, dx1));
+                            box.z = std::min(box.z, std::min(dz0, dz1));
+                            box.w = std::max(box.w, std::max(dz0, dz1));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // the normals whose angle to an axis is below 90 degrees form a convex set of gradients, so a cone that
+    // holds the normals of the four corners of the gradient box holds every normal of the patch
+    const float halfPi = 1.57079632679f;
+    for (size_t i = 0; i < bounds.size(); i++)
+    {
+        TerrainPatchBounds &patch = bounds[i];
+        patch.MinHeight -= heightShift;
+        patch.MaxHeight -= heightShift;
+
+        const glm::vec4 &box = gradients[i];
+        glm::vec3 corners[4] = {
+            glm::normalize(glm::vec3(-box.x, 1.0f, -box.z)), glm::normalize(glm::vec3(-box.y, 1.0f, -box.z)),
+            glm::normalize(glm::vec3(-box.x, 1.0f, -box.w)), glm::normalize(glm::vec3(-box.y, 1.0f, -box.w))
+        };
+        patch.ConeAxis = glm::normalize(corners[0] + corners[1] + corners[2] + corners[3]);
+        float minDot = 1.0f;
+        for (const glm::vec3 &corner : corners)
+            minDot = std::min(minDot, glm::dot(corner, patch.ConeAxis));
+        patch.ConeAngle = std::acos(glm::clamp(minDot, -1.0f, 1.0f)) + coneSlack;
+        if (patch.ConeAngle >= halfPi)
+            patch.ConeAngle = halfPi;
+    }
+    return bounds;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "frustum.h"
+#include "mesh.h"
+#include "shader_s.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// chunked level of detail terrain: the heightmap is covered by a quadtree of tiles that all have the same
+// number of cells. a node at level l samples every 2^l-th height, level 0 is the full resolution.
+// every tile shares one (x, z) grid vertex buffer and one index buffer, it only owns its heights.
+// neighbouring tiles of different levels are joined with skirts hanging down from the tile borders.
+// a tile is a single draw of 16-bit indexed triangle strips separated by primitive restarts.
+// to be drawn with terrain_chunk.vs
+class TerrainQuadtree {
+public:
+    static const int TILE_CELLS = 64;
+    static const uint16_t RESTART_INDEX = 0xFFFF;
+
+    struct Node {
+        AABB Bounds;
+        // largest vertical distance (world units) between this tile and the full resolution heightmap,
+        // including the error of its children so refining a node never increases the error
+        float Error;
+        int Level;
+        // first heightmap sample of the tile
+        int Row, Column;
+        int Children[4];
+        unsigned int VAO, HeightVBO;
+
+        bool IsLeaf() const { return Level == 0; }
+    };
+
+    struct Stats {
+        unsigned int NodesDrawn = 0;
+        unsigned int Triangles = 0;
+    };
+
+    std::vector<Node> Nodes;
+
+    // data is the heightmap as loaded by stb_image, the first channel is the height.
+    // world height = value * yScale - yShift, samples are one unit apart and centered around the origin
+    TerrainQuadtree(const unsigned char *data, int width, int height, int channels, float yScale, float yShift)
+        : width(width), height(height), yScale(yScale), yShift(yShift)
+    {
+        heights.resize((size_t)width * height);
+        for (size_t i = 0; i < heights.size(); i++)
+            heights[i] = data[i * channels];
+
+        levelCount = 1;
+        while (TILE_CELLS * (1 << (levelCount - 1)) < std::max(width - 1, height - 1))
+            levelCount++;
+        levelMaxError.assign(levelCount, 0.0f);
+
+        setupGrid();
+        buildNode(levelCount - 1, 0, 0);
+    }
+
+    // draws the tiles that are in the frustum, each at the coarsest level whose projected error is below the selector's threshold
+    void Draw(Shader &shader, const Frustum &frustum, const LodSelector &selector)
+    {
+        stats = Stats();
+        shader.setFloat("heightScale", yScale);
+        shader.setFloat("heightShift", yShift);
+        shader.setVec2("mapMax", sampleToWorld(height - 1, width - 1));
+        GLState::Enable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(RESTART_INDEX);
+        drawNode(0, shader, frustum, selector);
+        GLState::BindVertexArray(0);
+    }
+
+    const Stats &GetStats() const { return stats; }
+
+    // bytes of vertex data on the GPU: the shared grid plus every tile's heights
+    size_t GetVertexMemory() const
+    {
+        return gridVertexCount() * 4 * sizeof(GLubyte) + Nodes.size() * gridVertexCount() * sizeof(uint16_t);
+    }
+
+    unsigned int GetTrianglesPerTile() const { return tileTriangleCount; }
+
+private:
+    int width, height;
+    float yScale, yShift;
+    std::vector<uint16_t> heights;
+    int levelCount;
+    // largest node error per level, sizes the skirts
+    std::vector<float> levelMaxError;
+    unsigned int gridVBO, gridIBO;
+    unsigned int tileIndexCount;
+    unsigned int tileTriangleCount;
+    Stats stats;
+
+    static int gridVertexCount() { return (TILE_CELLS + 1) * (TILE_CELLS + 1) + 4 * (TILE_CELLS + 1); }
+
+    glm::vec2 sampleToWorld(int row, int column) const
+    {
+        return glm::vec2(-height / 2.0f + row, -width / 2.0f + column);
+    }
+
+    uint16_t sample(int row, int column) const
+    {
+        row = std::min(row, height - 1);
+        column = std::min(column, width - 1);
+        return heights[(size_t)row * width + column];
+    }
+
+    // the grid vertices are (column, row, skirt) inside a tile: (TILE_CELLS + 1)^2 regular vertices
+    // followed by a copy of the 4 borders which the vertex shader pushes down
+    void setupGrid()
+    {
+        const int n = TILE_CELLS + 1;
+        std::vector<GLubyte> grid;
+        grid.reserve(gridVertexCount() * 4);
+        for (int row = 0; row < n; row++)
+            for (int column = 0; column < n; column++)
+                grid.insert(grid.end(), {(GLubyte)column, (GLubyte)row, 0, 0});
+        for (int edge = 0; edge < 4; edge++)
+            for (int i = 0; i < n; i++)
+            {
+                glm::ivec2 border = borderVertex(edge, i);
+                grid.insert(grid.end(), {(GLubyte)border.x, (GLubyte)border.y, 1, 0});
+            }
+
+        // one strip per row of cells (the diagonals run from the upper right to the lower left corner of each cell),
+        // then one strip per skirt, all separated by the restart index
+        const uint16_t restart = RESTART_INDEX;
+        std::vector<uint16_t> indices;
+        for (int row = 0; row < TILE_CELLS; row++)
+        {
+            for (int column = 0; column < n; column++)
+            {
+                indices.push_back((uint16_t)(row * n + column));
+                indices.push_back((uint16_t)((row + 1) * n + column));
+            }
+            indices.push_back(restart);
+        }
+        for (int edge = 0; edge < 4; edge++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                glm::ivec2 border = borderVertex(edge, i);
+                indices.push_back((uint16_t)(border.y * n + border.x));
+                indices.push_back((uint16_t)(n * n + edge * n + i));
+            }
+            indices.push_back(restart);
+        }
+        tileIndexCount = (unsigned int)indices.size();
+        tileTriangleCount = (TILE_CELLS + 4) * TILE_CELLS * 2;
+
+        glGenBuffers(1, &gridVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
+        glBufferData(GL_ARRAY_BUFFER, grid.size(), grid.data(), GL_STATIC_DRAW);
+        glGenBuffers(1, &gridIBO);
+        // don't attach the index buffer to whatever vertex array the caller has bound
+        GLState::BindVertexArray(0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridIBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint16_t), indices.data(), GL_STATIC_DRAW);
+    }
+
+    // (column, row) of the i-th vertex along a tile border: 0 = first row, 1 = last row, 2 = first column, 3 = last column
+    static glm::ivec2 borderVertex(int edge, int i)
+    {
+        switch (edge)
+        {
+            case 0: return glm::ivec2(i, 0);
+            case 1: return glm::ivec2(i, TILE_CELLS);
+            case 2: return glm::ivec2(0, i);
+            default: return glm::ivec2(TILE_CELLS, i);
+        }
+    }
+
+    int buildNode(int level, int row, int column)
+    {
+        int index = (int)Nodes.size();
+        Nodes.push_back(Node());
+        Node node;
+        node.Level = level;
+        node.Row = row;
+        node.Column = column;
+        for (int i = 0; i < 4; i++)
+            node.Children[i] = -1;
+
+        const int step = 1 << level;
+        const int span = TILE_CELLS * step;
+        float childError = 0.0f;
+        if (level > 0)
+        {
+            const int half = span / 2;
+            for (int i = 0; i < 4; i++)
+            {
+                int childRow = row + (i / 2) * half, childColumn = column + (i % 2) * half;
+                // no tiles beyond the heightmap
+                if (childRow >= height - 1 || childColumn >= width - 1)
+                    continue;
+                node.Children[i] = buildNode(level - 1, childRow, childColumn);
+                childError = std::max(childError, Nodes[node.Children[i]].Error);
+            }
+        }
+
+        // tile heights: regular grid followed by the border copies for the skirts
+        const int n = TILE_CELLS + 1;
+        std::vector<uint16_t> tileHeights(gridVertexCount());
+        uint16_t minHeight = 0xFFFF, maxHeight = 0;
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < n; x++)
+            {
+                uint16_t h = sample(row + y * step, column + x * step);
+                tileHeights[y * n + x] = h;
+            }
+        for (int edge = 0; edge < 4; edge++)
+            for (int i = 0; i < n; i++)
+            {
+                glm::ivec2 border = borderVertex(edge, i);
+                tileHeights[n * n + edge * n + i] = tileHeights[border.y * n + border.x];
+            }
+
+        // compare every full resolution sample under the tile with the tile's triangles
+        float ownError = 0.0f;
+        const int lastRow = std::min(row + span, height - 1), lastColumn = std::min(column + span, width - 1);
+        for (int r = row; r <= lastRow; r++)
+        {
+            for (int c = column; c <= lastColumn; c++)
+            {
+                uint16_t h = heights[(size_t)r * width + c];
+                minHeight = std::min(minHeight, h);
+                maxHeight = std::max(maxHeight, h);
+                if (level == 0)
+                    continue;
+                int y = std::min((r - row) / step, TILE_CELLS - 1), x = std::min((c - column) / step, TILE_CELLS - 1);
+                float fy = (float)(r - row - y * step) / step, fx = (float)(c - column - x * step) / step;
+                float a = tileHeights[y * n + x], b = tileHeights[y * n + x + 1];
+                float d = tileHeights[(y + 1) * n + x + 1], e = tileHeights[(y + 1) * n + x];
+                // same diagonal as the strips (from b to the lower left corner)
+                float approximation = fx + fy <= 1.0f ? a + (b - a) * fx + (e - a) * fy
+                                                       : d + (e - d) * (1.0f - fx) + (b - d) * (1.0f - fy);
+                ownError = std::max(ownError, std::abs(approximation - h));
+            }
+        }
+        node.Error = std::max(ownError * yScale, childError);
+        levelMaxError[level] = std::max(levelMaxError[level], node.Error);
+
+        glm::vec2 first = sampleToWorld(row, column), last = sampleToWorld(lastRow, lastColumn);
+        node.Bounds = AABB(glm::vec3(first.x, minHeight * yScale - yShift, first.y),
+                           glm::vec3(last.x, maxHeight * yScale - yShift, last.y));
+
+        glGenVertexArrays(1, &node.VAO);
+        GLState::BindVertexArray(node.VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, gridVBO);
+        glVertexAttribPointer(0, 4, GL_UNSIGNED_BYTE, GL_FALSE, 4 * sizeof(GLubyte), (void*)0);
+        glEnableVertexAttribArray(0);
+        glGenBuffers(1, &node.HeightVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, node.HeightVBO);
+        glBufferData(GL_ARRAY_BUFFER, tileHeights.size() * sizeof(uint16_t), tileHeights.data(), GL_STATIC_DRAW);
+        glVertexAttribPointer(1, 1, GL_UNSIGNED_SHORT, GL_FALSE, sizeof(uint16_t), (void*)0);
+        glEnableVertexAttribArray(1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gridIBO);
+        GLState::BindVertexArray(0);
+
+        Nodes[index] = node;
+        return index;
+    }
+
+    void drawNode(int index, Shader &shader, const Frustum &frustum, const LodSelector &selector)
+    {
+        const Node &node = Nodes[index];
+        if (!frustum.IsBoxVisible(node.Bounds))
+            return;
+
+        // distance from the camera to the closest point of the tile
+        glm::vec3 outside = glm::max(glm::max(node.Bounds.min - selector.ViewPosition, selector.ViewPosition - node.Bounds.max), glm::vec3(0.0f));
+        float distance = std::max(glm::length(outside), 1e-3f);
+        if (!node.IsLeaf() && node.Error / distance * selector.PixelsPerUnit > selector.MaxPixelError)
+        {
+            for (int i = 0; i < 4; i++)
+                if (node.Children[i] >= 0)
+                    drawNode(node.Children[i], shader, frustum, selector);
+            return;
+        }
+
+        // a neighbour is at most a couple of levels coarser, its error bounds the gap the skirt has to hide
+        float skirtDepth = levelMaxError[std::min(node.Level + 2, levelCount - 1)] + node.Error + 1.0f;
+        shader.setVec2("tileOrigin", sampleToWorld(node.Row, node.Column));
+        shader.setFloat("tileSpacing", (float)(1 << node.Level));
+        shader.setFloat("skirtDepth", skirtDepth);
+        GLState::BindVertexArray(node.VAO);
+        glDrawElements(GL_TRIANGLE_STRIP, tileIndexCount, GL_UNSIGNED_SHORT, 0);
+
+        stats.NodesDrawn++;
+        stats.Triangles += tileTriangleCount;
+    }
+};
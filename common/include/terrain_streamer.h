@@ -0,0 +1,290 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "shader_s.h"
+#include "terrain_tiles.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// keeps the tiles of a cooked terrain around the camera resident in a GL_TEXTURE_2D_ARRAY. tiles are read on a
+// worker thread and uploaded on the GL thread, the least recently wanted tile is evicted when the array is full.
+// the single tile of the coarsest level is always resident, so every place of the map has some height.
+//
+// an indirection texture with one texel per level-0 tile tells the shader where the best resident tile for
+// that area is: (layer, level, first level-0 sample x, first level-0 sample y). see tessellation.tes
+class TerrainStreamer {
+public:
+    struct Stats {
+        unsigned int Resident = 0;
+        unsigned int Pending = 0;
+        unsigned int Uploaded = 0;
+        unsigned int Evicted = 0;
+    };
+
+    // layerCount is the budget of resident tiles. a level-m tile stays wanted while the camera is closer than
+    // wantedRadius (in level-m tiles) to it
+    TerrainStreamer(TerrainTileFile &file, int layerCount = 96, float wantedRadius = 1.5f)
+        : file(file), layerCount(layerCount), wantedRadius(wantedRadius), tileSize(file.Header.TileSize)
+    {
+        const TerrainTileLevel &finest = file.Levels[0];
+        glGenTextures(1, &tileArray);
+        GLState::BindTexture(GL_TEXTURE_2D_ARRAY, tileArray);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16, tileSize, tileSize, layerCount, 0, GL_RED, GL_UNSIGNED_SHORT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glGenTextures(1, &indirection);
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, finest.TilesX, finest.TilesY, 0, GL_RGBA, GL_FLOAT, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        indirectionData.resize((size_t)finest.TilesX * finest.TilesY * 4);
+
+        layers.resize(layerCount);
+
+        // the root tile is loaded right away and never leaves
+        Tile root;
+        root.Key = makeKey((int)file.Levels.size() - 1, 0, 0);
+        root.Samples.resize(file.TileSampleCount());
+        file.ReadTile((int)file.Levels.size() - 1, 0, 0, root.Samples.data());
+        upload(root, 0);
+        layers[0].Pinned = true;
+
+        worker = std::thread(&TerrainStreamer::workerLoop, this);
+    }
+
+    ~TerrainStreamer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    TerrainStreamer(const TerrainStreamer&) = delete;
+    TerrainStreamer& operator=(const TerrainStreamer&) = delete;
+
+    // call once per frame with the camera position in level-0 samples (x = column, y = row)
+    void Update(const glm::vec2 &cameraSample)
+    {
+        frame++;
+        stats.Uploaded = 0;
+        stats.Evicted = 0;
+
+        // 1. what should be resident now, coarse levels first (they matter most when tiles are missing)
+        wanted.clear();
+        const float cells = (float)(tileSize - 1);
+        for (int level = (int)file.Levels.size() - 1; level >= 0; level--)
+        {
+            const TerrainTileLevel &info = file.Levels[level];
+            float span = cells * (float)(1 << level);
+            glm::vec2 center = cameraSample / span;
+            int firstX = std::max((int)std::floor(center.x - wantedRadius), 0), lastX = std::min((int)std::floor(center.x + wantedRadius), (int)info.TilesX - 1);
+            int firstY = std::max((int)std::floor(center.y - wantedRadius), 0), lastY = std::min((int)std::floor(center.y + wantedRadius), (int)info.TilesY - 1);
+            for (int y = firstY; y <= lastY; y++)
+                for (int x = firstX; x <= lastX; x++)
+                    wanted.push_back(makeKey(level, x, y));
+        }
+
+        // 2. keep the wanted resident tiles fresh and ask the worker for the missing ones
+        std::vector<uint64_t> missing;
+        for (uint64_t key : wanted)
+        {
+            auto resident = residentLayers.find(key);
+            if (resident != residentLayers.end())
+                layers[resident->second].LastWanted = frame;
+            else
+                missing.push_back(key);
+        }
+
+        std::vector<Tile> loaded;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.clear();
+            for (uint64_t key : missing)
+                if (key != loading)
+                    requests.push_back(key);
+            loaded.swap(completed);
+            stats.Pending = (unsigned int)requests.size() + (loading != NO_TILE ? 1 : 0);
+        }
+        if (stats.Pending > 0)
+            wake.notify_one();
+
+        // 3. upload what the worker finished, evicting the tile that hasn't been wanted for the longest time
+        bool changed = false;
+        for (Tile &tile : loaded)
+        {
+            // the camera may have moved on while the tile was loading
+            if (residentLayers.count(tile.Key) || std::find(wanted.begin(), wanted.end(), tile.Key) == wanted.end())
+                continue;
+            int layer = findFreeLayer();
+            if (layer < 0)
+                break;
+            upload(tile, layer);
+            layers[layer].LastWanted = frame;
+            stats.Uploaded++;
+            changed = true;
+        }
+        if (changed || indirectionDirty)
+            updateIndirection();
+        stats.Resident = (unsigned int)residentLayers.size();
+    }
+
+    // binds the tile array and the indirection texture and sets the sampler uniforms of the terrain shader
+    void Bind(Shader &shader, int firstUnit)
+    {
+        GLState::ActiveTexture(GL_TEXTURE0 + firstUnit);
+        GLState::BindTexture(GL_TEXTURE_2D_ARRAY, tileArray);
+        GLState::ActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        GLState::ActiveTexture(GL_TEXTURE0);
+        shader.setInt("terrainTiles", firstUnit);
+        shader.setInt("terrainIndirection", firstUnit + 1);
+        shader.setFloat("terrainTileSize", (float)tileSize);
+        shader.setVec2("terrainSize", glm::vec2(file.Header.Width, file.Header.Height));
+    }
+
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Tile {
+        uint64_t Key;
+        std::vector<uint16_t> Samples;
+    };
+
+    struct Layer {
+        uint64_t Key = NO_TILE;
+        uint64_t LastWanted = 0;
+        bool Pinned = false;
+    };
+
+    static const uint64_t NO_TILE = ~0ull;
+
+    TerrainTileFile &file;
+    int layerCount;
+    float wantedRadius;
+    int tileSize;
+    unsigned int tileArray, indirection;
+    std::vector<float> indirectionData;
+    bool indirectionDirty = true;
+
+    std::vector<Layer> layers;
+    std::unordered_map<uint64_t, int> residentLayers;
+    std::vector<uint64_t> wanted;
+    uint64_t frame = 0;
+    Stats stats;
+
+    // shared with the worker
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<uint64_t> requests;
+    std::vector<Tile> completed;
+    uint64_t loading = NO_TILE;
+    bool stopping = false;
+
+    static uint64_t makeKey(int level, int x, int y) { return ((uint64_t)level << 48) | ((uint64_t)y << 24) | (uint64_t)x; }
+    static int keyLevel(uint64_t key) { return (int)(key >> 48); }
+    static int keyX(uint64_t key) { return (int)(key & 0xFFFFFF); }
+    static int keyY(uint64_t key) { return (int)((key >> 24) & 0xFFFFFF); }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            uint64_t key;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !requests.empty(); });
+                if (stopping)
+                    return;
+                key = requests.front();
+                requests.pop_front();
+                loading = key;
+            }
+
+            // touching the mapped pages here keeps the page faults (disk reads) off the render thread
+            Tile tile;
+            tile.Key = key;
+            tile.Samples.resize(file.TileSampleCount());
+            file.ReadTile(keyLevel(key), keyX(key), keyY(key), tile.Samples.data());
+
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(std::move(tile));
+            loading = NO_TILE;
+        }
+    }
+
+    int findFreeLayer()
+    {
+        int oldest = -1;
+        for (int i = 0; i < layerCount; i++)
+        {
+            if (layers[i].Key == NO_TILE)
+                return i;
+            if (layers[i].Pinned || layers[i].LastWanted == frame)
+                continue;
+            if (oldest < 0 || layers[i].LastWanted < layers[oldest].LastWanted)
+                oldest = i;
+        }
+        if (oldest >= 0)
+        {
+            residentLayers.erase(layers[oldest].Key);
+            layers[oldest].Key = NO_TILE;
+            indirectionDirty = true;
+            stats.Evicted++;
+        }
+        return oldest;
+    }
+
+    void upload(const Tile &tile, int layer)
+    {
+        GLState::BindTexture(GL_TEXTURE_2D_ARRAY, tileArray);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, tileSize, tileSize, 1, GL_RED, GL_UNSIGNED_SHORT, tile.Samples.data());
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        layers[layer].Key = tile.Key;
+        residentLayers[tile.Key] = layer;
+        indirectionDirty = true;
+    }
+
+    // for every level-0 tile, the finest resident tile covering it
+    void updateIndirection()
+    {
+        const TerrainTileLevel &finest = file.Levels[0];
+        const int cells = tileSize - 1;
+        for (uint32_t y = 0; y < finest.TilesY; y++)
+        {
+            for (uint32_t x = 0; x < finest.TilesX; x++)
+            {
+                for (int level = 0; level < (int)file.Levels.size(); level++)
+                {
+                    auto resident = residentLayers.find(makeKey(level, x >> level, y >> level));
+                    if (resident == residentLayers.end())
+                        continue;
+                    float *texel = &indirectionData[(y * finest.TilesX + x) * 4];
+                    texel[0] = (float)resident->second;
+                    texel[1] = (float)level;
+                    texel[2] = (float)((x >> level) * cells << level);
+                    texel[3] = (float)((y >> level) * cells << level);
+                    break;
+                }
+            }
+        }
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, finest.TilesX, finest.TilesY, GL_RGBA, GL_FLOAT, indirectionData.data());
+        indirectionDirty = false;
+    }
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define TERRAIN_TILES_USE_MMAP 1
+#endif
+
+// cooked terrain: the heightmap as a mip chain of square tiles of raw 16-bit heights.
+// a tile has TileSize x TileSize samples and shares its last row/column with its neighbour, so tiles can be
+// filtered on their own without seams. level m keeps every 2^m-th sample of level 0, a level-m tile covers
+// exactly the area of 2^m x 2^m level-0 tiles, and the last level is a single tile of the whole map.
+//
+// layout: TerrainTileHeader, LevelCount x TerrainTileLevel, then the tiles of every level row by row.
+struct TerrainTileHeader {
+    char Magic[4];
+    uint32_t Version;
+    // heightmap size in samples (level 0)
+    uint32_t Width, Height;
+    uint32_t TileSize;
+    uint32_t LevelCount;
+};
+
+struct TerrainTileLevel {
+    uint32_t TilesX, TilesY;
+    // byte offset of the level's first tile in the file
+    uint64_t Offset;
+};
+
+static const char TERRAIN_TILE_MAGIC[4] = {'T', 'T', 'I', 'L'};
+static const uint32_t TERRAIN_TILE_VERSION = 1;
+
+// writes the tile file for an 8-bit heightmap as loaded by stb_image (the first channel is the height)
+inline bool CookTerrainTiles(const unsigned char *data, int width, int height, int channels, const std::string &path, int tileSize = 129)
+{
+    const int cells = tileSize - 1;
+    std::vector<TerrainTileLevel> levels;
+    uint64_t offset = 0;
+    for (int level = 0; ; level++)
+    {
+        int levelWidth = (width - 1) / (1 << level) + 1, levelHeight = (height - 1) / (1 << level) + 1;
+        TerrainTileLevel info;
+        info.TilesX = std::max((levelWidth - 1 + cells - 1) / cells, 1);
+        info.TilesY = std::max((levelHeight - 1 + cells - 1) / cells, 1);
+        info.Offset = offset;
+        offset += (uint64_t)info.TilesX * info.TilesY * tileSize * tileSize * sizeof(uint16_t);
+        levels.push_back(info);
+        if (info.TilesX == 1 && info.TilesY == 1)
+            break;
+    }
+    const uint64_t dataStart = sizeof(TerrainTileHeader) + levels.size() * sizeof(TerrainTileLevel);
+    for (TerrainTileLevel &level : levels)
+        level.Offset += dataStart;
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "ERROR::TERRAIN_TILES::COULD_NOT_WRITE " << path << std::endl;
+        return false;
+    }
+    TerrainTileHeader header;
+    std::memcpy(header.Magic, TERRAIN_TILE_MAGIC, 4);
+    header.Version = TERRAIN_TILE_VERSION;
+    header.Width = width;
+    header.Height = height;
+    header.TileSize = tileSize;
+    header.LevelCount = (uint32_t)levels.size();
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)levels.data(), levels.size() * sizeof(TerrainTileLevel));
+
+    std::vector<uint16_t> tile((size_t)tileSize * tileSize);
+    for (size_t level = 0; level < levels.size(); level++)
+    {
+        const int step = 1 << level;
+        for (uint32_t tileY = 0; tileY < levels[level].TilesY; tileY++)
+        {
+            for (uint32_t tileX = 0; tileX < levels[level].TilesX; tileX++)
+            {
+                for (int y = 0; y < tileSize; y++)
+                {
+                    // point sampling keeps every coarse sample equal to the fine sample at the same place
+                    int row = std::min(((int)tileY * cells + y) * step, height - 1);
+                    for (int x = 0; x < tileSize; x++)
+                    {
+                        int column = std::min(((int)tileX * cells + x) * step, width - 1);
+                        // 8 to 16 bits, 255 maps to 65535
+                        tile[y * tileSize + x] = (uint16_t)(data[((size_t)row * width + column) * channels] * 257);
+                    }
+                }
+                file.write((const char*)tile.data(), tile.size() * sizeof(uint16_t));
+            }
+        }
+    }
+    return (bool)file;
+}
+
+// the tile file exists and is at least as new as the heightmap it was cooked from (or there is no heightmap)
+inline bool TerrainTilesFresh(const std::string &sourcePath, const std::string &path)
+{
+    struct stat source, tiles;
+    if (stat(path.c_str(), &tiles) != 0)
+        return false;
+    return stat(sourcePath.c_str(), &source) != 0 || source.st_mtime <= tiles.st_mtime;
+}
+
+// read-only view of a cooked tile file. the file is memory mapped, so only the tiles that are touched are
+// paged in and the heightmap can be larger than the available memory
+class TerrainTileFile {
+public:
+    TerrainTileHeader Header;
+    std::vector<TerrainTileLevel> Levels;
+
+    TerrainTileFile() = default;
+    TerrainTileFile(const TerrainTileFile&) = delete;
+    TerrainTileFile& operator=(const TerrainTileFile&) = delete;
+
+    ~TerrainTileFile()
+    {
+        close();
+    }
+
+    bool Open(const std::string &path)
+    {
+        close();
+#if defined(TERRAIN_TILES_USE_MMAP)
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+            return false;
+        struct stat info;
+        if (fstat(descriptor, &info) != 0 || (size_t)info.st_size < sizeof(TerrainTileHeader))
+        {
+            close();
+            return false;
+        }
+        size = (size_t)info.st_size;
+        uint64_t fileSize = size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        mapped = (const unsigned char*)mapping;
+        std::memcpy(&Header, mapped, sizeof(Header));
+#else
+        stream.open(path, std::ios::binary | std::ios::ate);
+        uint64_t fileSize = stream ? (uint64_t)stream.tellg() : 0;
+        stream.seekg(0);
+        if (!stream || !stream.read((char*)&Header, sizeof(Header)))
+        {
+            close();
+            return false;
+        }
+#endif
+        // a level count of more than 32 can't come from a 32-bit size, it would only make the resize below fail
+        if (std::memcmp(Header.Magic, TERRAIN_TILE_MAGIC, 4) != 0 || Header.Version != TERRAIN_TILE_VERSION ||
+            Header.Width == 0 || Header.Height == 0 || Header.TileSize < 2 || Header.LevelCount == 0 || Header.LevelCount > 32 ||
+            sizeof(Header) + (uint64_t)Header.LevelCount * sizeof(TerrainTileLevel) > fileSize)
+        {
+            std::cout << "ERROR::TERRAIN_TILES::INVALID_FILE " << path << std::endl;
+            close();
+            return false;
+        }
+        Levels.resize(Header.LevelCount);
+#if defined(TERRAIN_TILES_USE_MMAP)
+        std::memcpy(Levels.data(), mapped + sizeof(Header), Levels.size() * sizeof(TerrainTileLevel));
+#else
+        stream.read((char*)Levels.data(), Levels.size() * sizeof(TerrainTileLevel));
+#endif
+        // every tile ReadTile() can be asked for must be inside the file, a truncated one would be read past its end
+        const uint64_t tileBytes = TileSampleCount() * sizeof(uint16_t);
+        for (const TerrainTileLevel &level : Levels)
+        {
+            uint64_t tiles = (uint64_t)level.TilesX * level.TilesY;
+            if (tiles == 0 || level.Offset > fileSize || tiles > (fileSize - level.Offset) / tileBytes)
+            {
+                std::cout << "ERROR::TERRAIN_TILES::TRUNCATED_FILE " << path << std::endl;
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool IsOpen() const { return !Levels.empty(); }
+
+    size_t TileSampleCount() const { return (size_t)Header.TileSize * Header.TileSize; }
+
+    // copies the samples of a tile, safe to call from another thread than the one that opened the file
+    void ReadTile(int level, int tileX, int tileY, uint16_t *samples)
+    {
+        const TerrainTileLevel &info = Levels[level];
+        uint64_t offset = info.Offset + ((uint64_t)tileY * info.TilesX + tileX) * TileSampleCount() * sizeof(uint16_t);
+#if defined(TERRAIN_TILES_USE_MMAP)
+        std::memcpy(samples, mapped + offset, TileSampleCount() * sizeof(uint16_t));
+#else
+        std::lock_guard<std::mutex> lock(streamMutex);
+        stream.seekg(offset);
+        stream.read((char*)samples, TileSampleCount() * sizeof(uint16_t));
+#endif
+    }
+
+private:
+#if defined(TERRAIN_TILES_USE_MMAP)
+    int descriptor = -1;
+    const unsigned char *mapped = nullptr;
+    size_t size = 0;
+#else
+    std::ifstream stream;
+    std::mutex streamMutex;
+#endif
+
+    void close()
+    {
+        Levels.clear();
+#if defined(TERRAIN_TILES_USE_MMAP)
+        if (mapped)
+            munmap((void*)mapped, size);
+        if (descriptor >= 0)
+            ::close(descriptor);
+        mapped = nullptr;
+        descriptor = -1;
+        size = 0;
+#else
+        if (stream.is_open())
+            stream.close();
+#endif
+    }
+};
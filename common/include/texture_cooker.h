@@ -0,0 +1,667 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "gl_state.h"
+#include "mip_generator.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// textures are cooked once into block compressed mip chains and cached next to their source as <source>.dds, later
+// loads upload the cached blocks as they are: no image decoding, no glGenerateMipmap, and 4 to 8 times less memory
+// than the RGBA8 the driver makes of an uncompressed upload. the format follows from the texture:
+//
+//   BC1  color without alpha (or with all texels opaque), 8 bytes per 4x4 block
+//   BC4  single channel, 8 bytes per block
+//   BC5  normal maps, x and y only (two BC4 blocks), 16 bytes per block. z has to be rebuilt in the shader
+//   BC7  color with alpha, 16 bytes per block (mode 6 only), when the driver has BPTC (not on macOS)
+//   BC3  color with alpha otherwise, a BC4 alpha block and a BC1 color block
+//
+// the mips come from MipGenerator, color filtered in linear light and normals renormalized, whatever the texture is
+// sampled as later (the sRGB formats are chosen at upload, the cache is the same for both).
+// the encoders are the fast kind (bounding box endpoints, no refinement), it is a cooking step but it still runs the
+// first time a texture is loaded. the cache holds the pixels as stb_image decoded them, so it has to be cooked with
+// the same stbi_set_flip_vertically_on_load setting it is loaded with (flipped, in every course loading models).
+// the container is DDS with the DX10 header, so other tools read it too. a cache older than its source is cooked again.
+class TextureCooker {
+public:
+    enum Format { BC1, BC3, BC4, BC5, BC7 };
+    // COLOR is sRGB encoded color, NORMAL a tangent space normal map, DATA anything else (roughness, masks..)
+    enum Usage { COLOR, NORMAL, DATA };
+
+    struct Image {
+        Format BlockFormat = BC1;
+        int Width = 0, Height = 0;
+        // the mip chain down to 1x1, blocks in rows
+        std::vector<std::vector<uint8_t>> Levels;
+    };
+
+    // of everything loaded through LoadTexture and Prepare
+    struct Stats {
+        unsigned int Cooked = 0;
+        unsigned int Cached = 0;
+        size_t CompressedBytes = 0;
+        // what the same textures take as RGBA8 (R8 for BC4) with their mips
+        size_t UncompressedBytes = 0;
+        double CookMilliseconds = 0.0;
+    };
+
+    // the compressed texture of the image at sourcePath, from cachePath or cooked (and cached there) now.
+    // decode(width, height, channels) returns the pixels in stb_image's layout, it is only called when the cache is
+    // missing or older than the source, and the pixels stay the caller's. returns 0 when the image can't be decoded
+    // or the driver can't sample the format, the caller falls back to an uncompressed upload. srgb as in Upload
+    template <typename Decode>
+    static unsigned int LoadTexture(const std::string &sourcePath, const std::string &cachePath, Usage usage, Decode decode,
+                                    bool srgb = false)
+    {
+        Image image;
+        if (!Prepare(sourcePath, cachePath, usage, decode, image))
+            return 0;
+        return Upload(image, srgb);
+    }
+
+    // the part of LoadTexture before the upload, it doesn't touch GL state and is safe to call from other threads.
+    // threadCount as in MipGenerator::Options, it applies to cooking
+    template <typename Decode>
+    static bool Prepare(const std::string &sourcePath, const std::string &cachePath, Usage usage, Decode decode, Image &image,
+                        unsigned int threadCount = 0)
+    {
+        bool cooked = false;
+        double milliseconds = 0.0;
+        if (!isCacheFresh(sourcePath, cachePath) || !Load(cachePath, image) || !IsSupported(image.BlockFormat))
+        {
+            int width, height, channels;
+            unsigned char *pixels = decode(width, height, channels);
+            if (!pixels)
+                return false;
+            Format format = ChooseFormat(pixels, width, height, channels, usage);
+            if (!IsSupported(format))
+                return false;
+            auto start = std::chrono::high_resolution_clock::now();
+            MipGenerator::Options mipOptions = MipOptions(usage);
+            mipOptions.ThreadCount = threadCount;
+            image = Cook(pixels, width, height, channels, format, mipOptions);
+            milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            cooked = true;
+            if (!Save(cachePath, image))
+                std::cout << "ERROR::TEXTURE_COOKER::CACHE_NOT_WRITTEN " << cachePath << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex());
+        Stats &total = stats();
+        if (cooked)
+        {
+            total.Cooked++;
+            total.CookMilliseconds += milliseconds;
+        }
+        else
+        {
+            total.Cached++;
+        }
+        int width = image.Width, height = image.Height;
+        for (const std::vector<uint8_t> &level : image.Levels)
+        {
+            total.CompressedBytes += level.size();
+            total.UncompressedBytes += (size_t)width * height * (image.BlockFormat == BC4 ? 1 : 4);
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+        return true;
+    }
+
+    static std::string CachePath(const std::string &path) { return path + ".dds"; }
+
+    // how the mips of a texture of that usage are filtered
+    static MipGenerator::Options MipOptions(Usage usage)
+    {
+        MipGenerator::Options options;
+        options.SRGB = usage == COLOR;
+        options.NormalMap = usage == NORMAL;
+        return options;
+    }
+
+    // the format for an image of 1 to 4 channels (stb_image's layout)
+    static Format ChooseFormat(const unsigned char *pixels, int width, int height, int channels, Usage usage)
+    {
+        if (usage == NORMAL)
+            return BC5;
+        if (channels == 1)
+            return BC4;
+        if (channels == 2 || channels == 4)
+        {
+            size_t count = (size_t)width * height;
+            for (size_t i = 0; i < count; i++)
+                if (pixels[i * channels + channels - 1] != 255)
+                    return IsSupported(BC7) ? BC7 : BC3;
+        }
+        return BC1;
+    }
+
+    // encodes the image and the mip chain MipGenerator makes of it with mipOptions, the rows of blocks are split
+    // over mipOptions.ThreadCount threads
+    static Image Cook(const unsigned char *pixels, int width, int height, int channels, Format format,
+                      const MipGenerator::Options &mipOptions = MipGenerator::Options())
+    {
+        Image image;
+        image.BlockFormat = format;
+        image.Width = width;
+        image.Height = height;
+
+        std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(pixels, width, height, channels, mipOptions);
+        image.Levels.push_back(encodeLevel(expand(pixels, width, height, channels), width, height, format, mipOptions.ThreadCount));
+        int levelWidth = width, levelHeight = height;
+        for (const std::vector<uint8_t> &mip : mips)
+        {
+            levelWidth = std::max(levelWidth / 2, 1);
+            levelHeight = std::max(levelHeight / 2, 1);
+            image.Levels.push_back(encodeLevel(expand(mip.data(), levelWidth, levelHeight, channels), levelWidth, levelHeight, format,
+                                               mipOptions.ThreadCount));
+        }
+        return image;
+    }
+
+    static bool Save(const std::string &path, const Image &image)
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        uint32_t header[1 + 31 + 5] = {};
+        header[0] = DDS_MAGIC;
+        header[1] = 124;
+        header[2] = 0xA1007;    // caps, height, width, pixel format, mip map count, linear size
+        header[3] = (uint32_t)image.Height;
+        header[4] = (uint32_t)image.Width;
+        header[5] = (uint32_t)image.Levels[0].size();
+        header[7] = (uint32_t)image.Levels.size();
+        header[8] = COOKER_VERSION;
+        header[19] = 32;
+        header[20] = 0x4;       // four cc
+        header[21] = DX10_FOURCC;
+        header[27] = 0x401008;  // complex, texture, mip map
+        header[32] = dxgiFormat(image.BlockFormat);
+        header[33] = 3;         // 2d texture
+        header[35] = 1;         // array size
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+        for (const std::vector<uint8_t> &level : image.Levels)
+            file.write(reinterpret_cast<const char *>(level.data()), level.size());
+        return (bool)file;
+    }
+
+    // reads a file written by Save, anything else (other formats, cubes, arrays, a cache of an older cooker) fails
+    static bool Load(const std::string &path, Image &image)
+    {
+        std::ifstream file(path, std::ios::binary);
+        uint32_t header[1 + 31 + 5];
+        if (!file || !file.read(reinterpret_cast<char *>(header), sizeof(header)))
+            return false;
+        if (header[0] != DDS_MAGIC || header[21] != DX10_FOURCC || header[8] != COOKER_VERSION || header[35] != 1)
+            return false;
+        bool known = false;
+        for (Format format : {BC1, BC3, BC4, BC5, BC7})
+            if (dxgiFormat(format) == header[32])
+            {
+                image.BlockFormat = format;
+                known = true;
+            }
+        if (!known)
+            return false;
+        // a corrupt header must not size the levels: the chain is always complete and no larger than a texture can be
+        if (header[4] == 0 || header[3] == 0 || header[4] > MAX_SIZE || header[3] > MAX_SIZE ||
+            header[7] != (uint32_t)MipGenerator::LevelCount((int)header[4], (int)header[3]))
+            return false;
+        image.Width = (int)header[4];
+        image.Height = (int)header[3];
+        image.Levels.resize(header[7]);
+        int width = image.Width, height = image.Height;
+        for (std::vector<uint8_t> &level : image.Levels)
+        {
+            level.resize(LevelBytes(image.BlockFormat, width, height));
+            if (!file.read(reinterpret_cast<char *>(level.data()), level.size()))
+                return false;
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+        return !image.Levels.empty();
+    }
+
+    // a new GL_TEXTURE_2D with all levels of the image, repeating and trilinear filtered. srgb samples BC1, BC3 and
+    // BC7 as sRGB (decoded to linear by the texture unit), the single and two channel formats have no sRGB variant
+    static unsigned int Upload(const Image &image, bool srgb = false)
+    {
+        unsigned int textureID;
+        glGenTextures(1, &textureID);
+        GLState::BindTexture(GL_TEXTURE_2D, textureID);
+        int width = image.Width, height = image.Height;
+        for (size_t level = 0; level < image.Levels.size(); level++)
+        {
+            glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)level, GLFormat(image.BlockFormat, srgb), width, height, 0,
+                                   (GLsizei)image.Levels[level].size(), image.Levels[level].data());
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)image.Levels.size() - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        return textureID;
+    }
+
+    // RGTC (BC4, BC5) is core since 3.0, S3TC (BC1, BC3) is an extension every desktop driver has, BPTC (BC7) is 4.2
+    static bool IsSupported(Format format)
+    {
+        switch (format)
+        {
+        case BC1:
+        case BC3:
+            return GLAD_GL_EXT_texture_compression_s3tc != 0;
+        case BC7:
+            return GLAD_GL_ARB_texture_compression_bptc != 0 || GLVersion.major > 4 ||
+                   (GLVersion.major == 4 && GLVersion.minor >= 2);
+        default:
+            return true;
+        }
+    }
+
+    static GLenum GLFormat(Format format, bool srgb = false)
+    {
+        switch (format)
+        {
+        case BC1: return srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BC3: return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BC4: return GL_COMPRESSED_RED_RGTC1;
+        case BC5: return GL_COMPRESSED_RG_RGTC2;
+        default:  return srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+        }
+    }
+
+    static size_t BlockBytes(Format format) { return format == BC1 || format == BC4 ? 8 : 16; }
+
+    static size_t LevelBytes(Format format, int width, int height)
+    {
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(format);
+    }
+
+    static Stats GetStats()
+    {
+        std::lock_guard<std::mutex> lock(statsMutex());
+        return stats();
+    }
+
+private:
+    static const uint32_t DDS_MAGIC = 0x20534444;      // "DDS "
+    static const uint32_t DX10_FOURCC = 0x30315844;    // "DX10"
+    // stored in the first reserved word of the header, caches of another version are cooked again
+    static const uint32_t COOKER_VERSION = 2;
+    // the largest width or height a cache may have, the largest texture size drivers commonly allow
+    static const uint32_t MAX_SIZE = 16384;
+    // rows of 4x4 blocks a thread encodes at least
+    static const int MIN_ROWS_PER_THREAD = 8;
+
+    static Stats &stats()
+    {
+        static Stats instance;
+        return instance;
+    }
+
+    static std::mutex &statsMutex()
+    {
+        static std::mutex instance;
+        return instance;
+    }
+
+    static uint32_t dxgiFormat(Format format)
+    {
+        switch (format)
+        {
+        case BC1: return 71;
+        case BC3: return 77;
+        case BC4: return 80;
+        case BC5: return 83;
+        default:  return 98;
+        }
+    }
+
+    static bool isCacheFresh(const std::string &sourcePath, const std::string &cachePath)
+    {
+        struct stat source, cache;
+        if (stat(cachePath.c_str(), &cache) != 0)
+            return false;
+        // without a source there is nothing to cook from, the cache is all there is
+        return stat(sourcePath.c_str(), &source) != 0 || source.st_mtime <= cache.st_mtime;
+    }
+
+    // RGBA8 of an image of 1 to 4 channels, grey and grey alpha images are spread to the color channels
+    static std::vector<uint8_t> expand(const unsigned char *pixels, int width, int height, int channels)
+    {
+        std::vector<uint8_t> level((size_t)width * height * 4);
+        for (size_t i = 0, count = (size_t)width * height; i < count; i++)
+        {
+            const unsigned char *source = pixels + i * channels;
+            uint8_t *texel = &level[i * 4];
+            texel[0] = source[0];
+            texel[1] = channels >= 3 ? source[1] : source[0];
+            texel[2] = channels >= 3 ? source[2] : source[0];
+            texel[3] = channels == 2 ? source[1] : channels == 4 ? source[3] : 255;
+        }
+        return level;
+    }
+
+    static std::vector<uint8_t> encodeLevel(const std::vector<uint8_t> &level, int width, int height, Format format,
+                                            unsigned int threadCount)
+    {
+        int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+        size_t blockBytes = BlockBytes(format);
+        std::vector<uint8_t> blocks((size_t)blocksX * blocksY * blockBytes);
+        forEachRow(blocksY, threadCount, [&](int first, int last) {
+            uint8_t texels[16 * 4];
+            for (int by = first; by < last; by++)
+                for (int bx = 0; bx < blocksX; bx++)
+                {
+                    // blocks over the edge repeat the last row and column
+                    for (int i = 0; i < 16; i++)
+                    {
+                        int x = std::min(bx * 4 + i % 4, width - 1), y = std::min(by * 4 + i / 4, height - 1);
+                        std::memcpy(texels + i * 4, &level[((size_t)y * width + x) * 4], 4);
+                    }
+                    uint8_t *block = &blocks[((size_t)by * blocksX + bx) * blockBytes];
+                    switch (format)
+                    {
+                    case BC1: encodeBC1(texels, block); break;
+                    case BC3: encodeBC4(texels, 3, block); encodeBC1(texels, block + 8); break;
+                    case BC4: encodeBC4(texels, 0, block); break;
+                    case BC5: encodeBC4(texels, 0, block); encodeBC4(texels, 1, block + 8); break;
+                    case BC7: encodeBC7(texels, block); break;
+                    }
+                }
+        });
+        return blocks;
+    }
+
+    static uint16_t to565(const int *color)
+    {
+        return (uint16_t)(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | ((color[2] * 31 + 127) / 255));
+    }
+
+    static void from565(uint16_t packed, int *color)
+    {
+        int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+        color[0] = (r << 3) | (r >> 2);
+        color[1] = (g << 2) | (g >> 4);
+        color[2] = (b << 3) | (b >> 2);
+    }
+
+    // the corners of the color bounding box, on the diagonal the colors spread along (signs of the red and blue
+    // covariance with green), inset by a sixteenth so the palette isn't stretched by outliers
+    static void encodeBC1(const uint8_t *texels, uint8_t *block)
+    {
+        int low[3] = {255, 255, 255}, high[3] = {0, 0, 0}, mean[3] = {0, 0, 0};
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 3; c++)
+            {
+                low[c] = std::min(low[c], (int)texels[i * 4 + c]);
+                high[c] = std::max(high[c], (int)texels[i * 4 + c]);
+                mean[c] += texels[i * 4 + c];
+            }
+        int redGreen = 0, blueGreen = 0;
+        for (int i = 0; i < 16; i++)
+        {
+            int green = texels[i * 4 + 1] * 16 - mean[1];
+            redGreen += (texels[i * 4] * 16 - mean[0]) * green;
+            blueGreen += (texels[i * 4 + 2] * 16 - mean[2]) * green;
+        }
+        if (redGreen < 0)
+            std::swap(low[0], high[0]);
+        if (blueGreen < 0)
+            std::swap(low[2], high[2]);
+        for (int c = 0; c < 3; c++)
+        {
+            int inset = (high[c] - low[c]) / 16;
+            high[c] -= inset;
+            low[c] += inset;
+        }
+
+        uint16_t color0 = to565(high), color1 = to565(low);
+        // four color mode needs color0 > color1, with equal endpoints every texel takes color0
+        if (color0 < color1)
+            std::swap(color0, color1);
+        uint32_t indices = 0;
+        if (color0 != color1)
+        {
+            int palette[4][3];
+            from565(color0, palette[0]);
+            from565(color1, palette[1]);
+            for (int c = 0; c < 3; c++)
+            {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            for (int i = 0; i < 16; i++)
+            {
+                int best = 0, bestError = INT32_MAX;
+                for (int p = 0; p < 4; p++)
+                {
+                    int error = 0;
+                    for (int c = 0; c < 3; c++)
+                    {
+                        int difference = texels[i * 4 + c] - palette[p][c];
+                        error += difference * difference;
+                    }
+                    if (error < bestError)
+                    {
+                        bestError = error;
+                        best = p;
+                    }
+                }
+                indices |= (uint32_t)best << (i * 2);
+            }
+        }
+        block[0] = (uint8_t)color0;
+        block[1] = (uint8_t)(color0 >> 8);
+        block[2] = (uint8_t)color1;
+        block[3] = (uint8_t)(color1 >> 8);
+        for (int i = 0; i < 4; i++)
+            block[4 + i] = (uint8_t)(indices >> (i * 8));
+    }
+
+    // one channel between its minimum and maximum in eight steps, endpoint 0 is the maximum
+    static void encodeBC4(const uint8_t *texels, int channel, uint8_t *block)
+    {
+        int high = 0, low = 255;
+        for (int i = 0; i < 16; i++)
+        {
+            high = std::max(high, (int)texels[i * 4 + channel]);
+            low = std::min(low, (int)texels[i * 4 + channel]);
+        }
+        uint64_t indices = 0;
+        int range = high - low;
+        if (range > 0)
+        {
+            for (int i = 0; i < 16; i++)
+            {
+                // the step from the minimum, mapped to the palette order: maximum, minimum, then downwards
+                int step = ((texels[i * 4 + channel] - low) * 7 + range / 2) / range;
+                uint64_t index = step == 7 ? 0 : step == 0 ? 1 : (uint64_t)(8 - step);
+                indices |= index << (i * 3);
+            }
+        }
+        block[0] = (uint8_t)high;
+        block[1] = (uint8_t)low;
+        for (int i = 0; i < 6; i++)
+            block[2 + i] = (uint8_t)(indices >> (i * 8));
+    }
+
+    struct BitWriter {
+        uint8_t *Block;
+        int Position;
+
+        void Write(uint32_t value, int count)
+        {
+            for (int i = 0; i < count; i++, Position++)
+                if (value & (1u << i))
+                    Block[Position / 8] |= (uint8_t)(1u << (Position % 8));
+        }
+    };
+
+    // mode 6: one subset, RGBA endpoints of 7 bits and a p-bit each, 16 weights. the endpoints are the extremes of
+    // the texels along their principal axis, the p-bit is whichever rounds the endpoint closer
+    static void encodeBC7(const uint8_t *texels, uint8_t *block)
+    {
+        static const int WEIGHTS[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+        float mean[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 4; c++)
+                mean[c] += texels[i * 4 + c] / 16.0f;
+        float covariance[4][4] = {};
+        for (int i = 0; i < 16; i++)
+            for (int a = 0; a < 4; a++)
+                for (int b = 0; b < 4; b++)
+                    covariance[a][b] += (texels[i * 4 + a] - mean[a]) * (texels[i * 4 + b] - mean[b]);
+        // a few power iterations are plenty to find the direction of the largest spread. they start at the channel
+        // that varies most: a fixed start can be orthogonal to the spread (half red, half green texels against the
+        // diagonal) and the block would come out flat
+        int widest = 0;
+        for (int c = 1; c < 4; c++)
+            if (covariance[c][c] > covariance[widest][widest])
+                widest = c;
+        float axis[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        axis[widest] = 1.0f;
+        for (int iteration = 0; iteration < 4; iteration++)
+        {
+            float next[4] = {0.0f, 0.0f, 0.0f, 0.0f}, length = 0.0f;
+            for (int a = 0; a < 4; a++)
+            {
+                for (int b = 0; b < 4; b++)
+                    next[a] += covariance[a][b] * axis[b];
+                length = std::max(length, std::abs(next[a]));
+            }
+            if (length == 0.0f)
+                break;
+            for (int a = 0; a < 4; a++)
+                axis[a] = next[a] / length;
+        }
+        float lowest = 0.0f, highest = 0.0f;
+        for (int i = 0; i < 16; i++)
+        {
+            float projection = 0.0f;
+            for (int c = 0; c < 4; c++)
+                projection += (texels[i * 4 + c] - mean[c]) * axis[c];
+            lowest = std::min(lowest, projection);
+            highest = std::max(highest, projection);
+        }
+        float lengthSquared = 0.0f;
+        for (int c = 0; c < 4; c++)
+            lengthSquared += axis[c] * axis[c];
+
+        int endpoints[2][4], pBits[2];
+        for (int e = 0; e < 2; e++)
+        {
+            float t = (e == 0 ? lowest : highest) / std::max(lengthSquared, 1e-8f);
+            float target[4];
+            for (int c = 0; c < 4; c++)
+                target[c] = std::min(std::max(mean[c] + axis[c] * t, 0.0f), 255.0f);
+            float bestError = 0.0f;
+            for (int p = 0; p < 2; p++)
+            {
+                int quantized[4];
+                float error = 0.0f;
+                for (int c = 0; c < 4; c++)
+                {
+                    quantized[c] = std::min(std::max((int)std::lround((target[c] - p) / 2.0f), 0), 127);
+                    float difference = (float)((quantized[c] << 1) | p) - target[c];
+                    error += difference * difference;
+                }
+                if (p == 0 || error < bestError)
+                {
+                    bestError = error;
+                    pBits[e] = p;
+                    std::copy(quantized, quantized + 4, endpoints[e]);
+                }
+            }
+        }
+
+        int palette[16][4];
+        for (int c = 0; c < 4; c++)
+        {
+            int first = (endpoints[0][c] << 1) | pBits[0], second = (endpoints[1][c] << 1) | pBits[1];
+            for (int w = 0; w < 16; w++)
+                palette[w][c] = ((64 - WEIGHTS[w]) * first + WEIGHTS[w] * second + 32) >> 6;
+        }
+        int indices[16];
+        for (int i = 0; i < 16; i++)
+        {
+            int bestError = INT32_MAX;
+            for (int w = 0; w < 16; w++)
+            {
+                int error = 0;
+                for (int c = 0; c < 4; c++)
+                {
+                    int difference = texels[i * 4 + c] - palette[w][c];
+                    error += difference * difference;
+                }
+                if (error < bestError)
+                {
+                    bestError = error;
+                    indices[i] = w;
+                }
+            }
+        }
+        // the first index is stored without its top bit, so it has to be in the lower half: swap the endpoints if not
+        if (indices[0] >= 8)
+        {
+            std::swap(endpoints[0], endpoints[1]);
+            std::swap(pBits[0], pBits[1]);
+            for (int i = 0; i < 16; i++)
+                indices[i] = 15 - indices[i];
+        }
+
+        std::memset(block, 0, 16);
+        BitWriter writer = {block, 0};
+        writer.Write(1u << 6, 7);
+        for (int c = 0; c < 4; c++)
+        {
+            writer.Write((uint32_t)endpoints[0][c], 7);
+            writer.Write((uint32_t)endpoints[1][c], 7);
+        }
+        writer.Write((uint32_t)pBits[0], 1);
+        writer.Write((uint32_t)pBits[1], 1);
+        writer.Write((uint32_t)indices[0], 3);
+        for (int i = 1; i < 16; i++)
+            writer.Write((uint32_t)indices[i], 4);
+    }
+
+    // calls function(first, last) for ranges of rows on up to threadCount threads (0: one per core)
+    template <typename Function>
+    static void forEachRow(int rows, unsigned int threadCount, const Function &function)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+        // a few rows of blocks don't pay for starting a thread
+        threadCount = std::min(threadCount, (unsigned int)std::max(rows / MIN_ROWS_PER_THREAD, 1));
+        int rowsPerThread = (rows + threadCount - 1) / threadCount;
+
+        std::vector<std::thread> workers;
+        for (unsigned int t = 1; t < threadCount; t++)
+        {
+            int first = t * rowsPerThread, last = std::min(first + rowsPerThread, rows);
+            if (first < last)
+                workers.emplace_back([&function, first, last]() { function(first, last); });
+        }
+        function(0, std::min(rowsPerThread, rows));
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+};
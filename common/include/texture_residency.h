@@ -0,0 +1,298 @@
+#pragma once
+
+#include "glm/glm.hpp"
+#include "mesh.h"
+#include "texture_streamer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+// keeps the streamed textures (texture_streamer.h) of a scene within a video memory budget: every frame the
+// textures of the frame's draws get the mip level their meshes need on screen, the levels above it are dropped
+// and streamed back in when a mesh comes closer.
+//
+// the level a draw needs is where a texel covers about a pixel: the mesh's texture coordinates per model unit
+// (measured once per mesh, from the areas of its triangles) times the texture size give texels per unit, the
+// LodSelector gives pixels per unit at the distance of the mesh's bounds. a texture takes the finest level any
+// of its draws needs. textures that aren't drawn need only a level of unseenSize texels, and levels that aren't
+// needed anymore stay for keepFrames frames first so looking away and back doesn't reload them.
+//
+// when the needed levels don't fit the budget every texture drops levels (a bias) until they do. drops are
+// issued before loads, and a load is only issued when the budget has room for it with what's resident now.
+//
+// it manages every texture the streamer loads from the moment its size is known, so it is made before the first
+// Request(): a new texture starts at the largest level that still fits the budget next to the resident ones.
+class TextureResidency {
+public:
+    struct Stats {
+        unsigned int Textures = 0;
+        // textures with levels dropped
+        unsigned int Reduced = 0;
+        // waiting for their levels to change
+        unsigned int Pending = 0;
+        size_t ResidentBytes = 0;
+        // what the textures would take at the levels their draws need
+        size_t NeededBytes = 0;
+        size_t BudgetBytes = 0;
+        // levels dropped from every texture to fit the budget
+        int Bias = 0;
+        // levels dropped and streamed back in, since the start
+        unsigned int Dropped = 0;
+        unsigned int Restored = 0;
+    };
+
+    explicit TextureResidency(TextureStreamer &streamer, size_t budgetBytes = 64 << 20, unsigned int keepFrames = 120,
+                              int unseenSize = 64, unsigned int changesPerFrame = 4)
+        : streamer(streamer), keepFrames(keepFrames), unseenSize(unseenSize), changesPerFrame(changesPerFrame)
+    {
+        stats.BudgetBytes = budgetBytes;
+        streamer.SetFirstLevelChooser([this](unsigned int texture, const TextureStreamer::TextureInfo &info) {
+            return addTexture(texture, info);
+        });
+    }
+
+    ~TextureResidency()
+    {
+        streamer.SetFirstLevelChooser(nullptr);
+    }
+
+    TextureResidency(const TextureResidency&) = delete;
+    TextureResidency& operator=(const TextureResidency&) = delete;
+
+    void SetBudget(size_t bytes) { stats.BudgetBytes = bytes; }
+
+    // leaves the levels of all textures as they are from now on, for when their storage must not change (bindless
+    // handles were made for them)
+    void Freeze() { frozen = true; }
+
+    // call once per frame with the draws, on the frames they bind their meshes' textures. it isn't called while
+    // the textures are sampled from somewhere else (copies in a material system's arrays), which aren't covered
+    // by the budget, and the levels stay as they are meanwhile
+    void Update(const std::vector<MeshDraw> &draws, const LodSelector &selector)
+    {
+        frame++;
+        if (frozen)
+            return;
+        for (Record &record : records)
+            record.Needed = -1;
+        for (const MeshDraw &draw : draws)
+        {
+            auto density = meshDensities.find(draw.mesh);
+            if (density == meshDensities.end())
+                density = meshDensities.emplace(draw.mesh, uvDensity(*draw.mesh)).first;
+            for (const Texture &texture : draw.mesh->textures)
+            {
+                auto found = textureIndices.find(texture.id);
+                if (found == textureIndices.end())
+                    continue;
+                Record &record = records[found->second];
+                const TextureStreamer::TextureInfo *info = streamer.GetInfo(record.Texture);
+                if (info->LevelBytes.empty())
+                    continue;
+                int level = neededLevel(*info, density->second, *draw.mesh, draw.model, selector);
+                record.Needed = record.Needed < 0 ? level : std::min(record.Needed, level);
+            }
+        }
+
+        // the levels to keep before the budget is applied
+        size_t neededBytes = 0;
+        for (Record &record : records)
+        {
+            const TextureStreamer::TextureInfo *info = streamer.GetInfo(record.Texture);
+            if (info->LevelBytes.empty())
+            {
+                record.Target = -1;
+                continue;
+            }
+            int needed = record.Needed >= 0 ? record.Needed : unseenLevel(*info);
+            neededBytes += bytesFrom(*info, needed);
+            if (needed <= info->FirstLevel)
+                record.LastNeeded = frame;
+            record.Target = needed < info->FirstLevel || frame - record.LastNeeded >= keepFrames ? needed : info->FirstLevel;
+        }
+        stats.NeededBytes = neededBytes;
+
+        stats.Bias = 0;
+        while (stats.Bias < 16 && targetBytes(stats.Bias) > stats.BudgetBytes)
+            stats.Bias++;
+
+        size_t residentBytes = 0;
+        std::vector<size_t> drops, loads;
+        stats.Reduced = 0;
+        stats.Pending = 0;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            const TextureStreamer::TextureInfo *info = streamer.GetInfo(records[i].Texture);
+            residentBytes += info->ResidentBytes();
+            if (info->FirstLevel > 0)
+                stats.Reduced++;
+            if (info->Busy)
+                stats.Pending++;
+            if (records[i].Target < 0 || info->Busy)
+                continue;
+            int target = biased(*info, records[i].Target, stats.Bias);
+            if (target > info->FirstLevel)
+                drops.push_back(i);
+            else if (target < info->FirstLevel)
+                loads.push_back(i);
+        }
+        stats.ResidentBytes = residentBytes;
+
+        // the textures missing the most levels are loaded first
+        std::sort(loads.begin(), loads.end(), [this](size_t a, size_t b) { return missingLevels(a) > missingLevels(b); });
+        unsigned int changes = 0;
+        for (size_t i : drops)
+        {
+            if (changes == changesPerFrame)
+                return;
+            const TextureStreamer::TextureInfo *info = streamer.GetInfo(records[i].Texture);
+            int firstLevel = info->FirstLevel;
+            int target = biased(*info, records[i].Target, stats.Bias);
+            if (streamer.SetFirstLevel(records[i].Texture, target))
+            {
+                stats.Dropped += target - firstLevel;
+                changes++;
+            }
+        }
+        for (size_t i : loads)
+        {
+            if (changes == changesPerFrame)
+                return;
+            const TextureStreamer::TextureInfo *info = streamer.GetInfo(records[i].Texture);
+            int firstLevel = info->FirstLevel;
+            int target = biased(*info, records[i].Target, stats.Bias);
+            size_t added = bytesFrom(*info, target) - info->ResidentBytes();
+            if (residentBytes + added > stats.BudgetBytes)
+                continue;
+            if (streamer.SetFirstLevel(records[i].Texture, target))
+            {
+                residentBytes += added;
+                stats.Restored += firstLevel - target;
+                changes++;
+            }
+        }
+    }
+
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Record {
+        unsigned int Texture = 0;
+        // the finest level a draw of this frame needs, -1 when none was drawn
+        int Needed = -1;
+        // the level to start at before the bias, -1 while the texture isn't loaded
+        int Target = -1;
+        // the last frame the texture needed its first level (or a finer one)
+        unsigned int LastNeeded = 0;
+    };
+
+    TextureStreamer &streamer;
+    bool frozen = false;
+    unsigned int keepFrames;
+    int unseenSize;
+    unsigned int changesPerFrame;
+    unsigned int frame = 0;
+    std::vector<Record> records;
+    std::unordered_map<unsigned int, size_t> textureIndices;
+    // texture coordinate units per model unit of each mesh
+    std::unordered_map<const Mesh *, float> meshDensities;
+    Stats stats;
+
+    // registers a texture the streamer has loaded and picks its first level: the largest that fits the budget
+    int addTexture(unsigned int texture, const TextureStreamer::TextureInfo &info)
+    {
+        size_t residentBytes = 0;
+        for (const Record &record : records)
+            residentBytes += streamer.GetInfo(record.Texture)->ResidentBytes();
+        int level = 0;
+        while (level + 1 < (int)info.LevelBytes.size() && residentBytes + bytesFrom(info, level) > stats.BudgetBytes)
+            level++;
+
+        textureIndices[texture] = records.size();
+        Record record;
+        record.Texture = texture;
+        record.LastNeeded = frame;
+        records.push_back(record);
+        stats.Textures = (unsigned int)records.size();
+        return level;
+    }
+
+    // the square root of texture coordinate area over surface area, 0 for meshes without texture coordinates
+    static float uvDensity(const Mesh &mesh)
+    {
+        double surfaceArea = 0.0, uvArea = 0.0;
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+        {
+            const Vertex &a = mesh.vertices[mesh.indices[i]];
+            const Vertex &b = mesh.vertices[mesh.indices[i + 1]];
+            const Vertex &c = mesh.vertices[mesh.indices[i + 2]];
+            surfaceArea += glm::length(glm::cross(b.Position - a.Position, c.Position - a.Position));
+            glm::vec2 u = b.TexCoords - a.TexCoords, v = c.TexCoords - a.TexCoords;
+            uvArea += std::abs(u.x * v.y - u.y * v.x);
+        }
+        return surfaceArea > 0.0 ? (float)std::sqrt(uvArea / surfaceArea) : 0.0f;
+    }
+
+    // the level whose texels are about as large as the pixels of the draw at the distance of its bounds
+    static int neededLevel(const TextureStreamer::TextureInfo &info, float density, const Mesh &mesh, const glm::mat4 &model,
+                           const LodSelector &selector)
+    {
+        int lastLevel = (int)info.LevelBytes.size() - 1;
+        if (density <= 0.0f)
+            return lastLevel;
+        // the largest axis scale and the nearest point of the bounds, so the level is never too coarse
+        float scale = std::max(std::max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1]))), glm::length(glm::vec3(model[2])));
+        glm::vec3 center = glm::vec3(model * glm::vec4(mesh.Bounds.Center(), 1.0f));
+        float radius = glm::length(mesh.Bounds.Extents()) * scale;
+        float distance = std::max(glm::length(center - selector.ViewPosition) - radius, 1e-3f);
+
+        // texels per unit over pixels per unit, every level halves it
+        float texelsPerUnit = density / scale * (float)std::max(info.Width, info.Height);
+        float texelsPerPixel = texelsPerUnit * distance / selector.PixelsPerUnit;
+        if (texelsPerPixel <= 1.0f)
+            return 0;
+        return std::min((int)std::floor(std::log2(texelsPerPixel)), lastLevel);
+    }
+
+    // the level of at most unseenSize texels on a side
+    int unseenLevel(const TextureStreamer::TextureInfo &info) const
+    {
+        int level = 0;
+        while (level + 1 < (int)info.LevelBytes.size() && std::max(info.Width, info.Height) >> level > unseenSize)
+            level++;
+        return level;
+    }
+
+    static int biased(const TextureStreamer::TextureInfo &info, int level, int bias)
+    {
+        return std::min(level + bias, (int)info.LevelBytes.size() - 1);
+    }
+
+    static size_t bytesFrom(const TextureStreamer::TextureInfo &info, int level)
+    {
+        size_t bytes = 0;
+        for (size_t i = level; i < info.LevelBytes.size(); i++)
+            bytes += info.LevelBytes[i];
+        return bytes;
+    }
+
+    // what all textures take at their targets with the bias
+    size_t targetBytes(int bias) const
+    {
+        size_t bytes = 0;
+        for (const Record &record : records)
+        {
+            const TextureStreamer::TextureInfo *info = streamer.GetInfo(record.Texture);
+            bytes += record.Target >= 0 ? bytesFrom(*info, biased(*info, record.Target, bias)) : info->ResidentBytes();
+        }
+        return bytes;
+    }
+
+    int missingLevels(size_t index) const
+    {
+        return streamer.GetInfo(records[index].Texture)->FirstLevel - records[index].Target;
+    }
+};
@@ -0,0 +1,638 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "gl_state.h"
+#include "texture_cooker.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// loads textures without stalling the frames it happens in. Request() hands out the texture right away (a grey
+// placeholder texel), worker threads load or cook it (texture_cooker.h) and Update() uploads its levels a few per
+// frame, smallest first: a texture gets sharper while it streams in, every texture gets its small levels before
+// any gets its large ones, and GL_TEXTURE_BASE_LEVEL always points at the largest level uploaded so far.
+//
+// the uploads go through a ring of pixel buffer objects, one per frame in flight, each with a fence: a frame fills
+// the next buffer only when the GPU has finished the copies out of it, otherwise it uploads nothing. the buffers
+// are mapped persistently with ARB_buffer_storage (4.4), mapped unsynchronized for each frame without it.
+// levels larger than a buffer are uploaded from client memory, alone in their frame.
+//
+// SetFirstLevel() loads a streamed texture again without its largest levels (or with them, to bring them back):
+// the texture's storage then starts at that level of the image, the levels above it take no video memory. the
+// reload goes through the same workers. dropping levels replaces the whole chain at once as soon as it is loaded,
+// bringing them back replaces it with storage for all levels and the ones the texture had, in one go, and streams
+// only the new larger levels into it like Request() does, so the texture never gets blurrier meanwhile. a
+// FirstLevelChooser picks the first level of newly requested textures once their sizes are known, so they can
+// start out without their largest levels too. texture_residency.h decides which levels a texture keeps.
+//
+// an image whose compressed format the driver can't sample (BC1 and BC3 without S3TC) is uploaded uncompressed
+// instead, with its MipGenerator chain and all levels in one go, as UploadTexture() does. such textures have no
+// LevelBytes, their levels can't be dropped.
+class TextureStreamer {
+public:
+    // fills pixels (stb_image's layout) and returns true, or returns false when the image can't be decoded. it runs
+    // on a worker thread, so it must not reference anything that may be gone by then (an assimp scene)
+    typedef std::function<bool(std::vector<unsigned char> &pixels, int &width, int &height, int &channels)> Decode;
+
+    struct Stats {
+        // waiting for or being loaded by a worker
+        unsigned int Loading = 0;
+        // loaded, levels left to upload
+        unsigned int Uploading = 0;
+        // all levels uploaded, and loads that failed (their placeholder stays), since the start
+        unsigned int Completed = 0;
+        unsigned int Failed = 0;
+        // of the last Update()
+        unsigned int LevelsUploaded = 0;
+        size_t BytesUploaded = 0;
+        // the next buffer of the ring was still in use, nothing was uploaded
+        bool Waited = false;
+        bool Persistent = false;
+    };
+
+    // what's known of a requested texture once its image is loaded
+    struct TextureInfo {
+        // of the full image, 0 until it is loaded
+        int Width = 0, Height = 0;
+        // bytes of each level of the full image, largest first. empty for textures uploaded uncompressed
+        std::vector<size_t> LevelBytes;
+        // the level of the image that is level 0 of the texture, the ones above it aren't resident
+        int FirstLevel = 0;
+        // a load or upload of the texture is in flight, FirstLevel is updated once it completes
+        bool Busy = true;
+
+        size_t ResidentBytes() const
+        {
+            size_t bytes = 0;
+            for (size_t i = FirstLevel; i < LevelBytes.size(); i++)
+                bytes += LevelBytes[i];
+            return bytes;
+        }
+    };
+
+    // the first level to upload of a requested texture, called on the thread of Update() once it is loaded
+    typedef std::function<int(unsigned int texture, const TextureInfo &info)> FirstLevelChooser;
+
+    // bufferBytes is the size of each buffer of the ring and so the upload budget of a frame
+    explicit TextureStreamer(size_t bufferBytes = 4 << 20, unsigned int bufferCount = 3, unsigned int workerCount = 2)
+        : bufferBytes(bufferBytes), buffers(bufferCount)
+    {
+        stats.Persistent = GLAD_GL_ARB_buffer_storage != 0;
+        for (Buffer &buffer : buffers)
+        {
+            glGenBuffers(1, &buffer.ID);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.ID);
+            if (stats.Persistent)
+            {
+                GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bufferBytes, nullptr, flags);
+                buffer.Mapped = static_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bufferBytes, flags));
+            }
+            else
+            {
+                glBufferData(GL_PIXEL_UNPACK_BUFFER, bufferBytes, nullptr, GL_STREAM_DRAW);
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        for (unsigned int i = 0; i < std::max(workerCount, 1u); i++)
+            workers.emplace_back(&TextureStreamer::workerLoop, this);
+    }
+
+    ~TextureStreamer()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+        for (Buffer &buffer : buffers)
+        {
+            if (buffer.Fence)
+                glDeleteSync(buffer.Fence);
+            if (buffer.Mapped)
+            {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.ID);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+            glDeleteBuffers(1, &buffer.ID);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    TextureStreamer(const TextureStreamer&) = delete;
+    TextureStreamer& operator=(const TextureStreamer&) = delete;
+
+    // a new texture, a placeholder until its levels arrive. the arguments are those of TextureCooker::LoadTexture
+    unsigned int Request(const std::string &sourcePath, const std::string &cachePath, TextureCooker::Usage usage, Decode decode,
+                         bool srgb = false)
+    {
+        unsigned int textureID;
+        glGenTextures(1, &textureID);
+        GLState::BindTexture(GL_TEXTURE_2D, textureID);
+        const uint8_t grey[4] = {128, 128, 128, 255};
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        Job job;
+        job.Texture = textureID;
+        job.SourcePath = sourcePath;
+        job.CachePath = cachePath;
+        job.Usage = usage;
+        job.SRGB = srgb;
+        job.DecodeImage = decode;
+        // what SetFirstLevel() reloads the texture from
+        Source &source = sources[textureID];
+        source.SourcePath = sourcePath;
+        source.CachePath = cachePath;
+        source.Usage = usage;
+        source.SRGB = srgb;
+        source.DecodeImage = std::move(decode);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return textureID;
+    }
+
+    // nullptr for textures that weren't requested here
+    const TextureInfo *GetInfo(unsigned int texture) const
+    {
+        auto found = sources.find(texture);
+        return found != sources.end() ? &found->second.Info : nullptr;
+    }
+
+    // nullptr uploads every texture from level 0
+    void SetFirstLevelChooser(FirstLevelChooser chooser) { chooseFirstLevel = std::move(chooser); }
+
+    // reloads a loaded texture so its storage starts at firstLevel of its image (clamped to the smallest level).
+    // false when nothing is to be done: the texture is unknown, not loaded yet, busy or already starts there
+    bool SetFirstLevel(unsigned int texture, int firstLevel)
+    {
+        auto found = sources.find(texture);
+        if (found == sources.end())
+            return false;
+        Source &source = found->second;
+        if (source.Info.Busy || source.Info.LevelBytes.empty())
+            return false;
+        firstLevel = std::max(std::min(firstLevel, (int)source.Info.LevelBytes.size() - 1), 0);
+        if (firstLevel == source.Info.FirstLevel)
+            return false;
+
+        Job job;
+        job.Texture = texture;
+        job.SourcePath = source.SourcePath;
+        job.CachePath = source.CachePath;
+        job.Usage = source.Usage;
+        job.SRGB = source.SRGB;
+        job.DecodeImage = source.DecodeImage;
+        job.FirstLevel = firstLevel;
+        job.Reload = true;
+        source.Info.Busy = true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(std::move(job));
+        }
+        wake.notify_one();
+        return true;
+    }
+
+    // call once per frame: takes the textures the workers finished and uploads as many levels as fit in the next
+    // buffer of the ring
+    void Update()
+    {
+        stats.LevelsUploaded = 0;
+        stats.BytesUploaded = 0;
+        stats.Waited = false;
+
+        std::vector<Job> finished;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.swap(completed);
+            stats.Loading = (unsigned int)requests.size() + busyWorkers;
+        }
+        for (Job &job : finished)
+        {
+            TextureInfo &info = sources[job.Texture].Info;
+            if (job.Image.Levels.empty() && !job.Pixels.empty())
+            {
+                uploadUncompressed(job);
+                info.Width = job.PixelWidth;
+                info.Height = job.PixelHeight;
+                info.Busy = false;
+                stats.Completed++;
+                continue;
+            }
+            if (job.Image.Levels.empty())
+            {
+                std::cout << "ERROR::TEXTURE_STREAMER::LOAD_FAILED " << job.SourcePath << std::endl;
+                stats.Failed++;
+                info.Busy = false;
+                continue;
+            }
+            info.Width = job.FullWidth;
+            info.Height = job.FullHeight;
+            info.LevelBytes.swap(job.FullLevelBytes);
+            if (!job.Reload)
+            {
+                // a new texture's storage is what it will have, account for it right away
+                if (chooseFirstLevel)
+                    job.FirstLevel = std::max(std::min(chooseFirstLevel(job.Texture, info), (int)job.Image.Levels.size() - 1), 0);
+                info.FirstLevel = job.FirstLevel;
+            }
+            job.FirstLevel = std::min(job.FirstLevel, (int)job.Image.Levels.size() - 1);
+            // the levels above the first one are never uploaded
+            job.Image.Levels.erase(job.Image.Levels.begin(), job.Image.Levels.begin() + job.FirstLevel);
+            job.Image.Width = std::max(job.Image.Width >> job.FirstLevel, 1);
+            job.Image.Height = std::max(job.Image.Height >> job.FirstLevel, 1);
+            // a shorter chain is at most a third of what the texture has now, uploading it in one go never blurs it
+            if (job.Reload && job.FirstLevel > info.FirstLevel)
+            {
+                replaceChain(job);
+                info.FirstLevel = job.FirstLevel;
+                info.Busy = false;
+                stats.Completed++;
+                continue;
+            }
+            job.NextLevel = (int)job.Image.Levels.size() - 1;
+            if (job.Reload)
+            {
+                restoreChain(job, info.FirstLevel - job.FirstLevel);
+                job.NextLevel = info.FirstLevel - job.FirstLevel - 1;
+            }
+            uploading.push_back(std::move(job));
+        }
+
+        if (!uploading.empty())
+        {
+            Buffer &buffer = buffers[nextBuffer];
+            if (buffer.Fence)
+            {
+                if (glClientWaitSync(buffer.Fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+                    stats.Waited = true;
+                else
+                {
+                    glDeleteSync(buffer.Fence);
+                    buffer.Fence = 0;
+                }
+            }
+            if (!stats.Waited)
+                uploadLevels(buffer);
+        }
+        stats.Uploading = (unsigned int)uploading.size();
+    }
+
+    // nothing is loading or waiting to be uploaded
+    bool IsIdle()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return requests.empty() && completed.empty() && busyWorkers == 0 && uploading.empty();
+    }
+
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Job {
+        unsigned int Texture = 0;
+        std::string SourcePath, CachePath;
+        TextureCooker::Usage Usage = TextureCooker::COLOR;
+        bool SRGB = false;
+        Decode DecodeImage;
+        // the level of the full image the texture starts at, Image holds it and the smaller ones once loaded
+        int FirstLevel = 0;
+        // from SetFirstLevel(), the texture has levels already
+        bool Reload = false;
+        // filled by the worker, no levels when the load failed
+        TextureCooker::Image Image;
+        int FullWidth = 0, FullHeight = 0;
+        std::vector<size_t> FullLevelBytes;
+        // the decoded image and its mips instead, when the driver can't sample the format it would be cooked to
+        std::vector<std::vector<uint8_t>> Pixels;
+        int PixelWidth = 0, PixelHeight = 0, PixelChannels = 0;
+        // the next level to upload, the smaller ones after it are resident
+        int NextLevel = 0;
+    };
+
+    struct Source {
+        std::string SourcePath, CachePath;
+        TextureCooker::Usage Usage = TextureCooker::COLOR;
+        bool SRGB = false;
+        Decode DecodeImage;
+        TextureInfo Info;
+    };
+
+    struct Buffer {
+        unsigned int ID = 0;
+        uint8_t *Mapped = nullptr;
+        GLsync Fence = 0;
+    };
+
+    struct Upload {
+        Job *Source;
+        int Level;
+        size_t Offset;
+    };
+
+    size_t bufferBytes;
+    std::vector<Buffer> buffers;
+    unsigned int nextBuffer = 0;
+    std::vector<Job> uploading;
+    std::unordered_map<unsigned int, Source> sources;
+    FirstLevelChooser chooseFirstLevel;
+    Stats stats;
+
+    // shared with the workers
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> requests;
+    std::vector<Job> completed;
+    unsigned int busyWorkers = 0;
+    bool stopping = false;
+
+    static glm::ivec2 levelSize(const TextureCooker::Image &image, int level)
+    {
+        return glm::ivec2(std::max(image.Width >> level, 1), std::max(image.Height >> level, 1));
+    }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !requests.empty(); });
+                if (stopping)
+                    return;
+                job = std::move(requests.front());
+                requests.pop_front();
+                busyWorkers++;
+            }
+
+            std::vector<unsigned char> pixels;
+            bool decoded = false;
+            auto decode = [&](int &width, int &height, int &channels) -> unsigned char * {
+                decoded = job.DecodeImage(pixels, width, height, channels);
+                job.PixelWidth = width;
+                job.PixelHeight = height;
+                job.PixelChannels = channels;
+                return decoded ? pixels.data() : nullptr;
+            };
+            // the workers already run side by side, cooking on more threads would only oversubscribe the cores
+            if (!TextureCooker::Prepare(job.SourcePath, job.CachePath, job.Usage, decode, job.Image, 1))
+            {
+                job.Image.Levels.clear();
+                // decoded but not cooked, the format isn't supported: the mips are made here, uploaded uncompressed
+                if (decoded)
+                {
+                    MipGenerator::Options mipOptions = TextureCooker::MipOptions(job.Usage);
+                    mipOptions.ThreadCount = 1;
+                    std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(pixels.data(), job.PixelWidth, job.PixelHeight,
+                                                                                    job.PixelChannels, mipOptions);
+                    pixels.resize((size_t)job.PixelWidth * job.PixelHeight * job.PixelChannels);
+                    job.Pixels.push_back(std::move(pixels));
+                    for (std::vector<uint8_t> &mip : mips)
+                        job.Pixels.push_back(std::move(mip));
+                }
+            }
+            job.DecodeImage = nullptr;
+            if (!job.Image.Levels.empty())
+            {
+                job.FullWidth = job.Image.Width;
+                job.FullHeight = job.Image.Height;
+                for (const std::vector<uint8_t> &level : job.Image.Levels)
+                    job.FullLevelBytes.push_back(level.size());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(std::move(job));
+            busyWorkers--;
+        }
+    }
+
+    // the smallest levels waiting, across all textures, as long as they fit into the buffer
+    void uploadLevels(Buffer &buffer)
+    {
+        std::vector<Upload> uploads;
+        size_t used = 0;
+        while (true)
+        {
+            Job *smallest = nullptr;
+            for (Job &job : uploading)
+            {
+                int level = nextLevel(job, uploads);
+                if (level < 0)
+                    continue;
+                if (!smallest || job.Image.Levels[level].size() < smallest->Image.Levels[nextLevel(*smallest, uploads)].size())
+                    smallest = &job;
+            }
+            if (!smallest)
+                break;
+            int level = nextLevel(*smallest, uploads);
+            size_t bytes = smallest->Image.Levels[level].size();
+            // offsets into the buffer are kept 16 byte aligned
+            size_t offset = (used + 15) & ~(size_t)15;
+            if (offset + bytes > bufferBytes)
+            {
+                if (uploads.empty() && bytes > bufferBytes)
+                    uploadDirect(*smallest, level);
+                break;
+            }
+            uploads.push_back({smallest, level, offset});
+            used = offset + bytes;
+        }
+        if (uploads.empty())
+        {
+            retireCompleted();
+            return;
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer.ID);
+        // the fence guarantees the GPU is done with the buffer, nothing to synchronize
+        uint8_t *mapped = buffer.Mapped ? buffer.Mapped
+                                        : static_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, used,
+                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+        if (!mapped)
+        {
+            std::cout << "ERROR::TEXTURE_STREAMER::MAP_FAILED" << std::endl;
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return;
+        }
+        for (const Upload &upload : uploads)
+        {
+            const std::vector<uint8_t> &level = upload.Source->Image.Levels[upload.Level];
+            std::memcpy(mapped + upload.Offset, level.data(), level.size());
+        }
+        // the contents of a buffer whose unmap fails are undefined, its levels are uploaded again next frame
+        if (!buffer.Mapped && glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return;
+        }
+        for (const Upload &upload : uploads)
+            uploadLevel(*upload.Source, upload.Level, reinterpret_cast<const void *>(upload.Offset), buffer.ID);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        buffer.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        nextBuffer = (nextBuffer + 1) % (unsigned int)buffers.size();
+        retireCompleted();
+    }
+
+    // the level of the job to upload after the ones already picked for this frame, -1 when all are picked
+    static int nextLevel(const Job &job, const std::vector<Upload> &uploads)
+    {
+        int level = job.NextLevel;
+        for (const Upload &upload : uploads)
+            if (upload.Source == &job)
+                level = std::min(level, upload.Level - 1);
+        return level;
+    }
+
+    void uploadDirect(Job &job, int level)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        uploadLevel(job, level, job.Image.Levels[level].data(), 0);
+        retireCompleted();
+    }
+
+    // data is an offset into pixelBuffer, which is bound, or client memory when pixelBuffer is 0
+    void uploadLevel(Job &job, int level, const void *data, unsigned int pixelBuffer)
+    {
+        const TextureCooker::Image &image = job.Image;
+        GLenum format = TextureCooker::GLFormat(image.BlockFormat, job.SRGB);
+        int levelCount = (int)image.Levels.size();
+        GLState::BindTexture(GL_TEXTURE_2D, job.Texture);
+        // the first level of a new texture to arrive replaces the placeholder with the storage of all levels, a reload
+        // has it from restoreChain()
+        if (level == levelCount - 1)
+        {
+            // with a pixel buffer bound a null pointer is an offset to copy from, not "allocate only"
+            if (pixelBuffer)
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            for (int i = 0; i < levelCount; i++)
+            {
+                glm::ivec2 size = levelSize(image, i);
+                glCompressedTexImage2D(GL_TEXTURE_2D, i, format, size.x, size.y, 0, (GLsizei)image.Levels[i].size(), nullptr);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+            if (pixelBuffer)
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        }
+        glm::ivec2 size = levelSize(image, level);
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, size.x, size.y, format, (GLsizei)image.Levels[level].size(), data);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        job.NextLevel = level - 1;
+        stats.LevelsUploaded++;
+        stats.BytesUploaded += image.Levels[level].size();
+    }
+
+    // the texture's storage and contents from the job's levels at once, from client memory
+    void replaceChain(Job &job)
+    {
+        const TextureCooker::Image &image = job.Image;
+        GLenum format = TextureCooker::GLFormat(image.BlockFormat, job.SRGB);
+        int levelCount = (int)image.Levels.size();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLState::BindTexture(GL_TEXTURE_2D, job.Texture);
+        for (int i = 0; i < levelCount; i++)
+        {
+            glm::ivec2 size = levelSize(image, i);
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, format, size.x, size.y, 0, (GLsizei)image.Levels[i].size(), image.Levels[i].data());
+            stats.LevelsUploaded++;
+            stats.BytesUploaded += image.Levels[i].size();
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    }
+
+    // the decoded image and its mips, all at once from client memory, as UploadTexture() does
+    void uploadUncompressed(Job &job)
+    {
+        GLenum format = GL_RGBA;
+        if (job.PixelChannels == 1)
+            format = GL_RED;
+        else if (job.PixelChannels == 2)
+            format = GL_RG;
+        else if (job.PixelChannels == 3)
+            format = GL_RGB;
+        GLenum internalFormat = format;
+        if (job.SRGB && job.PixelChannels >= 3)
+            internalFormat = job.PixelChannels == 3 ? GL_SRGB8 : GL_SRGB8_ALPHA8;
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLState::BindTexture(GL_TEXTURE_2D, job.Texture);
+        // rows of 1 to 3 channel images aren't 4 byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        int width = job.PixelWidth, height = job.PixelHeight;
+        for (size_t i = 0; i < job.Pixels.size(); i++)
+        {
+            glTexImage2D(GL_TEXTURE_2D, (GLint)i, internalFormat, width, height, 0, format, GL_UNSIGNED_BYTE, job.Pixels[i].data());
+            stats.LevelsUploaded++;
+            stats.BytesUploaded += job.Pixels[i].size();
+            width = std::max(width / 2, 1);
+            height = std::max(height / 2, 1);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)job.Pixels.size() - 1);
+    }
+
+    // the storage of all of the job's levels, with the contents of the ones from level on (the levels the texture
+    // had) at once from client memory. the larger ones stream in after
+    void restoreChain(Job &job, int level)
+    {
+        const TextureCooker::Image &image = job.Image;
+        GLenum format = TextureCooker::GLFormat(image.BlockFormat, job.SRGB);
+        int levelCount = (int)image.Levels.size();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLState::BindTexture(GL_TEXTURE_2D, job.Texture);
+        for (int i = 0; i < levelCount; i++)
+        {
+            glm::ivec2 size = levelSize(image, i);
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, format, size.x, size.y, 0, (GLsizei)image.Levels[i].size(),
+                                   i >= level ? image.Levels[i].data() : nullptr);
+            if (i >= level)
+            {
+                stats.LevelsUploaded++;
+                stats.BytesUploaded += image.Levels[i].size();
+            }
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    }
+
+    void retireCompleted()
+    {
+        size_t before = uploading.size();
+        for (const Job &job : uploading)
+        {
+            if (job.NextLevel >= 0)
+                continue;
+            TextureInfo &info = sources[job.Texture].Info;
+            info.FirstLevel = job.FirstLevel;
+            info.Busy = false;
+        }
+        uploading.erase(std::remove_if(uploading.begin(), uploading.end(), [](const Job &job) { return job.NextLevel < 0; }),
+                        uploading.end());
+        stats.Completed += (unsigned int)(before - uploading.size());
+    }
+};
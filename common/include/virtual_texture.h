@@ -0,0 +1,642 @@
+#pragma once
+
+#include <glad/glad.h>
+#include "glm/glm.hpp"
+#include "gl_state.h"
+#include "shader_s.h"
+#include "virtual_texture_file.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// the textures of a scene as one virtual texture, of which only the pages that are seen are resident, so the
+// textures can take more memory than the GPU has. the memory is fixed: a physical page cache (a GL_TEXTURE_2D of
+// physicalPages x physicalPages page slots) and an indirection table.
+//
+//   page file     the textures cut into pages once (virtual_texture_file.h), cooked again when a source changes
+//   feedback      the scene drawn at 1/feedbackDivisor of the resolution with virtual_texture_feedback.fs,
+//                 which writes the page (and level) every fragment samples. read back a few frames late through
+//                 pixel buffers, so the GPU never waits
+//   loading       the missing pages are read on a worker thread, coarse levels first, and uploaded at most
+//                 uploadsPerFrame per frame into the slot of the page that hasn't been seen for the longest time
+//   indirection   a mipmapped GL_RGBA8UI texture with one texel per virtual page of every level: the slot and the
+//                 level of the finest resident page covering it (see SampleVirtual in gbuffer.fs)
+//
+// the coarsest page of every texture is loaded by Build and never leaves, so every texture has some texels.
+// the page cache has no mips: the shader picks the nearest level and filters it bilinearly.
+class VirtualTexture {
+public:
+    static const int PAGE_SIZE = 128;
+    static const int PAGE_SHIFT = 7;
+    static const int BORDER = 4;
+    static const int SLOT_SIZE = PAGE_SIZE + 2 * BORDER;
+    // the feedback target has 8 bits per page coordinate
+    static const int VIRTUAL_PAGES = 256;
+    static const int VIRTUAL_LEVELS = 9;
+    static const int FEEDBACK_BUFFERS = 3;
+
+    // decodes a texture, only called when the page file is cooked (see StreamedTextureDecoder in model.h)
+    typedef std::function<bool(std::vector<unsigned char> &pixels, int &width, int &height, int &channels)> Decode;
+
+    struct Stats {
+        unsigned int Textures = 0;
+        unsigned int Resident = 0;
+        unsigned int Capacity = 0;
+        // pages sampled in the last feedback that was read back
+        unsigned int Requested = 0;
+        unsigned int Pending = 0;
+        unsigned int Uploaded = 0;
+        unsigned int Evicted = 0;
+        // loaded pages that found no slot: the view wants more pages than the cache holds
+        unsigned int Dropped = 0;
+        // page cache and indirection table
+        size_t Bytes = 0;
+        bool Cooked = false;
+    };
+
+    VirtualTexture(const std::string &pagePath, int physicalPages = 16, int feedbackDivisor = 8, unsigned int uploadsPerFrame = 16)
+        : pagePath(pagePath), physicalPages(physicalPages), feedbackDivisor(feedbackDivisor), uploadsPerFrame(uploadsPerFrame)
+    {
+    }
+
+    ~VirtualTexture()
+    {
+        if (worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+        if (!built)
+            return;
+        GLState::DeleteTextures(1, &pageTexture);
+        GLState::DeleteTextures(1, &indirection);
+        GLState::DeleteFramebuffers(1, &feedbackFBO);
+        glDeleteRenderbuffers(1, &feedbackColor);
+        glDeleteRenderbuffers(1, &feedbackDepth);
+        for (Readback &readback : readbacks)
+        {
+            if (readback.Fence)
+                glDeleteSync(readback.Fence);
+            glDeleteBuffers(1, &readback.Buffer);
+        }
+    }
+
+    VirtualTexture(const VirtualTexture&) = delete;
+    VirtualTexture& operator=(const VirtualTexture&) = delete;
+
+    // the texture registered under key, or -1
+    int Find(const std::string &key) const
+    {
+        auto found = textureIndices.find(key);
+        return found != textureIndices.end() ? found->second : -1;
+    }
+
+    // registers a texture before Build, textures with the same key are shared. sourcePath is the file the texture
+    // comes from (the model, for embedded ones): the page file is cooked again when it is newer
+    int AddTexture(const std::string &key, const std::string &sourcePath, Decode decode)
+    {
+        int index = Find(key);
+        if (index >= 0)
+            return index;
+        sources.push_back({key, std::move(decode)});
+        sourcePaths.push_back(sourcePath);
+        textureIndices[key] = (int)sources.size() - 1;
+        return (int)sources.size() - 1;
+    }
+
+    // opens the page file (cooking it first when it is missing or stale), creates the page cache and loads the
+    // coarsest page of every texture. called once after the last AddTexture
+    bool Build()
+    {
+        if (!isFresh())
+        {
+            file.Close();
+            std::cout << "cooking the virtual texture pages of " << sources.size() << " textures" << std::endl;
+            CookVirtualTexture(sources, pagePath, PAGE_SIZE, BORDER, VIRTUAL_PAGES);
+            stats.Cooked = true;
+            if (!file.Open(pagePath) || !matches())
+            {
+                std::cout << "ERROR::VIRTUAL_TEXTURE::INVALID_PAGE_FILE " << pagePath << std::endl;
+                return false;
+            }
+        }
+        // the images (embedded ones are copies) aren't needed anymore
+        sources.clear();
+        stats.Textures = (unsigned int)file.Regions.size();
+
+        owners.assign((size_t)VIRTUAL_PAGES * VIRTUAL_PAGES, -1);
+        for (size_t r = 0; r < file.Regions.size(); r++)
+        {
+            const VirtualTextureRegion &region = file.Regions[r];
+            if (region.LevelCount == 0)
+                continue;
+            for (uint32_t y = region.Y; y < region.Y + region.Pages; y++)
+                for (uint32_t x = region.X; x < region.X + region.Pages; x++)
+                    owners[(size_t)y * VIRTUAL_PAGES + x] = (int)r;
+        }
+
+        const int physicalSize = physicalPages * SLOT_SIZE;
+        glGenTextures(1, &pageTexture);
+        GLState::BindTexture(GL_TEXTURE_2D, pageTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, physicalSize, physicalSize, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        stats.Bytes = (size_t)physicalSize * physicalSize * 4;
+
+        // integer textures can't be filtered, they are read with texelFetch only
+        glGenTextures(1, &indirection);
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        indirectionData.resize(VIRTUAL_LEVELS);
+        slotOf.resize(VIRTUAL_LEVELS);
+        for (int level = 0; level < VIRTUAL_LEVELS; level++)
+        {
+            int size = VIRTUAL_PAGES >> level;
+            glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8UI, size, size, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+            indirectionData[level].assign((size_t)size * size * 4, 0);
+            slotOf[level].assign((size_t)size * size, -1);
+            stats.Bytes += (size_t)size * size * 4;
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, VIRTUAL_LEVELS - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        glGenFramebuffers(1, &feedbackFBO);
+        glGenRenderbuffers(1, &feedbackColor);
+        glGenRenderbuffers(1, &feedbackDepth);
+        for (Readback &readback : readbacks)
+            glGenBuffers(1, &readback.Buffer);
+
+        // the coarsest page of every texture is its fallback, loaded right away and never evicted
+        slots.resize((size_t)physicalPages * physicalPages);
+        stats.Capacity = (unsigned int)slots.size();
+        pinned.assign(file.Regions.size(), false);
+        Page page;
+        page.Texels.resize(file.PageBytes());
+        int slot = 0;
+        for (size_t r = 0; r < file.Regions.size(); r++)
+        {
+            const VirtualTextureRegion &region = file.Regions[r];
+            if (region.LevelCount == 0)
+                continue;
+            if (slot == (int)slots.size())
+            {
+                std::cout << "ERROR::VIRTUAL_TEXTURE::TOO_MANY_TEXTURES_FOR_THE_PAGE_CACHE" << std::endl;
+                break;
+            }
+            int root = (int)region.LevelCount - 1;
+            page.Key = makeKey(root, region.X >> root, region.Y >> root);
+            file.ReadPage((int)r, root, 0, 0, page.Texels.data());
+            upload(page, slot);
+            slots[slot++].Pinned = true;
+            pinned[r] = true;
+        }
+        updateIndirection();
+        built = true;
+
+        worker = std::thread(&VirtualTexture::workerLoop, this);
+        return true;
+    }
+
+    // renders the feedback of the draws between BeginFeedback and EndFeedback. width and height are the size
+    // of the framebuffer, restored as the viewport by EndFeedback
+    void BeginFeedback(Shader &shader, int width, int height)
+    {
+        viewportWidth = width;
+        viewportHeight = height;
+        int feedbackWidth = std::max(width / feedbackDivisor, 1), feedbackHeight = std::max(height / feedbackDivisor, 1);
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        if (feedbackWidth != feedbackSize.x || feedbackHeight != feedbackSize.y)
+        {
+            feedbackSize = glm::ivec2(feedbackWidth, feedbackHeight);
+            glBindRenderbuffer(GL_RENDERBUFFER, feedbackColor);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8UI, feedbackWidth, feedbackHeight);
+            glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedbackColor);
+            glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+                std::cout << "ERROR::VIRTUAL_TEXTURE::FEEDBACK_FRAMEBUFFER_INCOMPLETE" << std::endl;
+        }
+        GLState::Viewport(0, 0, feedbackWidth, feedbackHeight);
+        const GLuint nothing[4] = {0, 0, 0, 0};
+        glClearBufferuiv(GL_COLOR, 0, nothing);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        // the derivatives are feedbackDivisor times larger than at full resolution
+        shader.use();
+        shader.setFloat("virtualLevelBias", -std::log2((float)feedbackDivisor));
+    }
+
+    void EndFeedback()
+    {
+        // a buffer that is still waiting to be read skips this frame's feedback
+        Readback &readback = readbacks[nextReadback];
+        if (readback.Fence == 0)
+        {
+            size_t bytes = (size_t)feedbackSize.x * feedbackSize.y * 4;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.Buffer);
+            if (readback.Bytes != bytes)
+            {
+                glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+                readback.Bytes = bytes;
+            }
+            glReadPixels(0, 0, feedbackSize.x, feedbackSize.y, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            readback.Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            nextReadback = (nextReadback + 1) % FEEDBACK_BUFFERS;
+        }
+        GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+        GLState::Viewport(0, 0, viewportWidth, viewportHeight);
+    }
+
+    // call once per frame: reads back the feedback that is ready, asks the worker for the missing pages and
+    // uploads what it loaded
+    void Update()
+    {
+        if (!built)
+            return;
+        stats.Uploaded = 0;
+        stats.Evicted = 0;
+        stats.Dropped = 0;
+
+        // 1. the feedback the GPU has finished, oldest first
+        for (int i = 0; i < FEEDBACK_BUFFERS; i++)
+        {
+            Readback &readback = readbacks[(nextReadback + i) % FEEDBACK_BUFFERS];
+            if (readback.Fence == 0)
+                continue;
+            GLenum status = glClientWaitSync(readback.Fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(readback.Fence);
+            readback.Fence = 0;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.Buffer);
+            const uint8_t *texels = static_cast<const uint8_t *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, readback.Bytes, GL_MAP_READ_BIT));
+            if (texels)
+                processFeedback(texels, readback.Bytes / 4);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+
+        // 2. upload what the worker finished, evicting the page that hasn't been seen for the longest time
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Page &page : completed)
+                loaded.push_back(std::move(page));
+            completed.clear();
+        }
+        while (!loaded.empty() && stats.Uploaded < uploadsPerFrame)
+        {
+            Page page = std::move(loaded.front());
+            loaded.pop_front();
+            // the camera may have moved on while the page was loading
+            if (residentSlots.count(page.Key) || !std::binary_search(wanted.begin(), wanted.end(), page.Key))
+                continue;
+            int slot = findFreeSlot();
+            if (slot < 0)
+            {
+                stats.Dropped += 1 + (unsigned int)loaded.size();
+                loaded.clear();
+                break;
+            }
+            upload(page, slot);
+            slots[slot].LastWanted = frame;
+            stats.Uploaded++;
+        }
+        if (indirectionDirty)
+            updateIndirection();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.Resident = (unsigned int)residentSlots.size();
+        stats.Pending = (unsigned int)(requests.size() + loaded.size() + completed.size()) + (loading != NO_PAGE ? 1 : 0);
+    }
+
+    // binds the page cache and the indirection table for the VIRTUAL_TEXTURE permutation of gbuffer.fs and
+    // forward_lighting.fs
+    void Bind(Shader &shader, int firstUnit)
+    {
+        GLState::ActiveTexture(GL_TEXTURE0 + firstUnit);
+        GLState::BindTexture(GL_TEXTURE_2D, pageTexture);
+        GLState::ActiveTexture(GL_TEXTURE0 + firstUnit + 1);
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        GLState::ActiveTexture(GL_TEXTURE0);
+        shader.setInt("virtualPages", firstUnit);
+        shader.setInt("virtualIndirection", firstUnit + 1);
+    }
+
+    // selects the texture of the next draws (-1: none, sampled as white)
+    void SetRegion(Shader &shader, int texture)
+    {
+        if (texture < 0 || texture >= (int)file.Regions.size() || !pinned[texture])
+        {
+            shader.setFloat("virtualMaxLevel", -1.0f);
+            return;
+        }
+        const VirtualTextureRegion &region = file.Regions[texture];
+        shader.setVec4("virtualRegion", glm::vec4(region.X * PAGE_SIZE, region.Y * PAGE_SIZE, region.Width, region.Height));
+        shader.setFloat("virtualMaxLevel", (float)region.LevelCount - 1.0f);
+    }
+
+    std::string ShaderDefines() const
+    {
+        return "#define VIRTUAL_TEXTURE\n#define VT_PAGE_SHIFT " + std::to_string(PAGE_SHIFT) +
+               "\n#define VT_PAGE_SIZE " + std::to_string(PAGE_SIZE) + ".0\n#define VT_BORDER " + std::to_string(BORDER) +
+               ".0\n#define VT_SLOT_SIZE " + std::to_string(SLOT_SIZE) + ".0\n#define VT_PHYSICAL_SIZE " +
+               std::to_string(physicalPages * SLOT_SIZE) + ".0\n";
+    }
+
+    const Stats &GetStats() const { return stats; }
+
+private:
+    struct Page {
+        uint64_t Key = NO_PAGE;
+        std::vector<uint8_t> Texels;
+    };
+
+    struct Slot {
+        uint64_t Key = NO_PAGE;
+        uint64_t LastWanted = 0;
+        bool Pinned = false;
+    };
+
+    struct Readback {
+        unsigned int Buffer = 0;
+        size_t Bytes = 0;
+        GLsync Fence = 0;
+    };
+
+    static const uint64_t NO_PAGE = ~0ull;
+
+    std::string pagePath;
+    int physicalPages;
+    int feedbackDivisor;
+    unsigned int uploadsPerFrame;
+    std::vector<VirtualTextureSource> sources;
+    std::vector<std::string> sourcePaths;
+    std::map<std::string, int> textureIndices;
+    VirtualTextureFile file;
+    bool built = false;
+
+    // the region of every level-0 virtual page, -1 where there is none
+    std::vector<int> owners;
+    std::vector<bool> pinned;
+    unsigned int pageTexture = 0, indirection = 0;
+    std::vector<std::vector<uint8_t>> indirectionData;
+    // the slot of every virtual page on every level, -1 when it isn't resident
+    std::vector<std::vector<int>> slotOf;
+    bool indirectionDirty = true;
+
+    unsigned int feedbackFBO = 0, feedbackColor = 0, feedbackDepth = 0;
+    glm::ivec2 feedbackSize = glm::ivec2(0);
+    int viewportWidth = 0, viewportHeight = 0;
+    Readback readbacks[FEEDBACK_BUFFERS];
+    int nextReadback = 0;
+
+    std::vector<Slot> slots;
+    std::unordered_map<uint64_t, int> residentSlots;
+    // sorted, the pages of the last feedback and their coarser levels
+    std::vector<uint64_t> wanted;
+    std::deque<Page> loaded;
+    uint64_t frame = 0;
+    Stats stats;
+
+    // shared with the worker
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<uint64_t> requests;
+    std::vector<Page> completed;
+    uint64_t loading = NO_PAGE;
+    bool stopping = false;
+
+    static uint64_t makeKey(int level, int x, int y) { return ((uint64_t)level << 48) | ((uint64_t)y << 24) | (uint64_t)x; }
+    static int keyLevel(uint64_t key) { return (int)(key >> 48); }
+    static int keyX(uint64_t key) { return (int)(key & 0xFFFFFF); }
+    static int keyY(uint64_t key) { return (int)((key >> 24) & 0xFFFFFF); }
+
+    bool matches() const
+    {
+        const VirtualTextureHeader &header = file.Header;
+        std::vector<std::string> keys(textureIndices.size());
+        for (const std::pair<const std::string, int> &entry : textureIndices)
+            keys[entry.second] = entry.first;
+        return header.PageSize == PAGE_SIZE && header.Border == BORDER && header.VirtualPages == VIRTUAL_PAGES &&
+               header.SourceHash == VirtualTextureHash(keys);
+    }
+
+    // the page file exists, holds the same textures and is newer than all of their sources
+    bool isFresh()
+    {
+        struct stat pages, source;
+        if (stat(pagePath.c_str(), &pages) != 0 || !file.Open(pagePath) || !matches())
+            return false;
+        for (const std::string &path : sourcePaths)
+            if (stat(path.c_str(), &source) == 0 && source.st_mtime > pages.st_mtime)
+                return false;
+        return true;
+    }
+
+    // the region a page belongs to, -1 for pages outside every texture
+    int pageRegion(uint64_t key) const
+    {
+        int level = keyLevel(key), x = keyX(key), y = keyY(key);
+        if (level >= VIRTUAL_LEVELS || (x << level) >= VIRTUAL_PAGES || (y << level) >= VIRTUAL_PAGES)
+            return -1;
+        int r = owners[(size_t)(y << level) * VIRTUAL_PAGES + (x << level)];
+        if (r < 0 || level >= (int)file.Regions[r].LevelCount)
+            return -1;
+        const VirtualTextureRegion &region = file.Regions[r];
+        int pagesX, pagesY;
+        VirtualRegionPages(region, PAGE_SIZE, level, pagesX, pagesY);
+        if (x - (int)(region.X >> level) >= pagesX || y - (int)(region.Y >> level) >= pagesY)
+            return -1;
+        return r;
+    }
+
+    void processFeedback(const uint8_t *texels, size_t count)
+    {
+        frame++;
+        std::vector<uint64_t> seen;
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t *texel = texels + i * 4;
+            if (texel[3] != 0)
+                seen.push_back(makeKey(texel[2], texel[0], texel[1]));
+        }
+        std::sort(seen.begin(), seen.end());
+        seen.erase(std::unique(seen.begin(), seen.end()), seen.end());
+
+        // the coarser pages of a seen page are its fallback while it loads, they are wanted as well
+        wanted.clear();
+        stats.Requested = 0;
+        for (uint64_t key : seen)
+        {
+            int r = pageRegion(key);
+            if (r < 0)
+                continue;
+            stats.Requested++;
+            int level = keyLevel(key), x = keyX(key), y = keyY(key);
+            for (int coarser = level; coarser < (int)file.Regions[r].LevelCount; coarser++)
+                wanted.push_back(makeKey(coarser, x >> (coarser - level), y >> (coarser - level)));
+        }
+        std::sort(wanted.begin(), wanted.end());
+        wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+        std::vector<uint64_t> missing;
+        for (uint64_t key : wanted)
+        {
+            auto resident = residentSlots.find(key);
+            if (resident != residentSlots.end())
+                slots[resident->second].LastWanted = frame;
+            else
+                missing.push_back(key);
+        }
+        // coarse levels first (the level is in the top bits of the key), they matter most when pages are missing
+        std::sort(missing.rbegin(), missing.rend());
+
+        // pages loaded but not uploaded yet aren't read again
+        std::unordered_set<uint64_t> pending;
+        for (const Page &page : loaded)
+            pending.insert(page.Key);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const Page &page : completed)
+                pending.insert(page.Key);
+            requests.clear();
+            for (uint64_t key : missing)
+                if (key != loading && !pending.count(key))
+                    requests.push_back(key);
+        }
+        if (!missing.empty())
+            wake.notify_one();
+    }
+
+    void workerLoop()
+    {
+        while (true)
+        {
+            uint64_t key;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !requests.empty(); });
+                if (stopping)
+                    return;
+                key = requests.front();
+                requests.pop_front();
+                loading = key;
+            }
+
+            // touching the mapped pages here keeps the page faults (disk reads) off the render thread
+            int r = pageRegion(key), level = keyLevel(key);
+            if (r < 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                loading = NO_PAGE;
+                continue;
+            }
+            Page page;
+            page.Key = key;
+            page.Texels.resize(file.PageBytes());
+            const VirtualTextureRegion &region = file.Regions[r];
+            file.ReadPage(r, level, keyX(key) - (int)(region.X >> level), keyY(key) - (int)(region.Y >> level), page.Texels.data());
+
+            std::lock_guard<std::mutex> lock(mutex);
+            completed.push_back(std::move(page));
+            loading = NO_PAGE;
+        }
+    }
+
+    int findFreeSlot()
+    {
+        int oldest = -1;
+        for (int i = 0; i < (int)slots.size(); i++)
+        {
+            if (slots[i].Key == NO_PAGE)
+                return i;
+            if (slots[i].Pinned || slots[i].LastWanted == frame)
+                continue;
+            if (oldest < 0 || slots[i].LastWanted < slots[oldest].LastWanted)
+                oldest = i;
+        }
+        if (oldest >= 0)
+        {
+            uint64_t key = slots[oldest].Key;
+            residentSlots.erase(key);
+            slotOf[keyLevel(key)][(size_t)keyY(key) * (VIRTUAL_PAGES >> keyLevel(key)) + keyX(key)] = -1;
+            slots[oldest].Key = NO_PAGE;
+            indirectionDirty = true;
+            stats.Evicted++;
+        }
+        return oldest;
+    }
+
+    void upload(const Page &page, int slot)
+    {
+        GLState::BindTexture(GL_TEXTURE_2D, pageTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % physicalPages) * SLOT_SIZE, (slot / physicalPages) * SLOT_SIZE, SLOT_SIZE,
+                        SLOT_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, page.Texels.data());
+        int level = keyLevel(page.Key);
+        slots[slot].Key = page.Key;
+        residentSlots[page.Key] = slot;
+        slotOf[level][(size_t)keyY(page.Key) * (VIRTUAL_PAGES >> level) + keyX(page.Key)] = slot;
+        indirectionDirty = true;
+    }
+
+    // for every virtual page of every level, the finest resident page covering it: coarse levels first, a page
+    // that isn't resident takes the entry of the page above it
+    void updateIndirection()
+    {
+        GLState::BindTexture(GL_TEXTURE_2D, indirection);
+        for (int level = VIRTUAL_LEVELS - 1; level >= 0; level--)
+        {
+            const int size = VIRTUAL_PAGES >> level;
+            std::vector<uint8_t> &entries = indirectionData[level];
+            for (int y = 0; y < size; y++)
+            {
+                for (int x = 0; x < size; x++)
+                {
+                    uint8_t *entry = &entries[((size_t)y * size + x) * 4];
+                    int slot = slotOf[level][(size_t)y * size + x];
+                    if (slot >= 0)
+                    {
+                        entry[0] = (uint8_t)(slot % physicalPages);
+                        entry[1] = (uint8_t)(slot / physicalPages);
+                        entry[2] = (uint8_t)level;
+                        entry[3] = 255;
+                    }
+                    else if (level + 1 < VIRTUAL_LEVELS)
+                    {
+                        const uint8_t *parent = &indirectionData[level + 1][((size_t)(y / 2) * (size / 2) + x / 2) * 4];
+                        std::copy(parent, parent + 4, entry);
+                    }
+                    else
+                    {
+                        std::fill(entry, entry + 4, (uint8_t)0);
+                    }
+                }
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, size, size, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, entries.data());
+        }
+        indirectionDirty = false;
+    }
+};
@@ -0,0 +1,340 @@
+#pragma once
+
+#include "mip_generator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VIRTUAL_TEXTURE_USE_MMAP 1
+#endif
+
+// the page file of a virtual texture: many textures placed side by side in one large virtual texture, cut into
+// square pages of PageSize x PageSize RGBA8 texels. every page is stored with a border of Border texels from its
+// neighbours (the texture repeats), so the pages can be bilinear filtered on their own wherever they end up.
+//
+// a texture takes a square of Pages x Pages level-0 pages (a power of two, at a multiple of its size, so it stays
+// aligned on every level) and has mip levels down to the one where it fits a single page. a level-m page covers
+// 2^m x 2^m level-0 pages. only the pages the texture covers are stored, unused parts of the square are not.
+//
+// layout: VirtualTextureHeader, RegionCount x VirtualTextureRegion, then the pages of every region: level by
+// level, row by row.
+struct VirtualTextureHeader {
+    char Magic[4];
+    uint32_t Version;
+    uint32_t PageSize;
+    uint32_t Border;
+    // pages per side of the level-0 virtual texture
+    uint32_t VirtualPages;
+    uint32_t RegionCount;
+    // of the keys of the textures, in order: a file of another texture set is cooked again
+    uint64_t SourceHash;
+};
+
+struct VirtualTextureRegion {
+    // first level-0 page
+    uint32_t X, Y;
+    uint32_t Pages;
+    // 0 when the texture couldn't be decoded or didn't fit
+    uint32_t LevelCount;
+    // of the texture at level 0
+    uint32_t Width, Height;
+    // byte offset of the region's first page in the file
+    uint64_t Offset;
+};
+
+static const char VIRTUAL_TEXTURE_MAGIC[4] = {'V', 'T', 'E', 'X'};
+static const uint32_t VIRTUAL_TEXTURE_VERSION = 1;
+
+// the texture to cook: decode returns the pixels in stb_image's layout (1 to 4 channels), false when it can't
+struct VirtualTextureSource {
+    std::string Key;
+    std::function<bool(std::vector<unsigned char> &pixels, int &width, int &height, int &channels)> Decode;
+};
+
+inline uint64_t VirtualTextureHash(const std::vector<std::string> &keys)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (const std::string &key : keys)
+        for (size_t i = 0; i <= key.size(); i++)
+        {
+            hash ^= (unsigned char)key.c_str()[i];
+            hash *= 1099511628211ull;
+        }
+    return hash;
+}
+
+// pages of a region on a level
+inline void VirtualRegionPages(const VirtualTextureRegion &region, uint32_t pageSize, int level, int &pagesX, int &pagesY)
+{
+    pagesX = (int)((std::max(region.Width >> level, 1u) + pageSize - 1) / pageSize);
+    pagesY = (int)((std::max(region.Height >> level, 1u) + pageSize - 1) / pageSize);
+}
+
+// writes the page file of the textures, decoding them one after the other. the mips are filtered as sRGB color
+inline bool CookVirtualTexture(const std::vector<VirtualTextureSource> &sources, const std::string &path, int pageSize = 128,
+                               int border = 4, int virtualPages = 256)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cout << "ERROR::VIRTUAL_TEXTURE::COULD_NOT_WRITE " << path << std::endl;
+        return false;
+    }
+    std::vector<std::string> keys;
+    for (const VirtualTextureSource &source : sources)
+        keys.push_back(source.Key);
+    VirtualTextureHeader header;
+    std::memcpy(header.Magic, VIRTUAL_TEXTURE_MAGIC, 4);
+    header.Version = VIRTUAL_TEXTURE_VERSION;
+    header.PageSize = pageSize;
+    header.Border = border;
+    header.VirtualPages = virtualPages;
+    header.RegionCount = (uint32_t)sources.size();
+    header.SourceHash = VirtualTextureHash(keys);
+    std::vector<VirtualTextureRegion> regions(sources.size());
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)regions.data(), regions.size() * sizeof(VirtualTextureRegion));
+
+    const int slotSize = pageSize + 2 * border;
+    MipGenerator::Options mipOptions;
+    mipOptions.SRGB = true;
+    std::vector<uint8_t> page((size_t)slotSize * slotSize * 4);
+    uint64_t offset = sizeof(header) + regions.size() * sizeof(VirtualTextureRegion);
+    for (size_t r = 0; r < sources.size(); r++)
+    {
+        VirtualTextureRegion &region = regions[r];
+        region = VirtualTextureRegion();
+        std::vector<unsigned char> pixels;
+        int width, height, channels;
+        if (!sources[r].Decode(pixels, width, height, channels))
+            continue;
+
+        // everything is RGBA8 in the pages, grey and grey alpha images are spread to the color channels
+        std::vector<uint8_t> level((size_t)width * height * 4);
+        for (size_t i = 0, count = (size_t)width * height; i < count; i++)
+        {
+            const unsigned char *texel = &pixels[i * channels];
+            level[i * 4 + 0] = texel[0];
+            level[i * 4 + 1] = channels >= 3 ? texel[1] : texel[0];
+            level[i * 4 + 2] = channels >= 3 ? texel[2] : texel[0];
+            level[i * 4 + 3] = channels == 2 ? texel[1] : channels == 4 ? texel[3] : 255;
+        }
+        std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(level.data(), width, height, 4, mipOptions);
+
+        region.Width = width;
+        region.Height = height;
+        region.Pages = 1;
+        while ((int)region.Pages * pageSize < std::max(width, height))
+            region.Pages *= 2;
+        region.LevelCount = 1;
+        while ((1u << (region.LevelCount - 1)) < region.Pages)
+            region.LevelCount++;
+        region.Offset = offset;
+
+        for (int m = 0; m < (int)region.LevelCount; m++)
+        {
+            const std::vector<uint8_t> &image = m == 0 ? level : mips[m - 1];
+            int levelWidth = std::max(width >> m, 1), levelHeight = std::max(height >> m, 1);
+            int pagesX, pagesY;
+            VirtualRegionPages(region, pageSize, m, pagesX, pagesY);
+            for (int py = 0; py < pagesY; py++)
+            {
+                for (int px = 0; px < pagesX; px++)
+                {
+                    for (int y = 0; y < slotSize; y++)
+                    {
+                        int row = ((py * pageSize - border + y) % levelHeight + levelHeight) % levelHeight;
+                        for (int x = 0; x < slotSize; x++)
+                        {
+                            int column = ((px * pageSize - border + x) % levelWidth + levelWidth) % levelWidth;
+                            std::memcpy(&page[((size_t)y * slotSize + x) * 4], &image[((size_t)row * levelWidth + column) * 4], 4);
+                        }
+                    }
+                    file.write((const char*)page.data(), page.size());
+                    offset += page.size();
+                }
+            }
+        }
+    }
+
+    // the largest squares first, each at the next free place of the Z-order curve: every square then starts at a
+    // multiple of its size and none overlap
+    std::vector<size_t> order;
+    for (size_t r = 0; r < regions.size(); r++)
+        if (regions[r].LevelCount > 0)
+            order.push_back(r);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return regions[a].Pages > regions[b].Pages; });
+    uint64_t cursor = 0;
+    for (size_t r : order)
+    {
+        VirtualTextureRegion &region = regions[r];
+        uint64_t area = (uint64_t)region.Pages * region.Pages;
+        if (cursor + area > (uint64_t)virtualPages * virtualPages)
+        {
+            std::cout << "ERROR::VIRTUAL_TEXTURE::OUT_OF_VIRTUAL_SPACE " << sources[r].Key << std::endl;
+            region.LevelCount = 0;
+            continue;
+        }
+        region.X = region.Y = 0;
+        for (int bit = 0; bit < 16; bit++)
+        {
+            region.X |= (uint32_t)((cursor >> (2 * bit)) & 1) << bit;
+            region.Y |= (uint32_t)((cursor >> (2 * bit + 1)) & 1) << bit;
+        }
+        cursor += area;
+    }
+    file.seekp(sizeof(header));
+    file.write((const char*)regions.data(), regions.size() * sizeof(VirtualTextureRegion));
+    return (bool)file;
+}
+
+// read-only view of a page file. the file is memory mapped, so only the pages that are touched are paged in and
+// the textures can be larger than the available memory
+class VirtualTextureFile {
+public:
+    VirtualTextureHeader Header;
+    std::vector<VirtualTextureRegion> Regions;
+
+    VirtualTextureFile() = default;
+    VirtualTextureFile(const VirtualTextureFile&) = delete;
+    VirtualTextureFile& operator=(const VirtualTextureFile&) = delete;
+
+    ~VirtualTextureFile()
+    {
+        close();
+    }
+
+    bool Open(const std::string &path)
+    {
+        close();
+#if defined(VIRTUAL_TEXTURE_USE_MMAP)
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+            return false;
+        struct stat info;
+        if (fstat(descriptor, &info) != 0 || (size_t)info.st_size < sizeof(VirtualTextureHeader))
+        {
+            close();
+            return false;
+        }
+        size = (size_t)info.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        if (mapping == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        mapped = (const unsigned char*)mapping;
+        std::memcpy(&Header, mapped, sizeof(Header));
+#else
+        stream.open(path, std::ios::binary);
+        if (!stream || !stream.read((char*)&Header, sizeof(Header)))
+        {
+            close();
+            return false;
+        }
+#endif
+        if (std::memcmp(Header.Magic, VIRTUAL_TEXTURE_MAGIC, 4) != 0 || Header.Version != VIRTUAL_TEXTURE_VERSION)
+        {
+            close();
+            return false;
+        }
+        Regions.resize(Header.RegionCount);
+#if defined(VIRTUAL_TEXTURE_USE_MMAP)
+        if (sizeof(Header) + Regions.size() * sizeof(VirtualTextureRegion) > size)
+        {
+            close();
+            return false;
+        }
+        std::memcpy(Regions.data(), mapped + sizeof(Header), Regions.size() * sizeof(VirtualTextureRegion));
+#else
+        stream.read((char*)Regions.data(), Regions.size() * sizeof(VirtualTextureRegion));
+#endif
+        open = true;
+        return true;
+    }
+
+    bool IsOpen() const { return open; }
+
+    // unmaps the file, before it is cooked again
+    void Close()
+    {
+        close();
+    }
+
+    size_t PageBytes() const
+    {
+        size_t slotSize = Header.PageSize + 2 * Header.Border;
+        return slotSize * slotSize * 4;
+    }
+
+    // copies the texels of a page (x, y counted from the region's first page on that level), safe to call from
+    // another thread than the one that opened the file
+    void ReadPage(int region, int level, int x, int y, uint8_t *texels)
+    {
+        const VirtualTextureRegion &info = Regions[region];
+        uint64_t index = 0;
+        int pagesX, pagesY;
+        for (int m = 0; m < level; m++)
+        {
+            VirtualRegionPages(info, Header.PageSize, m, pagesX, pagesY);
+            index += (uint64_t)pagesX * pagesY;
+        }
+        VirtualRegionPages(info, Header.PageSize, level, pagesX, pagesY);
+        index += (uint64_t)y * pagesX + x;
+        uint64_t offset = info.Offset + index * PageBytes();
+#if defined(VIRTUAL_TEXTURE_USE_MMAP)
+        // a truncated file reads as black instead of faulting
+        if (offset + PageBytes() > size)
+            std::memset(texels, 0, PageBytes());
+        else
+            std::memcpy(texels, mapped + offset, PageBytes());
+#else
+        std::lock_guard<std::mutex> lock(streamMutex);
+        stream.seekg(offset);
+        stream.read((char*)texels, PageBytes());
+#endif
+    }
+
+private:
+    bool open = false;
+#if defined(VIRTUAL_TEXTURE_USE_MMAP)
+    int descriptor = -1;
+    const unsigned char *mapped = nullptr;
+    size_t size = 0;
+#else
+    std::ifstream stream;
+    std::mutex streamMutex;
+#endif
+
+    void close()
+    {
+        open = false;
+        Regions.clear();
+#if defined(VIRTUAL_TEXTURE_USE_MMAP)
+        if (mapped)
+            munmap((void*)mapped, size);
+        if (descriptor >= 0)
+            ::close(descriptor);
+        mapped = nullptr;
+        descriptor = -1;
+        size = 0;
+#else
+        if (stream.is_open())
+            stream.close();
+#endif
+    }
+};
@@ -3,9 +3,14 @@
 out vec4 FragColor;
 
 in float Height;
+in vec3 Normal;
+
+const vec3 lightDirection = normalize(vec3(0.3, 1.0, 0.5));
 
 void main()
 {
     float h = (Height + 16)/32.0f;	// shift and scale the height into a grayscale value
+    float diffuse = max(dot(normalize(Normal), lightDirection), 0.0);
+    h *= 0.3 + 0.7 * diffuse;
     FragColor = vec4(h, h, h, 1.0);
-}
\ No newline at end of file
+}
@@ -1,8 +1,10 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
 
 out float Height;
 out vec3 Position;
+out vec3 Normal;
 
 uniform mat4 model;
 uniform mat4 view;
@@ -12,5 +14,6 @@ void main()
 {
     Height = aPos.y;
     Position = (view * model * vec4(aPos, 1.0)).xyz;
+    Normal = mat3(model) * aNormal;
     gl_Position = projection * view * model * vec4(aPos, 1.0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,27 @@
+#version 330 core
+// keep MAX_CASCADES in sync with cascaded_shadow_map.h
+#define MAX_CASCADES 8
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 24) out;
+
+uniform mat4 lightSpaceMatrices[MAX_CASCADES];
+uniform int cascadeCount;
+// cascades this draw goes to (bit i = cascade i), see CascadedShadowMap::CasterMask
+uniform int layerMask;
+
+// one pass for all cascades: every triangle is sent to each wanted layer of the depth array
+void main() {
+    for (int layer = 0; layer < cascadeCount; layer++)
+    {
+        if ((layerMask & (1 << layer)) == 0)
+            continue;
+        for (int i = 0; i < 3; i++)
+        {
+            gl_Position = lightSpaceMatrices[layer] * gl_in[i].gl_Position;
+            gl_Layer = layer;
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
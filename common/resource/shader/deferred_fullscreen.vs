@@ -0,0 +1,6 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+
+void main () {
+    gl_Position = vec4(aPos.xy, 0.0, 1.0);
+}
@@ -0,0 +1,65 @@
+#version 330 core
+// lighting passes of deferred shading: the directional light and ambient as one fullscreen pass, and with
+// POINT_LIGHT defined the light volumes (deferred_volume.vs), added up by blending
+out vec4 FragColor;
+
+#ifdef POINT_LIGHT
+flat in vec4 LightPositionRadius;
+flat in vec4 LightColorQuadratic;
+#endif
+
+uniform sampler2D gAlbedoSpec;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform vec2 viewportSize;
+uniform mat4 inverseProjection;
+
+// view space direction towards the directional light
+uniform vec3 lightDirection;
+uniform vec3 lightColor;
+uniform vec3 ambientColor;
+uniform float shininess;
+
+vec3 DecodeNormal(vec2 encoded) {
+    vec2 f = encoded * 2.0 - 1.0;
+    vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
+// blinn-phong of one light of the given color, lightDir towards the light
+vec3 Shade(vec3 albedo, float specular, vec3 normal, vec3 viewDir, vec3 lightDir, vec3 color) {
+    float diff = max(dot(normal, lightDir), 0.0);
+    float spec = pow(max(dot(normal, normalize(lightDir + viewDir)), 0.0), shininess);
+    return color * (diff * albedo + spec * specular);
+}
+
+void main () {
+    vec2 uv = gl_FragCoord.xy / viewportSize;
+    float depth = texture(gDepth, uv).r;
+#ifndef POINT_LIGHT
+    // nothing was drawn here, keep the clear color
+    if (depth == 1.0)
+        discard;
+#endif
+    // the view space position back from the depth: undo the viewport transform, then the projection
+    vec4 position = inverseProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    vec3 fragPos = position.xyz / position.w;
+    vec4 albedoSpec = texture(gAlbedoSpec, uv);
+    vec3 normal = DecodeNormal(texture(gNormal, uv).xy);
+    vec3 viewDir = normalize(-fragPos);
+
+#ifdef POINT_LIGHT
+    vec3 toLight = LightPositionRadius.xyz - fragPos;
+    float distance = length(toLight);
+    if (distance >= LightPositionRadius.w)
+        discard;
+    float fade = clamp(1.0 - pow(distance / LightPositionRadius.w, 4.0), 0.0, 1.0);
+    float attenuation = fade * fade / (1.0 + LightColorQuadratic.w * distance * distance);
+    vec3 result = Shade(albedoSpec.rgb, albedoSpec.a, normal, viewDir, toLight / distance, LightColorQuadratic.rgb * attenuation);
+#else
+    vec3 result = ambientColor * albedoSpec.rgb + Shade(albedoSpec.rgb, albedoSpec.a, normal, viewDir, normalize(lightDirection), lightColor);
+#endif
+    FragColor = vec4(result, 1.0);
+}
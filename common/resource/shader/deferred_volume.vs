@@ -0,0 +1,17 @@
+#version 330 core
+// a sphere around a point light, one instance per light
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec4 aPositionRadius;
+layout (location = 2) in vec4 aColorQuadratic;
+
+flat out vec4 LightPositionRadius;   // view space position
+flat out vec4 LightColorQuadratic;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main () {
+    LightPositionRadius = vec4((view * vec4(aPositionRadius.xyz, 1.0)).xyz, aPositionRadius.w);
+    LightColorQuadratic = aColorQuadratic;
+    gl_Position = projection * vec4(LightPositionRadius.xyz + aPos * aPositionRadius.w, 1.0);
+}
@@ -0,0 +1,14 @@
+#version 330 core
+// depth prepass: positions only. gl_Position must come out bit for bit the same as in the shading pass that
+// follows with GL_EQUAL, so the expression matches obj.vs and lit_model.vs exactly and both are invariant
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+invariant gl_Position;
+
+void main () {
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+}
@@ -0,0 +1,100 @@
+#version 330 core
+// geometry pass of deferred shading, see gbuffer.h for the layout
+#ifdef MATERIAL_BINDLESS
+#extension GL_ARB_bindless_texture : require
+#endif
+layout (location = 0) out vec4 gAlbedoSpec;
+layout (location = 1) out vec2 gNormal;
+
+in vec2 TexCoords;
+in vec3 FragPos;
+in vec3 Normal;
+
+#ifdef MATERIAL_SYSTEM
+// the textures come from material_system.h: the material materialIndex holds where they are
+struct Material {
+    ivec4 Slots;    // diffuse array and layer, specular array and layer
+    uvec4 Handles;  // bindless handles of the diffuse and specular texture
+};
+layout (std140) uniform Materials {
+    Material materials[MAX_MATERIALS];
+};
+uniform int materialIndex;
+#ifndef MATERIAL_BINDLESS
+uniform sampler2DArray materialArrays[MATERIAL_ARRAYS];
+#endif
+
+vec4 SampleMaterial(ivec2 slot, uvec2 handle, vec2 uv) {
+    // no texture, or one that found no array
+    if (slot.x < 0)
+        return vec4(1.0);
+#ifdef MATERIAL_BINDLESS
+    return texture(sampler2D(handle), uv);
+#else
+    // sampler arrays only take constant indices before GLSL 4.00, one branch per array (MaterialSystem::MAX_ARRAYS).
+    // the slot is the same for the whole draw, so the branches don't diverge
+    vec3 coord = vec3(uv, float(slot.y));
+    if (slot.x == 0)
+        return texture(materialArrays[0], coord);
+    if (slot.x == 1)
+        return texture(materialArrays[1], coord);
+    if (slot.x == 2)
+        return texture(materialArrays[2], coord);
+    return texture(materialArrays[3], coord);
+#endif
+}
+#elif defined(VIRTUAL_TEXTURE)
+// the diffuse texture comes from virtual_texture.h: the indirection table holds where the page of the wanted level
+// is in the page cache, or the finest resident page above it while it is loading
+uniform usampler2D virtualIndirection;
+uniform sampler2D virtualPages;
+// first texel and size of the draw's texture, in level-0 virtual texels
+uniform vec4 virtualRegion;
+// -1: the draw has no texture
+uniform float virtualMaxLevel;
+
+vec4 SampleVirtual(vec2 uv) {
+    if (virtualMaxLevel < 0.0)
+        return vec4(1.0);
+    // the level from the unwrapped coordinates, fract() below jumps where the texture repeats
+    vec2 texels = uv * virtualRegion.zw;
+    vec2 dx = dFdx(texels), dy = dFdy(texels);
+    float level = clamp(floor(0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + 0.5), 0.0, virtualMaxLevel);
+    vec2 position = virtualRegion.xy + fract(uv) * virtualRegion.zw;
+    int wanted = int(level);
+    uvec4 entry = texelFetch(virtualIndirection, ivec2(position) >> (VT_PAGE_SHIFT + wanted), wanted);
+    // the position on the level of the resident page, relative to that page
+    vec2 inPage = position / float(1 << int(entry.z));
+    inPage -= floor(inPage / VT_PAGE_SIZE) * VT_PAGE_SIZE;
+    vec2 physical = vec2(entry.xy) * VT_SLOT_SIZE + VT_BORDER + inPage;
+    return textureLod(virtualPages, physical / VT_PHYSICAL_SIZE, 0.0);
+}
+#else
+uniform sampler2D texture_diffuse1;
+#endif
+uniform float specularStrength;
+
+// octahedral encoding: the unit sphere is projected onto the octahedron |x| + |y| + |z| = 1 and the lower half
+// is folded over the upper one, two numbers keep the normal to about 0.01 degrees at 16 bits
+vec2 OctWrap(vec2 v) {
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 EncodeNormal(vec3 n) {
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    n.xy = n.z >= 0.0 ? n.xy : OctWrap(n.xy);
+    return n.xy * 0.5 + 0.5;
+}
+
+void main () {
+#ifdef MATERIAL_SYSTEM
+    Material material = materials[materialIndex];
+    vec3 albedo = SampleMaterial(material.Slots.xy, material.Handles.xy, TexCoords).rgb;
+#elif defined(VIRTUAL_TEXTURE)
+    vec3 albedo = SampleVirtual(TexCoords).rgb;
+#else
+    vec3 albedo = texture(texture_diffuse1, TexCoords).rgb;
+#endif
+    gAlbedoSpec = vec4(albedo, specularStrength);
+    gNormal = EncodeNormal(normalize(Normal));
+}
@@ -1,6 +1,8 @@
 #version 330 core
 out vec4 FragColor;
 
+in vec3 LampColor;
+
 void main(){
-    FragColor = vec4(1.0);
+    FragColor = vec4(LampColor, 1.0);
 }
\ No newline at end of file
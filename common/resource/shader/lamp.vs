@@ -1,10 +1,16 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 
-uniform mat4 model;
+out vec3 LampColor;
+
 uniform mat4 view;
 uniform mat4 projection;
+uniform float lampSize;
+// the light texels of obj.fs, one lamp per instance
+uniform samplerBuffer lights;
 
 void main () {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    vec3 position = texelFetch(lights, gl_InstanceID * 2).xyz;
+    LampColor = texelFetch(lights, gl_InstanceID * 2 + 1).rgb;
+    gl_Position = projection * view * vec4(position + aPos * lampSize, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+
+out vec2 TexCoords;
+// view space, the lighting of forward_lighting.fs and deferred_lighting.fs happens in view space
+out vec3 FragPos;
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// the same position as depth_prepass.vs, so the shading pass can test with GL_EQUAL
+invariant gl_Position;
+
+void main () {
+    TexCoords = aTexCoords;
+    vec4 viewPos = view * model * vec4(aPos, 1.0);
+    FragPos = viewPos.xyz;
+    Normal = mat3(transpose(inverse(view * model))) * aNormal;
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+}
@@ -15,18 +15,6 @@ struct DirLight {
     vec3 specular;
 };
 
-struct PointLight {
-    vec3 position;
-
-    float constant;
-    float linear;
-    float quadratic;
-
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
-};
-
 struct SpotLight {
     vec3 position;
     vec3 direction;
@@ -42,21 +30,33 @@ struct SpotLight {
     vec3 specular;
 };
 
-#define NR_POINT_LIGHTS 4
+// keep in sync with clustered_lights.h
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
 
 in vec3 FragPos;
 in vec3 Normal;
 in vec2 TexCoords;
+in float ViewDepth;
 
 uniform vec3 viewPos;
 uniform DirLight dirLight;
-uniform PointLight pointLights[NR_POINT_LIGHTS];
+// point lights, two texels each: position and radius, color and quadratic attenuation
+uniform samplerBuffer lights;
+// per cluster the offset of its first light in lightIndices and the number of its lights
+uniform usamplerBuffer lightGrid;
+uniform usamplerBuffer lightIndices;
+uniform vec2 viewportSize;
+// depth slice of a fragment = log(ViewDepth / clusterNear) * clusterSliceScale
+uniform float clusterNear;
+uniform float clusterSliceScale;
 uniform SpotLight spotLight;
 uniform Material material;
 
 // function prototypes
 vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir);
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir);
+vec3 CalcPointLight(int index, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColor, vec3 specularColor);
 vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir);
 
 void main()
@@ -73,9 +73,15 @@ void main()
     // == =====================================================
     // phase 1: directional lighting
     vec3 result = CalcDirLight(dirLight, norm, viewDir);
-    // phase 2: point lights
-    for(int i = 0; i < NR_POINT_LIGHTS; i++)
-        result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);
+    // phase 2: point lights, only those listed in the cluster of this fragment
+    ivec2 tile = ivec2(gl_FragCoord.xy / viewportSize * vec2(CLUSTERS_X, CLUSTERS_Y));
+    int slice = int(floor(log(ViewDepth / clusterNear) * clusterSliceScale));
+    int cluster = (clamp(slice, 0, CLUSTERS_Z - 1) * CLUSTERS_Y + clamp(tile.y, 0, CLUSTERS_Y - 1)) * CLUSTERS_X + clamp(tile.x, 0, CLUSTERS_X - 1);
+    uvec2 range = texelFetch(lightGrid, cluster).xy;
+    vec3 diffuseColor = vec3(texture(material.diffuse, TexCoords));
+    vec3 specularColor = vec3(texture(material.specular, TexCoords));
+    for(uint i = 0u; i < range.y; i++)
+        result += CalcPointLight(int(texelFetch(lightIndices, int(range.x + i)).r), norm, FragPos, viewDir, diffuseColor, specularColor);
     // phase 3: spot light
     result += CalcSpotLight(spotLight, norm, FragPos, viewDir);
 
@@ -99,25 +105,24 @@ vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
 }
 
 // calculates the color when using a point light.
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
+vec3 CalcPointLight(int index, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColor, vec3 specularColor)
 {
-    vec3 lightDir = normalize(light.position - fragPos);
+    vec4 positionRadius = texelFetch(lights, index * 2);
+    vec4 colorQuadratic = texelFetch(lights, index * 2 + 1);
+    float distance = length(positionRadius.xyz - fragPos);
+    if (distance >= positionRadius.w)
+        return vec3(0.0);
+    vec3 lightDir = (positionRadius.xyz - fragPos) / distance;
     // diffuse shading
     float diff = max(dot(normal, lightDir), 0.0);
     // specular shading
     vec3 reflectDir = reflect(-lightDir, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
-    // attenuation
-    float distance = length(light.position - fragPos);
-    float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+    // attenuation, faded to reach zero at the radius where the clusters stop listing the light
+    float fade = clamp(1.0 - pow(distance / positionRadius.w, 4.0), 0.0, 1.0);
+    float attenuation = fade * fade / (1.0 + colorQuadratic.w * (distance * distance));
     // combine results
-    vec3 ambient = light.ambient * vec3(texture(material.diffuse, TexCoords));
-    vec3 diffuse = light.diffuse * diff * vec3(texture(material.diffuse, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(material.specular, TexCoords));
-    ambient *= attenuation;
-    diffuse *= attenuation;
-    specular *= attenuation;
-    return (ambient + diffuse + specular);
+    return colorQuadratic.rgb * attenuation * (diff * diffuseColor + spec * specularColor);
 }
 
 // calculates the color when using a spot light.
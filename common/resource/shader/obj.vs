@@ -6,16 +6,21 @@ layout (location = 2) in vec2 aTexCoords;
 out vec3 Normal;
 out vec3 FragPos;
 out vec2 TexCoords;
+out float ViewDepth;
 
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 uniform mat3 normalMatrix;
 
+// the same position as depth_prepass.vs, so the shading pass can test with GL_EQUAL
+invariant gl_Position;
+
 void main()
 {
     gl_Position = projection * view * model * vec4(aPos, 1.0);
     FragPos = vec3(model * vec4(aPos, 1.0));
     Normal = normalMatrix * aNormal;
     TexCoords = aTexCoords;
+    ViewDepth = -(view * model * vec4(aPos, 1.0)).z;
 }
\ No newline at end of file
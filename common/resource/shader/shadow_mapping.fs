@@ -1,45 +1,164 @@
 #version 330 core
+// keep MAX_CASCADES in sync with cascaded_shadow_map.h
+#define MAX_CASCADES 8
+
+// filter permutations, picked by the application with defines (see Shader's defines argument)
+#define SHADOW_HARD 0           // one nearest texel, manual compare
+#define SHADOW_PCF_HARDWARE 1   // one comparison tap, the hardware filters the 2x2 results bilinearly
+#define SHADOW_PCF_DISK 2       // PCF_TAPS comparison taps on a disk of pcfRadius texels, rotated per pixel
+#define SHADOW_PCSS 3           // disk PCF whose radius follows the distance to the blockers
+#ifndef SHADOW_FILTER
+#define SHADOW_FILTER SHADOW_PCF_HARDWARE
+#endif
+#ifndef PCF_TAPS
+#define PCF_TAPS 16
+#endif
+#ifndef BLOCKER_TAPS
+#define BLOCKER_TAPS 16
+#endif
+// with TRANSPARENT defined the alpha of diffuseTexture is output for blending, the surface is lit from both sides
+
 out vec4 FragColor;
 
 in VS_OUT {
     vec3 FragPos;
     vec3 Normal;
     vec2 TexCoords;
-    vec4 FragPosLightSpace;
+    float ViewDepth;
 } fs_in;
 
 uniform sampler2D diffuseTexture;
-uniform sampler2D shadowMap;
+// one layer per cascade, bound twice: with depth comparison and raw
+uniform sampler2DArrayShadow shadowMap;
+uniform sampler2DArray shadowDepth;
+uniform mat4 lightSpaceMatrices[MAX_CASCADES];
+// view distance where each cascade ends
+uniform float cascadeFarDistances[MAX_CASCADES];
+// world size of a shadow texel of each cascade
+uniform float cascadeTexelSizes[MAX_CASCADES];
+// world distance covered by the depth range of each cascade
+uniform float cascadeDepthRanges[MAX_CASCADES];
+uniform int cascadeCount;
+uniform bool showCascades;
 
-uniform vec3 lightPos;
+// direction towards the (directional) light
+uniform vec3 lightDirection;
 uniform vec3 viewPos;
+// disk PCF radius in texels
+uniform float pcfRadius;
+// PCSS: tangent of the angular radius of the light, and the largest penumbra (and blocker search) radius in texels
+uniform float lightSize;
+uniform float pcssMaxTexels;
+
+const float SHADOW_BIAS = 0.0005;
+
+// i-th of count points evenly spread over the unit disk (golden angle spiral), turned by rotation
+vec2 DiskTap(int i, int count, float rotation) {
+    float radius = sqrt((float(i) + 0.5) / float(count));
+    float angle = float(i) * 2.39996323 + rotation;
+    return radius * vec2(cos(angle), sin(angle));
+}
+
+// per pixel noise in [0, 1), rotates the disk so the banding of few taps turns into fine noise
+float InterleavedGradientNoise(vec2 pixel) {
+    return fract(52.9829189 * fract(dot(pixel, vec2(0.06711056, 0.00583715))));
+}
+
+// fraction of lit comparison taps on a disk of radius texels
+float DiskPCF(vec3 projCoords, int cascade, float radius, float rotation) {
+    vec2 texelSize = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    float lit = 0.0;
+    for (int i = 0; i < PCF_TAPS; i++)
+    {
+        vec2 uv = projCoords.xy + DiskTap(i, PCF_TAPS, rotation) * radius * texelSize;
+        lit += texture(shadowMap, vec4(uv, cascade, projCoords.z - SHADOW_BIAS));
+    }
+    return lit / float(PCF_TAPS);
+}
 
-float ShadowCalculation(vec4 fragPosLightSpace, vec3 lightDir) {
+// the first cascade that reaches the fragment, cascadeCount when it is beyond the shadow distance
+int SelectCascade() {
+    for (int i = 0; i < cascadeCount; i++)
+    {
+        if (fs_in.ViewDepth < cascadeFarDistances[i])
+            return i;
+    }
+    return cascadeCount;
+}
+
+float ShadowCalculation(int cascade, vec3 lightDir) {
+    if (cascade >= cascadeCount)
+        return 0.0;
+    // normal offset: look up the shadow a little above the surface, by about a texel of this cascade, so far
+    // cascades with their large texels don't shadow themselves
+    vec3 normal = normalize(fs_in.Normal);
+    float slope = 1.0 - max(dot(normal, lightDir), 0.0);
+    vec3 offsetPos = fs_in.FragPos + normal * cascadeTexelSizes[cascade] * (0.5 + 1.5 * slope);
+    vec4 fragPosLightSpace = lightSpaceMatrices[cascade] * vec4(offsetPos, 1.0);
     // 手动执行透视除法（在进行透视投影时有效）
     vec3 projCoords = fragPosLightSpace.xyz / fragPosLightSpace.w;
     // 标准化设备空间坐标范围是[-1, 1], 我们需要的是用于采样的纹理坐标，将NDC坐标范围缩小一半，再向x轴正向平移0.5个单位，可得到范围[0, 1]的坐标
     projCoords = 0.5 * projCoords + 0.5;
-    // 在当前片段，获取光照视角下的深度值，也即最深可以被光照照射到的深度值，凡是超过这个深度值，说明不能被光照照射到，处于阴影之中
-    float closestDepth = texture(shadowMap, projCoords.xy).r; // opengl会自动将深度值转化为灰度值？
     // 当前片段，摄像机视角的深度值
     float currentDepth = projCoords.z;
 
-    vec3 normal = normalize(fs_in.Normal);
-    vec3 light = normalize(lightDir);
-    float bias = max(0.05 * (1.0 - dot(normal, lightDir)), 0.005);
-    float isInShadow = currentDepth - bias > closestDepth ? 1.0 : 0.0;
-
-    return isInShadow;
+#if SHADOW_FILTER == SHADOW_HARD
+    // 在当前片段，获取光照视角下的深度值，也即最深可以被光照照射到的深度值，凡是超过这个深度值，说明不能被光照照射到，处于阴影之中
+    // clamped, projCoords.xy of exactly 1.0 would fetch one past the last texel (undefined, the range test below
+    // only drops what is beyond 1.0)
+    ivec2 depthSize = textureSize(shadowDepth, 0).xy;
+    ivec2 texel = clamp(ivec2(projCoords.xy * vec2(depthSize)), ivec2(0), depthSize - 1);
+    float closestDepth = texelFetch(shadowDepth, ivec3(texel, cascade), 0).r;
+    if (any(lessThan(projCoords.xy, vec2(0.0))) || any(greaterThan(projCoords.xy, vec2(1.0))))
+        closestDepth = 1.0;
+    return currentDepth - SHADOW_BIAS > closestDepth ? 1.0 : 0.0;
+#elif SHADOW_FILTER == SHADOW_PCF_HARDWARE
+    return 1.0 - texture(shadowMap, vec4(projCoords.xy, cascade, currentDepth - SHADOW_BIAS));
+#else
+    float rotation = InterleavedGradientNoise(gl_FragCoord.xy) * 6.28318531;
+#if SHADOW_FILTER == SHADOW_PCF_DISK
+    return 1.0 - DiskPCF(projCoords, cascade, pcfRadius, rotation);
+#else
+    // blocker search: the average depth of the occluders within the largest penumbra
+    vec2 texelSize = 1.0 / vec2(textureSize(shadowDepth, 0).xy);
+    float blockerSum = 0.0;
+    int blockers = 0;
+    for (int i = 0; i < BLOCKER_TAPS; i++)
+    {
+        vec2 uv = projCoords.xy + DiskTap(i, BLOCKER_TAPS, rotation) * pcssMaxTexels * texelSize;
+        float depth = texture(shadowDepth, vec3(uv, cascade)).r;
+        if (depth < currentDepth - SHADOW_BIAS)
+        {
+            blockerSum += depth;
+            blockers++;
+        }
+    }
+    if (blockers == 0)
+        return 0.0;
+    // the penumbra grows with the world distance between blocker and receiver, as wide as the light looks from there
+    float blockerDistance = (currentDepth - blockerSum / float(blockers)) * cascadeDepthRanges[cascade];
+    float penumbra = blockerDistance * lightSize / cascadeTexelSizes[cascade];
+    return 1.0 - DiskPCF(projCoords, cascade, clamp(penumbra, 1.0, pcssMaxTexels), rotation);
+#endif
+#endif
 }
 
 void main() {
-    vec3 color = texture(diffuseTexture, fs_in.TexCoords).rgb;
+    vec4 texel = texture(diffuseTexture, fs_in.TexCoords);
+#ifdef TRANSPARENT
+    // the cut out texels add nothing to the blend
+    if (texel.a < 0.1)
+        discard;
+    vec3 normal = normalize(gl_FrontFacing ? fs_in.Normal : -fs_in.Normal);
+#else
     vec3 normal = normalize(fs_in.Normal);
+#endif
+    vec3 color = texel.rgb;
     vec3 lightColor = vec3(0.3);
     // ambient
     vec3 ambient = 0.3 * lightColor;
     // diffuse
-    vec3 lightDir = normalize(lightPos - fs_in.FragPos);
+    vec3 lightDir = normalize(lightDirection);
     float diff = max(dot(lightDir, normal), 0.0);
     vec3 diffuse = diff * lightColor;
     // specular
@@ -50,9 +169,20 @@ void main() {
     vec3 specular = spec * lightColor;
 
     // calculate shadow
-    float shadow = ShadowCalculation(fs_in.FragPosLightSpace, lightDir);
+    int cascade = SelectCascade();
+    float shadow = ShadowCalculation(cascade, lightDir);
 
     vec3 lighting = (ambient + (1.0 - shadow) * (diffuse + specular)) * color;
+    if (showCascades)
+    {
+        const vec3 cascadeColors[4] = vec3[](vec3(1.0, 0.3, 0.3), vec3(0.3, 1.0, 0.3), vec3(0.3, 0.3, 1.0), vec3(1.0, 1.0, 0.3));
+        if (cascade < cascadeCount)
+            lighting *= cascadeColors[cascade % 4];
+    }
 
+#ifdef TRANSPARENT
+    FragColor = vec4(lighting, texel.a);
+#else
     FragColor = vec4(lighting, 1.0);
-}
\ No newline at end of file
+#endif
+}
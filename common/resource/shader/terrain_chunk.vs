@@ -0,0 +1,26 @@
+#version 330 core
+layout (location = 0) in vec4 aGrid;    // column, row inside the tile, 1 for skirt vertices
+layout (location = 1) in float aHeight; // raw heightmap value
+
+out float Height;
+out vec3 Position;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+uniform vec2 tileOrigin;   // world x, z of the first sample of the tile
+uniform float tileSpacing; // world distance between two samples of the tile
+uniform vec2 mapMax;       // world x, z of the last heightmap sample, tiles on the border are clamped to it
+uniform float heightScale;
+uniform float heightShift;
+uniform float skirtDepth;
+
+void main()
+{
+    vec2 xz = min(tileOrigin + vec2(aGrid.y, aGrid.x) * tileSpacing, mapMax);
+    Height = aHeight * heightScale - heightShift;
+    vec4 worldPosition = model * vec4(xz.x, Height - aGrid.z * skirtDepth, xz.y, 1.0);
+    Position = (view * worldPosition).xyz;
+    gl_Position = projection * view * worldPosition;
+}
@@ -5,8 +5,13 @@
 layout (location = 0) in vec3 aPos;
 // texture coordinate
 layout (location = 1) in vec2 aTex;
+// culling data of the patch, the same for its four control points
+layout (location = 2) in vec2 aPatchHeight;
+layout (location = 3) in vec4 aPatchNormalCone;
 
 out vec2 TexCoord;
+out vec2 PatchHeight;
+out vec4 PatchNormalCone;
 
 void main()
 {
@@ -14,4 +19,6 @@ void main()
     gl_Position = vec4(aPos, 1.0);
     // pass texture coordinate though
     TexCoord = aTex;
+    PatchHeight = aPatchHeight;
+    PatchNormalCone = aPatchNormalCone;
 }
\ No newline at end of file
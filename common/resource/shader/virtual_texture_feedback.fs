@@ -0,0 +1,25 @@
+#version 330 core
+// feedback pass of virtual_texture.h, drawn with lit_model.vs into a small GL_RGBA8UI target: the page every
+// fragment samples in SampleVirtual (gbuffer.fs), as x and y of the page on its level, the level and 1
+layout (location = 0) out uvec4 FeedbackPage;
+
+in vec2 TexCoords;
+
+uniform vec4 virtualRegion;
+uniform float virtualMaxLevel;
+// the target is smaller than the screen, its derivatives are larger by as much
+uniform float virtualLevelBias;
+
+void main () {
+    if (virtualMaxLevel < 0.0)
+    {
+        FeedbackPage = uvec4(0u);
+        return;
+    }
+    vec2 texels = TexCoords * virtualRegion.zw;
+    vec2 dx = dFdx(texels), dy = dFdy(texels);
+    float level = clamp(floor(0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8)) + virtualLevelBias + 0.5), 0.0, virtualMaxLevel);
+    vec2 position = virtualRegion.xy + fract(TexCoords) * virtualRegion.zw;
+    int wanted = int(level);
+    FeedbackPage = uvec4(uvec2(ivec2(position) >> (VT_PAGE_SHIFT + wanted)), uint(wanted), 1u);
+}
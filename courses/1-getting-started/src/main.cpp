@@ -118,10 +118,13 @@ int main()
             glm::vec3(-1.3f,  1.0f, -1.5f)
     };
 
+    // model space bounds of the box above
+    AABB cubeBounds(glm::vec3(-0.5f), glm::vec3(0.5f));
+
     GLuint VBO, VAO;
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
-    glBindVertexArray(VAO);
+    GLState::BindVertexArray(VAO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
@@ -138,7 +141,7 @@ int main()
     shader.setInt("texture0", 0);
     shader.setInt("texture1", 1);
 
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
     while (!glfwWindowShouldClose(window)) {
         float  currentTime = glfwGetTime();
         deltaTime = currentTime - lastTime;
@@ -158,23 +161,29 @@ int main()
         shader.setMat4("view", view);
         shader.setMat4("projection", projection);
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, texture0);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, texture1);
+        GLState::ActiveTexture(GL_TEXTURE0);
+        GLState::BindTexture(GL_TEXTURE_2D, texture0);
+        GLState::ActiveTexture(GL_TEXTURE1);
+        GLState::BindTexture(GL_TEXTURE_2D, texture1);
+
+        // skip the boxes that are outside of the view frustum
+        Frustum frustum(projection * view);
 
-        glBindVertexArray(VAO);
+        GLState::BindVertexArray(VAO);
         for(unsigned int i = 0; i < 10; i++)
         {
             glm::mat4 model = glm::mat4(1.0f);
             model = glm::translate(model, cubePositions[i]);
             float angle = 20.0f * i;
             model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
+            if (!frustum.IsBoxVisible(cubeBounds.Transform(model)))
+                continue;
             shader.setMat4("model", model);
 
             glDrawArrays(GL_TRIANGLES, 0, 36);
         }
 
+        GLState::EndFrame();
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
@@ -205,7 +214,7 @@ void processInput(GLFWwindow *window)
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 void mouse_callback(GLFWwindow* window, double xpos, double ypos) {
@@ -243,7 +252,7 @@ unsigned int loadTexture(const char *path){
         if(channels == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        GLState::BindTexture(GL_TEXTURE_2D, textureId);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
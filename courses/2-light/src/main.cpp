@@ -9,16 +9,24 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <camera.h>
+#include <clustered_lights.h>
+#include <algorithm>
+#include <random>
+#include <vector>
 
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 void processInput(GLFWwindow *window);
 void mouse_callback(GLFWwindow *window, double posX, double posY);
 void scroll_callback(GLFWwindow *window, double offsetX, double offsetY);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
+void generateLights(unsigned int count);
 unsigned int loadTexture(const char * path);
 
 //settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100.0f;
 
 //camera
 Camera camera(glm::vec3(0.0f, 0.0f, 4.0f));
@@ -30,6 +38,14 @@ float lastTime = 0.0f;
 
 //light
 glm::vec3 lightPos (-0.2f, 1.0f, 2.0f);   // 光源位置为世界坐标，所以相应的在片段着色器里，计算角度和距离时，片段位置也应该是世界坐标
+// point lights bobbing around the boxes, +/- doubles or halves their number
+const unsigned int MAX_LIGHT_COUNT = 16384;
+unsigned int lightCount = 1024;
+std::vector<ClusteredPointLight> pointLights;
+std::vector<glm::vec3> pointLightBases;
+std::vector<float> pointLightPhases;
+// lay down depth first and shade with GL_EQUAL, P switches
+bool depthPrepass = true;
 
 
 int main()
@@ -59,6 +75,7 @@ int main()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
 
     // glad: load all OpenGL function pointers
     // ---------------------------------------
@@ -67,12 +84,13 @@ int main()
         std::cout << "Failed to initialize GLAD" << std::endl;
         return -1;
     }
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
 
     // build and compile our shader program
     // ------------------------------------
     Shader lightingShader("shader/obj.vs", "shader/obj.fs");
     Shader lampShader("shader/lamp.vs", "shader/lamp.fs");
+    Shader prepassShader("shader/depth_prepass.vs", "shader/depth_prepass.fs");
 
     float vertices[] = {
             // positions          // normals           // texture coords
@@ -131,13 +149,16 @@ int main()
             glm::vec3( 1.5f,  0.2f, -1.5f),
             glm::vec3(-1.3f,  1.0f, -1.5f)
     };
-    // positions of the point lights
-    glm::vec3 pointLightPositions[] = {
-            glm::vec3( 0.7f,  0.2f,  2.0f),
-            glm::vec3( 2.3f, -3.3f, -4.0f),
-            glm::vec3(-4.0f,  2.0f, -12.0f),
-            glm::vec3( 0.0f,  0.0f, -3.0f)
-    };
+    // a floor below the boxes, for the point lights to shine on
+    glm::mat4 floorModel = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -4.0f, -6.0f));
+    floorModel = glm::scale(floorModel, glm::vec3(16.0f, 0.2f, 24.0f));
+    generateLights(lightCount);
+    // assigns the point lights to the clusters of the view frustum every frame
+    ClusteredLights clusteredLights;
+    float lastStatsTime = 0.0f;
+
+    // model space bounds of the box above
+    AABB cubeBounds(glm::vec3(-0.5f), glm::vec3(0.5f));
 
     unsigned int VBO, cubeVAO;
     glGenVertexArrays(1, &cubeVAO);
@@ -146,7 +167,7 @@ int main()
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof (vertices), vertices, GL_STATIC_DRAW);
 
-    glBindVertexArray(cubeVAO);
+    GLState::BindVertexArray(cubeVAO);
 
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof (float),  (void*) nullptr);
     glEnableVertexAttribArray(0);
@@ -157,7 +178,7 @@ int main()
 
     unsigned int lightVAO;
     glGenVertexArrays(1, &lightVAO);
-    glBindVertexArray(lightVAO);
+    GLState::BindVertexArray(lightVAO);
     //we only need to bind the VBO to link it with glVertexAttribPointer, no need to fill it. The VBO data already contains all we need
     //actually, the VBO is already bound, but we do it again for educational purpose
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
@@ -165,12 +186,29 @@ int main()
 
     glEnableVertexAttribArray(0);
 
+    // positions only for the depth prepass, a third of the interleaved vertex
+    float positions[36 * 3];
+    for (int i = 0; i < 36; i++)
+        for (int j = 0; j < 3; j++)
+            positions[i * 3 + j] = vertices[i * 8 + j];
+    unsigned int depthVBO, depthVAO;
+    glGenVertexArrays(1, &depthVAO);
+    glGenBuffers(1, &depthVBO);
+    GLState::BindVertexArray(depthVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, depthVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof (positions), positions, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof (float), (void*) nullptr);
+    glEnableVertexAttribArray(0);
+    std::vector<glm::mat4> boxModels;
+
     unsigned int diffuseMap = loadTexture("./image/container2.png");
     unsigned int specularMap = loadTexture("./image/container2_specular.png");
     lightingShader.use();
     lightingShader.setFloat("material.shininess", 32.0f);
     lightingShader.setInt("material.diffuse", 0);
     lightingShader.setInt("material.specular", 1);
+    lampShader.use();
+    lampShader.setFloat("lampSize", 0.05f);
 
     // render loop
     // -----------
@@ -193,49 +231,11 @@ int main()
         lightingShader.setVec3("viewPos", camera.Position);
         lightingShader.setFloat("material.shininess", 32.0f);
 
-        /*
-           Here we set all the uniforms for the 5/6 types of lights we have. We have to set them manually and index
-           the proper PointLight struct in the array to set each uniform variable. This can be done more code-friendly
-           by defining light types as classes and set their values in there, or by using a more efficient uniform approach
-           by using 'Uniform buffer objects', but that is something we'll discuss in the 'Advanced GLSL' tutorial.
-        */
         // directional light
         lightingShader.setVec3("dirLight.direction", -0.2f, -1.0f, -0.3f);
         lightingShader.setVec3("dirLight.ambient", 0.05f, 0.05f, 0.05f);
         lightingShader.setVec3("dirLight.diffuse", 0.4f, 0.4f, 0.4f);
         lightingShader.setVec3("dirLight.specular", 0.5f, 0.5f, 0.5f);
-        // point light 1
-        lightingShader.setVec3("pointLights[0].position", pointLightPositions[0]);
-        lightingShader.setVec3("pointLights[0].ambient", 0.05f, 0.05f, 0.05f);
-        lightingShader.setVec3("pointLights[0].diffuse", 0.8f, 0.8f, 0.8f);
-        lightingShader.setVec3("pointLights[0].specular", 1.0f, 1.0f, 1.0f);
-        lightingShader.setFloat("pointLights[0].constant", 1.0f);
-        lightingShader.setFloat("pointLights[0].linear", 0.09f);
-        lightingShader.setFloat("pointLights[0].quadratic", 0.032f);
-        // point light 2
-        lightingShader.setVec3("pointLights[1].position", pointLightPositions[1]);
-        lightingShader.setVec3("pointLights[1].ambient", 0.05f, 0.05f, 0.05f);
-        lightingShader.setVec3("pointLights[1].diffuse", 0.8f, 0.8f, 0.8f);
-        lightingShader.setVec3("pointLights[1].specular", 1.0f, 1.0f, 1.0f);
-        lightingShader.setFloat("pointLights[1].constant", 1.0f);
-        lightingShader.setFloat("pointLights[1].linear", 0.09f);
-        lightingShader.setFloat("pointLights[1].quadratic", 0.032f);
-        // point light 3
-        lightingShader.setVec3("pointLights[2].position", pointLightPositions[2]);
-        lightingShader.setVec3("pointLights[2].ambient", 0.05f, 0.05f, 0.05f);
-        lightingShader.setVec3("pointLights[2].diffuse", 0.8f, 0.8f, 0.8f);
-        lightingShader.setVec3("pointLights[2].specular", 1.0f, 1.0f, 1.0f);
-        lightingShader.setFloat("pointLights[2].constant", 1.0f);
-        lightingShader.setFloat("pointLights[2].linear", 0.09f);
-        lightingShader.setFloat("pointLights[2].quadratic", 0.032f);
-        // point light 4
-        lightingShader.setVec3("pointLights[3].position", pointLightPositions[3]);
-        lightingShader.setVec3("pointLights[3].ambient", 0.05f, 0.05f, 0.05f);
-        lightingShader.setVec3("pointLights[3].diffuse", 0.8f, 0.8f, 0.8f);
-        lightingShader.setVec3("pointLights[3].specular", 1.0f, 1.0f, 1.0f);
-        lightingShader.setFloat("pointLights[3].constant", 1.0f);
-        lightingShader.setFloat("pointLights[3].linear", 0.09f);
-        lightingShader.setFloat("pointLights[3].quadratic", 0.032f);
         // spotLight
         lightingShader.setVec3("spotLight.position", camera.Position);
         lightingShader.setVec3("spotLight.direction", camera.Front);
@@ -249,58 +249,114 @@ int main()
         lightingShader.setFloat("spotLight.outerCutOff", glm::cos(glm::radians(15.0f)));
 
         // view/projection transformations
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
         glm::mat4 view = camera.GetViewMatrix();
         lightingShader.setMat4("projection", projection);
         lightingShader.setMat4("view", view);
 
+        // point lights: move them, then list them in the clusters they reach
+        for (size_t i = 0; i < pointLights.size(); i++)
+            pointLights[i].Position = pointLightBases[i] + glm::vec3(0.0f, 0.5f * sin(currentTime + pointLightPhases[i]), 0.0f);
+        clusteredLights.Update(pointLights, view, glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
+        int framebufferWidth, framebufferHeight;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        clusteredLights.Bind(lightingShader, 2, glm::vec2(framebufferWidth, framebufferHeight));
+        if (currentTime - lastStatsTime > 1.0f)
+        {
+            const ClusteredLights::Stats &stats = clusteredLights.GetStats();
+            std::cout << stats.Lights << " lights (" << stats.VisibleLights << " in range): " << stats.References
+                      << " cluster entries, at most " << stats.MaxPerCluster << " per cluster, assigned in "
+                      << stats.AssignMilliseconds << " ms" << std::endl;
+            if (stats.DroppedLights > 0 || stats.DroppedReferences > 0)
+                std::cout << "clustered lights: " << stats.DroppedLights << " lights and " << stats.DroppedReferences
+                          << " cluster entries didn't fit the texture buffers" << std::endl;
+            std::cout << "gl state: " << GLState::GetCounters().Issued << " calls issued, "
+                      << GLState::GetCounters().Skipped << " redundant calls skipped per frame" << std::endl;
+            lastStatsTime = currentTime;
+        }
+
         // world transformation
         glm::mat4 model = glm::mat4(1.0f);
         lightingShader.setMat4("model", model);
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, diffuseMap);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, specularMap);
+        GLState::ActiveTexture(GL_TEXTURE0);
+        GLState::BindTexture(GL_TEXTURE_2D, diffuseMap);
+        GLState::ActiveTexture(GL_TEXTURE1);
+        GLState::BindTexture(GL_TEXTURE_2D, specularMap);
+
+        // skip the boxes and lamps that are outside of the view frustum
+        Frustum frustum(projection * view);
 
-        glBindVertexArray(cubeVAO);
+        // the visible boxes and the floor, nearest first
+        boxModels.clear();
         for(unsigned int i = 0; i < 10; i++)
         {
             glm::mat4 model = glm::mat4(1.0f);
             model = glm::translate(model, cubePositions[i]);
             float angle = 20.0f * i;
             model = glm::rotate(model, glm::radians(angle), glm::vec3(1.0f, 0.3f, 0.5f));
+            if (frustum.IsBoxVisible(cubeBounds.Transform(model)))
+                boxModels.push_back(model);
+        }
+        if (frustum.IsBoxVisible(cubeBounds.Transform(floorModel)))
+            boxModels.push_back(floorModel);
+        std::sort(boxModels.begin(), boxModels.end(), [](const glm::mat4 &a, const glm::mat4 &b) {
+            return glm::length(glm::vec3(a[3]) - camera.Position) < glm::length(glm::vec3(b[3]) - camera.Position);
+        });
+
+        // depth only first, so the lighting below runs just for the fragments whose depth equals the nearest one
+        if (depthPrepass)
+        {
+            GLState::ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            prepassShader.use();
+            prepassShader.setMat4("projection", projection);
+            prepassShader.setMat4("view", view);
+            GLState::BindVertexArray(depthVAO);
+            for (const glm::mat4 &model : boxModels)
+            {
+                prepassShader.setMat4("model", model);
+                glDrawArrays(GL_TRIANGLES, 0, 36);
+            }
+            GLState::ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            GLState::DepthFunc(GL_EQUAL);
+            GLState::DepthMask(GL_FALSE);
+            lightingShader.use();
+        }
+
+        GLState::BindVertexArray(cubeVAO);
+        for (const glm::mat4 &model : boxModels)
+        {
             lightingShader.setMat4("model", model);
             glm::mat3 normalMatrix = glm::transpose(glm::inverse(model));
             lightingShader.setMat3("normalMatrix", normalMatrix);
 
             glDrawArrays(GL_TRIANGLES, 0, 36);
         }
+        GLState::DepthFunc(GL_LESS);
+        GLState::DepthMask(GL_TRUE);
 
         // also draw the lamp object(s)
         lampShader.use();
         lampShader.setMat4("projection", projection);
         lampShader.setMat4("view", view);
 
-        // we now draw as many light bulbs as we have point lights.
-        glBindVertexArray(lightVAO);
-        for (unsigned int i = 0; i < 4; i++)
-        {
-            model = glm::mat4(1.0f);
-            model = glm::translate(model, pointLightPositions[i]);
-            model = glm::scale(model, glm::vec3(0.2f)); // Make it a smaller cube
-            lampShader.setMat4("model", model);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
-        }
-
+        // we now draw as many light bulbs as we have point lights, in one instanced draw that reads the light buffer
+        GLState::ActiveTexture(GL_TEXTURE2);
+        GLState::BindTexture(GL_TEXTURE_BUFFER, clusteredLights.GetLightBuffer());
+        lampShader.setInt("lights", 2);
+        GLState::BindVertexArray(lightVAO);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 36, (GLsizei)pointLights.size());
 
+        GLState::EndFrame();
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
 
-    glDeleteVertexArrays(1, &cubeVAO);
-    glDeleteVertexArrays(1, &lightVAO);
+    GLState::DeleteVertexArrays(1, &cubeVAO);
+    GLState::DeleteVertexArrays(1, &lightVAO);
+    GLState::DeleteVertexArrays(1, &depthVAO);
     glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &depthVBO);
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
     glfwTerminate();
@@ -335,7 +391,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 void mouse_callback(GLFWwindow* window, double posX, double posY){
@@ -358,6 +414,54 @@ void scroll_callback(GLFWwindow* window, double offsetX, double offsetY){
     camera.ProcessMouseScroll(offsetY);
 }
 
+// glfw: whenever a key event occurs, this callback is called
+// ---------------------------------------------------------------------------------------------
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers)
+{
+    if(action == GLFW_PRESS)
+    {
+        switch(key)
+        {
+            case GLFW_KEY_EQUAL:
+                generateLights(std::min(lightCount * 2, MAX_LIGHT_COUNT));
+                break;
+            case GLFW_KEY_MINUS:
+                generateLights(std::max(lightCount / 2, 1u));
+                break;
+            case GLFW_KEY_P:
+                depthPrepass = !depthPrepass;
+                std::cout << "depth prepass " << (depthPrepass ? "on" : "off") << std::endl;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// scatters count point lights of random colors and sizes through the space around the boxes
+// ---------------------------------------------------------------------------------------------
+void generateLights(unsigned int count)
+{
+    lightCount = count;
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    pointLights.resize(count);
+    pointLightBases.resize(count);
+    pointLightPhases.resize(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        pointLightBases[i] = glm::vec3(-8.0f + 16.0f * unit(random), -3.5f + 9.0f * unit(random), -18.0f + 24.0f * unit(random));
+        pointLightPhases[i] = 6.2831853f * unit(random);
+        ClusteredPointLight &light = pointLights[i];
+        light.Position = pointLightBases[i];
+        light.Color = glm::vec3(unit(random), unit(random), unit(random));
+        light.Color /= std::max(std::max(light.Color.r, light.Color.g), std::max(light.Color.b, 0.01f));
+        light.Quadratic = 8.0f + 32.0f * unit(random);
+        light.Radius = PointLightRadius(1.0f, light.Quadratic);
+    }
+    std::cout << count << " point lights" << std::endl;
+}
+
 unsigned int loadTexture(const char *path){
     unsigned int textureId;
     glGenTextures(1, &textureId);
@@ -372,7 +476,7 @@ unsigned int loadTexture(const char *path){
         if(channels == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        GLState::BindTexture(GL_TEXTURE_2D, textureId);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -10,11 +10,29 @@
 //#include <stb_image.h>
 #include <camera.h>
 #include <model.h>
+#include <bvh.h>
+#include <occlusion.h>
+#include <gbuffer.h>
+#include <gpu_counter.h>
+#include <clustered_lights.h>
+#include <material_system.h>
+#include <virtual_texture.h>
+#include <texture_residency.h>
+
+#include <chrono>
+#include <random>
+#include <vector>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
+void mouse_button_callback(GLFWwindow* window, int button, int action, int modifiers);
 void processInput(GLFWwindow *window);
+void runBvhBenchmark();
+std::vector<ClusteredPointLight> generateLights();
+unsigned int buildLightVolume(unsigned int lightBuffer, unsigned int &indexCount);
+void renderQuad();
 
 // settings
 const unsigned int SCR_WIDTH = 800;
@@ -30,6 +48,33 @@ bool firstMouse = true;
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
+// asteroid field
+const unsigned int ROCK_COUNT = 2000;
+const glm::vec3 BELT_CENTER = glm::vec3(0.0f, -10.0f, -100.0f);
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 500.0f;
+bool pickRequested = false;
+bool benchmarkRequested = false;
+bool occlusionEnabled = true;
+bool lodEnabled = true;
+
+// lighting: a directional light and point lights scattered through the belt, shaded forward or deferred (F switches)
+const unsigned int POINT_LIGHT_COUNT = 256;
+const glm::vec3 CLEAR_COLOR = glm::vec3(0.05f, 0.05f, 0.05f);
+bool deferredShading = true;
+// forward shading only: lay down depth first and shade with GL_EQUAL (P switches)
+bool depthPrepass = true;
+// textures through the material system instead of binding them for every mesh (M switches)
+bool useMaterialSystem = true;
+// the diffuse textures as one virtual texture: a fixed amount of memory, of which only the pages that are seen are
+// loaded. chosen at startup (set it to true to try it), the textures aren't loaded on their own with it, so the
+// material system (M) and the texture budget below have nothing to work on then
+const bool useVirtualTexture = false;
+// video memory the streamed textures may take, distant and unseen ones drop their largest levels to stay within it.
+// it only applies while the textures are bound per mesh (press M once the material system is built): the material
+// system's arrays are copies made once, outside of the budget, and their texels don't follow the screen size
+const size_t TEXTURE_BUDGET = 32 << 20;
+
 int main()
 {
     // glfw: initialize and configure
@@ -56,6 +101,8 @@ int main()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -73,16 +120,124 @@ int main()
 
     // configure global opengl state
     // -----------------------------
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
 
     // build and compile shaders
     // -------------------------
-    Shader ourShader("../resource/shader/modelLoading.vs", "../resource/shader/modelLoading.fs");
+    Shader forwardShader("../resource/shader/lit_model.vs", "../resource/shader/forward_lighting.fs");
+    Shader geometryShader("../resource/shader/lit_model.vs", "../resource/shader/gbuffer.fs");
+    Shader directionalShader("../resource/shader/deferred_fullscreen.vs", "../resource/shader/deferred_lighting.fs");
+    Shader prepassShader("../resource/shader/depth_prepass.vs", "../resource/shader/depth_prepass.fs");
+    Shader pointLightShader("../resource/shader/deferred_volume.vs", "../resource/shader/deferred_lighting.fs", nullptr, "#define POINT_LIGHT\n");
 
     // load models
     // -----------
+    // the model textures stream in while the scene is already drawn: block compressed (cooked on the first run,
+    // loaded from their .dds caches after that) on worker threads and uploaded a few levels per frame
+    TextureStreamer textureStreamer;
+    TextureResidency textureResidency(textureStreamer, TEXTURE_BUDGET);
+    // the page file is cooked on the first run (and whenever a texture changes)
+    VirtualTexture virtualTexture("../resource/model/scene.vpages");
+    VirtualTexture *virtualTextureTarget = useVirtualTexture ? &virtualTexture : nullptr;
 //    Model ourModel("../resource/model/backpack/backpack.obj");
-    Model ourModel("../resource/model/voyager.gltf");
+    Model ourModel("../resource/model/voyager.gltf", false, 1, &textureStreamer, virtualTextureTarget);
+    // planet and rocks are seen from far away most of the time, generate 4 levels of detail for them
+    Model planet("../resource/model/planet/planet.obj", false, 4, &textureStreamer, virtualTextureTarget);
+    Model rock("../resource/model/rock/rock.obj", false, 4, &textureStreamer, virtualTextureTarget);
+    for (const MeshLod &lod : rock.meshes[0].Lods)
+        std::cout << "rock lod: " << lod.IndexCount / 3 << " triangles, error " << lod.Error << std::endl;
+
+    // the textures of all meshes as texture arrays (or bindless handles) indexed by material, the shading passes
+    // below then bind them once per frame instead of for every mesh. the arrays are copies, they are built once
+    // the textures have finished streaming, until then the textures are bound per mesh
+    MaterialSystem materials;
+    materials.AddModel(ourModel);
+    materials.AddModel(planet);
+    materials.AddModel(rock);
+    bool materialsBuilt = false;
+    Shader forwardMaterialShader("../resource/shader/lit_model.vs", "../resource/shader/forward_lighting.fs", nullptr, materials.ShaderDefines());
+    Shader geometryMaterialShader("../resource/shader/lit_model.vs", "../resource/shader/gbuffer.fs", nullptr, materials.ShaderDefines());
+
+    if (useVirtualTexture && virtualTexture.Build())
+    {
+        const VirtualTexture::Stats &virtualStats = virtualTexture.GetStats();
+        std::cout << "virtual texture: " << virtualStats.Textures << " textures " << (virtualStats.Cooked ? "cooked" : "from the page file")
+                  << ", " << virtualStats.Capacity << " page cache slots (" << virtualStats.Bytes / (1024 * 1024) << " MB)" << std::endl;
+    }
+    Shader forwardVirtualShader("../resource/shader/lit_model.vs", "../resource/shader/forward_lighting.fs", nullptr, virtualTexture.ShaderDefines());
+    Shader geometryVirtualShader("../resource/shader/lit_model.vs", "../resource/shader/gbuffer.fs", nullptr, virtualTexture.ShaderDefines());
+    Shader feedbackShader("../resource/shader/lit_model.vs", "../resource/shader/virtual_texture_feedback.fs", nullptr, virtualTexture.ShaderDefines());
+
+    // place the rocks in a ring around the planet, each rock keeps its transform relative to the ring
+    // so the whole belt can orbit (animated objects -> the BVH is refit every frame instead of rebuilt)
+    std::vector<glm::mat4> rockLocalMatrices(ROCK_COUNT);
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    const float beltRadius = 50.0f;
+    const float beltOffset = 5.0f;
+    for (unsigned int i = 0; i < ROCK_COUNT; i++)
+    {
+        float angle = (float)i / (float)ROCK_COUNT * 360.0f;
+        glm::vec3 position(sin(glm::radians(angle)) * beltRadius + (unit(random) * 2.0f - 1.0f) * beltOffset,
+                           (unit(random) * 2.0f - 1.0f) * beltOffset * 0.4f,
+                           cos(glm::radians(angle)) * beltRadius + (unit(random) * 2.0f - 1.0f) * beltOffset);
+        glm::mat4 local = glm::translate(glm::mat4(1.0f), position);
+        local = glm::scale(local, glm::vec3(0.05f + unit(random) * 0.2f));
+        local = glm::rotate(local, unit(random) * glm::two_pi<float>(), glm::vec3(0.4f, 0.6f, 0.8f));
+        rockLocalMatrices[i] = local;
+    }
+
+    std::vector<MeshInstance> rockInstances;
+    for (unsigned int i = 0; i < ROCK_COUNT; i++)
+        for (Mesh &mesh : rock.meshes)
+            rockInstances.push_back({&mesh, glm::translate(glm::mat4(1.0f), BELT_CENTER) * rockLocalMatrices[i]});
+    std::vector<AABB> rockBounds(rockInstances.size());
+    for (size_t i = 0; i < rockInstances.size(); i++)
+        rockBounds[i] = rockInstances[i].GetWorldBounds();
+    BVH rockBVH;
+    rockBVH.Build(rockBounds);
+    std::vector<uint32_t> visibleRocks;
+    float beltRotation = 0.0f;
+
+    // the planet hides a large part of the belt, it is rasterized as the only occluder
+    OcclusionBuffer occlusion;
+    float lastStatsTime = 0.0f;
+
+    // the point lights live in one buffer: a texture buffer for the forward shader, instance attributes of the
+    // light volumes for the deferred one
+    std::vector<ClusteredPointLight> pointLights = generateLights();
+    unsigned int lightBuffer, lightTexture, lightVolumeIndexCount;
+    glGenBuffers(1, &lightBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, pointLights.size() * sizeof(ClusteredPointLight), pointLights.data(), GL_STATIC_DRAW);
+    glGenTextures(1, &lightTexture);
+    GLState::BindTexture(GL_TEXTURE_BUFFER, lightTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+    GLState::BindTexture(GL_TEXTURE_BUFFER, 0);
+    unsigned int lightVolumeVAO = buildLightVolume(lightBuffer, lightVolumeIndexCount);
+
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    GBuffer gbuffer(framebufferWidth, framebufferHeight);
+    GpuCounter forwardTimer(GL_TIME_ELAPSED), geometryTimer(GL_TIME_ELAPSED), lightingTimer(GL_TIME_ELAPSED);
+    GpuCounter prepassTimer(GL_TIME_ELAPSED);
+    std::vector<MeshDraw> draws;
+    for (Shader *shader : {&forwardShader, &geometryShader, &forwardMaterialShader, &geometryMaterialShader,
+                           &forwardVirtualShader, &geometryVirtualShader, &directionalShader, &pointLightShader})
+    {
+        shader->use();
+        shader->setFloat("specularStrength", 0.3f);
+        shader->setFloat("shininess", 32.0f);
+        shader->setVec3("lightColor", glm::vec3(0.6f));
+        shader->setVec3("ambientColor", glm::vec3(0.1f));
+    }
+    for (Shader *shader : {&forwardShader, &forwardMaterialShader, &forwardVirtualShader})
+    {
+        shader->use();
+        shader->setInt("lights", 8);
+        shader->setInt("lightCount", (int)pointLights.size());
+    }
+    std::cout << "Built BVH over " << rockInstances.size() << " rock instances (" << rockBVH.Nodes.size() << " nodes)" << std::endl;
 
     // draw in wireframe
     //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -101,27 +256,268 @@ int main()
         // -----
         processInput(window);
 
+        textureStreamer.Update();
+        virtualTexture.Update();
+        if (!materialsBuilt && textureStreamer.IsIdle())
+        {
+            materials.Build();
+            materialsBuilt = true;
+            const TextureCooker::Stats &cookerStats = TextureCooker::GetStats();
+            std::cout << "textures: " << cookerStats.Cooked << " cooked (" << cookerStats.CookMilliseconds << " ms), "
+                      << cookerStats.Cached << " from cache, " << cookerStats.CompressedBytes / (1024 * 1024) << " MB instead of "
+                      << cookerStats.UncompressedBytes / (1024 * 1024) << " MB" << std::endl;
+            const MaterialSystem::Stats &materialStats = materials.GetStats();
+            std::cout << materialStats.Materials << " materials, " << materialStats.Textures << " textures";
+            if (materialStats.Bindless)
+                std::cout << " as bindless handles" << std::endl;
+            else
+                std::cout << " in " << materialStats.Arrays << " texture arrays (" << materialStats.Resized << " scaled, "
+                          << materialStats.Bytes / (1024 * 1024) << " MB)" << std::endl;
+            // bindless handles keep their textures as they are, the arrays are copies and leave them free to shrink
+            if (materialStats.Bindless)
+                textureResidency.Freeze();
+        }
+        const bool materialSystemActive = useMaterialSystem && materialsBuilt;
+
         // render
         // ------
-        glClearColor(0.05f, 0.05f, 0.05f, 1.0f);
+        glClearColor(CLEAR_COLOR.r, CLEAR_COLOR.g, CLEAR_COLOR.b, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // don't forget to enable shader before setting uniforms
-        ourShader.use();
-
         // view/projection transformations
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
         glm::mat4 view = camera.GetViewMatrix();
-        ourShader.setMat4("projection", projection);
-        ourShader.setMat4("view", view);
+        // the lighting happens in view space
+        glm::vec3 lightDirection = glm::mat3(view) * glm::normalize(glm::vec3(-0.3f, 1.0f, 0.5f));
 
         // render the loaded model
         glm::mat4 model = glm::mat4(1.0f);
         model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
         model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));	// it's a bit too big for our scene, so scale it down
-        ourShader.setMat4("model", model);
-        ourModel.Draw(ourShader);
-
+        Frustum frustum(projection * view);
+
+        // planet
+        glm::mat4 planetModel = glm::translate(glm::mat4(1.0f), BELT_CENTER);
+        planetModel = glm::scale(planetModel, glm::vec3(4.0f));
+
+        occlusion.Begin(projection * view);
+        for (const Mesh &mesh : planet.meshes)
+            occlusion.AddOccluder(mesh, planetModel);
+        occlusion.BuildHierarchy();
+        OcclusionBuffer *occlusionTest = occlusionEnabled ? &occlusion : nullptr;
+        LodSelector lodSelector(camera.Position, glm::radians(camera.Zoom), (float)SCR_HEIGHT);
+        const LodSelector *lodTest = lodEnabled ? &lodSelector : nullptr;
+
+        // asteroid belt: move the rocks, refit the hierarchy and only draw what the frustum query returns
+        beltRotation += deltaTime * 2.0f;
+        glm::mat4 belt = glm::translate(glm::mat4(1.0f), BELT_CENTER);
+        belt = glm::rotate(belt, glm::radians(beltRotation), glm::vec3(0.0f, 1.0f, 0.0f));
+        for (size_t i = 0; i < rockInstances.size(); i++)
+        {
+            rockInstances[i].model = belt * rockLocalMatrices[i / rock.meshes.size()];
+            rockBounds[i] = rockInstances[i].GetWorldBounds();
+        }
+        rockBVH.Refit(rockBounds);
+
+        visibleRocks.clear();
+        unsigned int rockTriangles = 0, rockFullTriangles = 0;
+        rockBVH.QueryFrustum(frustum, visibleRocks);
+        // collect the frame's draws once, front to back: the depth prepass, the forward shader and the G-buffer
+        // all submit the same list
+        draws.clear();
+        ourModel.Collect(model, frustum, draws, occlusionTest);
+        planet.Collect(planetModel, frustum, draws, nullptr, lodTest);
+        for (uint32_t index : visibleRocks)
+        {
+            if (occlusionTest && !occlusionTest->IsVisible(rockBounds[index]))
+                continue;
+            Mesh &mesh = *rockInstances[index].mesh;
+            unsigned int lod = lodTest ? mesh.SelectLod(rockInstances[index].model, *lodTest) : 0;
+            rockTriangles += mesh.Lods[lod].IndexCount / 3;
+            rockFullTriangles += mesh.Lods[0].IndexCount / 3;
+            draws.push_back({&mesh, rockInstances[index].model, lod});
+        }
+        SortFrontToBack(draws, camera.Position);
+        // the budget follows the draws only while they bind their meshes' textures, the material system's arrays
+        // and the virtual texture are outside of it
+        const bool texturesPerMesh = !useVirtualTexture && !materialSystemActive;
+        if (texturesPerMesh)
+            textureResidency.Update(draws, lodSelector);
+        // with the material system or the virtual texture the textures are bound once, a draw only picks its
+        // material or its region of the virtual texture
+        auto drawScene = [&](Shader &shader) {
+            shader.use();
+            shader.setMat4("projection", projection);
+            shader.setMat4("view", view);
+            if (useVirtualTexture)
+                virtualTexture.Bind(shader, 0);
+            else if (materialSystemActive)
+                materials.Bind(shader, 0, 0);
+            for (const MeshDraw &draw : draws)
+            {
+                shader.setMat4("model", draw.model);
+                if (useVirtualTexture)
+                {
+                    virtualTexture.SetRegion(shader, draw.mesh->VirtualTextureIndex);
+                    draw.mesh->DrawGeometry(draw.lod);
+                }
+                else if (materialSystemActive)
+                {
+                    shader.setInt("materialIndex", std::max(draw.mesh->MaterialIndex, 0));
+                    draw.mesh->DrawGeometry(draw.lod);
+                }
+                else
+                    draw.mesh->Draw(shader, draw.lod);
+            }
+        };
+        Shader &geometryPassShader = useVirtualTexture ? geometryVirtualShader : materialSystemActive ? geometryMaterialShader : geometryShader;
+        Shader &forwardPassShader = useVirtualTexture ? forwardVirtualShader : materialSystemActive ? forwardMaterialShader : forwardShader;
+
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        // the pages this frame samples, read back a few frames later by virtualTexture.Update()
+        if (useVirtualTexture)
+        {
+            virtualTexture.BeginFeedback(feedbackShader, framebufferWidth, framebufferHeight);
+            drawScene(feedbackShader);
+            virtualTexture.EndFeedback();
+        }
+        if (deferredShading)
+        {
+            geometryTimer.Begin();
+            gbuffer.Resize(framebufferWidth, framebufferHeight);
+            gbuffer.BeginGeometryPass();
+            drawScene(geometryPassShader);
+            geometryTimer.End();
+
+            lightingTimer.Begin();
+            gbuffer.BeginLightingPass(CLEAR_COLOR);
+            // directional light and ambient over the whole screen
+            GLState::Disable(GL_DEPTH_TEST);
+            directionalShader.use();
+            directionalShader.setMat4("inverseProjection", glm::inverse(projection));
+            directionalShader.setVec3("lightDirection", lightDirection);
+            gbuffer.BindTextures(directionalShader, 0);
+            renderQuad();
+            // point lights added up over the pixels inside their spheres: the back faces of a sphere pass the depth
+            // test where they are behind the scene, which also works with the camera inside the sphere
+            GLState::Enable(GL_DEPTH_TEST);
+            GLState::DepthMask(GL_FALSE);
+            GLState::DepthFunc(GL_GEQUAL);
+            GLState::Enable(GL_CULL_FACE);
+            GLState::CullFace(GL_FRONT);
+            GLState::Enable(GL_BLEND);
+            GLState::BlendFunc(GL_ONE, GL_ONE);
+            pointLightShader.use();
+            pointLightShader.setMat4("projection", projection);
+            pointLightShader.setMat4("view", view);
+            pointLightShader.setMat4("inverseProjection", glm::inverse(projection));
+            gbuffer.BindTextures(pointLightShader, 0);
+            GLState::BindVertexArray(lightVolumeVAO);
+            glDrawElementsInstanced(GL_TRIANGLES, lightVolumeIndexCount, GL_UNSIGNED_INT, 0, (GLsizei)pointLights.size());
+            GLState::BindVertexArray(0);
+            GLState::Disable(GL_BLEND);
+            GLState::CullFace(GL_BACK);
+            GLState::Disable(GL_CULL_FACE);
+            GLState::DepthFunc(GL_LESS);
+            GLState::DepthMask(GL_TRUE);
+            gbuffer.Present();
+            lightingTimer.End();
+        }
+        else
+        {
+            // depth only first, so the lighting below runs once per pixel: just for the fragments whose depth
+            // equals the nearest one
+            if (depthPrepass)
+            {
+                prepassTimer.Begin();
+                GLState::ColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                prepassShader.use();
+                prepassShader.setMat4("projection", projection);
+                prepassShader.setMat4("view", view);
+                for (const MeshDraw &draw : draws)
+                {
+                    prepassShader.setMat4("model", draw.model);
+                    draw.mesh->DrawDepth(draw.lod);
+                }
+                GLState::ColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+                GLState::DepthFunc(GL_EQUAL);
+                GLState::DepthMask(GL_FALSE);
+                prepassTimer.End();
+            }
+            forwardTimer.Begin();
+            forwardPassShader.use();
+            forwardPassShader.setVec3("lightDirection", lightDirection);
+            GLState::ActiveTexture(GL_TEXTURE8);
+            GLState::BindTexture(GL_TEXTURE_BUFFER, lightTexture);
+            GLState::ActiveTexture(GL_TEXTURE0);
+            drawScene(forwardPassShader);
+            forwardTimer.End();
+            GLState::DepthFunc(GL_LESS);
+            GLState::DepthMask(GL_TRUE);
+        }
+
+        // ray picking through the center of the screen (the cursor is captured)
+        if (pickRequested)
+        {
+            pickRequested = false;
+            Ray ray = camera.GetPickingRay(SCR_WIDTH / 2.0f, SCR_HEIGHT / 2.0f, (float)SCR_WIDTH, (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
+            uint32_t hitIndex;
+            float hitDistance;
+            if (rockBVH.Raycast(ray, hitIndex, hitDistance))
+                std::cout << "Picked rock " << hitIndex << " at distance " << hitDistance << std::endl;
+            else
+                std::cout << "Picked nothing" << std::endl;
+        }
+
+        if (currentFrame - lastStatsTime > 1.0f)
+        {
+            lastStatsTime = currentFrame;
+            const OcclusionBuffer::Stats &stats = occlusion.GetStats();
+            std::cout << "occlusion " << (occlusionEnabled ? "on" : "off") << ": " << stats.Visible() << " drawn, "
+                      << stats.Occluded << " culled of " << stats.Tested << " tested" << std::endl;
+            std::cout << "lod " << (lodEnabled ? "on" : "off") << ": rocks drawn with " << rockTriangles << " of "
+                      << rockFullTriangles << " triangles" << std::endl;
+            if (deferredShading)
+                std::cout << "deferred: geometry " << geometryTimer.Result() / 1.0e6 << " ms, lighting "
+                          << lightingTimer.Result() / 1.0e6 << " ms" << std::endl;
+            else if (depthPrepass)
+                std::cout << "forward: depth prepass " << prepassTimer.Result() / 1.0e6 << " ms, shading "
+                          << forwardTimer.Result() / 1.0e6 << " ms" << std::endl;
+            else
+                std::cout << "forward: " << forwardTimer.Result() / 1.0e6 << " ms" << std::endl;
+            std::cout << "gl state: " << GLState::GetCounters().Issued << " calls issued, "
+                      << GLState::GetCounters().Skipped << " redundant calls skipped per frame" << std::endl;
+            const TextureStreamer::Stats &streamStats = textureStreamer.GetStats();
+            if (streamStats.Loading > 0 || streamStats.Uploading > 0)
+                std::cout << "streaming textures: " << streamStats.Loading << " loading, " << streamStats.Uploading
+                          << " uploading (" << streamStats.BytesUploaded / 1024 << " KB last frame"
+                          << (streamStats.Persistent ? ", persistently mapped" : "") << "), " << streamStats.Completed
+                          << " done" << std::endl;
+            const TextureResidency::Stats &residencyStats = textureResidency.GetStats();
+            if (texturesPerMesh && residencyStats.Textures > 0)
+                std::cout << "texture residency: " << residencyStats.ResidentBytes / 1024 << " KB of " << residencyStats.BudgetBytes / 1024
+                          << " KB budget (" << residencyStats.NeededBytes / 1024 << " KB needed, bias " << residencyStats.Bias << "), "
+                          << residencyStats.Reduced << " of " << residencyStats.Textures << " textures reduced, "
+                          << residencyStats.Pending << " pending, " << residencyStats.Dropped << " levels dropped, "
+                          << residencyStats.Restored << " restored" << std::endl;
+            if (useVirtualTexture)
+            {
+                const VirtualTexture::Stats &virtualStats = virtualTexture.GetStats();
+                std::cout << "virtual texture: " << virtualStats.Requested << " pages seen, " << virtualStats.Resident << " of "
+                          << virtualStats.Capacity << " resident, " << virtualStats.Pending << " pending, "
+                          << virtualStats.Uploaded << " uploaded, " << virtualStats.Evicted << " evicted, "
+                          << virtualStats.Dropped << " dropped last frame" << std::endl;
+            }
+        }
+
+        if (benchmarkRequested)
+        {
+            benchmarkRequested = false;
+            runBvhBenchmark();
+        }
+
+
+        GLState::EndFrame();
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
@@ -162,7 +558,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -190,4 +586,208 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
     camera.ProcessMouseScroll(yoffset);
-}
\ No newline at end of file
+}
+
+// glfw: whenever a key event occurs, this callback is called
+// ---------------------------------------------------------------------------------------------
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers)
+{
+    if(action == GLFW_PRESS)
+    {
+        switch(key)
+        {
+            case GLFW_KEY_B:
+                benchmarkRequested = true;
+                break;
+            case GLFW_KEY_O:
+                occlusionEnabled = !occlusionEnabled;
+                break;
+            case GLFW_KEY_L:
+                lodEnabled = !lodEnabled;
+                break;
+            case GLFW_KEY_P:
+                depthPrepass = !depthPrepass;
+                std::cout << "depth prepass " << (depthPrepass ? "on" : "off") << std::endl;
+                break;
+            case GLFW_KEY_F:
+                deferredShading = !deferredShading;
+                std::cout << (deferredShading ? "deferred" : "forward") << " shading" << std::endl;
+                break;
+            case GLFW_KEY_M:
+                useMaterialSystem = !useMaterialSystem;
+                if (useVirtualTexture)
+                    std::cout << "textures from the virtual texture, the material system isn't used with it" << std::endl;
+                else
+                    std::cout << "textures " << (useMaterialSystem ? "from the material system" : "bound per mesh") << std::endl;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// glfw: whenever a mouse button is pressed or released, this callback is called
+// ---------------------------------------------------------------------------------------------
+void mouse_button_callback(GLFWwindow* window, int button, int action, int modifiers)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        pickRequested = true;
+}
+
+// compares BVH build/refit/query time against brute force culling of the same boxes
+// ---------------------------------------------------------------------------------------------
+void runBvhBenchmark()
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    auto milliseconds = [](Clock::time_point from, Clock::time_point to) {
+        return std::chrono::duration<double, std::milli>(to - from).count();
+    };
+
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+    std::uniform_real_distribution<float> size(0.5f, 4.0f);
+    Frustum frustum = camera.GetFrustum((float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
+
+    for (unsigned int count : {10000u, 100000u, 1000000u})
+    {
+        std::vector<AABB> boxes(count);
+        for (AABB &box : boxes)
+        {
+            glm::vec3 center(position(random), position(random), position(random));
+            box = AABB(center - glm::vec3(size(random)), center + glm::vec3(size(random)));
+        }
+
+        BVH bvh;
+        Clock::time_point start = Clock::now();
+        bvh.Build(boxes);
+        Clock::time_point built = Clock::now();
+        for (AABB &box : boxes)
+        {
+            box.min += glm::vec3(0.5f);
+            box.max += glm::vec3(0.5f);
+        }
+        Clock::time_point moved = Clock::now();
+        bvh.Refit(boxes);
+        Clock::time_point refitted = Clock::now();
+        std::vector<uint32_t> result;
+        bvh.QueryFrustum(frustum, result);
+        Clock::time_point queried = Clock::now();
+
+        AABBBatch batch;
+        batch.Reserve(count);
+        for (const AABB &box : boxes)
+            batch.Add(box);
+        std::vector<unsigned char> visible(count);
+        Clock::time_point bruteStart = Clock::now();
+        size_t bruteVisible = CullAABBs(frustum, batch, visible.data());
+        Clock::time_point bruteEnd = Clock::now();
+
+        std::cout << count << " objects: build " << milliseconds(start, built) << " ms, refit " << milliseconds(moved, refitted)
+                  << " ms, query " << milliseconds(refitted, queried) << " ms (" << result.size() << " visible)"
+                  << ", brute force " << milliseconds(bruteStart, bruteEnd) << " ms (" << bruteVisible << " visible)" << std::endl;
+    }
+}
+
+// point lights of random colors, a few around the model and the rest scattered through the asteroid belt
+// ---------------------------------------------------------------------------------------------
+std::vector<ClusteredPointLight> generateLights()
+{
+    std::mt19937 random(3);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+    std::vector<ClusteredPointLight> lights(POINT_LIGHT_COUNT);
+    for (unsigned int i = 0; i < POINT_LIGHT_COUNT; i++)
+    {
+        ClusteredPointLight &light = lights[i];
+        if (i < POINT_LIGHT_COUNT / 8)
+            light.Position = glm::vec3(unit(random) * 16.0f - 8.0f, unit(random) * 8.0f - 4.0f, unit(random) * 16.0f - 8.0f);
+        else
+        {
+            float angle = unit(random) * glm::two_pi<float>(), distance = 42.0f + unit(random) * 16.0f;
+            light.Position = BELT_CENTER + glm::vec3(sin(angle) * distance, unit(random) * 8.0f - 4.0f, cos(angle) * distance);
+        }
+        light.Color = glm::vec3(unit(random), unit(random), unit(random));
+        light.Color /= std::max(std::max(light.Color.r, light.Color.g), std::max(light.Color.b, 0.01f));
+        light.Quadratic = 0.05f + unit(random) * 0.2f;
+        light.Radius = PointLightRadius(1.0f, light.Quadratic);
+    }
+    return lights;
+}
+
+// a sphere that encloses the unit sphere, drawn once per light with the light's data as instance attributes
+// ---------------------------------------------------------------------------------------------
+unsigned int buildLightVolume(unsigned int lightBuffer, unsigned int &indexCount)
+{
+    const int stacks = 8, slices = 12;
+    // the flat faces of a unit sphere mesh cut inside the sphere, push them out to enclose it
+    const float scale = 1.0f / (cos(glm::pi<float>() / slices) * cos(glm::pi<float>() / (2 * stacks)));
+    std::vector<glm::vec3> vertices;
+    std::vector<unsigned int> indices;
+    for (int stack = 0; stack <= stacks; stack++)
+    {
+        float theta = glm::pi<float>() * stack / stacks;
+        for (int slice = 0; slice <= slices; slice++)
+        {
+            float phi = glm::two_pi<float>() * slice / slices;
+            vertices.push_back(scale * glm::vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi)));
+        }
+    }
+    for (int stack = 0; stack < stacks; stack++)
+    {
+        for (int slice = 0; slice < slices; slice++)
+        {
+            unsigned int a = stack * (slices + 1) + slice, b = a + slices + 1;
+            indices.insert(indices.end(), {a, a + 1, b, b, a + 1, b + 1});
+        }
+    }
+    indexCount = (unsigned int)indices.size();
+
+    unsigned int VAO, VBO, EBO;
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+    GLState::BindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+    // per instance: position and radius, color and quadratic attenuation
+    glBindBuffer(GL_ARRAY_BUFFER, lightBuffer);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(ClusteredPointLight), (void*)0);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(ClusteredPointLight), (void*)(4 * sizeof(float)));
+    glVertexAttribDivisor(2, 1);
+    GLState::BindVertexArray(0);
+    return VAO;
+}
+
+// renderQuad() draws a quad over the whole viewport (positions only), the deferred directional light pass runs on it
+// ------------------------------------------------------------------------------------------------------------------
+unsigned int quadVAO = 0;
+unsigned int quadVBO;
+void renderQuad()
+{
+    if (quadVAO == 0)
+    {
+        float quadVertices[] = {
+                // positions
+                -1.0f,  1.0f, 0.0f,
+                -1.0f, -1.0f, 0.0f,
+                1.0f,  1.0f, 0.0f,
+                1.0f, -1.0f, 0.0f,
+        };
+        glGenVertexArrays(1, &quadVAO);
+        glGenBuffers(1, &quadVBO);
+        GLState::BindVertexArray(quadVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    }
+    GLState::BindVertexArray(quadVAO);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    GLState::BindVertexArray(0);
+}
@@ -10,16 +10,25 @@
 #include <stb_image.h>
 #include <camera.h>
 #include <model.h>
+#include <cascaded_shadow_map.h>
+#include <gpu_counter.h>
+#include <render_queue.h>
 #include <vector>
 #include <map>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
 void processInput(GLFWwindow *window);
-unsigned int loadTexture(const char *path);
+unsigned int loadTexture(const char *path, bool clampToEdge = false);
 unsigned int loadCubemap(std::vector<const char *> faces);
-void renderScene(const Shader &shader);
+void buildScene();
+void renderScene(const Shader &shader, const Frustum *frustum = nullptr);
+void renderSceneQueued(Shader &opaqueShader, Shader &transparentShader, const glm::mat4 &view, const Frustum &frustum);
+unsigned int renderShadowCasters(const Shader &shader, const CascadedShadowMap &shadowMap, bool isStatic, unsigned int layers);
+void benchmarkShadowFilters(std::vector<Shader> &shaders, const glm::mat4 &projection, const glm::mat4 &view,
+                            const glm::vec3 &lightPos, CascadedShadowMap &shadowMap);
 void renderCube();
 void renderQuad();
 
@@ -27,6 +36,32 @@ void renderQuad();
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100.0f;
+bool showCascades = false;
+bool animateLight = false;
+bool runBenchmark = false;
+// submit the lighting pass through the sorted render queue (O), or draw in scene order
+bool useRenderQueue = true;
+
+// shadow filter permutations of shadow_mapping.fs, cheapest first (K cycles through them, B times them all)
+struct ShadowFilterMode {
+    const char *Name;
+    const char *Defines;
+};
+const ShadowFilterMode shadowFilterModes[] = {
+        {"hard", "#define SHADOW_FILTER 0\n"},
+        {"hardware 2x2 PCF", "#define SHADOW_FILTER 1\n"},
+        {"disk PCF, 8 taps", "#define SHADOW_FILTER 2\n#define PCF_TAPS 8\n"},
+        {"disk PCF, 16 taps", "#define SHADOW_FILTER 2\n#define PCF_TAPS 16\n"},
+        {"disk PCF, 32 taps", "#define SHADOW_FILTER 2\n#define PCF_TAPS 32\n"},
+        {"PCSS, 16 + 16 taps", "#define SHADOW_FILTER 3\n#define PCF_TAPS 16\n#define BLOCKER_TAPS 16\n"},
+};
+const int SHADOW_FILTER_COUNT = sizeof(shadowFilterModes) / sizeof(shadowFilterModes[0]);
+int shadowFilter = 1;
+const unsigned int BENCHMARK_WIDTH = 1280;
+const unsigned int BENCHMARK_HEIGHT = 720;
+const int BENCHMARK_FRAMES = 100;
 
 // camera
 Camera camera(glm::vec3(0.0f, 0.0f, 5.0f));
@@ -40,6 +75,30 @@ float lastFrame = 0.0f;
 
 // meshes
 unsigned int planeVAO;
+unsigned int transparentQuadVAO;
+
+// the materials of the scene are one diffuse texture each, grass and windows are blended with their alpha
+enum Material { WOOD, CONTAINER, METAL, GRASS, WINDOW, MATERIAL_COUNT };
+const char *materialTexturePaths[MATERIAL_COUNT] = {"./image/box.png", "./image/container2.png", "./image/metal.jpeg",
+                                                    "./image/grass.png", "./image/window.png"};
+unsigned int materialTextures[MATERIAL_COUNT];
+
+// scene objects, static ones never move and their shadows are cached. transparent ones cast no shadows
+struct SceneObject {
+    enum Shape { PLANE, CUBE, QUAD };
+    Shape Type;
+    glm::mat4 Model;
+    bool IsStatic;
+    unsigned int Material = WOOD;
+    bool IsTransparent = false;
+};
+std::vector<SceneObject> sceneObjects;
+
+// render queue passes and the programs of the lighting pass
+enum RenderPass { PASS_OPAQUE, PASS_TRANSPARENT };
+enum LightingProgram { PROGRAM_OPAQUE, PROGRAM_TRANSPARENT };
+RenderQueue renderQueue;
+AABB objectBounds(const SceneObject &object);
 
 int main()
 {
@@ -67,6 +126,7 @@ int main()
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetKeyCallback(window, key_callback);
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -81,13 +141,22 @@ int main()
 
     // configure global opengl state
     // -----------------------------
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
+    GLState::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    Shader simpleDepthShader("./shader/depth.vs", "./shader/depth.fs");
-    Shader shader("./shader/shadow_mapping.vs", "./shader/shadow_mapping.fs");
+    // renders the depth of all shadow cascades in one pass
+    Shader simpleDepthShader("./shader/csm_depth.vs", "./shader/csm_depth.fs", "./shader/csm_depth.gs");
+    std::vector<Shader> shadowShaders, transparentShaders;
+    for (const ShadowFilterMode &mode : shadowFilterModes)
+    {
+        shadowShaders.emplace_back("./shader/shadow_mapping.vs", "./shader/shadow_mapping.fs", nullptr, mode.Defines);
+        transparentShaders.emplace_back("./shader/shadow_mapping.vs", "./shader/shadow_mapping.fs", nullptr,
+                                        std::string(mode.Defines) + "#define TRANSPARENT\n");
+    }
     Shader debugDepthQuad("./shader/debugQuad.vs", "./shader/debugQuad.fs");
 
-    unsigned int woodTexture = loadTexture("./image/box.png");
+    for (int i = 0; i < MATERIAL_COUNT; i++)
+        materialTextures[i] = loadTexture(materialTexturePaths[i], i >= GRASS);
 
     // set up vertex data (and buffer(s)) and configure vertex attributes 用于承载深度贴图？
     // ------------------------------------------------------------------
@@ -105,7 +174,7 @@ int main()
     unsigned int planeVBO;
     glGenVertexArrays(1, &planeVAO);
     glGenBuffers(1, &planeVBO);
-    glBindVertexArray(planeVAO);
+    GLState::BindVertexArray(planeVAO);
     glBindBuffer(GL_ARRAY_BUFFER, planeVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(planeVertices), planeVertices, GL_STATIC_DRAW);
     glEnableVertexAttribArray(0);
@@ -114,37 +183,64 @@ int main()
     glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
     glEnableVertexAttribArray(2);
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
-    glBindVertexArray(0);
-
-    GLuint depthMapFBO;
-    glGenFramebuffers(1, &depthMapFBO);
-
-    // 创建一个2D纹理，提供给帧缓冲的深度缓冲使用
-    const GLuint SHADOW_WIDTH = 1024, SHADOW_HEIGHT = 1024;
-    GLuint depthMap;
-    glGenTextures(1, &depthMap);
-    glBindTexture(GL_TEXTURE_2D, depthMap);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    // 将生成的深度纹理作为帧缓冲的深度缓冲
-    glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // an upright quad for grass and windows, the top of the image is at the top
+    float transparentQuadVertices[] = {
+            // positions          // normals         // texcoords
+            -1.0f,  1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  0.0f, 0.0f,
+            -1.0f, -1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  0.0f, 1.0f,
+             1.0f, -1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  1.0f, 1.0f,
+
+            -1.0f,  1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  0.0f, 0.0f,
+             1.0f, -1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  1.0f, 1.0f,
+             1.0f,  1.0f, 0.0f,  0.0f, 0.0f, 1.0f,  1.0f, 0.0f
+    };
+    unsigned int transparentQuadVBO;
+    glGenVertexArrays(1, &transparentQuadVAO);
+    glGenBuffers(1, &transparentQuadVBO);
+    GLState::BindVertexArray(transparentQuadVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, transparentQuadVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(transparentQuadVertices), transparentQuadVertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
+    GLState::BindVertexArray(0);
+
+    // 4 cascades of 512x512 in a depth texture array, the same memory as a single 1024x1024 map
+    CascadedShadowMap shadowMap(4, 512);
+    // the casters every cascade has to keep in its depth range: the floor and the cubes above it
+    const AABB sceneBounds(glm::vec3(-25.0f, -0.5f, -25.0f), glm::vec3(25.0f, 2.0f, 25.0f));
 
     // shader configuration
-    shader.use();
-    shader.setInt("diffuseTexture", 0);
-    shader.setInt("shadowMap", 1);
+    std::vector<Shader *> lightingShaders;
+    for (int i = 0; i < SHADOW_FILTER_COUNT; i++)
+    {
+        lightingShaders.push_back(&shadowShaders[i]);
+        lightingShaders.push_back(&transparentShaders[i]);
+    }
+    for (Shader *lightingShader : lightingShaders)
+    {
+        Shader &shader = *lightingShader;
+        shader.use();
+        shader.setInt("diffuseTexture", 0);
+        shader.setFloat("pcfRadius", 1.5f);
+        shader.setFloat("lightSize", 0.05f);
+        shader.setFloat("pcssMaxTexels", 8.0f);
+    }
     debugDepthQuad.use();
     debugDepthQuad.setInt("depthMap", 0);
+    debugDepthQuad.setInt("layer", 0);
 
     glm::vec3 lightPos(-2.0f, 4.0f, -1.0f);
+    buildScene();
+    // the last object is the one dynamic caster: a cube circling the others
+    SceneObject &orbitingCube = sceneObjects.back();
+    float lastStatsTime = 0.0f;
+    unsigned int statsFrames = 0, statsStaticLayers = 0, statsCasterDraws = 0;
+    GpuCounter lightingTimer(GL_TIME_ELAPSED);
 
 
     // draw as wireframe
@@ -169,53 +265,89 @@ int main()
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // 1. 从光源视角，得到深度该场景的深度贴图
-        float near_plane = 1.0f, far_plane = 7.5f;
-        glm::mat4 lightProjection = glm::ortho(-10.0f, 10.0f, -10.0f, 10.0f, near_plane, far_plane);
-        glm::mat4 lightView = glm::lookAt(lightPos, glm::vec3(0.0f), glm::vec3(0.0, 1.0, 0.0));
-        glm::mat4 lightSpaceMatrix = lightProjection * lightView;
-        simpleDepthShader.use();
-        simpleDepthShader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
+        glm::mat4 view = camera.GetViewMatrix();
 
-        glCullFace(GL_FRONT);
+        // move the dynamic cube, and the light when asked to (which makes every cached cascade outdated)
+        orbitingCube.Model = glm::translate(glm::mat4(1.0f), glm::vec3(3.0f * cos(currentFrame), 0.75f, 3.0f * sin(currentFrame)));
+        orbitingCube.Model = glm::rotate(orbitingCube.Model, currentFrame, glm::vec3(0.0f, 1.0f, 0.0f));
+        orbitingCube.Model = glm::scale(orbitingCube.Model, glm::vec3(0.3f));
+        if (animateLight)
+            lightPos = glm::vec3(glm::rotate(glm::mat4(1.0f), deltaTime * 0.2f, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(lightPos, 1.0f));
+
+        // 1. 从光源视角，得到深度该场景的深度贴图: every cascade is fitted to its slice of the view frustum
+        shadowMap.Update(view, glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE,
+                         lightPos, sceneBounds);
+        GLState::CullFace(GL_FRONT);
         // 渲染到深度缓冲区时，viewport大小与设定framebuffer一致
-        glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-        glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, woodTexture);
-        renderScene(simpleDepthShader);
+        // static casters only go into the cascades of the cache that are out of date, dynamic ones every frame
+        unsigned int casterDraws = 0;
+        unsigned int staticLayers = shadowMap.BeginStaticPass(simpleDepthShader);
+        if (staticLayers != 0)
+            casterDraws += renderShadowCasters(simpleDepthShader, shadowMap, true, staticLayers);
+        bool hasDynamicCasters = false;
+        for (const SceneObject &object : sceneObjects)
+            hasDynamicCasters = hasDynamicCasters ||
+                                (!object.IsStatic && !object.IsTransparent && shadowMap.CasterMask(objectBounds(object)) != 0);
+        if (shadowMap.BeginDynamicPass(simpleDepthShader, hasDynamicCasters))
+            casterDraws += renderShadowCasters(simpleDepthShader, shadowMap, false, ~0u);
         // reset
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glViewport(0, 0, SCR_WIDTH * 2, SCR_HEIGHT * 2); // 因为mac是Retina屏，输出到屏幕时viewport大小与设定窗口大小扩大两倍
+        shadowMap.EndDepthPass();
+        statsStaticLayers += shadowMap.GetStats().StaticLayersDrawn;
+        statsCasterDraws += casterDraws;
+        statsFrames++;
+        if (currentFrame - lastStatsTime > 1.0f)
+        {
+            std::cout << "shadow pass: " << (float)statsStaticLayers / statsFrames << " static cascades redrawn, "
+                      << (float)statsCasterDraws / statsFrames << " caster draws per frame, lighting ("
+                      << shadowFilterModes[shadowFilter].Name << "): " << lightingTimer.Result() / 1.0e6 << " ms" << std::endl;
+            const RenderQueue::Stats &queueStats = renderQueue.GetStats();
+            std::cout << (useRenderQueue ? "sorted" : "scene order") << ": " << queueStats.Commands << " draws, "
+                      << queueStats.ShaderChanges << " program and " << queueStats.TextureChanges
+                      << " texture changes, sorted in " << queueStats.SortMilliseconds << " ms" << std::endl;
+            std::cout << "gl state: " << GLState::GetCounters().Issued << " calls issued, "
+                      << GLState::GetCounters().Skipped << " redundant calls skipped per frame" << std::endl;
+            lastStatsTime = currentFrame;
+            statsFrames = statsStaticLayers = statsCasterDraws = 0;
+        }
+        GLState::Viewport(0, 0, SCR_WIDTH * 2, SCR_HEIGHT * 2); // 因为mac是Retina屏，输出到屏幕时viewport大小与设定窗口大小扩大两倍
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glCullFace(GL_BACK);
+        GLState::CullFace(GL_BACK);
+
+        if (runBenchmark)
+        {
+            runBenchmark = false;
+            benchmarkShadowFilters(shadowShaders, projection, view, lightPos, shadowMap);
+        }
 
         // 2. 正常渲染绘图
-        shader.use();
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
-        glm::mat4 view = camera.GetViewMatrix();
-        shader.setMat4("projection", projection);
-        shader.setMat4("view", view);
-        // set light uniforms
-        shader.setVec3("viewPos", camera.Position);
-        shader.setVec3("lightPos", lightPos);
-        shader.setMat4("lightSpaceMatrix", lightSpaceMatrix);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, woodTexture);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, depthMap);
-        renderScene(shader);
+        lightingTimer.Begin();
+        Shader *passShaders[2] = {&shadowShaders[shadowFilter], &transparentShaders[shadowFilter]};
+        for (Shader *passShader : passShaders)
+        {
+            Shader &shader = *passShader;
+            shader.use();
+            shader.setMat4("projection", projection);
+            shader.setMat4("view", view);
+            // set light uniforms, the light is directional and shines from lightPos towards the origin
+            shader.setVec3("viewPos", camera.Position);
+            shader.setVec3("lightDirection", glm::normalize(lightPos));
+            shader.setBool("showCascades", showCascades);
+            shadowMap.Bind(shader, 1);
+        }
+        Frustum frustum(projection * view);
+        renderSceneQueued(*passShaders[0], *passShaders[1], view, frustum);
+        lightingTimer.End();
 
         // render Depth map to quad for visual debugging
         // ---------------------------------------------
         debugDepthQuad.use();
-        debugDepthQuad.setFloat("near_plane", near_plane);
-        debugDepthQuad.setFloat("far_plane", far_plane);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, depthMap);
+        GLState::ActiveTexture(GL_TEXTURE0);
+        GLState::BindTexture(GL_TEXTURE_2D_ARRAY, shadowMap.GetDepthArray());
         //renderQuad();
 
+        GLState::EndFrame();
+
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
         glfwSwapBuffers(window);
@@ -228,32 +360,212 @@ int main()
     return 0;
 }
 
-// renders the 3D scene
+// fills sceneObjects: the floor and three cubes that never move, a grid of cubes with grass and windows between them,
+// then a cube that does. materials and blending alternate in this order, which is the worst case for drawing in it
 // --------------------
-void renderScene(const Shader &shader)
+void buildScene()
 {
-    // floor
+    sceneObjects.push_back({SceneObject::PLANE, glm::mat4(1.0f), true});
     glm::mat4 model = glm::mat4(1.0f);
-    shader.setMat4("model", model);
-    glBindVertexArray(planeVAO);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
-    // cubes
-    model = glm::mat4(1.0f);
     model = glm::translate(model, glm::vec3(0.0f, 1.5f, 0.0));
     model = glm::scale(model, glm::vec3(0.5f));
-    shader.setMat4("model", model);
-    renderCube();
+    sceneObjects.push_back({SceneObject::CUBE, model, true});
     model = glm::mat4(1.0f);
     model = glm::translate(model, glm::vec3(2.0f, 0.0f, 1.0));
     model = glm::scale(model, glm::vec3(0.5f));
-    shader.setMat4("model", model);
-    renderCube();
+    sceneObjects.push_back({SceneObject::CUBE, model, true});
     model = glm::mat4(1.0f);
     model = glm::translate(model, glm::vec3(-1.0f, 0.0f, 2.0));
     model = glm::rotate(model, glm::radians(60.0f), glm::normalize(glm::vec3(1.0, 0.0, 1.0)));
     model = glm::scale(model, glm::vec3(0.25));
-    shader.setMat4("model", model);
-    renderCube();
+    sceneObjects.push_back({SceneObject::CUBE, model, true});
+
+    unsigned int cell = 0;
+    for (int row = 0; row < 6; row++)
+    {
+        for (int column = 0; column < 6; column++)
+        {
+            glm::vec3 position(-7.5f + 3.0f * column, 0.0f, -7.5f + 3.0f * row);
+            // leave the middle to the cubes above
+            if (std::abs(position.x) < 3.0f && std::abs(position.z) < 3.0f)
+                continue;
+            model = glm::translate(glm::mat4(1.0f), position + glm::vec3(0.0f, -0.1f, 0.0f));
+            model = glm::scale(model, glm::vec3(0.4f));
+            sceneObjects.push_back({SceneObject::CUBE, model, true, cell % 3});
+            model = glm::translate(glm::mat4(1.0f), position + glm::vec3(1.5f, 0.0f, 0.0f));
+            model = glm::rotate(model, glm::radians(30.0f * column), glm::vec3(0.0f, 1.0f, 0.0f));
+            model = glm::scale(model, glm::vec3(0.5f));
+            sceneObjects.push_back({SceneObject::QUAD, model, true, cell % 2 == 0 ? (unsigned int)GRASS : (unsigned int)WINDOW, true});
+            cell++;
+        }
+    }
+    sceneObjects.push_back({SceneObject::CUBE, glm::mat4(1.0f), false});
+}
+
+// world space bounds of a scene object
+// --------------------
+AABB objectBounds(const SceneObject &object)
+{
+    // model space bounds of the floor plane, of renderCube()'s cube and of the transparent quad
+    static const AABB planeBounds(glm::vec3(-25.0f, -0.5f, -25.0f), glm::vec3(25.0f, -0.5f, 25.0f));
+    static const AABB cubeBounds(glm::vec3(-1.0f), glm::vec3(1.0f));
+    static const AABB quadBounds(glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.0f));
+    if (object.Type == SceneObject::PLANE)
+        return planeBounds.Transform(object.Model);
+    return (object.Type == SceneObject::QUAD ? quadBounds : cubeBounds).Transform(object.Model);
+}
+
+void drawObject(const SceneObject &object)
+{
+    if (object.Type == SceneObject::PLANE)
+    {
+        GLState::BindVertexArray(planeVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+    else if (object.Type == SceneObject::QUAD)
+    {
+        GLState::BindVertexArray(transparentQuadVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+    }
+    else
+        renderCube();
+}
+
+// renders the opaque objects of the 3D scene in scene order, objects outside of the frustum (if one is given) are skipped
+// --------------------
+void renderScene(const Shader &shader, const Frustum *frustum)
+{
+    GLState::ActiveTexture(GL_TEXTURE0);
+    for (const SceneObject &object : sceneObjects)
+    {
+        if (object.IsTransparent || (frustum && !frustum->IsBoxVisible(objectBounds(object))))
+            continue;
+        shader.setMat4("model", object.Model);
+        GLState::BindTexture(GL_TEXTURE_2D, materialTextures[object.Material]);
+        drawObject(object);
+    }
+}
+
+// renders the visible objects through the render queue: opaque ones grouped by program and texture and front to back,
+// then the transparent ones back to front with blending. without useRenderQueue they are drawn in scene order, with
+// the program and blending switching as often as the objects alternate (and the blending no longer right)
+// --------------------
+void renderSceneQueued(Shader &opaqueShader, Shader &transparentShader, const glm::mat4 &view, const Frustum &frustum)
+{
+    renderQueue.Begin(NEAR_PLANE, FAR_PLANE);
+    for (uint32_t i = 0; i < sceneObjects.size(); i++)
+    {
+        const SceneObject &object = sceneObjects[i];
+        if (!frustum.IsBoxVisible(objectBounds(object)))
+            continue;
+        float viewDepth = -(view * object.Model[3]).z;
+        if (object.IsTransparent)
+            renderQueue.Submit(renderQueue.MakeKey(PASS_TRANSPARENT, true, PROGRAM_TRANSPARENT, 0, object.Material, viewDepth), i);
+        else
+            renderQueue.Submit(renderQueue.MakeKey(PASS_OPAQUE, false, PROGRAM_OPAQUE, 0, object.Material, viewDepth), i);
+    }
+    if (useRenderQueue)
+        renderQueue.Sort();
+
+    GLState::ActiveTexture(GL_TEXTURE0);
+    renderQueue.Execute([&](const RenderQueue::Command &command) {
+        const SceneObject &object = sceneObjects[command.Payload];
+        // GLState drops whatever is the same as for the previous draw
+        Shader &shader = object.IsTransparent ? transparentShader : opaqueShader;
+        shader.use();
+        if (object.IsTransparent)
+        {
+            GLState::Enable(GL_BLEND);
+            GLState::DepthMask(GL_FALSE);
+        }
+        else
+        {
+            GLState::Disable(GL_BLEND);
+            GLState::DepthMask(GL_TRUE);
+        }
+        GLState::BindTexture(GL_TEXTURE_2D, materialTextures[object.Material]);
+        shader.setMat4("model", object.Model);
+        drawObject(object);
+    });
+    GLState::Disable(GL_BLEND);
+    GLState::DepthMask(GL_TRUE);
+}
+
+// renders the lighting pass with every shadow filter into an offscreen target of a fixed size, and prints the
+// GPU time per frame of each. the shadow map is the one of the current frame
+// --------------------
+void benchmarkShadowFilters(std::vector<Shader> &shaders, const glm::mat4 &projection, const glm::mat4 &view,
+                            const glm::vec3 &lightPos, CascadedShadowMap &shadowMap)
+{
+    unsigned int fbo, colorBuffer, depthBuffer;
+    glGenFramebuffers(1, &fbo);
+    GLState::BindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, BENCHMARK_WIDTH, BENCHMARK_HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, BENCHMARK_WIDTH, BENCHMARK_HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        std::cout << "ERROR::FRAMEBUFFER:: Benchmark framebuffer is not complete!" << std::endl;
+    GLState::Viewport(0, 0, BENCHMARK_WIDTH, BENCHMARK_HEIGHT);
+
+    unsigned int query;
+    glGenQueries(1, &query);
+    std::cout << "shadow filters at " << BENCHMARK_WIDTH << "x" << BENCHMARK_HEIGHT << ":" << std::endl;
+    for (int i = 0; i < (int)shaders.size(); i++)
+    {
+        Shader &shader = shaders[i];
+        shader.use();
+        shader.setMat4("projection", projection);
+        shader.setMat4("view", view);
+        shader.setVec3("viewPos", camera.Position);
+        shader.setVec3("lightDirection", glm::normalize(lightPos));
+        shader.setBool("showCascades", false);
+        shadowMap.Bind(shader, 1);
+        // one untimed frame so that the first use of a program (its lazy compilation) isn't measured
+        for (int frame = -1; frame < BENCHMARK_FRAMES; frame++)
+        {
+            if (frame == 0)
+                glBeginQuery(GL_TIME_ELAPSED, query);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            renderScene(shader);
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+        std::cout << "  " << shadowFilterModes[i].Name << ": " << elapsed / 1.0e6 / BENCHMARK_FRAMES << " ms" << std::endl;
+    }
+    glDeleteQueries(1, &query);
+
+    GLState::BindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &colorBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    GLState::DeleteFramebuffers(1, &fbo);
+    GLState::Viewport(0, 0, SCR_WIDTH * 2, SCR_HEIGHT * 2);
+}
+
+// renders the static or the dynamic casters into the cascades they can shadow (and that are in layers),
+// returns the number of draws
+// --------------------
+unsigned int renderShadowCasters(const Shader &shader, const CascadedShadowMap &shadowMap, bool isStatic, unsigned int layers)
+{
+    unsigned int draws = 0;
+    for (const SceneObject &object : sceneObjects)
+    {
+        if (object.IsStatic != isStatic || object.IsTransparent)
+            continue;
+        unsigned int mask = shadowMap.CasterMask(objectBounds(object)) & layers;
+        if (mask == 0)
+            continue;
+        shader.setInt("layerMask", (int)mask);
+        shader.setMat4("model", object.Model);
+        drawObject(object);
+        draws++;
+    }
+    return draws;
 }
 
 
@@ -316,7 +628,7 @@ void renderCube()
         glBindBuffer(GL_ARRAY_BUFFER, cubeVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
         // link vertex attributes
-        glBindVertexArray(cubeVAO);
+        GLState::BindVertexArray(cubeVAO);
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
         glEnableVertexAttribArray(1);
@@ -324,12 +636,11 @@ void renderCube()
         glEnableVertexAttribArray(2);
         glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6 * sizeof(float)));
         glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+        GLState::BindVertexArray(0);
     }
     // render Cube
-    glBindVertexArray(cubeVAO);
+    GLState::BindVertexArray(cubeVAO);
     glDrawArrays(GL_TRIANGLES, 0, 36);
-    glBindVertexArray(0);
 }
 
 // renderQuad() renders a 1x1 XY quad in NDC
@@ -350,7 +661,7 @@ void renderQuad()
         // setup plane VAO
         glGenVertexArrays(1, &quadVAO);
         glGenBuffers(1, &quadVBO);
-        glBindVertexArray(quadVAO);
+        GLState::BindVertexArray(quadVAO);
         glBindBuffer(GL_ARRAY_BUFFER, quadVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(quadVertices), &quadVertices, GL_STATIC_DRAW);
         glEnableVertexAttribArray(0);
@@ -358,9 +669,9 @@ void renderQuad()
         glEnableVertexAttribArray(1);
         glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
     }
-    glBindVertexArray(quadVAO);
+    GLState::BindVertexArray(quadVAO);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-    glBindVertexArray(0);
+    GLState::BindVertexArray(0);
 }
 
 
@@ -391,7 +702,38 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and 
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
+}
+
+// glfw: whenever a key event occurs, this callback is called
+// ---------------------------------------------------------------------------------------------
+void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers)
+{
+    if(action == GLFW_PRESS)
+    {
+        switch(key)
+        {
+            case GLFW_KEY_V:
+                showCascades = !showCascades;
+                break;
+            case GLFW_KEY_L:
+                animateLight = !animateLight;
+                break;
+            case GLFW_KEY_K:
+                shadowFilter = (shadowFilter + 1) % SHADOW_FILTER_COUNT;
+                std::cout << "shadow filter: " << shadowFilterModes[shadowFilter].Name << std::endl;
+                break;
+            case GLFW_KEY_B:
+                runBenchmark = true;
+                break;
+            case GLFW_KEY_O:
+                useRenderQueue = !useRenderQueue;
+                std::cout << "draw order: " << (useRenderQueue ? "sorted render queue" : "scene order") << std::endl;
+                break;
+            default:
+                break;
+        }
+    }
 }
 
 // glfw: whenever the mouse moves, this callback is called
@@ -423,37 +765,28 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 
 // utility function for loading a 2D texture from file
 // ---------------------------------------------------
-unsigned int loadTexture(char const * path)
+unsigned int loadTexture(char const * path, bool clampToEdge)
 {
-    unsigned int textureID;
-    glGenTextures(1, &textureID);
+    unsigned int textureID = 0;
 
     int width, height, nrComponents;
     unsigned char *data = stbi_load(path, &width, &height, &nrComponents, 0);
     if (data)
     {
-        GLenum format;
-        if (nrComponents == 1)
-            format = GL_RED;
-        else if (nrComponents == 3)
-            format = GL_RGB;
-        else if (nrComponents == 4)
-            format = GL_RGBA;
-
-        glBindTexture(GL_TEXTURE_2D, textureID);
-        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        // the mips filtered as sRGB color, the texture itself stays linear (this course doesn't gamma correct)
+        textureID = UploadTexture({data, width, height, nrComponents}, TextureCooker::COLOR);
+
+        // cut outs (grass, windows) clamp, repeating would bleed their opposite edge in
+        GLenum wrap = clampToEdge ? GL_CLAMP_TO_EDGE : GL_REPEAT;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
 
         stbi_image_free(data);
     }
     else
     {
         std::cout << "Texture failed to load at path: " << path << std::endl;
+        glGenTextures(1, &textureID);
         stbi_image_free(data);
     }
 
@@ -473,15 +806,23 @@ unsigned int loadCubemap(std::vector<const char *> faces)
 {
     unsigned int textureID;
     glGenTextures(1, &textureID);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
+    GLState::BindTexture(GL_TEXTURE_CUBE_MAP, textureID);
 
-    int width, height, nrChannels;
+    // every face gets its own mip chain, filtered as sRGB color
+    MipGenerator::Options mipOptions = TextureCooker::MipOptions(TextureCooker::COLOR);
+    int width, height, nrChannels, levelCount = 1;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     for (unsigned int i = 0; i < faces.size(); i++)
     {
-        unsigned char *data = stbi_load(faces[i], &width, &height, &nrChannels, 0);
+        unsigned char *data = stbi_load(faces[i], &width, &height, &nrChannels, 3);
         if (data)
         {
             glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+            std::vector<std::vector<uint8_t>> mips = MipGenerator::Generate(data, width, height, 3, mipOptions);
+            levelCount = (int)mips.size() + 1;
+            for (int level = 1; level < levelCount; level++)
+                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, level, GL_RGB, std::max(width >> level, 1), std::max(height >> level, 1),
+                             0, GL_RGB, GL_UNSIGNED_BYTE, mips[level - 1].data());
             stbi_image_free(data);
         }
         else
@@ -490,7 +831,9 @@ unsigned int loadCubemap(std::vector<const char *> faces)
             stbi_image_free(data);
         }
     }
-    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levelCount - 1);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
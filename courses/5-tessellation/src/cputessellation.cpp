@@ -9,18 +9,33 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <camera.h>
+#include <terrain_quadtree.h>
+#include <heightmap_mesh.h>
+#include <heightfield_pyramid.h>
+
+#include <chrono>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
 void mouse_callback(GLFWwindow* window, double xpos, double ypos);
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
+void mouse_button_callback(GLFWwindow* window, int button, int action, int modifiers);
 void processInput(GLFWwindow *window);
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+const float NEAR_PLANE = 0.1f;
+const float FAR_PLANE = 100000.0f;
+// the camera never gets closer than this to the ground
+const float CAMERA_CLEARANCE = 2.0f;
+// rows of the full resolution lattice culled together, a band is a contiguous range of strips
+const int BAND_ROWS = 64;
 bool useWireframe = false;
 bool displaygrayscale = true;
+bool useQuadtree = true;
+bool useSingleDraw = true;
+bool pickRequested = false;
 
 // camera - give pretty starting point
 Camera camera(glm::vec3(67.0f, 627.5f, 169.9f),
@@ -61,6 +76,7 @@ int main()
     glfwSetKeyCallback(window, key_callback);
     glfwSetCursorPosCallback(window, mouse_callback);
     glfwSetScrollCallback(window, scroll_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -75,11 +91,12 @@ int main()
 
     // configure global opengl state
     // -----------------------------
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
 
     // build and compile our shader program
     // ------------------------------------
     Shader heightMapShader("../resource/shader/cpuheight.vs","../resource/shader/cpuheight.fs");
+    Shader terrainChunkShader("../resource/shader/terrain_chunk.vs","../resource/shader/terrain_chunk.fs");
 
     // load and create a texture
     // -------------------------
@@ -100,60 +117,92 @@ int main()
 
     // set up vertex data (and buffer(s)) and configure vertex attributes
     // ------------------------------------------------------------------
-    std::vector<float> vertices;
     float yScale = 64.0f / 256.0f, yShift = 16.0f;
-    int rez = 1;
-    unsigned bytePerPixel = nrChannels;
-    for(int i = 0; i < height; i++)
-    {
-        for(int j = 0; j < width; j++)
-        {
-            unsigned char* pixelOffset = data + (j + width * i) * bytePerPixel;
-            unsigned char y = pixelOffset[0];
-
-            // vertex
-            vertices.push_back( -height/2.0f + height*i/(float)height );   // vx
-            vertices.push_back( (int) y * yScale - yShift);   // vy
-            vertices.push_back( -width/2.0f + width*j/(float)width );   // vz
-        }
-    }
-    std::cout << "Loaded " << vertices.size() / 3 << " vertices" << std::endl;
-    stbi_image_free(data);
-
-    std::vector<unsigned> indices;
-    for(unsigned i = 0; i < height-1; i += rez)
-    {
-        for(unsigned j = 0; j < width; j += rez)
-        {
-            for(unsigned k = 0; k < 2; k++)
-            {
-                indices.push_back(j + width * (i + k*rez));
-            }
-        }
-    }
-    std::cout << "Loaded " << indices.size() << " indices" << std::endl;
-
-    const int numStrips = (height-1)/rez;
-    const int numTrisPerStrip = (width/rez)*2-2;
+    // every strip is followed by the restart index, so the whole lattice can go out with a single draw call
+    const unsigned restartIndex = 0xFFFFFFFF;
+    HeightmapMesh heightmapMesh(data, width, height, nrChannels, yScale, yShift);
+    const size_t vertexCount = heightmapMesh.VertexCount();
+    const size_t indexCount = heightmapMesh.IndexCount();
+
+    const int numStrips = heightmapMesh.StripCount();
+    const int numTrisPerStrip = heightmapMesh.IndicesPerStrip()-2;
     std::cout << "Created lattice of " << numStrips << " strips with " << numTrisPerStrip << " triangles each" << std::endl;
     std::cout << "Created " << numStrips * numTrisPerStrip << " triangles total" << std::endl;
 
     // first, configure the cube's VAO (and terrainVBO + terrainIBO)
     unsigned int terrainVAO, terrainVBO, terrainIBO;
     glGenVertexArrays(1, &terrainVAO);
-    glBindVertexArray(terrainVAO);
-
+    GLState::BindVertexArray(terrainVAO);
     glGenBuffers(1, &terrainVBO);
     glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+    glGenBuffers(1, &terrainIBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIBO);
+
+    // the buffers are allocated with their final size and the lattice is generated straight into them
+    auto generateStart = std::chrono::high_resolution_clock::now();
+    const size_t vertexBytes = heightmapMesh.VertexFloatCount() * sizeof(float);
+    const size_t indexBytes = indexCount * sizeof(unsigned);
+    glBufferData(GL_ARRAY_BUFFER, vertexBytes, nullptr, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, nullptr, GL_STATIC_DRAW);
+    float *mappedVertices = (float*)glMapBufferRange(GL_ARRAY_BUFFER, 0, vertexBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    unsigned *mappedIndices = (unsigned*)glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, indexBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (mappedVertices && mappedIndices)
+    {
+        heightmapMesh.GenerateVertices(mappedVertices);
+        heightmapMesh.GenerateIndices(mappedIndices, restartIndex);
+    }
+    // an unmap that returns GL_FALSE lost the buffer's contents (e.g. a display mode change), they are undefined
+    bool uploaded = mappedVertices && mappedIndices;
+    if (mappedVertices && glUnmapBuffer(GL_ARRAY_BUFFER) == GL_FALSE)
+        uploaded = false;
+    if (mappedIndices && glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER) == GL_FALSE)
+        uploaded = false;
+    if (!uploaded)
+    {
+        // the driver refused to map or lost the mapped data, go through memory sized once instead
+        std::cout << "ERROR::TERRAIN::BUFFER_MAP_FAILED, uploading from memory" << std::endl;
+        std::vector<float> vertices(heightmapMesh.VertexFloatCount());
+        std::vector<unsigned> indices(indexCount);
+        heightmapMesh.GenerateVertices(vertices.data());
+        heightmapMesh.GenerateIndices(indices.data(), restartIndex);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, vertexBytes, vertices.data());
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indexBytes, indices.data());
+    }
+    std::cout << "Generated " << vertexCount << " vertices and " << indexCount << " indices in "
+              << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - generateStart).count()
+              << " ms" << std::endl;
 
     // position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, HeightmapMesh::FLOATS_PER_VERTEX * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
+    // normal attribute
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, HeightmapMesh::FLOATS_PER_VERTEX * sizeof(float), (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    GLState::BindVertexArray(0);
+
+    // the same heightmap as a quadtree of tiles with precomputed levels of detail
+    TerrainQuadtree terrain(data, width, height, nrChannels, yScale, yShift);
+    std::cout << "Created terrain quadtree of " << terrain.Nodes.size() << " tiles, "
+              << terrain.GetVertexMemory() / (1024 * 1024) << " MB of vertex data (full resolution: "
+              << vertexBytes / (1024 * 1024) << " MB)" << std::endl;
+
+    // min/max pyramid of the heights for culling, ground clamping and picking
+    auto pyramidStart = std::chrono::high_resolution_clock::now();
+    HeightfieldPyramid heightfield(data, width, height, nrChannels, yScale, yShift);
+    std::cout << "Built heightfield pyramid of " << heightfield.LevelCount() << " levels in "
+              << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - pyramidStart).count()
+              << " ms" << std::endl;
+    stbi_image_free(data);
 
-    glGenBuffers(1, &terrainIBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainIBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned), &indices[0], GL_STATIC_DRAW);
+    // bounds of the bands of strips of the full resolution lattice
+    std::vector<AABB> bandBounds;
+    for (int firstStrip = 0; firstStrip < numStrips; firstStrip += BAND_ROWS)
+        bandBounds.push_back(heightfield.Bounds(firstStrip, 0, std::min(firstStrip + BAND_ROWS, numStrips), width - 1));
+    float lastStatsTime = 0.0f;
+
+    // draw calls and the CPU time spent submitting them, averaged over the frames of the last second
+    unsigned int statsFrames = 0, statsDrawCalls = 0;
+    double statsSubmitTime = 0.0;
 
     // render loop
     // -----------
@@ -175,35 +224,118 @@ int main()
         // -----
         processInput(window);
 
+        // keep the camera above the ground
+        float groundHeight;
+        if (heightfield.HeightAt(camera.Position.x, camera.Position.z, groundHeight))
+            camera.Position.y = std::max(camera.Position.y, groundHeight + CAMERA_CLEARANCE);
+
         // render
         // ------
         glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-        // be sure to activate shader when setting uniforms/drawing objects
-        heightMapShader.use();
-
         // view/projection transformations
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100000.0f);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
         glm::mat4 view = camera.GetViewMatrix();
-        heightMapShader.setMat4("projection", projection);
-        heightMapShader.setMat4("view", view);
-
         // world transformation
         glm::mat4 model = glm::mat4(1.0f);
-        heightMapShader.setMat4("model", model);
 
-        // render the cube
-        glBindVertexArray(terrainVAO);
-//        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-        for(unsigned strip = 0; strip < numStrips; strip++)
+        auto submitStart = std::chrono::high_resolution_clock::now();
+        unsigned int drawCalls = 0;
+        if (useQuadtree)
+        {
+            terrainChunkShader.use();
+            terrainChunkShader.setMat4("projection", projection);
+            terrainChunkShader.setMat4("view", view);
+            terrainChunkShader.setMat4("model", model);
+
+            // tiles are refined until their error covers less than 2 pixels
+            LodSelector lodSelector(camera.Position, glm::radians(camera.Zoom), (float)SCR_HEIGHT, 2.0f);
+            terrain.Draw(terrainChunkShader, Frustum(projection * view), lodSelector);
+            drawCalls = terrain.GetStats().NodesDrawn;
+        }
+        else
+        {
+            // be sure to activate shader when setting uniforms/drawing objects
+            heightMapShader.use();
+            heightMapShader.setMat4("projection", projection);
+            heightMapShader.setMat4("view", view);
+            heightMapShader.setMat4("model", model);
+
+            // render the cube
+            GLState::BindVertexArray(terrainVAO);
+//            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            GLState::Enable(GL_PRIMITIVE_RESTART);
+            glPrimitiveRestartIndex(restartIndex);
+            if (useSingleDraw)
+            {
+                // bands outside the frustum are skipped, runs of visible bands still go out in one call each
+                Frustum frustum(projection * view);
+                const size_t indicesPerStrip = heightmapMesh.IndicesPerStrip() + 1;
+                int runStart = -1;
+                for (int band = 0; band <= (int)bandBounds.size(); band++)
+                {
+                    bool visible = band < (int)bandBounds.size() && frustum.IsBoxVisible(bandBounds[band]);
+                    if (visible && runStart < 0)
+                        runStart = band;
+                    if (!visible && runStart >= 0)
+                    {
+                        size_t firstStrip = (size_t)runStart * BAND_ROWS;
+                        size_t lastStrip = std::min((size_t)band * BAND_ROWS, (size_t)numStrips);
+                        glDrawElements(GL_TRIANGLE_STRIP, (GLsizei)((lastStrip - firstStrip) * indicesPerStrip), GL_UNSIGNED_INT,
+                                       (void*)(sizeof(unsigned) * firstStrip * indicesPerStrip));
+                        drawCalls++;
+                        runStart = -1;
+                    }
+                }
+            }
+            else
+            {
+                // the old way: one call per strip, skipping the restart index at the end of each
+                for(unsigned strip = 0; strip < numStrips; strip++)
+                {
+                    glDrawElements(GL_TRIANGLE_STRIP,   // primitive type
+                                   numTrisPerStrip+2,   // number of indices to render
+                                   GL_UNSIGNED_INT,     // index data type
+                                   (void*)(sizeof(unsigned) * (numTrisPerStrip+3) * strip)); // offset to starting index
+                }
+                drawCalls = numStrips;
+            }
+        }
+        statsSubmitTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - submitStart).count();
+        statsDrawCalls += drawCalls;
+        statsFrames++;
+
+        if (pickRequested)
         {
-            glDrawElements(GL_TRIANGLE_STRIP,   // primitive type
-                           numTrisPerStrip+2,   // number of indices to render
-                           GL_UNSIGNED_INT,     // index data type
-                           (void*)(sizeof(unsigned) * (numTrisPerStrip+2) * strip)); // offset to starting index
+            pickRequested = false;
+            Ray ray = camera.GetPickingRay(SCR_WIDTH / 2.0f, SCR_HEIGHT / 2.0f, (float)SCR_WIDTH, (float)SCR_HEIGHT, NEAR_PLANE, FAR_PLANE);
+            float hitDistance;
+            if (heightfield.Raycast(ray, hitDistance))
+            {
+                glm::vec3 hit = ray.Origin + ray.Direction * hitDistance;
+                std::cout << "Picked terrain at (" << hit.x << ", " << hit.y << ", " << hit.z << "), distance " << hitDistance << std::endl;
+            }
+            else
+                std::cout << "Picked nothing" << std::endl;
         }
 
+        if (currentFrame - lastStatsTime > 1.0f)
+        {
+            if (useQuadtree)
+                std::cout << "quadtree: " << terrain.GetStats().NodesDrawn << " tiles, " << terrain.GetStats().Triangles
+                          << " triangles (full resolution: " << numStrips * numTrisPerStrip << ")";
+            else
+                std::cout << "full resolution, " << (useSingleDraw ? "culled bands" : "one draw per strip");
+            std::cout << ": " << statsDrawCalls / statsFrames << " draw calls, "
+                      << statsSubmitTime / statsFrames << " ms CPU submit time per frame" << std::endl;
+            lastStatsTime = currentFrame;
+            statsFrames = statsDrawCalls = 0;
+            statsSubmitTime = 0.0;
+        }
+
+        GLState::EndFrame();
+
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
         glfwSwapBuffers(window);
@@ -212,7 +344,7 @@ int main()
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
-    glDeleteVertexArrays(1, &terrainVAO);
+    GLState::DeleteVertexArrays(1, &terrainVAO);
     glDeleteBuffers(1, &terrainVBO);
     glDeleteBuffers(1, &terrainIBO);
 
@@ -250,7 +382,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 // glfw: whenever a key event occurs, this callback is called
@@ -267,6 +399,12 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             case GLFW_KEY_G:
                 displaygrayscale = !displaygrayscale;
                 break;
+            case GLFW_KEY_T:
+                useQuadtree = !useQuadtree;
+                break;
+            case GLFW_KEY_R:
+                useSingleDraw = !useSingleDraw;
+                break;
             default:
                 break;
         }
@@ -299,4 +437,12 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
 void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 {
     camera.ProcessMouseScroll(yoffset);
-}
\ No newline at end of file
+}
+
+// glfw: whenever a mouse button is pressed or released, this callback is called
+// ---------------------------------------------------------------------------------------------
+void mouse_button_callback(GLFWwindow* window, int button, int action, int modifiers)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+        pickRequested = true;
+}
@@ -9,6 +9,9 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <camera.h>
+#include <terrain_streamer.h>
+#include <terrain_patches.h>
+#include <gpu_counter.h>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers);
@@ -19,9 +22,15 @@ void processInput(GLFWwindow *window);
 // settings
 bool useWireframe = false;
 bool displaygrayscale = true;
+bool patchCulling = true;
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 const unsigned int NUM_PATCH_PTS = 4;
+// world height = height map sample in [0, 1] * HEIGHT_SCALE - HEIGHT_SHIFT
+const float HEIGHT_SCALE = 64.0f;
+const float HEIGHT_SHIFT = 16.0f;
+// wanted on-screen length of a tessellated triangle edge
+const float TRIANGLE_PIXELS = 12.0f;
 
 // camera - give pretty starting point
 Camera camera(glm::vec3(67.0f, 627.5f, 169.9f),
@@ -80,7 +89,7 @@ int main()
 
     // configure global opengl state
     // -----------------------------
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
 
     // build and compile our shader program
     // ------------------------------------
@@ -91,71 +100,72 @@ int main()
                            "../../../common/resource/shader/tessellation.tes"
     );
 
-    // load and create a texture
-    // -------------------------
-    unsigned int texture;
-    glGenTextures(1, &texture);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
-    // set the texture wrapping parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);	// set texture wrapping to GL_REPEAT (default wrapping method)
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    // set texture filtering parameters
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    // load and create a texture
-    // -------------------------
-    // load image, create texture and generate mipmaps
-    // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
-    stbi_set_flip_vertically_on_load(true);
-    int width, height, nrChannels;
-    unsigned char *data = stbi_load("../../../common/resource/image/iceland_heightmap.png", &width, &height, &nrChannels, 0);
-    if (data)
+    // cook the height map into streamable tiles once (again when it changes), afterwards only the tile file is used
+    // -------------------------------------------------------------------------------------
+    const std::string heightmapPath = "../../../common/resource/image/iceland_heightmap.png";
+    const std::string tilePath = "../../../common/resource/image/iceland_heightmap.tiles";
+    TerrainTileFile tileFile;
+    if (!TerrainTilesFresh(heightmapPath, tilePath) || !tileFile.Open(tilePath))
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        glGenerateMipmap(GL_TEXTURE_2D);
-
-        tessHeightMapShader.setInt("heightMap", 0);
-        std::cout << "Loaded heightmap of size " << height << " x " << width << std::endl;
-    }
-    else
-    {
-        std::cout << "Failed to load texture" << std::endl;
+        // load image
+        // The FileSystem::getPath(...) is part of the GitHub repository so we can find files on any IDE/platform; replace it with your own image path.
+        stbi_set_flip_vertically_on_load(true);
+        int imageWidth, imageHeight, nrChannels;
+        unsigned char *data = stbi_load(heightmapPath.c_str(), &imageWidth, &imageHeight, &nrChannels, 0);
+        if (data)
+        {
+            std::cout << "Cooking heightmap of size " << imageHeight << " x " << imageWidth << " into " << tilePath << std::endl;
+            CookTerrainTiles(data, imageWidth, imageHeight, nrChannels, tilePath);
+            stbi_image_free(data);
+        }
+        else
+        {
+            std::cout << "Failed to load texture" << std::endl;
+        }
+        if (!tileFile.Open(tilePath))
+        {
+            std::cout << "Failed to open terrain tiles" << std::endl;
+            return -1;
+        }
     }
+    const int width = tileFile.Header.Width, height = tileFile.Header.Height;
+    std::cout << "Streaming heightmap of size " << height << " x " << width << " in " << tileFile.Levels.size() << " levels of "
+              << tileFile.Header.TileSize << "x" << tileFile.Header.TileSize << " tiles" << std::endl;
+    TerrainStreamer terrainStreamer(tileFile);
+    float lastStatsTime = 0.0f;
+
+    // per-patch height range and normal cone for culling in tessellation.tcs
+    // -----------------------------------------------------------------------
+    unsigned rez = 20;
+    std::vector<TerrainPatchBounds> patchBounds = ComputeTerrainPatchBounds(tileFile, rez, rez, HEIGHT_SCALE, HEIGHT_SHIFT);
 
     // set up vertex data (and buffer(s)) and configure vertex attributes
     // ------------------------------------------------------------------
     std::vector<float> vertices;
 
-    unsigned rez = 20;
     for(unsigned i = 0; i <= rez-1; i++)
     {
         for(unsigned j = 0; j <= rez-1; j++)
         {
-            vertices.push_back(-width/2.0f + width*i/(float)rez); // v.x
-            vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*j/(float)rez); // v.z
-            vertices.push_back(i / (float)rez); // u
-            vertices.push_back(j / (float)rez); // v
-
-            vertices.push_back(-width/2.0f + width*(i+1)/(float)rez); // v.x
-            vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*j/(float)rez); // v.z
-            vertices.push_back((i+1) / (float)rez); // u
-            vertices.push_back(j / (float)rez); // v
-
-            vertices.push_back(-width/2.0f + width*i/(float)rez); // v.x
-            vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*(j+1)/(float)rez); // v.z
-            vertices.push_back(i / (float)rez); // u
-            vertices.push_back((j+1) / (float)rez); // v
-
-            vertices.push_back(-width/2.0f + width*(i+1)/(float)rez); // v.x
-            vertices.push_back(0.0f); // v.y
-            vertices.push_back(-height/2.0f + height*(j+1)/(float)rez); // v.z
-            vertices.push_back((i+1) / (float)rez); // u
-            vertices.push_back((j+1) / (float)rez); // v
+            // i runs along the columns (x, u) and j along the rows (z, v) of the height map
+            const TerrainPatchBounds &bounds = patchBounds[j * rez + i];
+            auto pushControlPoint = [&](unsigned column, unsigned row) {
+                vertices.push_back(-width/2.0f + width*column/(float)rez); // v.x
+                vertices.push_back(0.0f); // v.y
+                vertices.push_back(-height/2.0f + height*row/(float)rez); // v.z
+                vertices.push_back(column / (float)rez); // u
+                vertices.push_back(row / (float)rez); // v
+                vertices.push_back(bounds.MinHeight);
+                vertices.push_back(bounds.MaxHeight);
+                vertices.push_back(bounds.ConeAxis.x);
+                vertices.push_back(bounds.ConeAxis.y);
+                vertices.push_back(bounds.ConeAxis.z);
+                vertices.push_back(bounds.ConeAngle);
+            };
+            pushControlPoint(i, j);
+            pushControlPoint(i+1, j);
+            pushControlPoint(i, j+1);
+            pushControlPoint(i+1, j+1);
         }
     }
     std::cout << "Loaded " << rez*rez << " patches of 4 control points each" << std::endl;
@@ -164,23 +174,32 @@ int main()
     // first, configure the cube's VAO (and terrainVBO)
     unsigned int terrainVAO, terrainVBO;
     glGenVertexArrays(1, &terrainVAO);
-    glBindVertexArray(terrainVAO);
+    GLState::BindVertexArray(terrainVAO);
 
     glGenBuffers(1, &terrainVBO);
     glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
     glBufferData(GL_ARRAY_BUFFER, sizeof(float) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
 
     // position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)0);
     glEnableVertexAttribArray(0);
     // texCoord attribute
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(sizeof(float) * 3));
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(sizeof(float) * 3));
     glEnableVertexAttribArray(1);
+    // patch height range attribute
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(sizeof(float) * 5));
+    glEnableVertexAttribArray(2);
+    // patch normal cone attribute
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 11 * sizeof(float), (void*)(sizeof(float) * 7));
+    glEnableVertexAttribArray(3);
 
     glPatchParameteri(GL_PATCH_VERTICES, NUM_PATCH_PTS);
 
     camera.SetSpeed(0.01, 50.0);
 
+    // triangles coming out of the tessellator, read back a few frames late so the CPU never waits
+    GpuCounter primitivesGenerated(GL_PRIMITIVES_GENERATED);
+
     // render loop
     // -----------
     while (!glfwWindowShouldClose(window))
@@ -219,9 +238,37 @@ int main()
         glm::mat4 model = glm::mat4(1.0f);
         tessHeightMapShader.setMat4("model", model);
 
+        // tessellation levels and patch culling
+        int framebufferWidth, framebufferHeight;
+        glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+        tessHeightMapShader.setVec3("viewPos", camera.Position);
+        tessHeightMapShader.setVec2("viewportSize", glm::vec2(framebufferWidth, framebufferHeight));
+        tessHeightMapShader.setFloat("trianglePixels", TRIANGLE_PIXELS);
+        tessHeightMapShader.setFloat("heightScale", HEIGHT_SCALE);
+        tessHeightMapShader.setFloat("heightShift", HEIGHT_SHIFT);
+        tessHeightMapShader.setBool("patchCulling", patchCulling);
+
+        // stream the tiles around the camera, its position in height map samples (x = column, y = row)
+        glm::vec2 cameraSample((camera.Position.x + width / 2.0f) / width * (width - 1),
+                               (camera.Position.z + height / 2.0f) / height * (height - 1));
+        terrainStreamer.Update(cameraSample);
+        terrainStreamer.Bind(tessHeightMapShader, 0);
+        if (currentFrame - lastStatsTime > 1.0f)
+        {
+            lastStatsTime = currentFrame;
+            const TerrainStreamer::Stats &stats = terrainStreamer.GetStats();
+            std::cout << "terrain tiles: " << stats.Resident << " resident, " << stats.Pending << " pending, "
+                      << primitivesGenerated.Result() << " triangles generated"
+                      << (patchCulling ? "" : " (patch culling off)") << std::endl;
+        }
+
         // render the terrain
-        glBindVertexArray(terrainVAO);
+        GLState::BindVertexArray(terrainVAO);
+        primitivesGenerated.Begin();
         glDrawArrays(GL_PATCHES, 0, NUM_PATCH_PTS*rez*rez);
+        primitivesGenerated.End();
+
+        GLState::EndFrame();
 
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
@@ -231,7 +278,7 @@ int main()
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
-    glDeleteVertexArrays(1, &terrainVAO);
+    GLState::DeleteVertexArrays(1, &terrainVAO);
     glDeleteBuffers(1, &terrainVBO);
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
@@ -268,7 +315,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 // glfw: whenever a key event occurs, this callback is called
@@ -285,6 +332,9 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
             case GLFW_KEY_G:
                 displaygrayscale = !displaygrayscale;
                 break;
+            case GLFW_KEY_C:
+                patchCulling = !patchCulling;
+                break;
             default:
                 break;
         }
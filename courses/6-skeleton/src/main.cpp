@@ -76,7 +76,7 @@ int main()
 
     // configure global opengl state
     // -----------------------------
-    glEnable(GL_DEPTH_TEST);
+    GLState::Enable(GL_DEPTH_TEST);
 
     // build and compile shaders
     // -------------------------
@@ -84,9 +84,13 @@ int main()
 
     // load models
     // -----------
-    Model ourModel("../resource/model/vampire/dancing_vampire.dae");
-    Animation danceAnimation("../resource/model/vampire/dancing_vampire.dae", &ourModel);
-    Animator animator(&danceAnimation);
+    // meshes, skeleton and every animation clip come out of a single import of the file
+    std::vector<Animation> animations;
+    Model ourModel("../resource/model/vampire/dancing_vampire.dae", [&](const aiScene* scene, Model* model) {
+        animations = Animation::ReadAll(scene, model);
+    });
+    std::cout << "Loaded " << animations.size() << " animation(s)" << std::endl;
+    Animator animator(animations.empty() ? nullptr : &animations[0]);
 
     // draw in wireframe
     //glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -133,6 +137,8 @@ int main()
         ourModel.Draw(ourShader);
 
 
+        GLState::EndFrame();
+
         // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
         // -------------------------------------------------------------------------------
         glfwSwapBuffers(window);
@@ -172,7 +178,7 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     // make sure the viewport matches the new window dimensions; note that width and
     // height will be significantly larger than specified on retina displays.
-    glViewport(0, 0, width, height);
+    GLState::Viewport(0, 0, width, height);
 }
 
 // glfw: whenever the mouse moves, this callback is called